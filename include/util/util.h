@@ -30,7 +30,9 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <atomic>
 #include <exception>
 #include <memory>
 
@@ -152,6 +154,19 @@ std::unique_ptr<T> make_unique(Args&&... args)
  */
 #define CLAMP(value, min, max) ((value < min) ? min : ((value > max) ? max : value))
 
+/**
+ * Raise an atomic to value, if it is lower
+ */
+static inline void AtomicMax( std::atomic<uint64_t> *pValue, uint64_t value )
+{
+    uint64_t current = pValue->load( std::memory_order_relaxed );
+
+    while ( value > current &&
+            !pValue->compare_exchange_weak( current, value, std::memory_order_release,
+                                                            std::memory_order_relaxed ) ) {
+    }
+}
+
 
 //-----------------------------------------------------------------------------
 
@@ -55,6 +55,126 @@ typedef VcetBoProxy* VcetBoHandle;
 struct VcetJobProxy;
 typedef VcetJobProxy* VcetJobHandle;
 
+/**
+ * Pass as the device index to place a context on the least loaded device
+ */
+#define VCET_DEVICE_LEAST_LOADED            0xffffffffu
+
+/**
+ * Describes a GPU that libvcetoy can run on
+ */
+struct VcetDeviceInfo {
+    char renderNode[64];            // e.g. /dev/dri/renderD128
+    char busId[32];                 // e.g. pci:0000:01:00.0
+    uint16_t pciVendorId;
+    uint16_t pciDeviceId;
+    uint32_t familyId;              // AMDGPU_FAMILY_*
+    uint32_t vceFwVersion;
+    bool mvSupported;               // Contexts can be created on this device
+};
+
+/**
+ * Scheduling priority of a context's jobs relative to other contexts
+ *
+ * Priorities above VCET_PRIORITY_NORMAL require CAP_SYS_NICE.
+ */
+enum VcetPriority {
+    VCET_PRIORITY_LOW = -1,         // Bulk work that may be starved
+    VCET_PRIORITY_NORMAL = 0,
+    VCET_PRIORITY_HIGH = 1,         // Latency critical work
+    VCET_PRIORITY_VERY_HIGH = 2,
+};
+
+/**
+ * Parameters for VcetContextCreate2, zero initialize for defaults
+ */
+struct VcetContextCreateInfo {
+    uint32_t width;                 // The frame width the app expects to handle
+    uint32_t height;                // The frame height the app expects to handle
+    VcetPriority priority;
+    bool selectDevice;              // Place the context on deviceIndex, instead of the default device
+    uint32_t deviceIndex;           // As for VcetContextCreateOnDevice, used if selectDevice is set
+};
+
+/**
+ * How the application accesses a bo, decides where the bo is placed
+ *
+ * Uploads to write combined memory are several times faster than to cached
+ * memory, while reads from it are several times slower.
+ */
+enum VcetBoUsage {
+    VCET_BO_USAGE_DEVICE = 0,       // GPU only, not mappable
+    VCET_BO_USAGE_DEVICE_UPLOAD,    // CPU writable VRAM, for data the GPU reads many times
+    VCET_BO_USAGE_UPLOAD,           // Write combined system memory the CPU streams into
+    VCET_BO_USAGE_READBACK,         // Cached system memory the CPU reads from
+};
+
+/**
+ * Parameters for VcetBoCreate2, zero initialize for defaults
+ *
+ * Either sizeBytes, or width and height of an NV21 image must be set.
+ */
+struct VcetBoCreateInfo {
+    uint64_t sizeBytes;
+    uint32_t width;                 // Image width, aligned as per VcetBoAlignDimensions
+    uint32_t height;                // Image height, aligned as per VcetBoAlignDimensions
+    VcetBoUsage usage;
+};
+
+/**
+ * Upper bound on the number of VCE rings a context can use
+ */
+#define VCET_MAX_RINGS                      4
+
+/**
+ * Counters describing the internal behaviour of a libvcetoy context
+ */
+struct VcetContextStats {
+    uint64_t boListCacheHits;       // Submissions that reused a cached bo list
+    uint64_t boListCacheMisses;     // Submissions that had to create a bo list
+    uint64_t ibRingWaits;           // Submissions that blocked on an in-flight IB
+    uint32_t ibRingSize;            // Number of IBs currently owned by the context, over all threads
+    uint32_t numRings;              // VCE rings the context submits to
+    uint64_t ringSubmissions[VCET_MAX_RINGS]; // Submissions per entry of the above
+    uint32_t numSessions;           // Live VCE sessions, one per aligned frame size
+    uint64_t sessionEvictions;      // Sessions destroyed to make room for another frame size
+    uint32_t numSlabs;              // Large bos that small bos are carved out of
+    uint32_t numSlabBlocks;         // Small bos currently carved out of the slabs
+    uint64_t vaArenaBytes;          // GPU VA handed out of the context's reserved range
+    uint64_t vaArenaReservedBytes;  // GPU VA reserved by the context, grows with its bos
+    uint64_t importCacheHits;       // Imports that reused the bo of an earlier import
+    uint32_t numCachedImports;      // Imported buffers kept alive by the import cache
+};
+
+/**
+ * Behaviour of a context when all of its command buffers are in flight
+ */
+enum VcetIbRingPolicy {
+    VCET_IB_RING_POLICY_WAIT = 0,   // Block until the oldest submission retires
+    VCET_IB_RING_POLICY_GROW,       // Allocate more command buffers, then block
+    VCET_IB_RING_POLICY_FAIL,       // Fail the submission
+};
+
+/**
+ * A single motion vector request, see VcetCalculateMvBatch
+ */
+struct VcetMvBatchEntry {
+    VcetBoHandle oldFrame;          // The reference frame in NV21 format
+    VcetBoHandle newFrame;          // The current frame in NV21 format
+    VcetBoHandle mvBo;              // The buffer in which to dump the motion vector data
+    uint32_t width;                 // The frame's width dimension
+    uint32_t height;                // The frame's height dimension
+    VcetJobHandle job;              // On success, associated with the gpu work
+};
+
+/**
+ * Invoked by the completion reactor when a job completes
+ *
+ * @param job        The completed job, as passed at submission time
+ * @param pUserData  The pointer registered with VcetContextStartReactor
+ */
+typedef void (*VcetJobCompletionCallback)( VcetJobHandle job, void *pUserData );
+
 /**
  * Check if the current system supports the libvcetoy features
  */
@@ -63,6 +183,12 @@ bool VcetIsSystemSupported();
 /**
  * Create a libvcetoy context
  *
+ * The context can process frames of any size. Each aligned frame size needs
+ * a VCE session, the one for width x height is created up front and others
+ * on first use. The engine has a limited number of sessions shared by all
+ * processes, when they run out the least recently used session of the
+ * context is destroyed.
+ *
  * @param pCtx      On success, populated with the libvcetoy context handle
  * @param width     The frame width the app expects to handle
  * @param height    The frame height the app expects to handle
@@ -71,6 +197,55 @@ bool VcetIsSystemSupported();
  */
 bool VcetContextCreate( VcetCtxHandle *pCtx, uint32_t width, uint32_t height );
 
+/**
+ * Create a libvcetoy context with extended parameters
+ *
+ * @param pCtx          On success, populated with the libvcetoy context handle
+ * @param pCreateInfo   Describes the context to create
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextCreate2( VcetCtxHandle *pCtx, const VcetContextCreateInfo *pCreateInfo );
+
+/**
+ * List the GPUs available to libvcetoy
+ *
+ * The list is built on first use and does not change afterwards. Device
+ * indices refer to positions in this list.
+ *
+ * @param pDevices  Optional. Populated with up to *pCount entries
+ * @param pCount    If pDevices is nullptr, populated with the number of
+ *                  devices. Otherwise holds the capacity of pDevices, and
+ *                  is updated with the number of entries written.
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetEnumerateDevices( VcetDeviceInfo *pDevices, uint32_t *pCount );
+
+/**
+ * Create a libvcetoy context on a specific device
+ *
+ * @param pCtx          On success, populated with the libvcetoy context handle
+ * @param deviceIndex   An index from VcetEnumerateDevices, or
+ *                      VCET_DEVICE_LEAST_LOADED to pick the MV capable
+ *                      device with the fewest contexts in this process
+ * @param width         The frame width the app expects to handle
+ * @param height        The frame height the app expects to handle
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextCreateOnDevice( VcetCtxHandle *pCtx, uint32_t deviceIndex, uint32_t width, uint32_t height );
+
+/**
+ * Query the device a context runs on
+ *
+ * @param ctx           The VcetCtx
+ * @param pDeviceIndex  On success, populated with the VcetEnumerateDevices index
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextGetDevice( VcetCtxHandle ctx, uint32_t *pDeviceIndex );
+
 /**
  * Destroy a libvcetoy context
  *
@@ -80,6 +255,151 @@ bool VcetContextCreate( VcetCtxHandle *pCtx, uint32_t width, uint32_t height );
  */
 void VcetContextDestroy( VcetCtxHandle *pCtx );
 
+/**
+ * Query the counters of a libvcetoy context
+ *
+ * @param ctx       The VcetCtx
+ * @param pStats    On success, populated with the context counters
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextGetStats( VcetCtxHandle ctx, VcetContextStats *pStats );
+
+/**
+ * Release the buffers the context keeps imported
+ *
+ * Call when the producer of imported buffers frees them, e.g. on swapchain
+ * recreation. Handles returned by VcetBoImport() remain valid.
+ *
+ * @param ctx       The VcetCtx
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextFlushImports( VcetCtxHandle ctx );
+
+/**
+ * Configure how a context handles running out of idle command buffers
+ *
+ * The default policy is VCET_IB_RING_POLICY_WAIT. Deep pipelines should
+ * use VCET_IB_RING_POLICY_GROW with maxIbs set to the expected number of
+ * jobs in flight.
+ *
+ * Each thread that submits to the context builds its jobs in its own set of
+ * command buffers, the policy applies to each set.
+ *
+ * @param ctx       The VcetCtx
+ * @param policy    The policy to apply
+ * @param maxIbs    Upper bound on the number of command buffers of each
+ *                  thread for VCET_IB_RING_POLICY_GROW. Must not be smaller
+ *                  than the current number of command buffers of any thread.
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextSetIbRingPolicy( VcetCtxHandle ctx, VcetIbRingPolicy policy, uint32_t maxIbs );
+
+/**
+ * How a context spreads its jobs over the VCE rings of its device
+ */
+enum VcetRingBalancePolicy {
+    VCET_RING_BALANCE_LEAST_OUTSTANDING = 0,    // The ring with the fewest jobs in flight
+    VCET_RING_BALANCE_ROUND_ROBIN,              // Rotate through the rings
+};
+
+/**
+ * Configure how a context distributes its jobs over the VCE rings
+ *
+ * The default policy is VCET_RING_BALANCE_LEAST_OUTSTANDING. Only jobs of
+ * this context are considered when estimating ring load.
+ *
+ * @param ctx       The VcetCtx
+ * @param policy    The policy to apply
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextSetRingBalancePolicy( VcetCtxHandle ctx, VcetRingBalancePolicy policy );
+
+/**
+ * How VcetJobWait waits for a job to complete
+ */
+enum VcetWaitPolicy {
+    VCET_WAIT_BLOCK = 0,    // Sleep in the kernel until the job completes
+    VCET_WAIT_SPIN,         // Poll for up to spin_us, then sleep
+    VCET_WAIT_ADAPTIVE,     // Sleep until the job is expected to complete, then poll
+};
+
+/**
+ * Configure how a context waits for its jobs
+ *
+ * Short jobs can complete well before a sleeping waiter is scheduled again.
+ * Polling trades CPU time for a lower and more predictable wake-up delay.
+ *
+ * VCET_WAIT_ADAPTIVE keeps a moving average of the observed job durations of
+ * the context. It sleeps until shortly before a job is expected to complete,
+ * then polls for at most spin_us around the expected completion. It blocks
+ * until a first job has been observed to complete.
+ *
+ * The default policy is VCET_WAIT_BLOCK. VcetJobWaitMany always blocks.
+ *
+ * @param ctx       The VcetCtx
+ * @param policy    The policy to apply
+ * @param spin_us   Longest polling window in microseconds, 0 selects a default
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextSetWaitPolicy( VcetCtxHandle ctx, VcetWaitPolicy policy, uint32_t spin_us );
+
+/**
+ * Move job submission of a context to a dedicated thread
+ *
+ * When enabled, VcetCalculateMv and VcetCalculateMvBatch only push their
+ * requests into a lock-free queue, which may be done from several threads
+ * at once. A per-context submission thread builds the IBs and packs queued
+ * requests into as few kernel submissions as possible.
+ *
+ * A queued job is reported as not completed by VcetJobPoll until it has been
+ * submitted. Waiting on it waits for its submission first. If its
+ * submission fails, the wait fails.
+ *
+ * Disabling submits the queued requests and stops the thread. It must not
+ * race with calls that queue requests.
+ *
+ * @param ctx       The VcetCtx
+ * @param enable    true to enable asynchronous submission
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextSetAsyncSubmit( VcetCtxHandle ctx, bool enable );
+
+/**
+ * Start the completion reactor of a context
+ *
+ * The reactor is a per-context thread that waits on every job submitted
+ * after this call, in submission order. When a job completes, it invokes
+ * callback and increments a per-context eventfd, which allows integrating
+ * completions into an epoll based event loop.
+ *
+ * The callback runs on the reactor thread. Job handles must remain valid
+ * until their completion has been reported.
+ *
+ * @param ctx       The VcetCtx
+ * @param callback  Optional. Invoked once for each completed job
+ * @param pUserData Passed to callback
+ * @param pEventFd  Optional. Populated with the reactor's eventfd. The fd
+ *                  remains owned by the context.
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetContextStartReactor( VcetCtxHandle ctx, VcetJobCompletionCallback callback, void *pUserData, int *pEventFd );
+
+/**
+ * Stop the completion reactor of a context
+ *
+ * Jobs that have not completed yet will not be reported
+ *
+ * @param ctx       The VcetCtx
+ */
+void VcetContextStopReactor( VcetCtxHandle ctx );
+
 /**
  * Calculates the required HW alignment for a NV21 image
  *
@@ -120,6 +440,20 @@ bool VcetBoCreate( VcetCtxHandle ctx, uint64_t sizeBytes, bool mappable, VcetBoH
  */
 bool VcetBoCreateImage( VcetCtxHandle ctx, uint32_t width, uint32_t height, bool mappable, VcetBoHandle *pBo, uint32_t *pAlignedWidth, uint32_t *pAlignedHeight );
 
+/**
+ * Creates a libvcetoy buffer object placed for the way it is accessed
+ *
+ * VcetBoCreate() and VcetBoCreateImage() place mappable bos as
+ * VCET_BO_USAGE_READBACK, and the others as VCET_BO_USAGE_DEVICE.
+ *
+ * @param ctx           The VcetCtx from which to allocate the bo
+ * @param pCreateInfo   Size and usage of the bo
+ * @param pBo           On success, populated with the bo handle
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetBoCreate2( VcetCtxHandle ctx, const VcetBoCreateInfo *pCreateInfo, VcetBoHandle *pBo );
+
 /**
  * Creates a libvcetoy buffer object that aliases the memory referenced by fd
  *
@@ -130,10 +464,34 @@ bool VcetBoCreateImage( VcetCtxHandle ctx, uint32_t width, uint32_t height, bool
  *
  * Note: on success, libvcetoy takes ownership of fd
  *
+ * The context keeps its most recently imported buffers imported. Importing
+ * one of them again, through any fd, returns a handle to the same bo without
+ * a round trip to the kernel. The cache keeps the memory alive once the
+ * producer is done with it, see VcetContextFlushImports().
+ *
  * @return true on success, false otherwise
  */
 bool VcetBoImport( VcetCtxHandle ctx, int fd, bool mappable, VcetBoHandle *pBo );
 
+/**
+ * Creates a libvcetoy buffer object backed by host memory
+ *
+ * The GPU accesses ptr directly, so frames decoded into it need no copy, and
+ * motion vectors are written straight to it. Maps return ptr.
+ *
+ * @param ctx           The VcetCtx from which to create the bo
+ * @param ptr           Page aligned host memory
+ * @param sizeBytes     Size of the memory, a multiple of the page size
+ * @param pBo           On success, populated with the bo handle
+ *
+ * Note: the memory must stay valid until the bo is destroyed and the jobs
+ * that use it have completed
+ *
+ * @return true on success, false otherwise. Always fails with libdrm
+ *         versions that lack amdgpu_create_bo_from_user_mem
+ */
+bool VcetBoCreateFromHostPtr( VcetCtxHandle ctx, void *ptr, uint64_t sizeBytes, VcetBoHandle *pBo );
+
 /**
  * Destroys a libvcetoy buffer object
  *
@@ -144,6 +502,10 @@ void VcetBoDestroy( VcetBoHandle *pBo );
 /**
  * Map a buffer object for cpu access
  *
+ * Maps are reference counted and may be taken from several threads at once.
+ * Only the first map of a bo creates the mapping, later ones return the same
+ * pointer without a system call.
+ *
  * @param bo        The bo to map
  * @param ppData    Will be filled with a cpu pointer to bo's memory
  *
@@ -152,17 +514,72 @@ void VcetBoDestroy( VcetBoHandle *pBo );
 bool VcetBoMap( VcetBoHandle bo, uint8_t **ppData );
 
 /**
- * Destroy a buffer objects CPU mapping
+ * Release a reference taken by VcetBoMap()
+ *
+ * The pointer must not be used once the reference is released. The mapping
+ * itself is kept until the bo is destroyed, so that mapping the bo again
+ * every frame is free.
  *
  * @param bo    The bo to unmap
  *
- * @return true on success, false otherwise
+ * @return false if bo holds no map reference, true otherwise
  */
 bool VcetBoUnmap( VcetBoHandle bo );
 
+/**
+ * Copy a range of a buffer object to CPU memory
+ *
+ * Reading a write combined or uncached bo through its mapping, e.g. a byte
+ * at a time, is very slow. This copy reads such bos with streaming loads
+ * (MOVNTDQA) a page at a time, and cached bos with a plain memcpy. See
+ * VcetJobAddReadback() to make the copy as soon as a job completes.
+ *
+ * @param bo        The bo to copy from, must be mappable
+ * @param pDst      Receives size bytes
+ * @param offset    Offset of the range in the bo
+ * @param size      Size of the range in bytes
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetBoReadback( VcetBoHandle bo, void *pDst, uint64_t offset, uint64_t size );
+
+/**
+ * Copy CPU memory into a buffer object
+ *
+ * Meant for filling write combined bos, see VCET_BO_USAGE_UPLOAD, which a
+ * plain memcpy is slow at. The copy uses the widest non-temporal stores the
+ * CPU supports and doesn't pull the bo into the CPU caches.
+ *
+ * Images from VcetBoCreateImage() are filled row by row: each source row
+ * provides width bytes, written at the aligned pitch. The first height rows
+ * are the luma plane, the following ones the interleaved chroma plane, which
+ * starts at the aligned height in the bo. Other bos receive the rows back to
+ * back.
+ *
+ * @param bo            The bo to fill, must be mappable
+ * @param pSrc          The first source row
+ * @param srcPitch      Distance between source rows in bytes
+ * @param rows          Number of rows to copy
+ * @param maxThreads    Split large copies over up to this many threads, 0 or
+ *                      1 to copy on the calling thread only
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetBoUpload( VcetBoHandle bo, const void *pSrc, uint32_t srcPitch, uint32_t rows, uint32_t maxThreads );
+
 /**
  * Calculate the motion vector delta between oldFrame and newFrame
  *
+ * May be called from several threads at once for the same context, each
+ * with its own _job.
+ *
+ * With asynchronous submission enabled, this only queues the request and
+ * processing errors are reported when waiting on _job. Invalid requests are
+ * still rejected right away, and never fail requests queued by other threads.
+ *
+ * Frames must hold an NV21 image of the dimensions aligned by
+ * VcetBoAlignDimensions, and _mvBo 16 bytes per 16x16 macroblock of it.
+ *
  * @param _ctx      The vcet context
  * @param _oldFrame The reference frame in NV21 format
  * @param _newFrame The current frame in NV21 format
@@ -175,6 +592,26 @@ bool VcetBoUnmap( VcetBoHandle bo );
  */
 bool VcetCalculateMv( VcetCtxHandle _ctx, VcetBoHandle _oldFrame, VcetBoHandle _newFrame, VcetBoHandle _mvBo, uint32_t width, uint32_t height, VcetJobHandle _job );
 
+/**
+ * Calculate the motion vector deltas for several frame pairs at once
+ *
+ * The work is packed into as few kernel submissions as possible. Each
+ * entry's job can be waited on individually with VcetJobWait. Jobs that
+ * were packed into the same submission complete together.
+ *
+ * Nothing is submitted if an entry is invalid. If a submission fails part
+ * way through the batch, the jobs of the entries submitted before it still
+ * complete as usual, and the remaining jobs are left without work. With
+ * asynchronous submission enabled, nothing is queued if an entry is invalid.
+ *
+ * @param _ctx      The vcet context
+ * @param pEntries  Array of count motion vector requests
+ * @param count     Number of entries in pEntries
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetCalculateMvBatch( VcetCtxHandle _ctx, const VcetMvBatchEntry *pEntries, uint32_t count );
+
 /**
  * Create a VcetJob object
  *
@@ -199,10 +636,78 @@ void VcetJobDestroy( VcetJobHandle *pJob );
  * @param _job       The job to wait for
  * @param timeout_ns Timeout value for the wait operation in nanoseconds
  *
- * @return true on success, false otherwise
+ * @return true if the job completed, false on timeout or error
  */
 bool VcetJobWait( VcetCtxHandle _ctx, VcetJobHandle _job, uint64_t timeout_ns );
 
+/**
+ * Check whether a job has completed without blocking
+ *
+ * Jobs known to have completed, or tracked by a running completion reactor,
+ * are answered with a memory load instead of a kernel query. This makes
+ * spin polling cheap when the reactor is running.
+ *
+ * @param _ctx       The vcet context
+ * @param _job       The job to check
+ * @param pCompleted On success, true if the job has completed
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetJobPoll( VcetCtxHandle _ctx, VcetJobHandle _job, bool *pCompleted );
+
+/**
+ * Wait for any or all of a set of jobs to complete with a single CPU wait
+ *
+ * @param _ctx       The vcet context all the jobs were submitted to
+ * @param pJobs      Array of count jobs
+ * @param count      Number of jobs in pJobs
+ * @param waitAll    Wait for all the jobs if true, for any job otherwise
+ * @param timeout_ns Timeout value for the wait operation in nanoseconds
+ * @param pCompleted On success, true if the wait condition was met before
+ *                   the timeout expired
+ * @param pFirst     Optional. When waiting for any job, populated with the
+ *                   index of a completed job
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetJobWaitMany( VcetCtxHandle _ctx, const VcetJobHandle *pJobs, uint32_t count, bool waitAll, uint64_t timeout_ns, bool *pCompleted, uint32_t *pFirst );
+
+/**
+ * Export a job's completion as a sync_file fd
+ *
+ * The fd becomes readable (POLLIN) once the job completes, which allows
+ * waiting on jobs from an epoll/poll based event loop.
+ *
+ * @param _ctx       The vcet context
+ * @param _job       A submitted job
+ * @param pFd        On success, populated with the sync_file fd. The caller
+ *                   takes ownership of the fd.
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetJobExportSyncFd( VcetCtxHandle _ctx, VcetJobHandle _job, int *pFd );
+
+/**
+ * Copy a range of a bo to CPU memory once a job completes
+ *
+ * Applies to the job's next submission only, the completion of an earlier
+ * submission does not trigger it. The copy is made as in VcetBoReadback(), by the first
+ * thread to see the job complete. With the completion reactor running, that
+ * is the reactor thread, and the copy is done by the time the job's
+ * completion callback runs and its eventfd is signaled. Otherwise it is done
+ * by the time VcetJobWait, VcetJobPoll or VcetJobWaitMany report the job as
+ * complete.
+ *
+ * @param _job      The job to attach the copy to
+ * @param _bo       The bo to copy from, must be mappable
+ * @param pDst      Receives the data, must stay valid until the job completes
+ * @param offset    Offset of the range in the bo
+ * @param size      Size of the range in bytes
+ *
+ * @return true on success, false otherwise
+ */
+bool VcetJobAddReadback( VcetJobHandle _job, VcetBoHandle _bo, void *pDst, uint64_t offset, uint64_t size );
+
 #ifdef __cplusplus
 }
 #endif
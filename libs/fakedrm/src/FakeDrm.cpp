@@ -0,0 +1,1183 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+/**
+ * A stand-in for libdrm and libdrm_amdgpu
+ *
+ * Implements the subset of the libdrm api used by libvcetoy on top of host
+ * memory so that the library can be exercised on machines without an AMD
+ * GPU. Point VCETOY_LIBDRM and VCETOY_LIBDRM_AMDGPU at this library to use it.
+ *
+ * Submissions are executed by a small simulation of the VCE engine. The MV
+ * and encode packets written by VcetIb are parsed, and motion vectors are
+ * computed on the CPU with a full search block matcher. The output holds one
+ * FakeMv per 16x16 macroblock, in raster order.
+ *
+ * By default submissions execute and retire during amdgpu_cs_submit. Setting
+ * VCETOY_FAKEDRM_LATENCY_US makes each submission occupy its ring for that
+ * long instead: a scheduler thread runs the rings of every device, and fence
+ * waits block until the submission retires. Like the kernel scheduler, a ring
+ * that frees up picks the oldest submission of the highest priority context
+ * from amdgpu_cs_ctx_create2.
+ *
+ * VCETOY_FAKEDRM_DEVICES sets how many GPUs are reported by drmGetDevices2,
+ * one by default. Each device lives on its own pci bus.
+ *
+ * VCETOY_FAKEDRM_VCE_RINGS sets how many VCE rings each device exposes, one
+ * by default. Every ring is modelled as an independent queue.
+ *
+ * dma-buf imports accept any mappable fd, such as a memfd, and share its
+ * pages with the file. Userptr bos use the caller's memory as is, with the
+ * kernel's page alignment requirements.
+ *
+ * Like the kernel, submissions are checked against the VCE session handles
+ * of the device. A device holds at most 16 sessions over all its users, or
+ * VCETOY_FAKEDRM_VCE_HANDLES if set.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <xf86drm.h>
+#include <libdrm/amdgpu.h>
+#include <libdrm/amdgpu_drm.h>
+
+#define FAKE_VA_START       0x100000000ull
+#define FAKE_VA_ALIGNMENT   4096
+
+// Report a Polaris 10 with MV capable firmware
+#define FAKE_FAMILY_ID      AMDGPU_FAMILY_VI
+#define FAKE_CHIP_REV       0x1
+#define FAKE_CHIP_EXT_REV   ( FAKE_CHIP_REV + 0x50 )
+#define FAKE_VCE_FW         ((53 << 24) | (0 << 16) | (03 << 8))
+
+#define FAKE_ALIGN(value, alignment) (((value) + alignment - 1) & ~((uint64_t)alignment - 1))
+
+#define FAKE_LATENCY_ENV    "VCETOY_FAKEDRM_LATENCY_US"
+#define FAKE_DEVICES_ENV    "VCETOY_FAKEDRM_DEVICES"
+#define FAKE_VCE_RINGS_ENV  "VCETOY_FAKEDRM_VCE_RINGS"
+#define FAKE_VCE_MAX_RINGS  3
+#define FAKE_VCE_HANDLES_ENV "VCETOY_FAKEDRM_VCE_HANDLES"
+#define FAKE_VCE_MAX_HANDLES 16
+
+#define FAKE_PCI_VENDOR_ID  0x1002
+#define FAKE_PCI_DEVICE_ID  0x67df
+#define FAKE_RENDER_MINOR   128
+
+// VCE packets understood by the simulated engine
+#define FAKE_VCE_CMD_SESSION 0x00000001
+#define FAKE_VCE_CMD_CREATE 0x01000001
+#define FAKE_VCE_CMD_DESTROY 0x02000001
+#define FAKE_VCE_CMD_MV     0x0500000d
+#define FAKE_VCE_CMD_ENCODE 0x03000001
+
+#define FAKE_MB_SIZE        16
+#define FAKE_MV_SEARCH      8
+
+typedef std::chrono::steady_clock FakeClock;
+
+struct FakeMv {
+    int16_t mX;
+    int16_t mY;
+};
+
+struct FakeTimeline {
+    uint64_t mLastSeqNo;
+    uint64_t mSignaledSeqNo;
+
+    // eventfds handed out as sync files, keyed by the seq_no they wait for
+    std::multimap<uint64_t, int> mSyncFds;
+
+    FakeTimeline() : mLastSeqNo( 0 ), mSignaledSeqNo( 0 ) {}
+};
+
+struct FakeMapping {
+    amdgpu_bo *mBo;
+    uint64_t mOffset;
+    uint64_t mSize;
+};
+
+struct amdgpu_device {
+    int mFd;
+    uint64_t mNextVa;
+
+    // GPU VA mappings keyed by start address
+    std::map<uint64_t, FakeMapping> mMappings;
+};
+
+struct amdgpu_bo {
+    amdgpu_device *mDevice;
+    uint64_t mSize;
+    uint32_t mHeap;
+    uint64_t mFlags;
+    uint8_t *mCpu;
+    bool mImported;         // mCpu is a shared mapping of the imported fd
+    bool mUserPtr;          // mCpu belongs to the caller
+};
+
+struct amdgpu_va {
+    amdgpu_device *mDevice;
+    uint64_t mAddr;
+    uint64_t mSize;
+};
+
+struct amdgpu_bo_list {
+    std::vector<amdgpu_bo_handle> mBos;
+};
+
+struct amdgpu_context {
+    amdgpu_device *mDevice;
+    int32_t mPriority;
+    std::map<uint32_t, FakeTimeline> mTimelines;
+};
+
+struct FakeIb {
+    uint64_t mVa;
+    uint32_t mSizeDw;
+};
+
+struct FakeSubmission {
+    amdgpu_context *mContext;
+    uint32_t mTimelineKey;
+    uint64_t mSeqNo;
+    std::vector<FakeIb> mIbs;
+};
+
+// Queue order of a submission, highest priority first then oldest first
+typedef std::pair<int32_t, uint64_t> FakeQueueKey;
+
+struct FakeRing {
+    std::map<FakeQueueKey, FakeSubmission> mQueue;
+
+    // The submission occupying the ring, and when it completes
+    bool mRunning;
+    FakeSubmission mCurrent;
+    FakeClock::time_point mBusyUntil;
+
+    FakeRing() : mRunning( false ) {}
+};
+
+struct FakeScheduler {
+    // Notified whenever a fence retires
+    std::condition_variable mRetired;
+
+    // Rings keyed by device and timeline key, only used with a latency
+    std::condition_variable mPendingChanged;
+    std::map<std::pair<amdgpu_device*, uint32_t>, FakeRing> mRings;
+    uint64_t mNextOrder;
+    bool mThreadStarted;
+
+    FakeScheduler() : mNextOrder( 0 ), mThreadStarted( false ) {}
+};
+
+static std::mutex sLock;
+
+// Device index of each fd returned by drmOpenWithType
+static std::map<int, uint32_t> sFdDevice;
+
+// Live VCE session handles of each device index, and the device handle that
+// created them
+static std::map<uint32_t, std::map<uint32_t, amdgpu_device*>> sVceHandles;
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static FakeScheduler *GetScheduler()
+{
+    // Never freed, the retire thread outlives static destructors
+    static FakeScheduler *scheduler = new FakeScheduler();
+    return scheduler;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static FakeClock::duration GetLatency()
+{
+    static const FakeClock::duration latency = [] {
+        const char *env = getenv( FAKE_LATENCY_ENV );
+        return std::chrono::microseconds( env ? strtoull( env, nullptr, 0 ) : 0 );
+    }();
+
+    return latency;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint32_t GetVceRingCount()
+{
+    static const uint32_t count = [] {
+        const char *env = getenv( FAKE_VCE_RINGS_ENV );
+        uint32_t rings = env ? strtoul( env, nullptr, 0 ) : 1;
+        return std::min<uint32_t>( std::max<uint32_t>( rings, 1 ), FAKE_VCE_MAX_RINGS );
+    }();
+
+    return count;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint32_t GetVceHandleLimit()
+{
+    static const uint32_t limit = [] {
+        const char *env = getenv( FAKE_VCE_HANDLES_ENV );
+        return env ? (uint32_t) strtoul( env, nullptr, 0 ) : FAKE_VCE_MAX_HANDLES;
+    }();
+
+    return limit;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint32_t GetTimelineKey( uint32_t ipType, uint32_t ipInstance, uint32_t ring )
+{
+    return ( ipType << 16 ) | ( ipInstance << 8 ) | ring;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static FakeTimeline *GetTimeline( struct amdgpu_cs_fence *fence )
+{
+    return &fence->context->mTimelines[ GetTimelineKey( fence->ip_type, fence->ip_instance, fence->ring ) ];
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void SignalSyncFd( int fd )
+{
+    uint64_t value = 1;
+    ssize_t written = write( fd, &value, sizeof(value) );
+    (void) written;
+    close( fd );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void RetireTimeline( FakeTimeline *timeline, uint64_t seqNo )
+{
+    if ( seqNo <= timeline->mSignaledSeqNo )
+        return;
+
+    timeline->mSignaledSeqNo = seqNo;
+
+    auto end = timeline->mSyncFds.upper_bound( seqNo );
+    for ( auto it = timeline->mSyncFds.begin(); it != end; ++it ) {
+        SignalSyncFd( it->second );
+    }
+    timeline->mSyncFds.erase( timeline->mSyncFds.begin(), end );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+template <typename Predicate>
+static void WaitForRetire( std::unique_lock<std::mutex> &lock, uint64_t timeoutNs, Predicate signaled )
+{
+    if ( !timeoutNs )
+        return;
+
+    // Anything that does not fit a steady_clock duration is forever
+    if ( timeoutNs >= (uint64_t) INT64_MAX / 2 )
+        GetScheduler()->mRetired.wait( lock, signaled );
+    else
+        GetScheduler()->mRetired.wait_for( lock, std::chrono::nanoseconds( timeoutNs ), signaled );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint8_t *TranslateVa( amdgpu_device *dev, uint64_t va, uint64_t size )
+{
+    auto it = dev->mMappings.upper_bound( va );
+    if ( it == dev->mMappings.begin() )
+        return nullptr;
+
+    --it;
+
+    const FakeMapping &mapping = it->second;
+    if ( va + size > it->first + mapping.mSize )
+        return nullptr;
+
+    return mapping.mBo->mCpu + mapping.mOffset + ( va - it->first );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static int ValidateVceHandles( amdgpu_device *dev, const struct amdgpu_cs_request *request )
+{
+    std::map<uint32_t, amdgpu_device*> &handles = sVceHandles[ sFdDevice[ dev->mFd ] ];
+    std::set<uint32_t> referenced, created, destroyed;
+
+    // Session packets select the handle for the packets that follow
+    for ( uint32_t i = 0; i < request->number_of_ibs; ++i ) {
+        FakeIb ib = { request->ibs[i].ib_mc_address, request->ibs[i].size };
+        const uint32_t *cmds = (const uint32_t*) TranslateVa( dev, ib.mVa, ib.mSizeDw * sizeof(uint32_t) );
+        uint32_t handle = 0;
+        uint32_t offset = 0;
+
+        if ( !cmds )
+            return -EINVAL;
+
+        while ( offset + 2 <= ib.mSizeDw ) {
+            const uint32_t *packet = &cmds[offset];
+            uint32_t packetDw = packet[0] / sizeof(uint32_t);
+            auto it = handles.find( handle );
+
+            if ( packetDw < 2 || offset + packetDw > ib.mSizeDw )
+                break;
+
+            switch ( packet[1] ) {
+                case FAKE_VCE_CMD_SESSION:
+                    handle = packet[2];
+                    referenced.insert( handle );
+
+                    if ( handles.count( handle ) && handles[ handle ] != dev )
+                        return -EINVAL;
+                    break;
+                case FAKE_VCE_CMD_CREATE:
+                    if ( it != handles.end() || created.count( handle ) )
+                        return -EINVAL;
+
+                    if ( handles.size() + created.size() >= GetVceHandleLimit() ) {
+                        fprintf( stderr, "fakedrm: No more free VCE handles!\n" );
+                        return -EINVAL;
+                    }
+
+                    created.insert( handle );
+                    break;
+                case FAKE_VCE_CMD_DESTROY:
+                    destroyed.insert( handle );
+                    break;
+                default:
+                    break;
+            }
+
+            offset += packetDw;
+        }
+    }
+
+    for ( uint32_t handle : referenced ) {
+        if ( !handles.count( handle ) && !created.count( handle ) )
+            return -ENOENT;
+    }
+
+    for ( uint32_t handle : created )
+        handles[ handle ] = dev;
+
+    for ( uint32_t handle : destroyed )
+        handles.erase( handle );
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint32_t BlockSad( const uint8_t *a, const uint8_t *b, uint32_t pitch, uint32_t limit )
+{
+    uint32_t sad = 0;
+
+    for ( uint32_t y = 0; y < FAKE_MB_SIZE && sad < limit; ++y ) {
+        for ( uint32_t x = 0; x < FAKE_MB_SIZE; ++x ) {
+            sad += abs( (int) a[x] - (int) b[x] );
+        }
+        a += pitch;
+        b += pitch;
+    }
+
+    return sad;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void ComputeMv( const uint8_t *ref, const uint8_t *cur, uint32_t width, uint32_t height, uint32_t pitch, FakeMv *mvs )
+{
+    int mbWidth = width / FAKE_MB_SIZE;
+    int mbHeight = height / FAKE_MB_SIZE;
+
+    for ( int mbY = 0; mbY < mbHeight; ++mbY ) {
+        for ( int mbX = 0; mbX < mbWidth; ++mbX ) {
+            int x = mbX * FAKE_MB_SIZE;
+            int y = mbY * FAKE_MB_SIZE;
+            const uint8_t *block = cur + y * pitch + x;
+            FakeMv best = { 0, 0 };
+            uint32_t bestSad = BlockSad( block, ref + y * pitch + x, pitch, UINT32_MAX );
+
+            // Full search, the zero vector wins ties
+            for ( int dy = -FAKE_MV_SEARCH; dy <= FAKE_MV_SEARCH && bestSad; ++dy ) {
+                for ( int dx = -FAKE_MV_SEARCH; dx <= FAKE_MV_SEARCH && bestSad; ++dx ) {
+                    int rx = x + dx;
+                    int ry = y + dy;
+                    uint32_t sad;
+
+                    if ( rx < 0 || ry < 0 || rx + FAKE_MB_SIZE > (int) width || ry + FAKE_MB_SIZE > (int) height )
+                        continue;
+
+                    sad = BlockSad( block, ref + ry * pitch + rx, pitch, bestSad );
+                    if ( sad < bestSad ) {
+                        bestSad = sad;
+                        best.mX = dx;
+                        best.mY = dy;
+                    }
+                }
+            }
+
+            mvs[ mbY * mbWidth + mbX ] = best;
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void ExecuteIb( amdgpu_device *dev, const FakeIb &ib )
+{
+    const uint32_t *cmds = (const uint32_t*) TranslateVa( dev, ib.mVa, ib.mSizeDw * sizeof(uint32_t) );
+    uint64_t refVa = 0;
+    uint64_t mvVa = 0;
+    uint32_t offset = 0;
+
+    if ( !cmds )
+        return;
+
+    // Every packet starts with its size in bytes followed by the command id
+    while ( offset + 2 <= ib.mSizeDw ) {
+        const uint32_t *packet = &cmds[offset];
+        uint32_t packetDw = packet[0] / sizeof(uint32_t);
+
+        if ( packetDw < 2 || offset + packetDw > ib.mSizeDw )
+            break;
+
+        switch ( packet[1] ) {
+            case FAKE_VCE_CMD_MV:
+                refVa = ( (uint64_t) packet[2] << 32 ) | packet[3];
+                mvVa = ( (uint64_t) packet[7] << 32 ) | packet[8];
+                break;
+            case FAKE_VCE_CMD_ENCODE: {
+                uint64_t frameVa = ( (uint64_t) packet[9] << 32 ) | packet[10];
+                uint32_t height = packet[13];
+                uint32_t pitch = packet[14];
+                uint32_t width = pitch;
+                uint64_t lumaSize = (uint64_t) pitch * height;
+                uint64_t mvSize = ( width / FAKE_MB_SIZE ) * ( height / FAKE_MB_SIZE ) * sizeof(FakeMv);
+                const uint8_t *ref = TranslateVa( dev, refVa, lumaSize );
+                const uint8_t *cur = TranslateVa( dev, frameVa, lumaSize );
+                FakeMv *mvs = (FakeMv*) TranslateVa( dev, mvVa, mvSize );
+
+                // A plain encode without a preceding MV packet has no output
+                if ( ref && cur && mvs )
+                    ComputeMv( ref, cur, width, height, pitch, mvs );
+
+                refVa = 0;
+                mvVa = 0;
+                break;
+            }
+            default:
+                break;
+        }
+
+        offset += packetDw;
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void Execute( const FakeSubmission &submission )
+{
+    FakeTimeline *timeline = &submission.mContext->mTimelines[ submission.mTimelineKey ];
+
+    for ( const FakeIb &ib : submission.mIbs ) {
+        ExecuteIb( submission.mContext->mDevice, ib );
+    }
+
+    RetireTimeline( timeline, submission.mSeqNo );
+    GetScheduler()->mRetired.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void SchedulerThread()
+{
+    std::unique_lock<std::mutex> lock( sLock );
+    FakeScheduler *scheduler = GetScheduler();
+
+    while ( true ) {
+        FakeClock::time_point now = FakeClock::now();
+        FakeClock::time_point next = FakeClock::time_point::max();
+
+        for ( auto &it : scheduler->mRings ) {
+            FakeRing &ring = it.second;
+            FakeClock::time_point start = now;
+
+            if ( ring.mRunning && now >= ring.mBusyUntil ) {
+                Execute( ring.mCurrent );
+                ring.mRunning = false;
+
+                // Back to back submissions do not lose time to wakeup jitter
+                start = ring.mBusyUntil;
+            }
+
+            if ( !ring.mRunning && !ring.mQueue.empty() ) {
+                ring.mCurrent = ring.mQueue.begin()->second;
+                ring.mQueue.erase( ring.mQueue.begin() );
+                ring.mBusyUntil = start + GetLatency();
+                ring.mRunning = true;
+            }
+
+            if ( ring.mRunning )
+                next = std::min( next, ring.mBusyUntil );
+        }
+
+        if ( next == FakeClock::time_point::max() )
+            scheduler->mPendingChanged.wait( lock );
+        else
+            scheduler->mPendingChanged.wait_until( lock, next );
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint32_t GetDeviceCount()
+{
+    static const uint32_t count = [] {
+        const char *env = getenv( FAKE_DEVICES_ENV );
+        return env ? std::max<uint32_t>( strtoul( env, nullptr, 0 ), 1 ) : 1;
+    }();
+
+    return count;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static drmDevicePtr CreateDevice( uint32_t index )
+{
+    drmDevicePtr device = (drmDevicePtr) calloc( 1, sizeof(drmDevice) );
+    char node[64];
+
+    device->bustype = DRM_BUS_PCI;
+    device->available_nodes = 1 << DRM_NODE_RENDER;
+    device->nodes = (char **) calloc( DRM_NODE_MAX, sizeof(char *) );
+    snprintf( node, sizeof(node), "/dev/dri/renderD%u", FAKE_RENDER_MINOR + index );
+    device->nodes[ DRM_NODE_RENDER ] = strdup( node );
+
+    device->businfo.pci = (drmPciBusInfoPtr) calloc( 1, sizeof(drmPciBusInfo) );
+    device->businfo.pci->bus = index + 1;
+
+    device->deviceinfo.pci = (drmPciDeviceInfoPtr) calloc( 1, sizeof(drmPciDeviceInfo) );
+    device->deviceinfo.pci->vendor_id = FAKE_PCI_VENDOR_ID;
+    device->deviceinfo.pci->device_id = FAKE_PCI_DEVICE_ID;
+
+    return device;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int drmOpenWithType( const char *name, const char *busid, int type )
+{
+    int fd;
+    unsigned domain, bus, dev, func;
+    uint32_t index = 0;
+
+    if ( busid ) {
+        if ( sscanf( busid, "pci:%x:%x:%x.%u", &domain, &bus, &dev, &func ) != 4 )
+            return -EINVAL;
+
+        if ( domain || dev || func || bus < 1 || bus > GetDeviceCount() )
+            return -ENODEV;
+
+        index = bus - 1;
+    }
+
+    fd = open( "/dev/null", O_RDWR | O_CLOEXEC );
+    if ( fd < 0 )
+        return -errno;
+
+    std::lock_guard<std::mutex> lock( sLock );
+    sFdDevice[ fd ] = index;
+
+    return fd;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int drmGetDevices2( uint32_t flags, drmDevicePtr devices[], int max_devices )
+{
+    uint32_t count = GetDeviceCount();
+
+    if ( !devices )
+        return count;
+
+    count = std::min<uint32_t>( count, max_devices );
+    for ( uint32_t i = 0; i < count; ++i )
+        devices[i] = CreateDevice( i );
+
+    return count;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int drmGetDevice2( int fd, uint32_t flags, drmDevicePtr *device )
+{
+    std::lock_guard<std::mutex> lock( sLock );
+    auto it = sFdDevice.find( fd );
+
+    if ( it == sFdDevice.end() )
+        return -ENODEV;
+
+    *device = CreateDevice( it->second );
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void drmFreeDevice( drmDevicePtr *device )
+{
+    if ( !device || !*device )
+        return;
+
+    for ( int i = 0; i < DRM_NODE_MAX; ++i )
+        free( (*device)->nodes[i] );
+
+    free( (*device)->nodes );
+    free( (*device)->businfo.pci );
+    free( (*device)->deviceinfo.pci );
+    free( *device );
+    *device = nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void drmFreeDevices( drmDevicePtr devices[], int count )
+{
+    for ( int i = 0; i < count; ++i )
+        drmFreeDevice( &devices[i] );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_device_initialize( int fd, uint32_t *major_version, uint32_t *minor_version, amdgpu_device_handle *device_handle )
+{
+    amdgpu_device *dev = new amdgpu_device();
+
+    dev->mFd = fd;
+    dev->mNextVa = FAKE_VA_START;
+
+    *major_version = 3;
+    *minor_version = 19;
+    *device_handle = dev;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_device_deinitialize( amdgpu_device_handle device_handle )
+{
+    std::lock_guard<std::mutex> lock( sLock );
+    FakeScheduler *scheduler = GetScheduler();
+
+    for ( auto it = scheduler->mRings.begin(); it != scheduler->mRings.end(); ) {
+        if ( it->first.first == device_handle )
+            it = scheduler->mRings.erase( it );
+        else
+            ++it;
+    }
+
+    // The kernel frees the sessions of a closed file
+    for ( auto &device : sVceHandles ) {
+        for ( auto it = device.second.begin(); it != device.second.end(); ) {
+            if ( it->second == device_handle )
+                it = device.second.erase( it );
+            else
+                ++it;
+        }
+    }
+
+    delete device_handle;
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_query_gpu_info( amdgpu_device_handle dev, struct amdgpu_gpu_info *info )
+{
+    memset( info, 0, sizeof(*info) );
+    info->family_id = FAKE_FAMILY_ID;
+    info->chip_rev = FAKE_CHIP_REV;
+    info->chip_external_rev = FAKE_CHIP_EXT_REV;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_query_firmware_version( amdgpu_device_handle dev, unsigned fw_type, unsigned ip_instance, unsigned index, uint32_t *version, uint32_t *feature )
+{
+    if ( fw_type != AMDGPU_INFO_FW_VCE )
+        return -EINVAL;
+
+    *version = FAKE_VCE_FW;
+    *feature = 0;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_query_hw_ip_info( amdgpu_device_handle dev, unsigned type, unsigned ip_instance, struct drm_amdgpu_info_hw_ip *info )
+{
+    memset( info, 0, sizeof(*info) );
+
+    // Only the VCE engine is simulated
+    if ( type != AMDGPU_HW_IP_VCE || ip_instance )
+        return 0;
+
+    info->hw_ip_version_major = 3;
+    info->hw_ip_version_minor = 4;
+    info->ib_start_alignment = 64;
+    info->ib_size_alignment = 64;
+    info->available_rings = ( 1u << GetVceRingCount() ) - 1;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_cs_ctx_create2( amdgpu_device_handle dev, uint32_t priority, amdgpu_context_handle *context )
+{
+    amdgpu_context *ctx;
+
+    if ( (int32_t) priority < AMDGPU_CTX_PRIORITY_VERY_LOW || (int32_t) priority > AMDGPU_CTX_PRIORITY_VERY_HIGH )
+        return -EINVAL;
+
+    ctx = new amdgpu_context();
+    ctx->mDevice = dev;
+    ctx->mPriority = priority;
+    *context = ctx;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_cs_ctx_create( amdgpu_device_handle dev, amdgpu_context_handle *context )
+{
+    return amdgpu_cs_ctx_create2( dev, AMDGPU_CTX_PRIORITY_NORMAL, context );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_cs_ctx_free( amdgpu_context_handle context )
+{
+    std::lock_guard<std::mutex> lock( sLock );
+    FakeScheduler *scheduler = GetScheduler();
+
+    for ( auto &it : scheduler->mRings ) {
+        FakeRing &ring = it.second;
+
+        for ( auto queued = ring.mQueue.begin(); queued != ring.mQueue.end(); ) {
+            if ( queued->second.mContext == context )
+                queued = ring.mQueue.erase( queued );
+            else
+                ++queued;
+        }
+
+        if ( ring.mRunning && ring.mCurrent.mContext == context )
+            ring.mRunning = false;
+    }
+
+    // Nothing can signal the outstanding sync files anymore
+    for ( auto &timeline : context->mTimelines ) {
+        RetireTimeline( &timeline.second, timeline.second.mLastSeqNo );
+    }
+    scheduler->mRetired.notify_all();
+
+    delete context;
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_cs_submit( amdgpu_context_handle context, uint64_t flags, struct amdgpu_cs_request *ibs_request, uint32_t number_of_requests )
+{
+    std::lock_guard<std::mutex> lock( sLock );
+    FakeScheduler *scheduler = GetScheduler();
+    FakeClock::duration latency = GetLatency();
+
+    for ( uint32_t i = 0; i < number_of_requests; ++i ) {
+        struct amdgpu_cs_request *request = &ibs_request[i];
+        FakeTimeline *timeline;
+        FakeSubmission submission;
+
+        if ( !request->number_of_ibs || request->number_of_ibs > AMDGPU_CS_MAX_IBS_PER_SUBMIT )
+            return -EINVAL;
+
+        if ( request->ip_type == AMDGPU_HW_IP_VCE && request->ring >= GetVceRingCount() )
+            return -EINVAL;
+
+        if ( request->ip_type == AMDGPU_HW_IP_VCE ) {
+            int err = ValidateVceHandles( context->mDevice, request );
+            if ( err )
+                return err;
+        }
+
+        submission.mContext = context;
+        submission.mTimelineKey = GetTimelineKey( request->ip_type, request->ip_instance, request->ring );
+
+        timeline = &context->mTimelines[ submission.mTimelineKey ];
+        request->seq_no = ++timeline->mLastSeqNo;
+        submission.mSeqNo = request->seq_no;
+
+        for ( uint32_t j = 0; j < request->number_of_ibs; ++j ) {
+            FakeIb ib = { request->ibs[j].ib_mc_address, request->ibs[j].size };
+            submission.mIbs.push_back( ib );
+        }
+
+        if ( latency == FakeClock::duration::zero() ) {
+            Execute( submission );
+            continue;
+        }
+
+        // The ring is shared by every context on the device
+        FakeRing &ring = scheduler->mRings[ std::make_pair( context->mDevice, submission.mTimelineKey ) ];
+        FakeQueueKey key( -context->mPriority, scheduler->mNextOrder++ );
+        ring.mQueue.insert( std::make_pair( key, submission ) );
+
+        if ( !scheduler->mThreadStarted ) {
+            std::thread( SchedulerThread ).detach();
+            scheduler->mThreadStarted = true;
+        }
+    }
+
+    scheduler->mPendingChanged.notify_one();
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_cs_query_fence_status( struct amdgpu_cs_fence *fence, uint64_t timeout_ns, uint64_t flags, uint32_t *expired )
+{
+    std::unique_lock<std::mutex> lock( sLock );
+    FakeTimeline *timeline = GetTimeline( fence );
+    auto signaled = [&] { return fence->fence <= timeline->mSignaledSeqNo; };
+
+    if ( fence->fence > timeline->mLastSeqNo )
+        return -EINVAL;
+
+    WaitForRetire( lock, timeout_ns, signaled );
+    *expired = signaled();
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_cs_wait_fences( struct amdgpu_cs_fence *fences, uint32_t fence_count, bool wait_all, uint64_t timeout_ns, uint32_t *status, uint32_t *first )
+{
+    std::unique_lock<std::mutex> lock( sLock );
+    uint32_t signaled = 0;
+    uint32_t firstSignaled = 0;
+
+    auto check = [&] {
+        signaled = 0;
+        for ( uint32_t i = 0; i < fence_count; ++i ) {
+            FakeTimeline *timeline = GetTimeline( &fences[i] );
+
+            if ( fences[i].fence > timeline->mSignaledSeqNo )
+                continue;
+
+            if ( !signaled )
+                firstSignaled = i;
+            signaled++;
+        }
+
+        return wait_all ? signaled == fence_count : signaled > 0;
+    };
+
+    if ( !fence_count )
+        return -EINVAL;
+
+    for ( uint32_t i = 0; i < fence_count; ++i ) {
+        if ( fences[i].fence > GetTimeline( &fences[i] )->mLastSeqNo )
+            return -EINVAL;
+    }
+
+    WaitForRetire( lock, timeout_ns, check );
+
+    *status = check();
+    *first = firstSignaled;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_cs_fence_to_handle( amdgpu_device_handle dev, struct amdgpu_cs_fence *fence, uint32_t what, uint32_t *out_handle )
+{
+    std::lock_guard<std::mutex> lock( sLock );
+    FakeTimeline *timeline = GetTimeline( fence );
+    int fd, signalFd;
+
+    // Sync files are emulated with eventfds, which poll the same way
+    if ( what != AMDGPU_FENCE_TO_HANDLE_GET_SYNC_FILE_FD )
+        return -EINVAL;
+
+    if ( fence->fence > timeline->mLastSeqNo )
+        return -EINVAL;
+
+    fd = eventfd( 0, EFD_CLOEXEC );
+    if ( fd < 0 )
+        return -errno;
+
+    signalFd = dup( fd );
+    if ( signalFd < 0 ) {
+        close( fd );
+        return -errno;
+    }
+
+    if ( fence->fence <= timeline->mSignaledSeqNo )
+        SignalSyncFd( signalFd );
+    else
+        timeline->mSyncFds.insert( std::make_pair( fence->fence, signalFd ) );
+
+    *out_handle = fd;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_list_create( amdgpu_device_handle dev, uint32_t number_of_resources, amdgpu_bo_handle *resources, uint8_t *resource_prios, amdgpu_bo_list_handle *result )
+{
+    amdgpu_bo_list *list = new amdgpu_bo_list();
+
+    list->mBos.assign( resources, resources + number_of_resources );
+    *result = list;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_list_destroy( amdgpu_bo_list_handle handle )
+{
+    delete handle;
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_alloc( amdgpu_device_handle dev, struct amdgpu_bo_alloc_request *alloc_buffer, amdgpu_bo_handle *buf_handle )
+{
+    amdgpu_bo *bo;
+    uint64_t alignment = alloc_buffer->phys_alignment ? alloc_buffer->phys_alignment : FAKE_VA_ALIGNMENT;
+    void *cpu = nullptr;
+
+    if ( !alloc_buffer->alloc_size )
+        return -EINVAL;
+
+    if ( posix_memalign( &cpu, alignment, alloc_buffer->alloc_size ) )
+        return -ENOMEM;
+
+    // Freshly allocated kernel memory is always cleared
+    memset( cpu, 0, alloc_buffer->alloc_size );
+
+    bo = new amdgpu_bo();
+    bo->mDevice = dev;
+    bo->mSize = alloc_buffer->alloc_size;
+    bo->mHeap = alloc_buffer->preferred_heap;
+    bo->mFlags = alloc_buffer->flags;
+    bo->mCpu = (uint8_t*) cpu;
+
+    *buf_handle = bo;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_free( amdgpu_bo_handle buf_handle )
+{
+    std::lock_guard<std::mutex> lock( sLock );
+    std::map<uint64_t, FakeMapping> &mappings = buf_handle->mDevice->mMappings;
+
+    // Drop any mapping the caller forgot about
+    for ( auto it = mappings.begin(); it != mappings.end(); ) {
+        if ( it->second.mBo == buf_handle )
+            it = mappings.erase( it );
+        else
+            ++it;
+    }
+
+    if ( buf_handle->mImported )
+        munmap( buf_handle->mCpu, buf_handle->mSize );
+    else if ( !buf_handle->mUserPtr )
+        free( buf_handle->mCpu );
+    delete buf_handle;
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_import( amdgpu_device_handle dev, enum amdgpu_bo_handle_type type, uint32_t shared_handle, struct amdgpu_bo_import_result *output )
+{
+    struct stat st;
+    void *cpu;
+    amdgpu_bo *bo;
+
+    // Any mappable fd stands in for a dma-buf, e.g. a memfd
+    if ( type != amdgpu_bo_handle_type_dma_buf_fd )
+        return -ENOSYS;
+
+    if ( fstat( shared_handle, &st ) || st.st_size <= 0 )
+        return -EINVAL;
+
+    cpu = mmap( nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_handle, 0 );
+    if ( cpu == MAP_FAILED )
+        return -errno;
+
+    bo = new amdgpu_bo();
+    bo->mDevice = dev;
+    bo->mSize = st.st_size;
+    bo->mHeap = AMDGPU_GEM_DOMAIN_GTT;
+    bo->mFlags = 0;
+    bo->mCpu = (uint8_t*) cpu;
+    bo->mImported = true;
+
+    output->buf_handle = bo;
+    output->alloc_size = st.st_size;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_create_bo_from_user_mem( amdgpu_device_handle dev, void *cpu, uint64_t size, amdgpu_bo_handle *buf_handle )
+{
+    uint64_t pageSize = sysconf( _SC_PAGESIZE );
+    amdgpu_bo *bo;
+
+    if ( !cpu || !size || ( (uintptr_t) cpu | size ) & ( pageSize - 1 ) )
+        return -EINVAL;
+
+    bo = new amdgpu_bo();
+    bo->mDevice = dev;
+    bo->mSize = size;
+    bo->mHeap = AMDGPU_GEM_DOMAIN_GTT;
+    bo->mFlags = 0;
+    bo->mCpu = (uint8_t*) cpu;
+    bo->mUserPtr = true;
+
+    *buf_handle = bo;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_cpu_map( amdgpu_bo_handle buf_handle, void **cpu )
+{
+    // Same as the kernel's mmap ioctl
+    if ( buf_handle->mUserPtr || ( buf_handle->mFlags & AMDGPU_GEM_CREATE_NO_CPU_ACCESS ) )
+        return -EPERM;
+
+    *cpu = buf_handle->mCpu;
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_cpu_unmap( amdgpu_bo_handle buf_handle )
+{
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_va_range_alloc( amdgpu_device_handle dev, enum amdgpu_gpu_va_range va_range_type, uint64_t size, uint64_t va_base_alignment, uint64_t va_base_required, uint64_t *va_base_allocated, amdgpu_va_handle *va_range_handle, uint64_t flags )
+{
+    std::lock_guard<std::mutex> lock( sLock );
+    uint64_t alignment = va_base_alignment ? va_base_alignment : FAKE_VA_ALIGNMENT;
+    amdgpu_va *va = new amdgpu_va();
+
+    va->mDevice = dev;
+    va->mSize = size;
+
+    // Addresses are never reused, which keeps the bookkeeping trivial
+    if ( va_base_required ) {
+        va->mAddr = va_base_required;
+        dev->mNextVa = std::max( dev->mNextVa, va_base_required + size );
+    } else {
+        va->mAddr = FAKE_ALIGN( dev->mNextVa, alignment );
+        dev->mNextVa = va->mAddr + size;
+    }
+
+    *va_base_allocated = va->mAddr;
+    *va_range_handle = va;
+
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_va_range_free( amdgpu_va_handle va_range_handle )
+{
+    delete va_range_handle;
+    return 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int amdgpu_bo_va_op( amdgpu_bo_handle bo, uint64_t offset, uint64_t size, uint64_t addr, uint64_t flags, uint32_t ops )
+{
+    if ( ops != AMDGPU_VA_OP_MAP && ops != AMDGPU_VA_OP_UNMAP )
+        return -EINVAL;
+
+    std::lock_guard<std::mutex> lock( sLock );
+
+    if ( offset + size > bo->mSize )
+        return -EINVAL;
+
+    if ( ops == AMDGPU_VA_OP_MAP ) {
+        FakeMapping mapping = { bo, offset, size };
+        bo->mDevice->mMappings[addr] = mapping;
+    } else {
+        bo->mDevice->mMappings.erase( addr );
+    }
+
+    return 0;
+}
@@ -25,8 +25,11 @@
 //
 
 #include <dlfcn.h>
+#include <errno.h>
 #include <unistd.h>
 #include <cstring>
+#include <map>
+#include <mutex>
 #include <xf86drm.h>
 
 #include <util/util.h>
@@ -34,32 +37,212 @@
 
 #include "Drm.h"
 
-#define DRM_CALL( fnName, ... ) mEntrypoints.mPfn_##fnName( __VA_ARGS__ )
+#define DRM_CALL( fnName, ... ) sEntrypoints.mPfn_##fnName( __VA_ARGS__ )
+
+/**
+ * The library paths can be overridden to run against a stand-in implementation
+ */
+#define LIBDRM_PATH_ENV "VCETOY_LIBDRM"
+#define LIBDRM_AMDGPU_PATH_ENV "VCETOY_LIBDRM_AMDGPU"
+
+/**
+ * When set, the command stream is recorded to this path for vcetoy-replay
+ */
+#define CAPTURE_PATH_ENV "VCETOY_CAPTURE"
+
+typedef int (*Pfn_drmOpenWithType)( const char *name, const char *busid, int type );
+typedef int (*Pfn_drmGetDevices2)( uint32_t flags, drmDevicePtr devices[], int max_devices );
+typedef void (*Pfn_drmFreeDevices)( drmDevicePtr devices[], int count );
+typedef int (*Pfn_drmGetDevice2)( int fd, uint32_t flags, drmDevicePtr *device );
+typedef void (*Pfn_drmFreeDevice)( drmDevicePtr *device );
+typedef int (*Pfn_amdgpu_device_initialize)(int fd, uint32_t *major_version, uint32_t *minor_version, amdgpu_device_handle *device_handle );
+typedef int (*Pfn_amdgpu_query_gpu_info)( amdgpu_device_handle dev, struct amdgpu_gpu_info *info );
+typedef int (*Pfn_amdgpu_cs_ctx_create)( amdgpu_device_handle dev, amdgpu_context_handle *context );
+typedef int (*Pfn_amdgpu_cs_ctx_create2)( amdgpu_device_handle dev, uint32_t priority, amdgpu_context_handle *context );
+typedef int (*Pfn_amdgpu_query_firmware_version)( amdgpu_device_handle dev, unsigned fw_type,unsigned ip_instance, unsigned index, uint32_t *version, uint32_t *feature );
+typedef int (*Pfn_amdgpu_query_hw_ip_info)( amdgpu_device_handle dev, unsigned type, unsigned ip_instance, struct drm_amdgpu_info_hw_ip *info );
+typedef int (*Pfn_amdgpu_cs_submit)( amdgpu_context_handle context,uint64_t flags, struct amdgpu_cs_request *ibs_request,uint32_t number_of_requests );
+typedef int (*Pfn_amdgpu_cs_query_fence_status)( struct amdgpu_cs_fence *fence, uint64_t timeout_ns, uint64_t flags,uint32_t *expired);
+typedef int (*Pfn_amdgpu_bo_list_create)( amdgpu_device_handle dev, uint32_t number_of_resources, amdgpu_bo_handle *resources, uint8_t *resource_prios, amdgpu_bo_list_handle *result );
+typedef int (*Pfn_amdgpu_bo_list_destroy)(amdgpu_bo_list_handle handle);
+typedef int (*Pfn_amdgpu_bo_alloc)(amdgpu_device_handle dev, struct amdgpu_bo_alloc_request *alloc_buffer, amdgpu_bo_handle *buf_handle);
+typedef int (*Pfn_amdgpu_bo_free)(amdgpu_bo_handle buf_handle);
+typedef int (*Pfn_amdgpu_bo_import)(amdgpu_device_handle dev, enum amdgpu_bo_handle_type type, uint32_t shared_handle, struct amdgpu_bo_import_result *output);
+typedef int (*Pfn_amdgpu_create_bo_from_user_mem)(amdgpu_device_handle dev, void *cpu, uint64_t size, amdgpu_bo_handle *buf_handle);
+typedef int (*Pfn_amdgpu_bo_cpu_map)(amdgpu_bo_handle buf_handle, void **cpu);
+typedef int (*Pfn_amdgpu_bo_cpu_unmap)(amdgpu_bo_handle buf_handle);
+typedef int (*Pfn_amdgpu_cs_ctx_free)(amdgpu_context_handle context);
+typedef int (*Pfn_amdgpu_device_deinitialize)(amdgpu_device_handle device_handle);
+typedef int (*Pfn_amdgpu_va_range_alloc)(amdgpu_device_handle dev, enum amdgpu_gpu_va_range va_range_type, uint64_t size, uint64_t va_base_alignment, uint64_t va_base_required, uint64_t *va_base_allocated, amdgpu_va_handle *va_range_handle, uint64_t flags);
+typedef int (*Pfn_amdgpu_va_range_free)(amdgpu_va_handle va_range_handle);
+typedef int (*Pfn_amdgpu_bo_va_op)(amdgpu_bo_handle bo, uint64_t offset, uint64_t size, uint64_t addr, uint64_t flags, uint32_t ops);
+typedef int (*Pfn_amdgpu_cs_wait_fences)(struct amdgpu_cs_fence *fences, uint32_t fence_count, bool wait_all, uint64_t timeout_ns, uint32_t *status, uint32_t *first);
+typedef int (*Pfn_amdgpu_cs_fence_to_handle)(amdgpu_device_handle dev, struct amdgpu_cs_fence *fence, uint32_t what, uint32_t *out_handle);
+
+struct DrmEntrypoints {
+    Pfn_drmOpenWithType mPfn_drmOpenWithType;
+    Pfn_drmGetDevices2 mPfn_drmGetDevices2;
+    Pfn_drmFreeDevices mPfn_drmFreeDevices;
+    Pfn_drmGetDevice2 mPfn_drmGetDevice2;
+    Pfn_drmFreeDevice mPfn_drmFreeDevice;
+    Pfn_amdgpu_device_initialize mPfn_amdgpu_device_initialize;
+    Pfn_amdgpu_query_gpu_info mPfn_amdgpu_query_gpu_info;
+    Pfn_amdgpu_cs_ctx_create mPfn_amdgpu_cs_ctx_create;
+    Pfn_amdgpu_cs_ctx_create2 mPfn_amdgpu_cs_ctx_create2;
+    Pfn_amdgpu_query_firmware_version mPfn_amdgpu_query_firmware_version;
+    Pfn_amdgpu_query_hw_ip_info mPfn_amdgpu_query_hw_ip_info;
+    Pfn_amdgpu_cs_submit mPfn_amdgpu_cs_submit;
+    Pfn_amdgpu_cs_query_fence_status mPfn_amdgpu_cs_query_fence_status;
+    Pfn_amdgpu_bo_list_create mPfn_amdgpu_bo_list_create;
+    Pfn_amdgpu_bo_list_destroy mPfn_amdgpu_bo_list_destroy;
+    Pfn_amdgpu_bo_alloc mPfn_amdgpu_bo_alloc;
+    Pfn_amdgpu_bo_free mPfn_amdgpu_bo_free;
+    Pfn_amdgpu_bo_import mPfn_amdgpu_bo_import;
+    Pfn_amdgpu_create_bo_from_user_mem mPfn_amdgpu_create_bo_from_user_mem;
+    Pfn_amdgpu_bo_cpu_map mPfn_amdgpu_bo_cpu_map;
+    Pfn_amdgpu_bo_cpu_unmap mPfn_amdgpu_bo_cpu_unmap;
+    Pfn_amdgpu_cs_ctx_free mPfn_amdgpu_cs_ctx_free;
+    Pfn_amdgpu_device_deinitialize mPfn_amdgpu_device_deinitialize;
+    Pfn_amdgpu_va_range_alloc mPfn_amdgpu_va_range_alloc;
+    Pfn_amdgpu_va_range_free mPfn_amdgpu_va_range_free;
+    Pfn_amdgpu_bo_va_op mPfn_amdgpu_bo_va_op;
+    Pfn_amdgpu_cs_fence_to_handle mPfn_amdgpu_cs_fence_to_handle;
+    Pfn_amdgpu_cs_wait_fences mPfn_amdgpu_cs_wait_fences;
+};
+
+/**
+ * libdrm is loaded once per process and never unloaded
+ */
+static std::mutex sEntrypointsLock;
+static bool sEntrypointsLoaded = false;
+static struct DrmEntrypoints sEntrypoints;
+
+/**
+ * Open devices keyed by bus id, and the bus id a nullptr request resolved to
+ */
+static std::mutex sDevicesLock;
+static std::map<std::string, std::weak_ptr<DrmDevice>> sDevices;
+static std::string sDefaultBusId;
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static const char *GetLibPath( const char *envName, const char *defaultPath )
+{
+    const char *path = getenv( envName );
+    return path ? path : defaultPath;
+}
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-Drm::Drm()
-    : mDrmLib( nullptr )
-    , mDrmAmdgpuLib( nullptr )
-    , mDrmFd( -1 )
+static bool IsAmdgpuRenderDevice( drmDevicePtr device )
+{
+    static const uint16_t kAmdVendorId = 0x1002;
+
+    return device->bustype == DRM_BUS_PCI &&
+           ( device->available_nodes & ( 1 << DRM_NODE_RENDER ) ) &&
+           device->deviceinfo.pci->vendor_id == kAmdVendorId;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static std::string GetBusIdString( drmDevicePtr device )
+{
+    char busId[32];
+    drmPciBusInfoPtr pci = device->businfo.pci;
+
+    snprintf( busId, sizeof(busId), "pci:%04x:%02x:%02x.%u", pci->domain, pci->bus, pci->dev, pci->func );
+
+    return busId;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static int LoadEntrypoints()
+{
+    void *drmLib = nullptr;
+    void *drmAmdgpuLib = nullptr;
+    std::lock_guard<std::mutex> lock( sEntrypointsLock );
+
+    if ( sEntrypointsLoaded )
+        return 0;
+
+    drmLib = dlopen( GetLibPath( LIBDRM_PATH_ENV, "libdrm.so" ), RTLD_NOW );
+    FailOnTo( !drmLib, error, "Failed to load libdrm\n" );
+
+    drmAmdgpuLib = dlopen( GetLibPath( LIBDRM_AMDGPU_PATH_ENV, "libdrm_amdgpu.so" ), RTLD_NOW );
+    FailOnTo( !drmAmdgpuLib, error, "Failed to load libdrm_amdgpu\n" );
+
+#define DRM_DLSYM_ENTRYPOINT(handle, name) \
+    sEntrypoints.mPfn_##name = (Pfn_##name) dlsym( handle, #name ); \
+    if ( !sEntrypoints.mPfn_##name ) \
+        goto error;
+
+    DRM_DLSYM_ENTRYPOINT(drmLib, drmOpenWithType);
+    DRM_DLSYM_ENTRYPOINT(drmLib, drmGetDevices2);
+    DRM_DLSYM_ENTRYPOINT(drmLib, drmFreeDevices);
+    DRM_DLSYM_ENTRYPOINT(drmLib, drmGetDevice2);
+    DRM_DLSYM_ENTRYPOINT(drmLib, drmFreeDevice);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_device_initialize);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_query_gpu_info);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_cs_ctx_create);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_query_firmware_version);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_query_hw_ip_info);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_cs_submit);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_cs_query_fence_status);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_list_create);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_list_destroy);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_alloc);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_free);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_import);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_cpu_map);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_cpu_unmap);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_cs_ctx_free);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_device_deinitialize);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_va_range_alloc);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_va_range_free);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_bo_va_op);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_cs_fence_to_handle);
+    DRM_DLSYM_ENTRYPOINT(drmAmdgpuLib, amdgpu_cs_wait_fences);
+
+// Entrypoints missing from older libdrm versions are left as nullptr
+#define DRM_DLSYM_ENTRYPOINT_OPTIONAL(handle, name) \
+    sEntrypoints.mPfn_##name = (Pfn_##name) dlsym( handle, #name );
+
+    DRM_DLSYM_ENTRYPOINT_OPTIONAL(drmAmdgpuLib, amdgpu_cs_ctx_create2);
+    DRM_DLSYM_ENTRYPOINT_OPTIONAL(drmAmdgpuLib, amdgpu_create_bo_from_user_mem);
+
+#undef DRM_DLSYM_ENTRYPOINT_OPTIONAL
+#undef DRM_DLSYM_ENTRYPOINT
+
+    sEntrypointsLoaded = true;
+
+    return 0;
+
+error:
+    if ( drmAmdgpuLib )
+        dlclose( drmAmdgpuLib );
+
+    if ( drmLib )
+        dlclose( drmLib );
+
+    return -1;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+DrmDevice::DrmDevice()
+    : mDrmFd( -1 )
     , mDevice( nullptr )
-    , mDeviceContext( nullptr )
     , mDevMajor( 0 )
     , mDevMinor( 0 )
 {
-    ::memset( &mEntrypoints, 0, sizeof(mEntrypoints) );
     ::memset( &mGpuInfo, 0, sizeof(mGpuInfo) );
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-Drm::~Drm()
+DrmDevice::~DrmDevice()
 {
-    if ( mDeviceContext ) {
-        DRM_CALL( amdgpu_cs_ctx_free, mDeviceContext );
-        mDeviceContext = 0;
-    }
-
     if ( mDevice ) {
         DRM_CALL( amdgpu_device_deinitialize, mDevice );
         mDevice = 0;
@@ -73,67 +256,168 @@ Drm::~Drm()
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-int Drm::Init()
+std::shared_ptr<DrmDevice> DrmDevice::Get( const char *busId )
+{
+    int err;
+    std::shared_ptr<DrmDevice> device;
+    std::shared_ptr<DrmDevice> existing;
+    std::lock_guard<std::mutex> lock( sDevicesLock );
+    std::string key = busId ? busId : sDefaultBusId;
+
+    if ( !key.empty() ) {
+        auto it = sDevices.find( key );
+        if ( it != sDevices.end() ) {
+            device = it->second.lock();
+            if ( device )
+                return device;
+        }
+    }
+
+    device = std::shared_ptr<DrmDevice>( new DrmDevice() );
+    FailOnTo( !device, error, "Failed to open device: out of memory\n" );
+
+    err = device->Init( busId );
+    FailOnTo( err, error, "Failed to open device: init failed\n" );
+
+    if ( !busId )
+        sDefaultBusId = device->mBusId;
+
+    // The request may have been spelled differently from the canonical bus id
+    existing = sDevices[ device->mBusId ].lock();
+    if ( existing )
+        return existing;
+
+    sDevices[ device->mBusId ] = device;
+
+    return device;
+
+error:
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int DrmDevice::Init( const char *busId )
 {
     int err;
+    drmDevicePtr device = nullptr;
 
     err = LoadEntrypoints();
     FailOnTo( err, error, "Failed to load libdrm entrypoints\n" );
 
-    mDrmFd = DRM_CALL( drmOpenWithType, "amdgpu", NULL, DRM_NODE_RENDER );
+    mDrmFd = DRM_CALL( drmOpenWithType, "amdgpu", busId, DRM_NODE_RENDER );
     FailOnTo( mDrmFd < 0, error, "Failed to open amdgpu fd\n" );
 
+    // Identify the device we ended up on, busId may have been nullptr
+    err = DRM_CALL( drmGetDevice2, mDrmFd, 0, &device );
+    FailOnTo( err, error, "Failed to query drm device\n" );
+    mBusId = GetBusIdString( device );
+    DRM_CALL( drmFreeDevice, &device );
+
     err = DRM_CALL( amdgpu_device_initialize, mDrmFd, &mDevMajor, &mDevMinor, &mDevice );
     FailOnTo( err, error, "Failed to initialize amdgpu device\n" );
 
     err = DRM_CALL( amdgpu_query_gpu_info, mDevice, &mGpuInfo );
     FailOnTo( err, error, "Failed to query gpu info\n" );
 
-    err = DRM_CALL( amdgpu_cs_ctx_create, mDevice, &mDeviceContext );
+    return 0;
+
+error:
+    return err ? err : -1;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+Drm::Drm()
+    : mDevice( nullptr )
+    , mDeviceContext( nullptr )
+{
+    ::memset( &mGpuInfo, 0, sizeof(mGpuInfo) );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+Drm::~Drm()
+{
+    mCapture.Close();
+
+    if ( mDeviceContext ) {
+        DRM_CALL( amdgpu_cs_ctx_free, mDeviceContext );
+        mDeviceContext = 0;
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int Drm::Init( const char *busId, int32_t priority )
+{
+    int err;
+    const char *capturePath;
+
+    // VcetContext initializes on demand from several entry points
+    if ( mDeviceContext )
+        return 0;
+
+    mDrmDevice = DrmDevice::Get( busId );
+    FailOnTo( !mDrmDevice, error, "Failed to open amdgpu device\n" );
+
+    mDevice = mDrmDevice->GetHandle();
+    mGpuInfo = *mDrmDevice->GetGpuInfo();
+
+    if ( priority == AMDGPU_CTX_PRIORITY_NORMAL ) {
+        err = DRM_CALL( amdgpu_cs_ctx_create, mDevice, &mDeviceContext );
+    } else {
+        FailOnTo( !sEntrypoints.mPfn_amdgpu_cs_ctx_create2, error, "Context priorities require amdgpu_cs_ctx_create2\n" );
+        err = DRM_CALL( amdgpu_cs_ctx_create2, mDevice, priority, &mDeviceContext );
+        FailOnTo( err == -EACCES, error, "Context priority %d requires CAP_SYS_NICE\n", priority );
+    }
     FailOnTo( err, error, "Failed to create device context\n" );
 
+    capturePath = getenv( CAPTURE_PATH_ENV );
+    if ( capturePath ) {
+        bool ret = mCapture.Open( capturePath );
+        WarnOn( !ret, "Failed to start command stream capture\n" );
+    }
+
     return 0;
 
 error:
-    return err;
+    return -1;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-int Drm::LoadEntrypoints()
+int Drm::GetDevices( std::vector<DrmDeviceDesc> *pDevices )
 {
-    mDrmLib = dlopen( "libdrm.so", RTLD_NOW );
-    FailOnTo( !mDrmLib, error, "Failed to load libdrm\n" );
+    int err;
+    int count;
+    std::vector<drmDevicePtr> devices;
 
-    mDrmAmdgpuLib = dlopen( "libdrm_amdgpu.so", RTLD_NOW );
-    FailOnTo( !mDrmAmdgpuLib, error, "Failed to load libdrm_amdgpu\n" );
+    err = LoadEntrypoints();
+    FailOnTo( err, error, "Failed to load libdrm entrypoints\n" );
 
-#define DRM_DLSYM_ENTRYPOINT(handle, name) \
-    mEntrypoints.mPfn_##name = (Pfn_##name) dlsym( handle, #name ); \
-    if ( !mEntrypoints.mPfn_##name ) \
-        goto error;
+    count = DRM_CALL( drmGetDevices2, 0, nullptr, 0 );
+    FailOnTo( count < 0, error, "Failed to count drm devices\n" );
 
-    DRM_DLSYM_ENTRYPOINT(mDrmLib, drmOpenWithType);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_device_initialize);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_query_gpu_info);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_cs_ctx_create);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_query_firmware_version);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_cs_submit);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_cs_query_fence_status);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_list_create);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_list_destroy);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_alloc);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_free);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_import);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_cpu_map);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_cpu_unmap);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_cs_ctx_free);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_device_deinitialize);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_va_range_alloc);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_va_range_free);
-    DRM_DLSYM_ENTRYPOINT(mDrmAmdgpuLib, amdgpu_bo_va_op);
+    devices.resize( count );
+    count = DRM_CALL( drmGetDevices2, 0, devices.data(), count );
+    FailOnTo( count < 0, error, "Failed to list drm devices\n" );
 
-#undef DRM_DLSYM_ENTRYPOINT
+    pDevices->clear();
+    for ( int i = 0; i < count; ++i ) {
+        DrmDeviceDesc desc;
+
+        if ( !IsAmdgpuRenderDevice( devices[i] ) )
+            continue;
+
+        desc.mBusId = GetBusIdString( devices[i] );
+        desc.mRenderNode = devices[i]->nodes[ DRM_NODE_RENDER ];
+        desc.mVendorId = devices[i]->deviceinfo.pci->vendor_id;
+        desc.mDeviceId = devices[i]->deviceinfo.pci->device_id;
+        pDevices->push_back( desc );
+    }
+
+    DRM_CALL( drmFreeDevices, devices.data(), count );
 
     return 0;
 
@@ -148,11 +432,32 @@ int Drm::QueryFirmwareVersion( unsigned fw_type, unsigned ip_instance, unsigned
     return DRM_CALL( amdgpu_query_firmware_version, mDevice, fw_type, ip_instance, index, version, feature );
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int Drm::QueryHwIpInfo( unsigned type, unsigned ipInstance, struct drm_amdgpu_info_hw_ip *info )
+{
+    return DRM_CALL( amdgpu_query_hw_ip_info, mDevice, type, ipInstance, info );
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 int Drm::CsSubmit( uint64_t flags, struct amdgpu_cs_request *ibs_request, uint32_t number_of_requests)
 {
-    return DRM_CALL( amdgpu_cs_submit, mDeviceContext, flags, ibs_request, number_of_requests );
+    int err = DRM_CALL( amdgpu_cs_submit, mDeviceContext, flags, ibs_request, number_of_requests );
+    uint32_t submitted = number_of_requests;
+
+    // On failure, the requests ahead of the failing one were submitted
+    if ( err ) {
+        for ( submitted = 0; submitted < number_of_requests; ++submitted ) {
+            if ( !ibs_request[ submitted ].seq_no )
+                break;
+        }
+    }
+
+    if ( submitted && mCapture.IsActive() )
+        mCapture.OnSubmit( ibs_request, submitted );
+
+    return err;
 }
 
 //---------------------------------------------------------------------------//
@@ -162,17 +467,39 @@ int Drm::CsQueryFenceStatus( struct amdgpu_cs_fence *fence, uint64_t timeoutNs,
     return DRM_CALL( amdgpu_cs_query_fence_status, fence, timeoutNs, flags, expired );
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int Drm::CsWaitFences( struct amdgpu_cs_fence *fences, uint32_t fenceCount, bool waitAll, uint64_t timeoutNs, uint32_t *status, uint32_t *first )
+{
+    return DRM_CALL( amdgpu_cs_wait_fences, fences, fenceCount, waitAll, timeoutNs, status, first );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int Drm::CsFenceToHandle( struct amdgpu_cs_fence *fence, uint32_t what, uint32_t *outHandle )
+{
+    return DRM_CALL( amdgpu_cs_fence_to_handle, mDevice, fence, what, outHandle );
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 int Drm::BoListCreate( uint32_t numberOfResources, amdgpu_bo_handle *resources, uint8_t *resourcePrios, amdgpu_bo_list_handle *result )
 {
-    return DRM_CALL( amdgpu_bo_list_create, mDevice, numberOfResources, resources, resourcePrios, result );
+    int err = DRM_CALL( amdgpu_bo_list_create, mDevice, numberOfResources, resources, resourcePrios, result );
+
+    if ( !err && mCapture.IsActive() )
+        mCapture.OnBoListCreate( *result, numberOfResources, resources );
+
+    return err;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 int Drm::BoListDestroy( amdgpu_bo_list_handle handle )
 {
+    if ( mCapture.IsActive() )
+        mCapture.OnBoListDestroy( handle );
+
     return DRM_CALL( amdgpu_bo_list_destroy, handle );
 }
 
@@ -181,13 +508,21 @@ int Drm::BoListDestroy( amdgpu_bo_list_handle handle )
 //---------------------------------------------------------------------------//
 int Drm::BoAlloc( struct amdgpu_bo_alloc_request *alloc_buffer, amdgpu_bo_handle *buf_handle )
 {
-    return DRM_CALL( amdgpu_bo_alloc, mDevice, alloc_buffer, buf_handle );
+    int err = DRM_CALL( amdgpu_bo_alloc, mDevice, alloc_buffer, buf_handle );
+
+    if ( !err && mCapture.IsActive() )
+        mCapture.OnBoAlloc( *buf_handle, alloc_buffer );
+
+    return err;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 int Drm::BoFree( amdgpu_bo_handle bo )
 {
+    if ( mCapture.IsActive() )
+        mCapture.OnBoFree( bo );
+
     return DRM_CALL( amdgpu_bo_free, bo );
 }
 
@@ -195,7 +530,32 @@ int Drm::BoFree( amdgpu_bo_handle bo )
 //---------------------------------------------------------------------------//
 int Drm::BoImport( enum amdgpu_bo_handle_type type, uint32_t sharedHandle, struct amdgpu_bo_import_result *result )
 {
-    return DRM_CALL( amdgpu_bo_import, mDevice, type, sharedHandle, result );
+    int err = DRM_CALL( amdgpu_bo_import, mDevice, type, sharedHandle, result );
+
+    if ( !err && mCapture.IsActive() )
+        mCapture.OnBoImport( result->buf_handle, result->alloc_size );
+
+    return err;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int Drm::BoCreateFromUserMem( void *cpu, uint64_t size, amdgpu_bo_handle *buf_handle )
+{
+    int err;
+
+    FailOnTo( !sEntrypoints.mPfn_amdgpu_create_bo_from_user_mem, error, "Host memory bos require amdgpu_create_bo_from_user_mem\n" );
+
+    err = DRM_CALL( amdgpu_create_bo_from_user_mem, mDevice, cpu, size, buf_handle );
+
+    // Replays in memory of its own, like an import
+    if ( !err && mCapture.IsActive() )
+        mCapture.OnBoImport( *buf_handle, size );
+
+    return err;
+
+error:
+    return -ENOSYS;
 }
 
 //---------------------------------------------------------------------------//
@@ -216,19 +576,32 @@ int Drm::VaRangeFree( amdgpu_va_handle va )
 //---------------------------------------------------------------------------//
 int Drm::BoVaOp( amdgpu_bo_handle bo, uint64_t offset, uint64_t size, uint64_t addr, uint64_t flags, uint32_t ops )
 {
-    return DRM_CALL( amdgpu_bo_va_op, bo, offset, size, addr, flags, ops );
+    int err = DRM_CALL( amdgpu_bo_va_op, bo, offset, size, addr, flags, ops );
+
+    if ( !err && mCapture.IsActive() )
+        mCapture.OnBoVaOp( bo, offset, size, addr, flags, ops );
+
+    return err;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 int Drm::BoCpuMap( amdgpu_bo_handle buf_handle, uint8_t **cpu )
 {
-    return DRM_CALL( amdgpu_bo_cpu_map, buf_handle, (void**)cpu );
+    int err = DRM_CALL( amdgpu_bo_cpu_map, buf_handle, (void**)cpu );
+
+    if ( !err && mCapture.IsActive() )
+        mCapture.OnBoCpuMap( buf_handle, *cpu );
+
+    return err;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 int Drm::BoCpuUnmap( amdgpu_bo_handle buf_handle )
 {
+    if ( mCapture.IsActive() )
+        mCapture.OnBoCpuUnmap( buf_handle );
+
     return DRM_CALL( amdgpu_bo_cpu_unmap, buf_handle );
 }
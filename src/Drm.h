@@ -25,11 +25,69 @@
 
 #pragma once
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <xf86drm.h>
 #include <libdrm/amdgpu.h>
 #include <libdrm/amdgpu_drm.h>
 
+#include "DrmCapture.h"
+
 class VcetIb;
 
+/**
+ * An amdgpu device visible to libdrm
+ */
+struct DrmDeviceDesc {
+    std::string mBusId;         // In drmOpen format, e.g. pci:0000:01:00.0
+    std::string mRenderNode;
+    uint16_t mVendorId;
+    uint16_t mDeviceId;
+};
+
+/**
+ * An opened amdgpu device
+ *
+ * Devices are shared by every Drm on the same bus, so a process holds one fd
+ * and one amdgpu_device_handle per GPU regardless of how many contexts it
+ * creates. The last reference closes the device.
+ */
+class DrmDevice
+{
+    public:
+        ~DrmDevice();
+
+        /**
+         * Get the device on busId, opening it on first use
+         *
+         * busId nullptr picks the first amdgpu device. Returns nullptr on
+         * failure.
+         */
+        static std::shared_ptr<DrmDevice> Get( const char *busId );
+
+        /**
+         * Getters/Setters
+         */
+        amdgpu_device_handle GetHandle() { return mDevice; }
+        const struct amdgpu_gpu_info *GetGpuInfo() { return &mGpuInfo; }
+        const std::string &GetBusId() { return mBusId; }
+
+    private:
+        DrmDevice();
+
+        int Init( const char *busId );
+
+        int mDrmFd;
+        std::string mBusId;
+        amdgpu_device_handle mDevice;
+
+        uint32_t mDevMajor;
+        uint32_t mDevMinor;
+        struct amdgpu_gpu_info mGpuInfo;
+};
+
 class Drm
 {
     public:
@@ -38,8 +96,16 @@ class Drm
 
         /**
          * Load libdrm and initialize the local context
+         *
+         * busId selects the device, nullptr picks the first amdgpu device.
+         * priority is an AMDGPU_CTX_PRIORITY_* for the submission context.
          */
-        int Init();
+        int Init( const char *busId = nullptr, int32_t priority = AMDGPU_CTX_PRIORITY_NORMAL );
+
+        /**
+         * List the amdgpu devices with a render node
+         */
+        int GetDevices( std::vector<DrmDeviceDesc> *pDevices );
 
         /**
          * Returns true if this version of libdrm supports motion estimation
@@ -50,8 +116,18 @@ class Drm
                                   uint32_t *version,
                                   uint32_t *feature );
 
+        /**
+         * Query the capabilities and available rings of a hardware IP
+         */
+        int QueryHwIpInfo( unsigned type,
+                           unsigned ipInstance,
+                           struct drm_amdgpu_info_hw_ip *info );
+
         /**
          * Submit
+         *
+         * The requests' seq_no must be zero, on failure the ones that were
+         * submitted before the failing request are set
          */
         int CsSubmit( uint64_t flags,
                        struct amdgpu_cs_request *ibs_request,
@@ -64,6 +140,24 @@ class Drm
                                 uint64_t timeout_ns,
                                 uint64_t flags,
                                 uint32_t *expired);
+
+        /**
+         * Wait for any or all of the fences to signal
+         */
+        int CsWaitFences( struct amdgpu_cs_fence *fences,
+                          uint32_t fenceCount,
+                          bool waitAll,
+                          uint64_t timeoutNs,
+                          uint32_t *status,
+                          uint32_t *first );
+
+        /**
+         * Export a fence as a syncobj or sync_file handle
+         */
+        int CsFenceToHandle( struct amdgpu_cs_fence *fence,
+                             uint32_t what,
+                             uint32_t *outHandle );
+
         /**
          * Create a BO list
          */
@@ -94,6 +188,14 @@ class Drm
         int BoImport( enum amdgpu_bo_handle_type type,
                       uint32_t sharedHandle,
                       struct amdgpu_bo_import_result *result );
+
+        /**
+         * Create a BO backed by page aligned user memory
+         *
+         * Returns -ENOSYS if libdrm lacks amdgpu_create_bo_from_user_mem
+         */
+        int BoCreateFromUserMem( void *cpu, uint64_t size, amdgpu_bo_handle *buf_handle );
+
         /**
          * Allocate a VA range
          */
@@ -135,61 +237,13 @@ class Drm
          */
         struct amdgpu_gpu_info *GetGpuInfo() { return &mGpuInfo; }
         amdgpu_context_handle GetContext() { return mDeviceContext; }
+        const std::string &GetBusId() { return mDrmDevice->GetBusId(); }
 
     private:
-        typedef int (*Pfn_drmOpenWithType)( const char *name, const char *busid, int type );
-        typedef int (*Pfn_amdgpu_device_initialize)(int fd, uint32_t *major_version, uint32_t *minor_version, amdgpu_device_handle *device_handle );
-        typedef int (*Pfn_amdgpu_query_gpu_info)( amdgpu_device_handle dev, struct amdgpu_gpu_info *info );
-        typedef int (*Pfn_amdgpu_cs_ctx_create)( amdgpu_device_handle dev, amdgpu_context_handle *context );
-        typedef int (*Pfn_amdgpu_query_firmware_version)( amdgpu_device_handle dev, unsigned fw_type,unsigned ip_instance, unsigned index, uint32_t *version, uint32_t *feature );
-        typedef int (*Pfn_amdgpu_cs_submit)( amdgpu_context_handle context,uint64_t flags, struct amdgpu_cs_request *ibs_request,uint32_t number_of_requests );
-        typedef int (*Pfn_amdgpu_cs_query_fence_status)( struct amdgpu_cs_fence *fence, uint64_t timeout_ns, uint64_t flags,uint32_t *expired);
-        typedef int (*Pfn_amdgpu_bo_list_create)( amdgpu_device_handle dev, uint32_t number_of_resources, amdgpu_bo_handle *resources, uint8_t *resource_prios, amdgpu_bo_list_handle *result );
-        typedef int (*Pfn_amdgpu_bo_list_destroy)(amdgpu_bo_list_handle handle);
-        typedef int (*Pfn_amdgpu_bo_alloc)(amdgpu_device_handle dev, struct amdgpu_bo_alloc_request *alloc_buffer, amdgpu_bo_handle *buf_handle);
-        typedef int (*Pfn_amdgpu_bo_free)(amdgpu_bo_handle buf_handle);
-        typedef int (*Pfn_amdgpu_bo_import)(amdgpu_device_handle dev, enum amdgpu_bo_handle_type type, uint32_t shared_handle, struct amdgpu_bo_import_result *output);
-        typedef int (*Pfn_amdgpu_bo_cpu_map)(amdgpu_bo_handle buf_handle, void **cpu);
-        typedef int (*Pfn_amdgpu_bo_cpu_unmap)(amdgpu_bo_handle buf_handle);
-        typedef int (*Pfn_amdgpu_cs_ctx_free)(amdgpu_context_handle context);
-        typedef int (*Pfn_amdgpu_device_deinitialize)(amdgpu_device_handle device_handle);
-        typedef int (*Pfn_amdgpu_va_range_alloc)(amdgpu_device_handle dev, enum amdgpu_gpu_va_range va_range_type, uint64_t size, uint64_t va_base_alignment, uint64_t va_base_required, uint64_t *va_base_allocated, amdgpu_va_handle *va_range_handle, uint64_t flags);
-        typedef int (*Pfn_amdgpu_va_range_free)(amdgpu_va_handle va_range_handle);
-        typedef int (*Pfn_amdgpu_bo_va_op)(amdgpu_bo_handle bo, uint64_t offset, uint64_t size, uint64_t addr, uint64_t flags, uint32_t ops);
-
-        struct DrmEntrypoints {
-            Pfn_drmOpenWithType mPfn_drmOpenWithType;
-            Pfn_amdgpu_device_initialize mPfn_amdgpu_device_initialize;
-            Pfn_amdgpu_query_gpu_info mPfn_amdgpu_query_gpu_info;
-            Pfn_amdgpu_cs_ctx_create mPfn_amdgpu_cs_ctx_create;
-            Pfn_amdgpu_query_firmware_version mPfn_amdgpu_query_firmware_version;
-            Pfn_amdgpu_cs_submit mPfn_amdgpu_cs_submit;
-            Pfn_amdgpu_cs_query_fence_status mPfn_amdgpu_cs_query_fence_status;
-            Pfn_amdgpu_bo_list_create mPfn_amdgpu_bo_list_create;
-            Pfn_amdgpu_bo_list_destroy mPfn_amdgpu_bo_list_destroy;
-            Pfn_amdgpu_bo_alloc mPfn_amdgpu_bo_alloc;
-            Pfn_amdgpu_bo_free mPfn_amdgpu_bo_free;
-            Pfn_amdgpu_bo_import mPfn_amdgpu_bo_import;
-            Pfn_amdgpu_bo_cpu_map mPfn_amdgpu_bo_cpu_map;
-            Pfn_amdgpu_bo_cpu_unmap mPfn_amdgpu_bo_cpu_unmap;
-            Pfn_amdgpu_cs_ctx_free mPfn_amdgpu_cs_ctx_free;
-            Pfn_amdgpu_device_deinitialize mPfn_amdgpu_device_deinitialize;
-            Pfn_amdgpu_va_range_alloc mPfn_amdgpu_va_range_alloc;
-            Pfn_amdgpu_va_range_free mPfn_amdgpu_va_range_free;
-            Pfn_amdgpu_bo_va_op mPfn_amdgpu_bo_va_op;
-        };
-
-        void *mDrmLib;
-        void *mDrmAmdgpuLib;
-        struct DrmEntrypoints mEntrypoints;
-
-        int LoadEntrypoints();
-
-        int mDrmFd;
+        std::shared_ptr<DrmDevice> mDrmDevice;
         amdgpu_device_handle mDevice;
         amdgpu_context_handle mDeviceContext;
-
-        uint32_t mDevMajor;
-        uint32_t mDevMinor;
         struct amdgpu_gpu_info mGpuInfo;
+
+        DrmCapture mCapture;
 };
@@ -0,0 +1,336 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include <cstring>
+#include <set>
+
+#include <util/util.h>
+
+#include "DrmCapture.h"
+
+/**
+ * Capture paths currently being written by this process
+ */
+static std::mutex sActivePathsLock;
+static std::set<std::string> sActivePaths;
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+DrmCapture::DrmCapture()
+    : mFile( nullptr )
+    , mNextBoId( 1 )
+{
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+DrmCapture::~DrmCapture()
+{
+    Close();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool DrmCapture::Open( const char *path )
+{
+    CaptureHeader header;
+    std::string capturePath = path;
+
+    // Drm may be initialized more than once, keep the existing stream
+    if ( mFile )
+        return true;
+
+    {
+        std::lock_guard<std::mutex> lock( sActivePathsLock );
+        for ( uint32_t i = 1; sActivePaths.count( capturePath ); ++i )
+            capturePath = std::string( path ) + "." + std::to_string( i );
+        sActivePaths.insert( capturePath );
+    }
+
+    mPath = capturePath;
+    mFile = fopen( mPath.c_str(), "wb" );
+    FailOnTo( !mFile, error, "Failed to open capture: could not open %s\n", mPath.c_str() );
+
+    header.mMagic = kCaptureMagic;
+    header.mVersion = kCaptureVersion;
+    FailOnTo( fwrite( &header, sizeof(header), 1, mFile ) != 1, error, "Failed to open capture: write failed\n" );
+
+    return true;
+
+error:
+    Close();
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::Close()
+{
+    if ( mFile ) {
+        fclose( mFile );
+        mFile = nullptr;
+    }
+
+    if ( !mPath.empty() ) {
+        std::lock_guard<std::mutex> lock( sActivePathsLock );
+        sActivePaths.erase( mPath );
+        mPath.clear();
+    }
+
+    mBos.clear();
+    mBoLists.clear();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::Append( const void *pData, size_t size )
+{
+    const uint8_t *pBytes = (const uint8_t*) pData;
+    mRecord.insert( mRecord.end(), pBytes, pBytes + size );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::WriteRecord( uint32_t type )
+{
+    CaptureRecordHeader header;
+    size_t written = 0;
+
+    header.mType = type;
+    header.mSizeBytes = mRecord.size();
+
+    written += fwrite( &header, sizeof(header), 1, mFile );
+    written += fwrite( mRecord.data(), mRecord.size(), 1, mFile );
+    WarnOn( written != 2, "Failed to write capture record\n" );
+
+    mRecord.clear();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::AddBo( amdgpu_bo_handle bo, const CaptureBoAlloc &record )
+{
+    BoInfo info = { record.mBoId, 0, 0, nullptr };
+
+    mBos[bo] = info;
+
+    Append( record );
+    WriteRecord( kCaptureRecordBoAlloc );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoAlloc( amdgpu_bo_handle bo, const struct amdgpu_bo_alloc_request *pRequest )
+{
+    CaptureBoAlloc record = {};
+    std::lock_guard<std::mutex> lock( mLock );
+
+    if ( !mFile )
+        return;
+
+    record.mBoId = mNextBoId++;
+    record.mHeap = pRequest->preferred_heap;
+    record.mSize = pRequest->alloc_size;
+    record.mAlignment = pRequest->phys_alignment;
+    record.mFlags = pRequest->flags;
+
+    AddBo( bo, record );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoImport( amdgpu_bo_handle bo, uint64_t size )
+{
+    CaptureBoAlloc record = {};
+    std::lock_guard<std::mutex> lock( mLock );
+
+    if ( !mFile )
+        return;
+
+    // The exporter's placement is unknown, replay as a plain GTT allocation
+    record.mBoId = mNextBoId++;
+    record.mHeap = AMDGPU_GEM_DOMAIN_GTT;
+    record.mSize = size;
+    record.mImported = 1;
+
+    AddBo( bo, record );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoFree( amdgpu_bo_handle bo )
+{
+    CaptureBoFree record = {};
+    std::lock_guard<std::mutex> lock( mLock );
+
+    auto it = mBos.find( bo );
+    if ( !mFile || it == mBos.end() )
+        return;
+
+    record.mBoId = it->second.mId;
+    mBos.erase( it );
+
+    Append( record );
+    WriteRecord( kCaptureRecordBoFree );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoVaOp( amdgpu_bo_handle bo, uint64_t offset, uint64_t size, uint64_t addr, uint64_t flags, uint32_t ops )
+{
+    CaptureVaOp record = {};
+    std::lock_guard<std::mutex> lock( mLock );
+
+    auto it = mBos.find( bo );
+    if ( !mFile || it == mBos.end() )
+        return;
+
+    if ( ops == AMDGPU_VA_OP_MAP ) {
+        it->second.mVa = addr - offset;
+        it->second.mVaSize = offset + size;
+    }
+
+    record.mBoId = it->second.mId;
+    record.mOp = ops;
+    record.mOffset = offset;
+    record.mSize = size;
+    record.mAddr = addr;
+    record.mFlags = flags;
+
+    Append( record );
+    WriteRecord( kCaptureRecordVaOp );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoCpuMap( amdgpu_bo_handle bo, uint8_t *pCpu )
+{
+    std::lock_guard<std::mutex> lock( mLock );
+
+    auto it = mBos.find( bo );
+    if ( it != mBos.end() )
+        it->second.mCpu = pCpu;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoCpuUnmap( amdgpu_bo_handle bo )
+{
+    std::lock_guard<std::mutex> lock( mLock );
+
+    auto it = mBos.find( bo );
+    if ( it != mBos.end() )
+        it->second.mCpu = nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoListCreate( amdgpu_bo_list_handle list, uint32_t count, amdgpu_bo_handle *resources )
+{
+    std::lock_guard<std::mutex> lock( mLock );
+    std::vector<uint32_t> &ids = mBoLists[list];
+
+    ids.clear();
+    for ( uint32_t i = 0; i < count; ++i ) {
+        auto it = mBos.find( resources[i] );
+        ids.push_back( it != mBos.end() ? it->second.mId : 0 );
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnBoListDestroy( amdgpu_bo_list_handle list )
+{
+    std::lock_guard<std::mutex> lock( mLock );
+    mBoLists.erase( list );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+const uint32_t *DrmCapture::FindIbData( uint64_t va, uint32_t sizeDw )
+{
+    for ( auto &it : mBos ) {
+        const BoInfo &info = it.second;
+
+        if ( !info.mCpu || va < info.mVa )
+            continue;
+
+        if ( va + sizeDw * sizeof(uint32_t) > info.mVa + info.mVaSize )
+            continue;
+
+        return (const uint32_t*)( info.mCpu + ( va - info.mVa ) );
+    }
+
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void DrmCapture::OnSubmit( const struct amdgpu_cs_request *pRequests, uint32_t count )
+{
+    CaptureSubmit submit = {};
+    std::lock_guard<std::mutex> lock( mLock );
+
+    if ( !mFile )
+        return;
+
+    submit.mNumRequests = count;
+    Append( submit );
+
+    for ( uint32_t i = 0; i < count; ++i ) {
+        const struct amdgpu_cs_request &request = pRequests[i];
+        CaptureRequest captureRequest = {};
+        static const std::vector<uint32_t> kNoBos;
+        auto listIt = mBoLists.find( request.resources );
+        const std::vector<uint32_t> &bos = listIt != mBoLists.end() ? listIt->second : kNoBos;
+
+        captureRequest.mIpType = request.ip_type;
+        captureRequest.mIpInstance = request.ip_instance;
+        captureRequest.mRing = request.ring;
+        captureRequest.mNumBos = bos.size();
+        captureRequest.mNumIbs = request.number_of_ibs;
+        Append( captureRequest );
+        Append( bos.data(), bos.size() * sizeof(uint32_t) );
+
+        for ( uint32_t j = 0; j < request.number_of_ibs; ++j ) {
+            const struct amdgpu_cs_ib_info &ib = request.ibs[j];
+            const uint32_t *pData = FindIbData( ib.ib_mc_address, ib.size );
+            CaptureIb captureIb = {};
+
+            captureIb.mVa = ib.ib_mc_address;
+            captureIb.mSizeDw = ib.size;
+            captureIb.mFlags = ib.flags;
+            Append( captureIb );
+
+            if ( pData ) {
+                Append( pData, ib.size * sizeof(uint32_t) );
+            } else {
+                Warn( "Capture: IB at 0x%lx is not cpu visible\n", ib.ib_mc_address );
+                mRecord.resize( mRecord.size() + ib.size * sizeof(uint32_t), 0 );
+            }
+        }
+    }
+
+    WriteRecord( kCaptureRecordSubmit );
+}
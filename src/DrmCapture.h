@@ -0,0 +1,181 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <libdrm/amdgpu.h>
+#include <libdrm/amdgpu_drm.h>
+
+/**
+ * Command stream capture file format
+ *
+ * A capture is a CaptureHeader followed by a sequence of records. Each record
+ * is a CaptureRecordHeader followed by mSizeBytes of payload. All values are
+ * stored in host byte order.
+ *
+ * BOs are identified by an id that is unique within the capture.
+ */
+static const uint32_t kCaptureMagic = 0x43544356; // 'VCTC'
+static const uint32_t kCaptureVersion = 1;
+
+enum CaptureRecordType : uint32_t {
+    kCaptureRecordBoAlloc = 1,
+    kCaptureRecordBoFree = 2,
+    kCaptureRecordVaOp = 3,
+    kCaptureRecordSubmit = 4,
+};
+
+struct CaptureHeader {
+    uint32_t mMagic;
+    uint32_t mVersion;
+};
+
+struct CaptureRecordHeader {
+    uint32_t mType;
+    uint32_t mSizeBytes;
+};
+
+struct CaptureBoAlloc {
+    uint32_t mBoId;
+    uint32_t mHeap;
+    uint64_t mSize;
+    uint64_t mAlignment;
+    uint64_t mFlags;
+    uint32_t mImported;
+    uint32_t mReserved;
+};
+
+struct CaptureBoFree {
+    uint32_t mBoId;
+    uint32_t mReserved;
+};
+
+struct CaptureVaOp {
+    uint32_t mBoId;
+    uint32_t mOp;
+    uint64_t mOffset;
+    uint64_t mSize;
+    uint64_t mAddr;
+    uint64_t mFlags;
+};
+
+/**
+ * A submit record is a CaptureSubmit followed by mNumRequests requests.
+ *
+ * Each request is a CaptureRequest, mNumBos uint32_t bo ids, and mNumIbs
+ * CaptureIb each followed by mSizeDw dwords of IB contents.
+ */
+struct CaptureSubmit {
+    uint32_t mNumRequests;
+    uint32_t mReserved;
+};
+
+struct CaptureRequest {
+    uint32_t mIpType;
+    uint32_t mIpInstance;
+    uint32_t mRing;
+    uint32_t mNumBos;
+    uint32_t mNumIbs;
+    uint32_t mReserved;
+};
+
+struct CaptureIb {
+    uint64_t mVa;
+    uint32_t mSizeDw;
+    uint32_t mFlags;
+};
+
+/**
+ * Records the command stream that goes through a Drm instance
+ */
+class DrmCapture
+{
+    public:
+        DrmCapture();
+        ~DrmCapture();
+
+        /**
+         * Start capturing to path, does nothing if already capturing
+         *
+         * If another capture in this process is already writing to path, a
+         * numeric suffix is appended to keep the streams separate.
+         */
+        bool Open( const char *path );
+
+        /**
+         * Stop capturing and flush the file
+         */
+        void Close();
+
+        bool IsActive() { return mFile != nullptr; }
+
+        /**
+         * Hooks called by Drm after each successful operation
+         */
+        void OnBoAlloc( amdgpu_bo_handle bo, const struct amdgpu_bo_alloc_request *pRequest );
+        void OnBoImport( amdgpu_bo_handle bo, uint64_t size );
+        void OnBoFree( amdgpu_bo_handle bo );
+        void OnBoVaOp( amdgpu_bo_handle bo, uint64_t offset, uint64_t size, uint64_t addr, uint64_t flags, uint32_t ops );
+        void OnBoCpuMap( amdgpu_bo_handle bo, uint8_t *pCpu );
+        void OnBoCpuUnmap( amdgpu_bo_handle bo );
+        void OnBoListCreate( amdgpu_bo_list_handle list, uint32_t count, amdgpu_bo_handle *resources );
+        void OnBoListDestroy( amdgpu_bo_list_handle list );
+        void OnSubmit( const struct amdgpu_cs_request *pRequests, uint32_t count );
+
+    private:
+        struct BoInfo {
+            uint32_t mId;
+            uint64_t mVa;
+            uint64_t mVaSize;
+            uint8_t *mCpu;
+        };
+
+        void AddBo( amdgpu_bo_handle bo, const CaptureBoAlloc &record );
+        const uint32_t *FindIbData( uint64_t va, uint32_t sizeDw );
+
+        template <typename T>
+        void Append( const T &value )
+        {
+            Append( &value, sizeof(value) );
+        }
+        void Append( const void *pData, size_t size );
+        void WriteRecord( uint32_t type );
+
+        std::mutex mLock;
+        FILE *mFile;
+        std::string mPath;
+        uint32_t mNextBoId;
+
+        std::unordered_map<amdgpu_bo_handle, BoInfo> mBos;
+        std::unordered_map<amdgpu_bo_list_handle, std::vector<uint32_t>> mBoLists;
+
+        // Scratch space for the record being built
+        std::vector<uint8_t> mRecord;
+};
@@ -26,9 +26,15 @@
 
 
 
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
 #include <util/util.h>
 
 #include "Drm.h"
+#include "VcetCopy.h"
 #include "VcetContext.h"
 #include "VcetBo.h"
 
@@ -37,6 +43,8 @@
 VcetBo::VcetBo( VcetContext *pContext )
     : mContext( pContext )
     , mMappable( false )
+    , mDomain( 0 )
+    , mFlags( 0 )
     , mSizeBytes( 0 )
     , mWidth( 0 )
     , mHeight( 0 )
@@ -44,8 +52,12 @@ VcetBo::VcetBo( VcetContext *pContext )
     , mAlignedHeight( 0 )
     , mBoHandle( 0 )
     , mVaHandle( 0 )
+    , mSuballocated( false )
+    , mBlock()
+    , mHostPtr( nullptr )
     , mGpuAddr( 0 )
     , mCpuAddr( nullptr )
+    , mMapCount( 0 )
 {
 }
 
@@ -55,10 +67,21 @@ VcetBo::~VcetBo()
 {
     int err;
 
-    if ( mCpuAddr )
-        Unmap();
+    // Whatever the map count, the mapping goes with the bo
+    if ( mCpuAddr && !mSuballocated && !mHostPtr ) {
+        err = mContext->GetDrm()->BoCpuUnmap( mBoHandle );
+        WarnOn( err, "Failed to unmap bo\n" );
+    }
+
+    // The slab owns the bo
+    if ( mSuballocated ) {
+        mContext->GetSlabAllocator()->Free( mBlock );
+        return;
+    }
 
     if ( mBoHandle ) {
+        mContext->OnBoDestroy( mBoHandle );
+
         err = mContext->GetDrm()->BoVaOp( mBoHandle, 0, mSizeBytes, mGpuAddr, 0, AMDGPU_VA_OP_UNMAP );
         WarnOn( err, "Failed to unmap gpu va range\n" );
 
@@ -68,39 +91,121 @@ VcetBo::~VcetBo()
         mBoHandle = nullptr;
     }
 
-    if ( mVaHandle ) {
-        err = mContext->GetDrm()->VaRangeFree( mVaHandle );
-        WarnOn( err, "Failed to free va range\n" );
+    if ( mGpuAddr ) {
+        FreeVa( mSizeBytes, mGpuAddr, mVaHandle );
 
+        mGpuAddr = 0;
         mVaHandle = 0;
     }
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBo::AllocateVa( uint64_t sizeBytes, uint64_t *pGpuAddr, amdgpu_va_handle *pVaHandle )
+{
+    int err;
+    uint64_t alignment = sizeBytes >= kLargePageBytes ? kLargePageBytes : kVaAlignment;
+
+    *pVaHandle = 0;
+
+    // Arena blocks are aligned to their size
+    if ( mContext->GetVaArena()->Allocate( sizeBytes, pGpuAddr ) )
+        return true;
+
+    err = mContext->GetDrm()->VaRangeAlloc( amdgpu_gpu_va_range_general,
+                                            sizeBytes, alignment, 0,
+                                            pGpuAddr, pVaHandle, kVaAllocFlags);
+    FailOnTo( err, error, "Failed to allocate va range\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetBo::FreeVa( uint64_t sizeBytes, uint64_t gpuAddr, amdgpu_va_handle vaHandle )
+{
+    int err;
+
+    if ( vaHandle ) {
+        err = mContext->GetDrm()->VaRangeFree( vaHandle );
+        WarnOn( err, "Failed to free va range\n" );
+    } else {
+        mContext->GetVaArena()->Free( gpuAddr, sizeBytes );
+    }
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetBo::Allocate( uint64_t sizeBytes, bool mappable, uint32_t alignment )
+{
+    return Allocate( sizeBytes, mappable ? Usage::kReadback : Usage::kDevice, alignment );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBo::Allocate( uint64_t sizeBytes, Usage usage, uint32_t alignment )
+{
+    switch ( usage ) {
+    case Usage::kDevice:
+        return AllocateInDomain( sizeBytes, AMDGPU_GEM_DOMAIN_VRAM, AMDGPU_GEM_CREATE_NO_CPU_ACCESS, alignment );
+    case Usage::kDeviceUpload:
+        return AllocateInDomain( sizeBytes, AMDGPU_GEM_DOMAIN_VRAM, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, alignment );
+    case Usage::kUpload:
+    case Usage::kCommands:
+        return AllocateInDomain( sizeBytes, AMDGPU_GEM_DOMAIN_GTT, AMDGPU_GEM_CREATE_CPU_GTT_USWC, alignment );
+    case Usage::kReadback:
+        return AllocateInDomain( sizeBytes, AMDGPU_GEM_DOMAIN_GTT, 0, alignment );
+    }
+
+    Warn( "Invalid bo usage %d\n", (int) usage );
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBo::AllocateInDomain( uint64_t sizeBytes, uint32_t domain, uint64_t flags, uint32_t alignment )
 {
     int err;
+    bool ret;
     uint64_t gpuAddr = 0;
-    amdgpu_va_handle vaHandle;
-    amdgpu_bo_handle boHandle;
+    amdgpu_va_handle vaHandle = 0;
+    amdgpu_bo_handle boHandle = nullptr;
     uint64_t alignedSize = ALIGN(sizeBytes, alignment );
-    int domain = mappable ? AMDGPU_GEM_DOMAIN_GTT :AMDGPU_GEM_DOMAIN_VRAM;
+    bool mappable = domain == AMDGPU_GEM_DOMAIN_GTT || ( flags & AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED );
     struct amdgpu_bo_alloc_request req = {};
 
     FailOnTo( sizeBytes == 0, error, "Invalid bo size\n" );
 
+    if ( alignedSize <= VcetSlabAllocator::kMaxBlockSizeBytes &&
+         alignment <= VcetSlabAllocator::kBlockAlignment &&
+         mContext->GetSlabAllocator()->Allocate( alignedSize, domain, flags, &mBlock ) ) {
+        mGpuAddr = mBlock.mGpuAddr;
+        mSizeBytes = alignedSize;
+        mBoHandle = mBlock.mBoHandle;
+        mMappable = mappable;
+        mDomain = domain;
+        mFlags = flags;
+        mSuballocated = true;
+
+        return true;
+    }
+
+    // Let the kernel back big bos with large pages
+    if ( alignedSize >= kLargePageBytes && alignment < kLargePageBytes )
+        alignment = kLargePageBytes;
+
     req.alloc_size = alignedSize;
     req.phys_alignment = alignment;
     req.preferred_heap = domain;
-    req.flags = 0;
+    req.flags = flags;
     err = mContext->GetDrm()->BoAlloc( &req, &boHandle );
     FailOnTo( err, error, "Failed to allocate amdgpu bo\n" );
 
-    err = mContext->GetDrm()->VaRangeAlloc( amdgpu_gpu_va_range_general,
-                                            alignedSize, kVaAlignment, 0,
-                                            &gpuAddr, &vaHandle, kVaAllocFlags);
-    FailOnTo( err, error, "Failed to allocate gpuAddr for bo\n" );
+    ret = AllocateVa( alignedSize, &gpuAddr, &vaHandle );
+    FailOnTo( !ret, error, "Failed to allocate gpuAddr for bo\n" );
 
     err = mContext->GetDrm()->BoVaOp( boHandle, 0, alignedSize, gpuAddr, 0, AMDGPU_VA_OP_MAP);
     FailOnTo( err, error, "Failed to map gpuAddr for bo\n" );
@@ -110,24 +215,40 @@ bool VcetBo::Allocate( uint64_t sizeBytes, bool mappable, uint32_t alignment )
     mBoHandle = boHandle;
     mVaHandle = vaHandle;
     mMappable = mappable;
+    mDomain = domain;
+    mFlags = flags;
 
     return true;
 
 error:
-    // TODO de-allocate intermediate stuff
+    if ( gpuAddr )
+        FreeVa( alignedSize, gpuAddr, vaHandle );
+
+    if ( boHandle ) {
+        err = mContext->GetDrm()->BoFree( boHandle );
+        WarnOn( err, "Failed to free amdgpu bo\n" );
+    }
+
     return false;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetBo::Allocate( uint32_t width, uint32_t height, bool mappable )
+{
+    return Allocate( width, height, mappable ? Usage::kReadback : Usage::kDevice );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBo::Allocate( uint32_t width, uint32_t height, Usage usage )
 {
     bool ret;
     uint32_t alignedWidth = ALIGN( width, GetWidthAlignment() );
     uint32_t alignedHeight = ALIGN( height, GetHeightAlignment() );
     uint64_t nv21Size = alignedWidth * alignedHeight * kNv21Bpp;
 
-    ret = Allocate( nv21Size, mappable, kDefaultAlignment );
+    ret = Allocate( nv21Size, usage, kDefaultAlignment );
     FailOnTo( !ret, error, "Failed to allocate bo by size\n" );
 
     mWidth = width;
@@ -147,17 +268,16 @@ error:
 bool VcetBo::Import( int fd, bool bMappable )
 {
     int err;
+    bool ret;
     struct amdgpu_bo_import_result importResult = {};
     uint64_t gpuAddr = 0;
-    amdgpu_va_handle vaHandle;
+    amdgpu_va_handle vaHandle = 0;
 
     err = mContext->GetDrm()->BoImport( amdgpu_bo_handle_type_dma_buf_fd, fd, &importResult );
     FailOnTo( err, error, "Failed to import fd %d\n", fd );
 
-    err = mContext->GetDrm()->VaRangeAlloc( amdgpu_gpu_va_range_general,
-                                            importResult.alloc_size, kVaAlignment, 0,
-                                            &gpuAddr, &vaHandle, kVaAllocFlags);
-    FailOnTo( err, error, "Failed to allocate gpuAddr for import bo\n" );
+    ret = AllocateVa( importResult.alloc_size, &gpuAddr, &vaHandle );
+    FailOnTo( !ret, error, "Failed to allocate gpuAddr for import bo\n" );
 
     err = mContext->GetDrm()->BoVaOp( importResult.buf_handle, 0,
                                       importResult.alloc_size,
@@ -173,10 +293,65 @@ bool VcetBo::Import( int fd, bool bMappable )
     return true;
 
 error:
-    // TODO de-allocate intermediate stuff
+    if ( gpuAddr )
+        FreeVa( importResult.alloc_size, gpuAddr, vaHandle );
+
+    if ( importResult.buf_handle ) {
+        err = mContext->GetDrm()->BoFree( importResult.buf_handle );
+        WarnOn( err, "Failed to free imported bo\n" );
+    }
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBo::CreateFromHostPtr( void *pHost, uint64_t sizeBytes )
+{
+    int err;
+    bool ret;
+    uint64_t gpuAddr = 0;
+    uint64_t pageSize = sysconf( _SC_PAGESIZE );
+    amdgpu_va_handle vaHandle = 0;
+    amdgpu_bo_handle boHandle = nullptr;
+
+    FailOnTo( !pHost || !sizeBytes, error, "Invalid host memory\n" );
+    FailOnTo( ( (uintptr_t) pHost | sizeBytes ) & ( pageSize - 1 ), error,
+              "Host memory %p, %lu bytes, is not page aligned\n", pHost, sizeBytes );
+
+    err = mContext->GetDrm()->BoCreateFromUserMem( pHost, sizeBytes, &boHandle );
+    FailOnTo( err, error, "Failed to create bo from host memory\n" );
+
+    ret = AllocateVa( sizeBytes, &gpuAddr, &vaHandle );
+    FailOnTo( !ret, error, "Failed to allocate gpuAddr for host memory bo\n" );
+
+    err = mContext->GetDrm()->BoVaOp( boHandle, 0, sizeBytes, gpuAddr, 0, AMDGPU_VA_OP_MAP);
+    FailOnTo( err, error, "Failed to map gpuAddr for bo\n" );
+
+    mGpuAddr = gpuAddr;
+    mSizeBytes = sizeBytes;
+    mBoHandle = boHandle;
+    mVaHandle = vaHandle;
+    mMappable = true;
+    mDomain = AMDGPU_GEM_DOMAIN_GTT;
+    mHostPtr = (uint8_t*) pHost;
+
+    return true;
+
+error:
+    if ( gpuAddr )
+        FreeVa( sizeBytes, gpuAddr, vaHandle );
+
+    if ( boHandle ) {
+        err = mContext->GetDrm()->BoFree( boHandle );
+        WarnOn( err, "Failed to free host memory bo\n" );
+    }
+
     return false;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
 bool VcetBo::Map()
 {
     int err;
@@ -184,12 +359,26 @@ bool VcetBo::Map()
 
     FailOnTo( !mBoHandle, error, "Attempted to map un-allocated BO\n" );
     FailOnTo( !mMappable, error, "Attempted to map un-mappable BO\n" );
-    FailOnTo( mCpuAddr, error, "Attempted to map already-mapped BO\n" );
 
-    err = mContext->GetDrm()->BoCpuMap( mBoHandle, &cpuAddr);
-    FailOnTo( err, error, "Failed to cpu map bo\n" );
+    // Mapped before, the mapping is still there
+    if ( !mCpuAddr.load( std::memory_order_acquire ) ) {
+        std::lock_guard<std::mutex> lock( mMapLock );
+
+        if ( !mCpuAddr.load( std::memory_order_relaxed ) ) {
+            if ( mSuballocated ) {
+                cpuAddr = mBlock.mCpuAddr;
+            } else if ( mHostPtr ) {
+                cpuAddr = mHostPtr;
+            } else {
+                err = mContext->GetDrm()->BoCpuMap( mBoHandle, &cpuAddr );
+                FailOnTo( err, error, "Failed to cpu map bo\n" );
+            }
+
+            mCpuAddr.store( cpuAddr, std::memory_order_release );
+        }
+    }
 
-    mCpuAddr = cpuAddr;
+    mMapCount.fetch_add( 1, std::memory_order_relaxed );
 
     return true;
 
@@ -197,17 +386,83 @@ error:
     return false;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
 bool VcetBo::Unmap()
 {
-    int err;
+    uint32_t count = mMapCount.load( std::memory_order_relaxed );
 
     FailOnTo( !mBoHandle, error, "Attempted to unmap un-allocated BO\n" );
-    FailOnTo( !mCpuAddr, error, "Attempted to unmap unmapped BO\n" );
 
-    err = mContext->GetDrm()->BoCpuUnmap( mBoHandle );
-    FailOnTo( err, error, "Failed to unmap bo\n" );
+    do {
+        FailOnTo( !count, error, "Attempted to unmap unmapped BO\n" );
+    } while ( !mMapCount.compare_exchange_weak( count, count - 1, std::memory_order_relaxed ) );
+
+    return true;
 
-    mCpuAddr = nullptr;
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBo::Upload( const uint8_t *pSrc, uint32_t srcPitch, uint32_t rows, uint32_t maxThreads )
+{
+    bool ret;
+    uint32_t lumaRows;
+    uint8_t *cpuAddr;
+    uint64_t rowBytes = mWidth ? mWidth : srcPitch;
+    uint64_t dstPitch = mWidth ? mAlignedWidth : srcPitch;
+    uint64_t maxRows = mWidth ? mHeight + ( mHeight + 1 ) / 2 : mSizeBytes / std::max( srcPitch, 1u );
+
+    FailOnTo( !pSrc || srcPitch < rowBytes || !srcPitch, error, "Invalid upload source\n" );
+    FailOnTo( rows > maxRows, error, "Upload of %u rows overflows the bo\n", rows );
+
+    ret = Map();
+    FailOnTo( !ret, error, "Failed to map bo for upload\n" );
+
+    cpuAddr = GetCpuAddr();
+    lumaRows = mWidth ? std::min( rows, mHeight ) : rows;
+
+    VcetCopy::StreamRows( cpuAddr, dstPitch, pSrc, srcPitch, rowBytes, lumaRows, maxThreads );
+
+    // The chroma plane starts at the aligned height
+    if ( rows > lumaRows ) {
+        VcetCopy::StreamRows( cpuAddr + dstPitch * mAlignedHeight, dstPitch,
+                              pSrc + (uint64_t) srcPitch * lumaRows, srcPitch,
+                              rowBytes, rows - lumaRows, maxThreads );
+    }
+
+    ret = Unmap();
+    FailOnTo( !ret, error, "Failed to unmap bo after upload\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBo::Readback( uint8_t *pDst, uint64_t offset, uint64_t size )
+{
+    bool ret;
+
+    FailOnTo( !pDst, error, "Invalid readback destination\n" );
+    FailOnTo( offset > mSizeBytes || size > mSizeBytes - offset, error,
+              "Readback of %lu bytes at %lu overflows the bo\n", size, offset );
+
+    ret = Map();
+    FailOnTo( !ret, error, "Failed to map bo for readback\n" );
+
+    // Streaming loads only pay off when they don't go through the cache
+    if ( mDomain == AMDGPU_GEM_DOMAIN_GTT && !( mFlags & AMDGPU_GEM_CREATE_CPU_GTT_USWC ) )
+        memcpy( pDst, GetCpuAddr() + offset, size );
+    else
+        VcetCopy::StreamRead( pDst, GetCpuAddr() + offset, size );
+
+    ret = Unmap();
+    FailOnTo( !ret, error, "Failed to unmap bo after readback\n" );
 
     return true;
 
@@ -231,6 +486,27 @@ bool VcetBo::IsHeightAligned( VcetContext *ctx, uint32_t width )
     return ( width % alignment ) == 0;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetBo::GetFrameSizeBytes( VcetContext *ctx, uint32_t width, uint32_t height )
+{
+    uint64_t alignedWidth = ALIGN( width, GetWidthAlignment( ctx ) );
+    uint64_t alignedHeight = ALIGN( height, GetHeightAlignment( ctx ) );
+
+    // Sessions run at the aligned size, so that is what the engine reads
+    return alignedWidth * alignedHeight * kNv21Bpp;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetBo::GetMvSizeBytes( VcetContext *ctx, uint32_t width, uint32_t height )
+{
+    uint64_t alignedWidth = ALIGN( width, GetWidthAlignment( ctx ) );
+    uint64_t alignedHeight = ALIGN( height, GetHeightAlignment( ctx ) );
+
+    return ( alignedWidth / kMbSize ) * ( alignedHeight / kMbSize ) * kMvBytesPerMb;
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 uint32_t VcetBo::GetWidthAlignment()
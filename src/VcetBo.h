@@ -29,7 +29,11 @@
 
 #include <libdrm/amdgpu.h>
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+
+#include "VcetSlabAllocator.h"
 
 class VcetContext;
 
@@ -38,7 +42,10 @@ class VcetBo
     private:
         static const int kDefaultAlignment = 4096;
         static const int kVaAlignment = 4096;
+        static const uint64_t kLargePageBytes = 2 * 1024 * 1024;   // Big bos are aligned to this
         static const uint64_t kVaAllocFlags = 0;
+        static const uint32_t kMbSize = 16;
+        static const uint32_t kMvBytesPerMb = 16;  // Upper bound on the output for a macroblock
 
     public:
         static constexpr float kNv21Bpp = 1.5;
@@ -47,6 +54,28 @@ class VcetBo
         static bool IsWidthAligned( VcetContext *ctx, uint32_t width );
         static bool IsHeightAligned( VcetContext *ctx, uint32_t width );
 
+        /**
+         * Bytes the hardware reads for an NV21 frame of width x height
+         */
+        static uint64_t GetFrameSizeBytes( VcetContext *ctx, uint32_t width, uint32_t height );
+
+        /**
+         * Bytes the hardware may write for the motion vectors of such a frame
+         */
+        static uint64_t GetMvSizeBytes( VcetContext *ctx, uint32_t width, uint32_t height );
+
+    public:
+        /**
+         * How a bo is accessed, which decides where it lives
+         */
+        enum class Usage {
+            kDevice,            // GPU only, VRAM without a CPU mapping
+            kDeviceUpload,      // CPU visible VRAM, for data the GPU reads many times
+            kUpload,            // Write combined GTT that the CPU streams into
+            kReadback,          // Cached GTT that the CPU reads from
+            kCommands,          // Write combined GTT for command buffers
+        };
+
     public:
 
         VcetBo( VcetContext *pContext );
@@ -55,10 +84,27 @@ class VcetBo
         /**
          * Allocate sizeBytes of GPU addressable memory
          *
-         * If mappable is set, then the memory will be CPU visible as well.
+         * If mappable is set, then the memory will be CPU visible as well,
+         * as Usage::kReadback. Otherwise it is placed as Usage::kDevice.
+         * Small allocations are carved out of the context's slabs, they
+         * share their amdgpu bo with other VcetBos.
          */
         bool Allocate( uint64_t sizeBytes, bool mappable, uint32_t alignment = kDefaultAlignment );
 
+        /**
+         * Allocate sizeBytes of GPU addressable memory placed for usage
+         */
+        bool Allocate( uint64_t sizeBytes, Usage usage, uint32_t alignment = kDefaultAlignment );
+
+        /**
+         * Allocate sizeBytes in an explicit heap
+         *
+         * domain and flags are AMDGPU_GEM_DOMAIN_* and AMDGPU_GEM_CREATE_*.
+         * The memory is CPU visible if it is in GTT, or flags contain
+         * AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED.
+         */
+        bool AllocateInDomain( uint64_t sizeBytes, uint32_t domain, uint64_t flags, uint32_t alignment );
+
         /**
          * Allocate an NV21 image of dimensions width x height
          *
@@ -66,6 +112,11 @@ class VcetBo
          */
         bool Allocate( uint32_t width, uint32_t height, bool mappable );
 
+        /**
+         * Allocate an NV21 image of dimensions width x height placed for usage
+         */
+        bool Allocate( uint32_t width, uint32_t height, Usage usage );
+
         /**
          * Import a BO from a dma buf fd
          *
@@ -73,22 +124,52 @@ class VcetBo
          */
         bool Import( int fd, bool bMappable );
 
+        /**
+         * Wrap sizeBytes of host memory at pHost, without copying it
+         *
+         * pHost and sizeBytes must be page aligned. The memory must outlive
+         * the BO. Maps return pHost.
+         */
+        bool CreateFromHostPtr( void *pHost, uint64_t sizeBytes );
+
         /**
          * Map the BO for cpu usage
          *
-         * Bo must've been allocated as mappable, otherwise an error will be produced
+         * Bo must've been allocated as mappable, otherwise an error will be produced.
+         * Maps are counted, the first one creates the mapping and later ones
+         * return it.
          */
         bool Map();
 
         /**
-         * Release the BO's cpu mapping
+         * Release a reference to the BO's cpu mapping
+         *
+         * The mapping itself stays until the BO is destroyed, so that mapping
+         * again is free. Fails if the BO holds no map reference.
          */
         bool Unmap();
 
+        /**
+         * Copy rows of pSrc into the BO with non-temporal stores
+         *
+         * Rows start srcPitch bytes apart. Plain BOs receive the rows back
+         * to back. NV21 image BOs receive GetWidth() bytes per row at their
+         * aligned pitch, the first GetHeight() rows being luma and the next
+         * ones chroma. The copy may be split across up to maxThreads threads.
+         */
+        bool Upload( const uint8_t *pSrc, uint32_t srcPitch, uint32_t rows, uint32_t maxThreads );
+
+        /**
+         * Copy size bytes at offset out of the BO
+         *
+         * Uses non-temporal loads unless the BO is in cached memory.
+         */
+        bool Readback( uint8_t *pDst, uint64_t offset, uint64_t size );
+
         /**
          * Getters/Setters
          */
-        uint8_t*    GetCpuAddr()        { return mCpuAddr; }
+        uint8_t*    GetCpuAddr()        { return mCpuAddr.load( std::memory_order_acquire ); }
         uint64_t    GetGpuAddr()        { return mGpuAddr; }
         amdgpu_bo_handle GetBoHandle()  { return mBoHandle; }
         uint64_t    GetSizeBytes()      { return mSizeBytes; }
@@ -96,14 +177,33 @@ class VcetBo
         uint32_t    GetHeight()         { return mHeight; }
         uint32_t    GetAlignedWidth()   { return mAlignedWidth; }
         uint32_t    GetAlignedHeight()  { return mAlignedHeight; }
+        bool        IsSuballocated()    { return mSuballocated; }
+        bool        IsHostPtr()         { return mHostPtr != nullptr; }
+        bool        IsMappable()        { return mMappable; }
+        uint32_t    GetDomain()         { return mDomain; }
+        uint64_t    GetFlags()          { return mFlags; }
 
     private:
+        /**
+         * Place sizeBytes in the context's VA arena, or a VA range of its own
+         *
+         * pVaHandle is only set for the latter
+         */
+        bool AllocateVa( uint64_t sizeBytes, uint64_t *pGpuAddr, amdgpu_va_handle *pVaHandle );
+
+        /**
+         * Give back a range returned by AllocateVa()
+         */
+        void FreeVa( uint64_t sizeBytes, uint64_t gpuAddr, amdgpu_va_handle vaHandle );
+
         uint32_t GetWidthAlignment();
         uint32_t GetHeightAlignment();
 
         VcetContext *mContext;
 
         bool mMappable;
+        uint32_t mDomain;
+        uint64_t mFlags;
 
         uint64_t mSizeBytes;
         uint32_t mWidth;
@@ -114,6 +214,13 @@ class VcetBo
         amdgpu_bo_handle mBoHandle;
         amdgpu_va_handle mVaHandle;
 
+        bool mSuballocated;
+        VcetSlabAllocator::Block mBlock;
+
+        uint8_t *mHostPtr;                  // Set for BOs wrapping host memory
+
         uint64_t mGpuAddr;
-        uint8_t *mCpuAddr;
+        std::mutex mMapLock;                // Serializes creating the mapping
+        std::atomic<uint8_t*> mCpuAddr;
+        std::atomic<uint32_t> mMapCount;
 };
@@ -0,0 +1,145 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <algorithm>
+
+#include <util/util.h>
+
+#include "Drm.h"
+#include "VcetContext.h"
+
+#include "VcetBoListCache.h"
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetBoListCache::VcetBoListCache( VcetContext *pContext )
+    : mContext( pContext )
+    , mTick( 0 )
+    , mHits( 0 )
+    , mMisses( 0 )
+{
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetBoListCache::~VcetBoListCache()
+{
+    Flush();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBoListCache::Get( amdgpu_bo_handle *resources, uint32_t count, amdgpu_bo_list_handle *pList )
+{
+    int err;
+    Entry entry = {};
+    Key key( resources, resources + count );
+
+    // Resources may be referenced more than once, or in a different order
+    std::sort( key.begin(), key.end() );
+    key.erase( std::unique( key.begin(), key.end() ), key.end() );
+
+    std::lock_guard<std::mutex> lock( mLock );
+
+    auto it = mEntries.find( key );
+    if ( it != mEntries.end() ) {
+        it->second.mLastUse = ++mTick;
+        *pList = it->second.mList;
+        mHits++;
+        return true;
+    }
+
+    err = mContext->GetDrm()->BoListCreate( key.size(), key.data(), nullptr, &entry.mList );
+    FailOnTo( err, error, "Failed to create bo list\n" );
+
+    if ( mEntries.size() >= kMaxEntries )
+        EvictOldest();
+
+    entry.mLastUse = ++mTick;
+    mEntries[ key ] = entry;
+    *pList = entry.mList;
+    mMisses++;
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetBoListCache::Invalidate( amdgpu_bo_handle bo )
+{
+    int err;
+    std::lock_guard<std::mutex> lock( mLock );
+
+    for ( auto it = mEntries.begin(); it != mEntries.end(); ) {
+        if ( !std::binary_search( it->first.begin(), it->first.end(), bo ) ) {
+            ++it;
+            continue;
+        }
+
+        err = mContext->GetDrm()->BoListDestroy( it->second.mList );
+        WarnOn( err, "Failed to destroy bo list\n" );
+
+        it = mEntries.erase( it );
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetBoListCache::Flush()
+{
+    int err;
+    std::lock_guard<std::mutex> lock( mLock );
+
+    for ( auto &it : mEntries ) {
+        err = mContext->GetDrm()->BoListDestroy( it.second.mList );
+        WarnOn( err, "Failed to destroy bo list\n" );
+    }
+
+    mEntries.clear();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetBoListCache::EvictOldest()
+{
+    int err;
+    auto oldest = mEntries.begin();
+
+    for ( auto it = mEntries.begin(); it != mEntries.end(); ++it ) {
+        if ( it->second.mLastUse < oldest->second.mLastUse )
+            oldest = it;
+    }
+
+    if ( oldest == mEntries.end() )
+        return;
+
+    err = mContext->GetDrm()->BoListDestroy( oldest->second.mList );
+    WarnOn( err, "Failed to destroy bo list\n" );
+
+    mEntries.erase( oldest );
+}
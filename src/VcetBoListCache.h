@@ -0,0 +1,95 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#pragma once
+
+#include <libdrm/amdgpu.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+class VcetContext;
+
+/**
+ * Cache of bo lists, keyed by the set of bos they reference
+ *
+ * Used by a single submitting thread, other threads may Invalidate()
+ */
+class VcetBoListCache
+{
+    private:
+        static constexpr uint32_t kMaxEntries = 32;
+
+    public:
+        VcetBoListCache( VcetContext *pContext );
+        ~VcetBoListCache();
+
+        /**
+         * Get a bo list containing the specified resources
+         *
+         * Lists are cached by the set of referenced bos, so repeated
+         * submissions of the same resources avoid a create/destroy round trip
+         */
+        bool Get( amdgpu_bo_handle *resources, uint32_t count, amdgpu_bo_list_handle *pList );
+
+        /**
+         * Drop all the cached lists that reference bo
+         */
+        void Invalidate( amdgpu_bo_handle bo );
+
+        /**
+         * Drop all the cached lists
+         */
+        void Flush();
+
+        /**
+         * Getters/Setters
+         */
+        uint64_t GetHits()      { std::lock_guard<std::mutex> lock( mLock ); return mHits; }
+        uint64_t GetMisses()    { std::lock_guard<std::mutex> lock( mLock ); return mMisses; }
+
+    private:
+        typedef std::vector<amdgpu_bo_handle> Key;
+
+        struct Entry {
+            amdgpu_bo_list_handle mList;
+            uint64_t mLastUse;
+        };
+
+        void EvictOldest();
+
+        VcetContext *mContext;
+
+        std::mutex mLock;
+
+        std::map<Key, Entry> mEntries;
+        uint64_t mTick;
+
+        uint64_t mHits;
+        uint64_t mMisses;
+};
@@ -24,8 +24,14 @@
 // SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //
 
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+
 #include <util/util.h>
 #include <xf86drm.h>
 
@@ -33,6 +39,9 @@
 #include "VcetIb.h"
 #include "VcetBo.h"
 #include "VcetJob.h"
+#include "VcetSession.h"
+#include "VcetSlabAllocator.h"
+#include "VcetSubmitter.h"
 
 #include "VcetContext.h"
 
@@ -41,29 +50,85 @@
  */
 #define FW_53_0_03 ((53 << 24) | (0 << 16) | (03 << 8))
 
+/**
+ * Live contexts per device, used for placement
+ */
+static std::mutex sDeviceLoadLock;
+static std::map<std::string, uint32_t> sDeviceLoad;
+
+/**
+ * Live contexts by id, for exiting threads to find the contexts they hold
+ * pools in
+ */
+static std::mutex sContextLock;
+static std::map<uint64_t, VcetContext*> sContexts;
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-static uint32_t GenSessionId()
+static uint64_t GenContextId()
 {
-    static uint32_t sNextSessionId = 1;
-    return  ( 0xA3D << 16 ) | sNextSessionId++;
+    static std::atomic<uint64_t> sNextContextId( 1 );
+    return sNextContextId++;
 }
 
+thread_local VcetContext::IbPoolCacheEntry VcetContext::sIbPoolCache[ VcetContext::kIbPoolCacheSize ];
+thread_local VcetContext::IbPoolOwner VcetContext::sIbPoolOwner;
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-VcetContext::VcetContext()
-    : mSesionId( GenSessionId() )
-    , mWidth( 0 )
-    , mHeight( 0 )
-    , mAlignedWidth( 0 )
-    , mAlignedHeight( 0 )
-    , mBoFb( nullptr )
-    , mBoBs( nullptr )
-    , mBoCpb( nullptr )
+VcetContext::IbPoolOwner::~IbPoolOwner()
+{
+    std::lock_guard<std::mutex> lock( sContextLock );
+
+    // Destroyed contexts took our pools with them
+    for ( uint64_t id : mContextIds ) {
+        auto it = sContexts.find( id );
+
+        if ( it != sContexts.end() )
+            it->second->ReleaseIbPool();
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetContext::IbPool::IbPool( VcetContext *pContext )
+    : mOwner( std::this_thread::get_id() )
     , mIbIdx( 0 )
-    , mSessionCreated( false )
+    , mBoListCache( pContext )
 {
-    memset( mIbs, 0, sizeof(mIbs) );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetContext::VcetContext()
+    : mId( GenContextId() )
+    , mVaArena( this )
+    , mSessionClock( 0 )
+    , mSessionEvictions( 0 )
+    , mImportCacheHits( 0 )
+    , mIbRingPolicy( IbRingPolicy::Wait )
+    , mMaxIbs( kDefaultMaxIbs )
+    , mIbRingWaits( 0 )
+    , mRingBalancePolicy( RingBalancePolicy::LeastOutstanding )
+    , mNextRing( 0 )
+    , mWaitPolicy( WaitPolicy::Block )
+    , mSpinNs( kDefaultSpinNs )
+    , mAvgJobNs( 0 )
+    , mReactor( this )
+    , mSubmitter( new VcetSubmitter( this ) )
+    , mSlabAllocator( new VcetSlabAllocator( this ) )
+    , mDeviceLoadTracked( false )
+{
+    for ( auto &state : mRingStates ) {
+        state.mLastSeqNo = 0;
+        state.mSubmissions = 0;
+    }
+
+    for ( auto &signaled : mSignaledSeqNo )
+        signaled = 0;
+
+    std::lock_guard<std::mutex> lock( sContextLock );
+    sContexts[ mId ] = this;
 }
 
 //---------------------------------------------------------------------------//
@@ -71,31 +136,81 @@ VcetContext::VcetContext()
 VcetContext::~VcetContext()
 {
     bool err;
+    bool ret;
+    IbPool *teardown = nullptr;
+    VcetIb *ib;
+
+    // Exiting threads must not hand pools back from here on
+    {
+        std::lock_guard<std::mutex> lock( sContextLock );
+        sContexts.erase( mId );
+    }
+
+    // Queued requests may still be handed to the reactor
+    mSubmitter->Stop();
+    mReactor.Stop();
+
+    // The pools belong to other threads, tear the sessions down through an
+    // IB of our own. Nothing else runs, so it can wait on itself.
+    if ( !mSessions.empty() ) {
+        mIbRingPolicy = IbRingPolicy::Wait;
+        teardown = new IbPool( this );
+
+        ib = CreateIb();
+        WarnOn( !ib, "Failed to create teardown ib\n" );
+        if ( ib )
+            teardown->mIbs.push_back( ib );
+    }
+
+    for ( auto &entry : mSessions ) {
+        err = DestroySession( teardown, entry.second );
+        WarnOn( err, "Failed to destroy VCE session\n" );
+
+        mRetiredSessions.push_back( entry.second );
+    }
+    mSessions.clear();
+
+    for ( VcetSession *session : mRetiredSessions ) {
+        ret = session->WaitIdle();
+        WarnOn( !ret, "Failed to wait for VCE session\n" );
+
+        delete session;
+    }
+    mRetiredSessions.clear();
+
+    if ( teardown )
+        DestroyIbPool( teardown );
 
-    err = DestroySession();
-    WarnOn( err, "Failed to destroy VCE session\n" );
+    FlushImportCache();
 
-    delete mBoFb;
-    mBoFb = nullptr;
+    // Unlink the pools first, destroying their IBs calls back into OnBoDestroy
+    std::vector<IbPool*> pools;
+    {
+        std::lock_guard<std::mutex> lock( mIbPoolLock );
+        pools.swap( mIbPools );
+    }
 
-    delete mBoBs;
-    mBoBs = nullptr;
+    for ( IbPool *pool : pools ) {
+        DestroyIbPool( pool );
+    }
 
-    delete mBoCpb;
-    mBoCpb = nullptr;
+    // Last, the slabs back the bos of everything above. The VA arena goes
+    // with the members, once every bo is gone.
+    mSlabAllocator.reset();
 
-    for ( int i = 0; i < kNumIbs; ++i ) {
-        delete mIbs[i];
+    if ( mDeviceLoadTracked ) {
+        std::lock_guard<std::mutex> lock( sDeviceLoadLock );
+        sDeviceLoad[ mDrm.GetBusId() ]--;
     }
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetContext::MinimalInit()
+bool VcetContext::MinimalInit( const char *busId )
 {
     int err;
 
-    err = mDrm.Init();
+    err = mDrm.Init( busId );
     if ( err )
         return false;
 
@@ -104,25 +219,37 @@ bool VcetContext::MinimalInit()
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetContext::Init( uint32_t width, uint32_t height )
+bool VcetContext::Init( uint32_t width, uint32_t height, const char *busId, int32_t priority )
 {
     int err;
+    bool ret;
+    IbPool *pool;
+    VcetSession *session;
 
     FailOnTo( !width || !height, error, "Bad dimensions\n" );
 
-    err = mDrm.Init();
+    err = mDrm.Init( busId, priority );
     FailOnTo( err, error, "Failed to init libdrm interface\n" );
 
-    mWidth = width;
-    mHeight = height;
-    mAlignedWidth = ALIGN( mWidth, VcetBo::GetWidthAlignment( this ) );
-    mAlignedHeight = ALIGN( mHeight, VcetBo::GetHeightAlignment( this ) );
+    // Without the arena, bos get VA ranges of their own
+    ret = mVaArena.Init();
+    WarnOn( !ret, "Falling back to per bo VA ranges\n" );
+
+    QueryRings();
 
-    err = AllocateResources();
-    FailOnTo( err, error, "Failed to allocate context resources\n" );
+    pool = GetIbPool();
+    FailOnTo( !pool, error, "Failed to get ib pool\n" );
 
-    err = CreateSession();
-    FailOnTo( err, error, "Failed to create session\n" );
+    session = AcquireSession( pool, width, height );
+    FailOnTo( !session, error, "Failed to create session\n" );
+
+    ReleaseSessions( &session, nullptr, 1 );
+
+    {
+        std::lock_guard<std::mutex> lock( sDeviceLoadLock );
+        sDeviceLoad[ mDrm.GetBusId() ]++;
+        mDeviceLoadTracked = true;
+    }
 
     return true;
 
@@ -136,14 +263,16 @@ bool VcetContext::IsMvDumpSupported()
 {
     int err;
     uint32_t fwVersion, fwFeature;
-    uint32_t chipId = mDrm.GetGpuInfo()->chip_external_rev;
-    uint32_t chipRev = mDrm.GetGpuInfo()->chip_rev;
-    uint32_t familyId = mDrm.GetGpuInfo()->family_id;
+    uint32_t chipId, chipRev, familyId;
 
     // Make sure our drm interface is initialized
     err = mDrm.Init();
     FailOnTo( err, error, "Failed to init libdrm interface\n" );
 
+    chipId = mDrm.GetGpuInfo()->chip_external_rev;
+    chipRev = mDrm.GetGpuInfo()->chip_rev;
+    familyId = mDrm.GetGpuInfo()->family_id;
+
     // Latest supported gpu
     if ( familyId >= AMDGPU_FAMILY_RV )
         return false;
@@ -173,15 +302,13 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetContext::AllocateResource( VcetBo*& bo, uint64_t size, bool mappable )
+bool VcetContext::QueryVceFwVersion( uint32_t *pVersion )
 {
-    bool ret;
-
-    bo = new VcetBo( this );
-    FailOnTo( !bo, error, "Failed to create bo\n" );
+    int err;
+    uint32_t fwFeature;
 
-    ret = bo->Allocate( size, true );
-    FailOnTo( !ret, error, "Failed to allocate fb bo\n" );
+    err = mDrm.QueryFirmwareVersion( AMDGPU_INFO_FW_VCE, 0, 0, pVersion, &fwFeature );
+    FailOnTo( err, error, "Failed to query firmware version\n" );
 
     return true;
 
@@ -191,50 +318,192 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-int VcetContext::AllocateResources()
+uint32_t VcetContext::GetDeviceLoad( const std::string &busId )
 {
+    std::lock_guard<std::mutex> lock( sDeviceLoadLock );
+    auto it = sDeviceLoad.find( busId );
+
+    return it != sDeviceLoad.end() ? it->second : 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSession *VcetContext::AcquireSession( IbPool *pPool, uint32_t width, uint32_t height )
+{
+    int err;
     bool ret;
+    SessionKey key( ALIGN( width, VcetBo::GetWidthAlignment( this ) ),
+                    ALIGN( height, VcetBo::GetHeightAlignment( this ) ) );
+    VcetSession *session = nullptr;
+
+    session = PinSession( key );
+    if ( session )
+        return session;
+
+    // Freeing bos may wait on the submission thread, so no session lock may
+    // be held here
+    FreeRetiredSessions();
+
+    {
+        // Jobs on existing sessions carry on while we create this one
+        std::lock_guard<std::mutex> createLock( mSessionCreateLock );
+
+        // Another thread may have created it while we waited
+        session = PinSession( key );
+        if ( session )
+            return session;
+
+        while ( GetNumSessions() >= kMaxSessions ) {
+            ret = EvictSession( pPool );
+            FailOnTo( !ret, error, "Failed to make room for a new session\n" );
+        }
 
-    ret = AllocateResource( mBoFb, GetFbSize(), true );
-    FailOnTo( !ret, error, "Failed to allocate fb bo\n" );
+        session = new VcetSession( this, key.first, key.second );
+        FailOnTo( !session, error, "Failed to allocate session\n" );
 
-    ret = AllocateResource( mBoBs, GetBsSize(), true );
-    FailOnTo( !ret, error, "Failed to allocate bs bo\n" );
+        ret = session->Init();
+        FailOnTo( !ret, error, "Failed to allocate session resources\n" );
 
-    ret = AllocateResource( mBoCpb, GetCpbSize(), false );
-    FailOnTo( !ret, error, "Failed to allocate cpb bo\n" );
+        // Other contexts may hold the engine's remaining handles
+        err = CreateSession( pPool, session );
+        while ( err ) {
+            ret = EvictSession( pPool );
+            FailOnTo( !ret, error, "Failed to create session\n" );
 
-    for ( int i = 0; i < kNumIbs; ++i ) {
-        mIbs[i] = new VcetIb( this );
-        FailOnTo( !mIbs[i], error, "Failed to create ib\n" );
+            err = CreateSession( pPool, session );
+        }
 
-        ret = mIbs[i]->Init();
-        FailOnTo( !ret, error, "Failed to init IB\n" );
+        std::lock_guard<std::mutex> lock( mSessionLock );
+        session->Acquire( ++mSessionClock );
+        mSessions[ key ] = session;
     }
 
-    return 0;
+    return session;
 
 error:
-    return -1;
+    delete session;
+    return nullptr;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-int VcetContext::CreateSession()
+VcetSession *VcetContext::PinSession( const SessionKey &key )
+{
+    std::lock_guard<std::mutex> lock( mSessionLock );
+    auto it = mSessions.find( key );
+
+    if ( it == mSessions.end() )
+        return nullptr;
+
+    it->second->Acquire( ++mSessionClock );
+    return it->second;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::ReleaseSessions( VcetSession **sessions, VcetIb **ibs, uint32_t count )
+{
+    // Record the submission before unpinning, eviction reads it once the
+    // session is idle
+    for ( uint32_t i = 0; i < count; ++i ) {
+        if ( ibs )
+            sessions[i]->OnSubmit( ibs[i]->GetRing(), ibs[i]->GetSeqNo() );
+
+        sessions[i]->Release();
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContext::EvictSession( IbPool *pPool )
+{
+    int err;
+    VcetSession *victim = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock( mSessionLock );
+        auto it = mSessions.end();
+
+        for ( auto candidate = mSessions.begin(); candidate != mSessions.end(); ++candidate ) {
+            if ( candidate->second->IsInUse() )
+                continue;
+
+            if ( it == mSessions.end() || candidate->second->GetLastUse() < it->second->GetLastUse() )
+                it = candidate;
+        }
+
+        FailOnTo( it == mSessions.end(), error, "All sessions are in use\n" );
+
+        // Out of the map it can't be pinned again
+        victim = it->second;
+        mSessions.erase( it );
+        mSessionEvictions++;
+    }
+
+    err = DestroySession( pPool, victim );
+
+    {
+        std::lock_guard<std::mutex> lock( mSessionLock );
+        mRetiredSessions.push_back( victim );
+    }
+
+    FailOnTo( err, error, "Failed to destroy session\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::FreeRetiredSessions()
+{
+    std::vector<VcetSession*> retired;
+    std::vector<VcetSession*> busy;
+
+    {
+        std::lock_guard<std::mutex> lock( mSessionLock );
+        retired.swap( mRetiredSessions );
+    }
+
+    for ( VcetSession *session : retired ) {
+        if ( session->IsIdle() )
+            delete session;
+        else
+            busy.push_back( session );
+    }
+
+    if ( busy.empty() )
+        return;
+
+    std::lock_guard<std::mutex> lock( mSessionLock );
+    mRetiredSessions.insert( mRetiredSessions.end(), busy.begin(), busy.end() );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int VcetContext::CreateSession( IbPool *pPool, VcetSession *pSession )
 {
     bool ret;
     VcetIb *ib = nullptr;
 
-    ib = GetNextIb();
+    ib = GetNextIb( pPool );
     FailOnTo( !ib, error, "Invalid ib\n" );
 
-    ret = ib->WriteCreateSession( mAlignedWidth, mAlignedHeight );
+    ret = ib->WriteCreateSession( pSession );
     FailOnTo( !ret, error, "Failed to prepare create session ib\n" );
 
-    ret = Submit( ib );
+    ret = Submit( pPool, ib );
     FailOnTo( !ret, error, "Failed to submit create session ib\n" );
 
-    mSessionCreated = true;
+    pSession->SetCreated( true );
+
+    // Rings execute independently, jobs on another ring must not overtake us
+    if ( mRings.size() > 1 ) {
+        ret = ib->WaitFromCompletion();
+        FailOnTo( !ret, error, "Failed to wait for create session ib\n" );
+    }
 
     return 0;
 
@@ -244,23 +513,32 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-int VcetContext::DestroySession()
+int VcetContext::DestroySession( IbPool *pPool, VcetSession *pSession )
 {
     bool ret;
     VcetIb *ib = nullptr;
 
-    if ( !mSessionCreated )
+    if ( !pSession->IsCreated() )
         return 0;
 
-    ib = GetNextIb();
+    if ( mRings.size() > 1 ) {
+        ret = pSession->WaitIdle();
+        FailOnTo( !ret, error, "Failed to wait for in-flight jobs\n" );
+    }
+
+    ib = GetNextIb( pPool );
     FailOnTo( !ib, error, "Invalid ib\n" );
 
-    ret = ib->WriteoDestroySession();
+    ret = ib->WriteoDestroySession( pSession );
     FailOnTo( !ret, error, "Failed to prepare destroy session ib\n" );
 
-    ret = Submit( ib );
+    ret = Submit( pPool, ib );
     FailOnTo( !ret, error, "Failed to submit destroy session ib\n" );
 
+    // The session's bos must outlive the destroy
+    pSession->OnSubmit( ib->GetRing(), ib->GetSeqNo() );
+    pSession->SetCreated( false );
+
     return 0;
 
 error:
@@ -269,65 +547,180 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-uint64_t VcetContext::GetFbSize()
+uint32_t VcetContext::GetIpType()
 {
-    // TODO: might need per-family values
-    return 4096;
+    return AMDGPU_HW_IP_VCE;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-uint64_t VcetContext::GetBsSize()
+uint32_t VcetContext::GetFamilyId()
 {
-    // TODO: need per-family values
-    return 0x154000;
+    return mDrm.GetGpuInfo()->family_id;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-uint64_t VcetContext::GetCpbSize()
+bool VcetContext::TrackCompletion( VcetJob *pJob, void *pCookie )
 {
-    return mAlignedWidth * mAlignedHeight * VcetBo::kNv21Bpp * kNumCpbBuffers;
+    if ( !mReactor.IsRunning() )
+        return true;
+
+    if ( !mReactor.Track( pJob, pCookie ) )
+        return false;
+
+    pJob->SetTracked();
+
+    return true;
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-uint32_t VcetContext::GetIpType()
+void VcetContext::OnBoDestroy( amdgpu_bo_handle bo )
 {
-    return AMDGPU_HW_IP_VCE;
+    // Queued requests may still reference bo
+    mSubmitter->Flush();
+
+    std::lock_guard<std::mutex> lock( mIbPoolLock );
+    for ( IbPool *pool : mIbPools ) {
+        pool->mBoListCache.Invalidate( bo );
+    }
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-uint32_t VcetContext::GetFamilyId()
+bool VcetContext::CalculateMv( VcetBo *oldFrame, VcetBo *newFrame, VcetBo *mvBo, uint32_t width, uint32_t height, VcetJob *pJob )
 {
-    return mDrm.GetGpuInfo()->family_id;
+    MvRequest request = { oldFrame, newFrame, mvBo, width, height, pJob };
+
+    return CalculateMvBatch( &request, 1 );
 }
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetContext::CalculateMv( VcetBo *oldFrame, VcetBo *newFrame, VcetBo *mvBo, uint32_t width, uint32_t height, VcetJob *pJob )
+bool VcetContext::ValidateMvRequest( const MvRequest *request )
+{
+    uint64_t frameSize, mvSize;
+
+    FailOnTo( !request->mOldFrame || !request->mNewFrame || !request->mMvBo, error, "Bad bo\n" );
+    FailOnTo( !request->mWidth || !request->mHeight, error, "Invalid frame dimensions\n" );
+
+    frameSize = VcetBo::GetFrameSizeBytes( this, request->mWidth, request->mHeight );
+    FailOnTo( request->mOldFrame->GetSizeBytes() < frameSize ||
+              request->mNewFrame->GetSizeBytes() < frameSize,
+              error, "Frame bo too small for the aligned frame dimensions\n" );
+
+    mvSize = VcetBo::GetMvSizeBytes( this, request->mWidth, request->mHeight );
+    FailOnTo( request->mMvBo->GetSizeBytes() < mvSize, error, "Mv bo too small for the frame dimensions\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContext::CalculateMvBatch( const MvRequest *requests, uint32_t count, uint32_t *pNumSubmitted )
 {
     bool ret;
-    VcetIb *ib = nullptr;
+    VcetIb *ibs[ kMaxIbsPerSubmit ];
+    VcetSession *sessions[ kMaxIbsPerSubmit ];
+    uint32_t numSessions = 0;
+    uint32_t numSubmitted = 0;
+    IbPool *pool = GetIbPool();
+
+    FailOnTo( !requests || !count, error, "Bad batch\n" );
+
+    // So that the jobs we fail to submit can be told apart
+    for ( uint32_t i = 0; i < count; ++i ) {
+        if ( requests[i].mJob )
+            requests[i].mJob->SetSeqNo( 0 );
+    }
 
-    FailOnTo( !oldFrame || !newFrame || !mvBo, error, "Bad bo\n" );
-    FailOnTo( width != mWidth || height != mHeight, error, "Invalid frame dimensions\n" );
+    FailOnTo( !pool, error, "Failed to get ib pool\n" );
 
-    ib = GetNextIb();
-    FailOnTo( !ib, error, "Invalid ib\n" );
+    // Nothing is submitted unless the whole batch is valid
+    for ( uint32_t i = 0; i < count; ++i ) {
+        ret = ValidateMvRequest( &requests[i] );
+        FailOnTo( !ret, error, "Bad request %u in batch\n", i );
+    }
 
-    ret = ib->WriteCalculateMv( oldFrame, newFrame, mvBo, width, height );
-    FailOnTo( !ret, error, "Failed to prepare mv dump ib\n" );
+    for ( uint32_t first = 0; first < count; first += kMaxIbsPerSubmit ) {
+        uint32_t numIbs = std::min( count - first, kMaxIbsPerSubmit );
 
-    ret = Submit( ib );
-    FailOnTo( !ret, error, "Failed to submit ib\n" );
+        // Session creation and eviction use IBs too, so resolve the sessions
+        // before claiming this submission's IBs
+        for ( uint32_t i = 0; i < numIbs; ++i ) {
+            const MvRequest *request = &requests[ first + i ];
 
-    if ( pJob )
-    {
-        pJob->SetSeqNo( ib->GetSeqNo() );
+            sessions[i] = AcquireSession( pool, request->mWidth, request->mHeight );
+            FailOnTo( !sessions[i], error, "Failed to get session\n" );
+            numSessions = i + 1;
+        }
+
+        for ( uint32_t i = 0; i < numIbs; ++i ) {
+            const MvRequest *request = &requests[ first + i ];
+
+            ibs[i] = GetNextIb( pool );
+            FailOnTo( !ibs[i], error, "Invalid ib\n" );
+
+            ret = ibs[i]->WriteCalculateMv( sessions[i], request->mOldFrame, request->mNewFrame, request->mMvBo,
+                                            request->mWidth, request->mHeight );
+            FailOnTo( !ret, error, "Failed to prepare mv dump ib\n" );
+        }
+
+        // A failed submission may have sent some of the IBs, those have a seq_no
+        ret = Submit( pool, ibs, numIbs );
+
+        ReleaseSessions( sessions, ibs, numIbs );
+        numSessions = 0;
+
+        for ( uint32_t i = 0; i < numIbs; ++i ) {
+            VcetJob *pJob = requests[ first + i ].mJob;
+
+            if ( !ibs[i]->GetSeqNo() )
+                continue;
+
+            numSubmitted = first + i + 1;
+
+            if ( pJob )
+            {
+                pJob->SetRing( ibs[i]->GetRing() );
+                pJob->SetSeqNo( ibs[i]->GetSeqNo() );
+            }
+        }
+
+        FailOnTo( !ret, error, "Failed to submit ib\n" );
+    }
+
+    if ( pNumSubmitted )
+        *pNumSubmitted = numSubmitted;
+
+    return true;
+
+error:
+    ReleaseSessions( sessions, nullptr, numSessions );
+
+    if ( pNumSubmitted )
+        *pNumSubmitted = numSubmitted;
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContext::SetIbRingPolicy( IbRingPolicy policy, uint32_t maxIbs )
+{
+    std::lock_guard<std::mutex> lock( mIbPoolLock );
+
+    for ( IbPool *pool : mIbPools ) {
+        FailOnTo( maxIbs < pool->mIbs.size(), error, "IB ring limit smaller than the current ring\n" );
     }
 
+    mIbRingPolicy = policy;
+    mMaxIbs = maxIbs;
+
     return true;
 
 error:
@@ -336,15 +729,280 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-VcetIb *VcetContext::GetNextIb()
+void VcetContext::QueryRings()
+{
+    int err;
+    struct drm_amdgpu_info_hw_ip info = {};
+
+    mRings.clear();
+
+    err = mDrm.QueryHwIpInfo( GetIpType(), 0, &info );
+    WarnOn( err, "Failed to query VCE rings, using ring 0 only\n" );
+
+    for ( uint32_t ring = 0; !err && ring < kMaxRings; ++ring ) {
+        if ( info.available_rings & ( 1u << ring ) )
+            mRings.push_back( ring );
+    }
+
+    if ( mRings.empty() )
+        mRings.push_back( 0 );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+std::shared_ptr<VcetBo> VcetContext::ImportBo( int fd, bool mappable )
+{
+    int err;
+    bool ret;
+    struct stat st;
+    ImportKey key;
+    std::shared_ptr<VcetBo> bo;
+    std::shared_ptr<VcetBo> evicted;
+
+    err = fstat( fd, &st );
+    FailOnTo( err, error, "Failed to stat fd %d\n", fd );
+
+    key = ImportKey( st.st_dev, st.st_ino, mappable );
+
+    {
+        std::lock_guard<std::mutex> lock( mImportLock );
+
+        for ( auto it = mImports.begin(); it != mImports.end(); ++it ) {
+            if ( it->first != key )
+                continue;
+
+            mImports.splice( mImports.begin(), mImports, it );
+            mImportCacheHits++;
+            return it->second;
+        }
+    }
+
+    bo = std::make_shared<VcetBo>( this );
+    ret = bo->Import( fd, mappable );
+    FailOnTo( !ret, error, "Failed to import fd %d\n", fd );
+
+    {
+        std::lock_guard<std::mutex> lock( mImportLock );
+
+        // A racing import of the same buffer adds a second entry, the older
+        // one ages out
+        mImports.emplace_front( key, bo );
+
+        // Released once the lock is dropped
+        if ( mImports.size() > kImportCacheSize ) {
+            evicted = std::move( mImports.back().second );
+            mImports.pop_back();
+        }
+    }
+
+    return bo;
+
+error:
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::FlushImportCache()
+{
+    std::list<ImportEntry> imports;
+
+    // Destroying the bos flushes the submitter, which may need the lock
+    {
+        std::lock_guard<std::mutex> lock( mImportLock );
+        imports.swap( mImports );
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetContext::GetImportCacheHits()
+{
+    std::lock_guard<std::mutex> lock( mImportLock );
+    return mImportCacheHits;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetContext::GetNumCachedImports()
+{
+    std::lock_guard<std::mutex> lock( mImportLock );
+    return mImports.size();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::GetSubmittedSeqNos( uint64_t *pSeqNos )
+{
+    for ( uint32_t ring = 0; ring < kMaxRings; ++ring ) {
+        pSeqNos[ ring ] = mRingStates[ ring ].mLastSeqNo.load( std::memory_order_acquire );
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetContext::PickRing( uint32_t *pPicked )
+{
+    uint32_t best = mRings[0];
+    uint64_t bestOutstanding = UINT64_MAX;
+
+    if ( mRings.size() > 1 ) {
+        switch ( mRingBalancePolicy.load( std::memory_order_relaxed ) ) {
+        case RingBalancePolicy::RoundRobin:
+            best = mRings[ ( mNextRing.fetch_add( 1, std::memory_order_relaxed ) + 1 ) % mRings.size() ];
+            break;
+        case RingBalancePolicy::LeastOutstanding:
+            // Estimated from retirements we have observed, no fence queries
+            for ( uint32_t ring : mRings ) {
+                const RingState &state = mRingStates[ ring ];
+                uint64_t signaled = mSignaledSeqNo[ ring ].load( std::memory_order_relaxed );
+                uint64_t last = state.mLastSeqNo.load( std::memory_order_relaxed );
+                uint64_t outstanding = last - std::min( signaled, last ) + pPicked[ ring ];
+
+                if ( outstanding < bestOutstanding ) {
+                    bestOutstanding = outstanding;
+                    best = ring;
+                }
+            }
+            break;
+        }
+    }
+
+    pPicked[ best ]++;
+
+    return best;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::SetWaitPolicy( WaitPolicy policy, uint64_t spinNs )
+{
+    mWaitPolicy = policy;
+    mSpinNs = spinNs ? spinNs : kDefaultSpinNs;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::GetWaitBudget( uint64_t elapsedNs, uint64_t *pSleepNs, uint64_t *pSpinNs )
+{
+    uint64_t avg, slack, remaining, window;
+    uint64_t spinNs = mSpinNs.load( std::memory_order_relaxed );
+
+    *pSleepNs = 0;
+    *pSpinNs = 0;
+
+    switch ( mWaitPolicy.load( std::memory_order_relaxed ) ) {
+    case WaitPolicy::Block:
+        break;
+    case WaitPolicy::Spin:
+        *pSpinNs = spinNs;
+        break;
+    case WaitPolicy::Adaptive:
+        // Block until we have seen a job complete
+        avg = mAvgJobNs.load( std::memory_order_relaxed );
+        if ( !avg )
+            break;
+
+        // Poll a little past the expected completion to absorb variance,
+        // with the polling window ending at expected + slack
+        slack = avg / 8 > kMinAdaptiveSlackNs ? avg / 8 : kMinAdaptiveSlackNs;
+        remaining = ( avg > elapsedNs ? avg - elapsedNs : 0 ) + slack;
+        window = std::min( remaining, spinNs );
+
+        *pSleepNs = remaining - window;
+        *pSpinNs = window;
+        break;
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::OnJobDuration( uint64_t durationNs )
+{
+    uint64_t avg = mAvgJobNs.load( std::memory_order_relaxed );
+
+    // Exponential moving average with a weight of 1/8 for the new sample.
+    // Outliers are clamped, overestimating makes us sleep past completion.
+    // Concurrent updates may drop a sample, which is harmless for an estimate
+    if ( !avg )
+        avg = durationNs;
+    else
+        avg = avg - avg / 8 + std::min( durationNs, 2 * avg ) / 8;
+
+    mAvgJobNs.store( avg, std::memory_order_relaxed );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::OnFenceSignaled( uint32_t ring, uint64_t seqNo )
+{
+    util::AtomicMax( &mSignaledSeqNo[ ring ], seqNo );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetIb *VcetContext::CreateIb()
+{
+    bool ret;
+    VcetIb *ib = nullptr;
+
+    ib = new VcetIb( this );
+    FailOnTo( !ib, error, "Failed to create ib\n" );
+
+    ret = ib->Init();
+    FailOnTo( !ret, error, "Failed to init IB\n" );
+
+    return ib;
+
+error:
+    delete ib;
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetIb *VcetContext::GetNextIb( IbPool *pPool )
 {
     bool ret;
     VcetIb *ib;
+    uint32_t idx;
+
+    FailOnTo( pPool->mIbs.empty(), error, "No IBs allocated\n" );
 
-    mIbIdx = ( mIbIdx + 1 ) % kNumIbs;
-    ib = mIbs[ mIbIdx ];
+    // The next IB in the ring is always the oldest submission
+    idx = ( pPool->mIbIdx + 1 ) % pPool->mIbs.size();
+    ib = pPool->mIbs[ idx ];
     FailOnTo( !ib, error, "Invalid ib\n" );
 
+    if ( !ib->IsIdle() ) {
+        switch ( mIbRingPolicy.load( std::memory_order_relaxed ) ) {
+        case IbRingPolicy::Grow:
+            if ( pPool->mIbs.size() < mMaxIbs.load( std::memory_order_relaxed ) ) {
+                // Insert ahead of the busy IB so it stays the oldest entry
+                ib = CreateIb();
+                FailOnTo( !ib, error, "Failed to grow IB ring\n" );
+
+                // Readers of other threads' pools take the lock
+                std::lock_guard<std::mutex> lock( mIbPoolLock );
+                pPool->mIbs.insert( pPool->mIbs.begin() + idx, ib );
+                break;
+            }
+            // Ring is at its limit, fall back to waiting
+            // fall through
+        case IbRingPolicy::Wait:
+            mIbRingWaits++;
+            ret = ib->WaitFromCompletion();
+            FailOnTo( !ret, error, "Failed to wait for in-flight ib\n" );
+            break;
+        case IbRingPolicy::Fail:
+            FailOnTo( true, error, "All IBs are in flight\n" );
+        }
+    }
+
+    pPool->mIbIdx = idx;
+
+    OnFenceSignaled( ib->GetRing(), ib->GetSeqNo() );
+
     ret = ib->Reset();
     FailOnTo( !ret, error, "Failed to reset ib\n" );
 
@@ -356,46 +1014,235 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetContext::Submit( VcetIb *ib )
+bool VcetContext::Submit( IbPool *pPool, VcetIb *ib )
 {
-    int err;
-    struct amdgpu_cs_request ibsRequest = {0};
-    struct amdgpu_cs_ib_info ibInfo = {0};
-    amdgpu_bo_list_handle boList = nullptr;
+    return Submit( pPool, &ib, 1 );
+}
 
-    ibInfo.ib_mc_address = ib->GetGpuAddress();
-    ibInfo.size = ib->GetSizeDw();
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContext::Submit( IbPool *pPool, VcetIb **ibs, uint32_t count )
+{
+    int err;
+    bool ret;
+    uint32_t numRequests = ( count + kMaxIbsPerRequest - 1 ) / kMaxIbsPerRequest;
+    struct amdgpu_cs_request ibsRequests[ kMaxIbsPerSubmit ] = {};
+    struct amdgpu_cs_ib_info ibInfos[ kMaxIbsPerSubmit ] = {};
+    uint32_t picked[ kMaxRings ] = {};
+
+    FailOnTo( !count || count > kMaxIbsPerSubmit, error, "Invalid ib count %u\n", count );
+
+    // Pack up to kMaxIbsPerRequest IBs in each request, libdrm issues one
+    // ioctl per request
+    for ( uint32_t i = 0; i < numRequests; ++i ) {
+        uint32_t first = i * kMaxIbsPerRequest;
+        uint32_t last = std::min( first + kMaxIbsPerRequest, count );
+        struct amdgpu_cs_request *ibsRequest = &ibsRequests[i];
+
+        pPool->mSubmitResources.clear();
+        for ( uint32_t j = first; j < last; ++j ) {
+            ibInfos[j].ib_mc_address = ibs[j]->GetGpuAddress();
+            ibInfos[j].size = ibs[j]->GetSizeDw();
+
+            pPool->mSubmitResources.insert( pPool->mSubmitResources.end(),
+                                            ibs[j]->GetResources(),
+                                            ibs[j]->GetResources() + ibs[j]->GetNumResources() );
+        }
+
+        ret = pPool->mBoListCache.Get( pPool->mSubmitResources.data(), pPool->mSubmitResources.size(),
+                                       &ibsRequest->resources );
+        FailOnTo( !ret, error, "Failed to get bo list\n" );
+
+        ibsRequest->ip_type = GetIpType();
+        ibsRequest->ring = PickRing( picked );
+        ibsRequest->number_of_ibs = last - first;
+        ibsRequest->ibs = &ibInfos[first];
+        ibsRequest->fence_info.handle = nullptr;
+    }
 
-    err = mDrm.BoListCreate( ib->GetNumResources(),
-                             ib->GetResources(), nullptr,
-                             &boList );
-    FailOnTo( err, error, "Failed to create bo list\n" );
+    err = mDrm.CsSubmit( 0, ibsRequests, numRequests );
 
-    ibsRequest.ip_type = GetIpType();
-    ibsRequest.number_of_ibs = 1;
-    ibsRequest.ibs = &ibInfo;
-    ibsRequest.fence_info.handle = nullptr;
-    ibsRequest.resources = boList;
+    // libdrm stops at the first request that fails, the ones before it are
+    // on the GPU and their IBs must not be reused until they retire
+    for ( uint32_t i = 0; i < numRequests && ibsRequests[i].seq_no; ++i ) {
+        RingState *state = &mRingStates[ ibsRequests[i].ring ];
 
-    err = mDrm.CsSubmit( 0, &ibsRequest, 1);
-    FailOnTo( err, error, "Failed to submit ib\n" );
+        // Another thread may have submitted to the ring in the meantime
+        util::AtomicMax( &state->mLastSeqNo, ibsRequests[i].seq_no );
+        state->mSubmissions.fetch_add( 1, std::memory_order_relaxed );
+    }
 
-    ib->SetSeqNo( ibsRequest.seq_no );
+    for ( uint32_t i = 0; i < count; ++i ) {
+        ibs[i]->SetSeqNo( ibsRequests[ i / kMaxIbsPerRequest ].seq_no );
+        ibs[i]->SetRing( ibsRequests[ i / kMaxIbsPerRequest ].ring );
+    }
 
-    err = mDrm.BoListDestroy( ibsRequest.resources );
-    boList = nullptr;
-    WarnOn( err,  "Failed to destroy bo list\n" );
+    FailOnTo( err, error, "Failed to submit ib\n" );
 
     if ( kForceSubmitSync ) {
-        bool ret = ib->WaitFromCompletion();
+        ret = ibs[ count - 1 ]->WaitFromCompletion();
         FailOnTo( !ret, error, "Failed to wait for ib completion\n" );
     }
 
     return true;
 
 error:
-    if ( boList )
-        mDrm.BoListDestroy( boList );
-
     return false;
 }
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetContext::IbPool *VcetContext::GetIbPool()
+{
+    IbPoolCacheEntry *entry = &sIbPoolCache[ mId % kIbPoolCacheSize ];
+    std::thread::id self = std::this_thread::get_id();
+    IbPool *adopted = nullptr;
+
+    if ( entry->mContextId == mId )
+        return entry->mPool;
+
+    {
+        std::lock_guard<std::mutex> lock( mIbPoolLock );
+
+        for ( IbPool *pool : mIbPools ) {
+            if ( pool->mOwner == self ) {
+                entry->mContextId = mId;
+                entry->mPool = pool;
+                return pool;
+            }
+
+            if ( !adopted && pool->mOwner == std::thread::id() )
+                adopted = pool;
+        }
+
+        // Left behind by a thread that exited
+        if ( adopted )
+            adopted->mOwner = self;
+    }
+
+    // First submission from this thread
+    entry->mPool = adopted ? adopted : CreateIbPool();
+    entry->mContextId = entry->mPool ? mId : 0;
+
+    if ( entry->mPool ) {
+        std::vector<uint64_t> &ids = sIbPoolOwner.mContextIds;
+        std::lock_guard<std::mutex> lock( sContextLock );
+
+        // Forget the contexts destroyed since, ids are never reused
+        ids.erase( std::remove_if( ids.begin(), ids.end(),
+                                   []( uint64_t id ) { return !sContexts.count( id ); } ),
+                   ids.end() );
+        ids.push_back( mId );
+    }
+
+    return entry->mPool;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::ReleaseIbPool()
+{
+    std::thread::id self = std::this_thread::get_id();
+    std::lock_guard<std::mutex> lock( mIbPoolLock );
+
+    for ( IbPool *pool : mIbPools ) {
+        if ( pool->mOwner == self )
+            pool->mOwner = std::thread::id();
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetContext::IbPool *VcetContext::CreateIbPool()
+{
+    IbPool *pool = new IbPool( this );
+
+    for ( uint32_t i = 0; i < kNumIbs; ++i ) {
+        VcetIb *ib = CreateIb();
+        FailOnTo( !ib, error, "Failed to create ib\n" );
+
+        pool->mIbs.push_back( ib );
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( mIbPoolLock );
+        mIbPools.push_back( pool );
+    }
+
+    return pool;
+
+error:
+    DestroyIbPool( pool );
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContext::DestroyIbPool( IbPool *pPool )
+{
+    for ( VcetIb *ib : pPool->mIbs ) {
+        delete ib;
+    }
+
+    pPool->mBoListCache.Flush();
+
+    delete pPool;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetContext::GetIbRingSize()
+{
+    uint32_t size = 0;
+    std::lock_guard<std::mutex> lock( mIbPoolLock );
+
+    for ( IbPool *pool : mIbPools ) {
+        size += pool->mIbs.size();
+    }
+
+    return size;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetContext::GetBoListCacheHits()
+{
+    uint64_t hits = 0;
+    std::lock_guard<std::mutex> lock( mIbPoolLock );
+
+    for ( IbPool *pool : mIbPools ) {
+        hits += pool->mBoListCache.GetHits();
+    }
+
+    return hits;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetContext::GetBoListCacheMisses()
+{
+    uint64_t misses = 0;
+    std::lock_guard<std::mutex> lock( mIbPoolLock );
+
+    for ( IbPool *pool : mIbPools ) {
+        misses += pool->mBoListCache.GetMisses();
+    }
+
+    return misses;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetContext::GetNumSessions()
+{
+    std::lock_guard<std::mutex> lock( mSessionLock );
+    return mSessions.size();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetContext::GetSessionEvictions()
+{
+    std::lock_guard<std::mutex> lock( mSessionLock );
+    return mSessionEvictions;
+}
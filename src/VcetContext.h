@@ -27,67 +27,389 @@
 
 #pragma once
 
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
 #include "Drm.h"
+#include "VcetBoListCache.h"
+#include "VcetReactor.h"
+#include "VcetVaArena.h"
 
 class VcetIb;
 class VcetBo;
 class VcetJob;
+class VcetSession;
+class VcetSlabAllocator;
+class VcetSubmitter;
 
+/**
+ * The resources to submit work to VCE, and the sessions it runs in
+ *
+ * Submissions may be made from several threads at once. Each thread builds
+ * its IBs from its own pool, so submitting threads only share atomics, the
+ * session lookup and the kernel's submission path.
+ *
+ * Each aligned frame size gets its own session, created on first use. Least
+ * recently used sessions are destroyed when the engine runs out of handles.
+ */
 class VcetContext
 {
     private:
-        static constexpr int kNumCpbBuffers = 10;
-        static constexpr int kNumIbs = 8;
+        static constexpr uint32_t kNumIbs = 8;
+        static constexpr uint32_t kDefaultMaxIbs = 64;
+        static constexpr uint32_t kMaxIbsPerRequest = AMDGPU_CS_MAX_IBS_PER_SUBMIT;
+        static constexpr uint32_t kMaxIbsPerSubmit = kNumIbs;
         static constexpr bool kForceSubmitSync = false;
+        static constexpr uint64_t kMinAdaptiveSlackNs = 20 * 1000;
+        static constexpr uint32_t kIbPoolCacheSize = 4;
+        static constexpr uint32_t kImportCacheSize = 16;
+
+        // The kernel's VCE handle limit, AMDGPU_MAX_VCE_HANDLES, shared by
+        // every process using the device
+        static constexpr uint32_t kMaxSessions = 16;
+
+    public:
+        // Upper bound on the VCE rings a context spreads its jobs over
+        static constexpr uint32_t kMaxRings = 4;
+
+        // Polling budget of the spinning wait policies when none is given
+        static constexpr uint64_t kDefaultSpinNs = 200 * 1000;
+
+        enum class IbRingPolicy {
+            Wait,   // Block until the oldest IB retires
+            Grow,   // Allocate a new IB, up to the ring limit, then wait
+            Fail,   // Fail the submission
+        };
+
+        enum class RingBalancePolicy {
+            LeastOutstanding,   // The ring with the fewest of our IBs in flight
+            RoundRobin,         // Rotate through the rings
+        };
+
+        enum class WaitPolicy {
+            Block,      // Sleep in the kernel until the fence signals
+            Spin,       // Poll for a fixed budget, then block
+            Adaptive,   // Sleep until the job is expected to finish, then poll
+        };
+
+        struct MvRequest {
+            VcetBo *mOldFrame;
+            VcetBo *mNewFrame;
+            VcetBo *mMvBo;
+            uint32_t mWidth;
+            uint32_t mHeight;
+            VcetJob *mJob;
+        };
 
     public:
         VcetContext( );
         ~VcetContext();
 
-        bool Init( uint32_t width, uint32_t height );
+        /**
+         * busId selects the device, nullptr picks the first amdgpu device.
+         * priority is an AMDGPU_CTX_PRIORITY_* for the context's jobs.
+         *
+         * A session for width x height is created up front, other frame
+         * sizes get theirs on first use.
+         */
+        bool Init( uint32_t width, uint32_t height, const char *busId = nullptr,
+                   int32_t priority = AMDGPU_CTX_PRIORITY_NORMAL );
 
-        bool MinimalInit();
+        bool MinimalInit( const char *busId = nullptr );
         bool IsMvDumpSupported();
+        bool QueryVceFwVersion( uint32_t *pVersion );
+
+        /**
+         * Number of initialized contexts in this process that use the device
+         */
+        static uint32_t GetDeviceLoad( const std::string &busId );
 
         bool CalculateMv( VcetBo *oldFrame, VcetBo *newFrame, VcetBo *mvBo, uint32_t width, uint32_t height, VcetJob *pJob );
 
+        /**
+         * Check that the hardware can run request
+         */
+        bool ValidateMvRequest( const MvRequest *request );
+
+        /**
+         * Calculate the motion vectors for several frame pairs
+         *
+         * IBs are packed into as few submissions as possible, so that N
+         * requests cost roughly N / kMaxIbsPerRequest kernel round trips.
+         *
+         * Nothing is submitted if a request is invalid. On a later failure,
+         * the jobs of the requests that were submitted have a seq_no, the
+         * others have none. Those are always the leading requests, their
+         * number is returned in pNumSubmitted if not nullptr.
+         */
+        bool CalculateMvBatch( const MvRequest *requests, uint32_t count, uint32_t *pNumSubmitted = nullptr );
+
+        /**
+         * Select how IB allocation behaves when the next IB is still in flight
+         *
+         * maxIbs bounds the ring size of each thread for IbRingPolicy::Grow
+         */
+        bool SetIbRingPolicy( IbRingPolicy policy, uint32_t maxIbs );
+
+        /**
+         * Select how submissions are spread over the VCE rings
+         */
+        void SetRingBalancePolicy( RingBalancePolicy policy ) { mRingBalancePolicy.store( policy, std::memory_order_relaxed ); }
+
+        /**
+         * Select how waits for job completion behave
+         *
+         * spinNs is the polling budget for WaitPolicy::Spin, and the longest
+         * polling window for WaitPolicy::Adaptive. 0 selects kDefaultSpinNs.
+         */
+        void SetWaitPolicy( WaitPolicy policy, uint64_t spinNs );
+
+        /**
+         * Split a wait on a job submitted elapsedNs ago into a kernel sleep,
+         * followed by a polling window, followed by a blocking wait
+         */
+        void GetWaitBudget( uint64_t elapsedNs, uint64_t *pSleepNs, uint64_t *pSpinNs );
+
+        /**
+         * Feed the time from submission to observed completion of a job
+         *
+         * Safe to call from any thread
+         */
+        void OnJobDuration( uint64_t durationNs );
+
         uint32_t GetIpType();
         uint32_t GetFamilyId();
-        uint32_t GetSessionId() { return mSesionId; }
-
-        VcetBo *GetFb() { return mBoFb; }
-        VcetBo *GetBs() { return mBoBs; }
-        VcetBo *GetCpb() { return mBoCpb; }
 
         Drm *GetDrm() { return &mDrm; }
+        VcetVaArena *GetVaArena() { return &mVaArena; }
+        uint64_t GetIbRingWaits() { return mIbRingWaits.load( std::memory_order_relaxed ); }
+        uint32_t GetNumRings() { return mRings.size(); }
+        uint32_t GetRing( uint32_t idx ) { return mRings[ idx ]; }
+        uint64_t GetRingSubmissions( uint32_t ring ) { return mRingStates[ ring ].mSubmissions.load( std::memory_order_relaxed ); }
+
+        /**
+         * Totals over the IB pools of every thread
+         */
+        uint32_t GetIbRingSize();
+        uint64_t GetBoListCacheHits();
+        uint64_t GetBoListCacheMisses();
+
+        uint32_t GetNumSessions();
+        uint64_t GetSessionEvictions();
+
+        /**
+         * Import the dma-buf behind fd
+         *
+         * Buffers imported before share their bo, looked up by the inode of
+         * the dma-buf. The kImportCacheSize most recently imported buffers are
+         * kept imported, so that a producer cycling through a few buffers
+         * gets each imported once.
+         */
+        std::shared_ptr<VcetBo> ImportBo( int fd, bool mappable );
+
+        /**
+         * Drop the imports kept by the cache
+         *
+         * Bos still referenced elsewhere stay alive until released
+         */
+        void FlushImportCache();
+
+        uint64_t GetImportCacheHits();
+        uint32_t GetNumCachedImports();
+
+        VcetReactor *GetReactor() { return &mReactor; }
+        VcetSubmitter *GetSubmitter() { return mSubmitter.get(); }
+        VcetSlabAllocator *GetSlabAllocator() { return mSlabAllocator.get(); }
+
+        /**
+         * Hand a submitted job to the completion reactor, if it is running
+         *
+         * pCookie is passed back to the reactor callback on completion
+         */
+        bool TrackCompletion( VcetJob *pJob, void *pCookie );
+
+        /**
+         * Notify the context that bo is about to be destroyed
+         */
+        void OnBoDestroy( amdgpu_bo_handle bo );
+
+        /**
+         * Notify the context that a fence on ring has signaled
+         *
+         * Safe to call from any thread
+         */
+        void OnFenceSignaled( uint32_t ring, uint64_t seqNo );
+
+        /**
+         * The latest seq_no submitted on each of the kMaxRings rings
+         *
+         * Safe to call from any thread
+         */
+        void GetSubmittedSeqNos( uint64_t *pSeqNos );
+
+        /**
+         * Returns true if the fence is known to have signaled
+         *
+         * This is a plain memory load, false means the fence must be queried
+         */
+        bool IsFenceSignaled( uint32_t ring, uint64_t seqNo )
+        {
+            return seqNo <= mSignaledSeqNo[ ring ].load( std::memory_order_acquire );
+        }
 
     private:
-        int AllocateResources();
-        bool AllocateResource( VcetBo*& bo, uint64_t size, bool mappable );
-        int CreateSession();
-        int DestroySession();
+        struct RingState {
+            std::atomic<uint64_t> mLastSeqNo;       // Latest submission on the ring
+            std::atomic<uint64_t> mSubmissions;
+        };
+
+        /**
+         * The IBs and submission state of one thread
+         */
+        struct IbPool {
+            IbPool( VcetContext *pContext );
+
+            std::thread::id mOwner;     // Default constructed while unowned
+            uint32_t mIbIdx;
+            std::vector<VcetIb*> mIbs;
+            VcetBoListCache mBoListCache;
+            std::vector<amdgpu_bo_handle> mSubmitResources;
+        };
+
+        struct IbPoolCacheEntry {
+            uint64_t mContextId;
+            IbPool *mPool;
+        };
+
+        /**
+         * Hands a thread's pools back to their contexts when the thread exits
+         */
+        struct IbPoolOwner {
+            ~IbPoolOwner();
+
+            std::vector<uint64_t> mContextIds;
+        };
+
+        // Aligned width and height
+        typedef std::pair<uint32_t, uint32_t> SessionKey;
+
+        // Device and inode of the dma-buf, and the mappable flag
+        typedef std::tuple<uint64_t, uint64_t, bool> ImportKey;
+        typedef std::pair<ImportKey, std::shared_ptr<VcetBo>> ImportEntry;
+
+        /**
+         * The calling thread's pool, created on first use
+         *
+         * Pools left behind by exited threads are adopted before a new one
+         * is created.
+         */
+        IbPool *GetIbPool();
+        IbPool *CreateIbPool();
+        void DestroyIbPool( IbPool *pPool );
+
+        /**
+         * Give up the calling thread's pool, for another thread to adopt
+         */
+        void ReleaseIbPool();
+
+        void QueryRings();
+        uint32_t PickRing( uint32_t *pPicked );
 
-        uint64_t GetFbSize();
-        uint64_t GetBsSize();
-        uint64_t GetCpbSize();
+        /**
+         * Pin the session for frames of width x height, creating it if needed
+         *
+         * Submissions go through pPool. Pinned sessions are never evicted.
+         */
+        VcetSession *AcquireSession( IbPool *pPool, uint32_t width, uint32_t height );
 
-        VcetIb *GetNextIb();
-        bool Submit( VcetIb *ib );
+        /**
+         * Pin the existing session for key, nullptr if there is none
+         */
+        VcetSession *PinSession( const SessionKey &key );
+
+        /**
+         * Unpin sessions, recording the submission of ibs if not nullptr
+         */
+        void ReleaseSessions( VcetSession **sessions, VcetIb **ibs, uint32_t count );
+
+        /**
+         * Destroy the least recently used idle session on the engine
+         *
+         * The session is retired, its bos are freed by FreeRetiredSessions()
+         * once its last job completed. Requires mSessionCreateLock.
+         */
+        bool EvictSession( IbPool *pPool );
+
+        /**
+         * Free the retired sessions the engine is done with
+         */
+        void FreeRetiredSessions();
+
+        int CreateSession( IbPool *pPool, VcetSession *pSession );
+        int DestroySession( IbPool *pPool, VcetSession *pSession );
+
+        VcetIb *GetNextIb( IbPool *pPool );
+        VcetIb *CreateIb();
+        bool Submit( IbPool *pPool, VcetIb *ib );
+        bool Submit( IbPool *pPool, VcetIb **ibs, uint32_t count );
+
+        // Direct mapped by context id, ids are never reused so stale entries
+        // can't match
+        static thread_local IbPoolCacheEntry sIbPoolCache[ kIbPoolCacheSize ];
+
+        // Ids of the contexts the thread holds a pool in
+        static thread_local IbPoolOwner sIbPoolOwner;
 
         Drm mDrm;
 
-        uint32_t mSesionId;
-        uint32_t mWidth;
-        uint32_t mHeight;
-        uint32_t mAlignedWidth;
-        uint32_t mAlignedHeight;
+        uint64_t mId;
+
+        // Declared after mDrm, so that it is destroyed first
+        VcetVaArena mVaArena;
+
+        // Serializes session creation and eviction, lookups only take
+        // mSessionLock
+        std::mutex mSessionCreateLock;
+
+        std::mutex mSessionLock;
+        std::map<SessionKey, VcetSession*> mSessions;
+        std::vector<VcetSession*> mRetiredSessions;
+        uint64_t mSessionClock;
+        uint64_t mSessionEvictions;
+
+        std::mutex mImportLock;
+        std::list<ImportEntry> mImports;    // Most recently used first
+        uint64_t mImportCacheHits;
+
+        std::mutex mIbPoolLock;
+        std::vector<IbPool*> mIbPools;
+        std::atomic<IbRingPolicy> mIbRingPolicy;
+        std::atomic<uint32_t> mMaxIbs;
+        std::atomic<uint64_t> mIbRingWaits;
+
+        std::vector<uint32_t> mRings;
+        RingState mRingStates[ kMaxRings ];
+
+        // Latest seq_no known to be done on each ring, published by whichever
+        // thread observes the fence
+        std::atomic<uint64_t> mSignaledSeqNo[ kMaxRings ];
+        std::atomic<RingBalancePolicy> mRingBalancePolicy;
+        std::atomic<uint32_t> mNextRing;
 
-        VcetBo *mBoFb;
-        VcetBo *mBoBs;
-        VcetBo *mBoCpb;
+        std::atomic<WaitPolicy> mWaitPolicy;
+        std::atomic<uint64_t> mSpinNs;
+        std::atomic<uint64_t> mAvgJobNs;    // Moving average of job durations
 
-        uint32_t mIbIdx;
-        VcetIb *mIbs[ kNumIbs ];
+        VcetReactor mReactor;
+        std::unique_ptr<VcetSubmitter> mSubmitter;
+        std::unique_ptr<VcetSlabAllocator> mSlabAllocator;
 
-        bool mSessionCreated;
+        bool mDeviceLoadTracked;
 };
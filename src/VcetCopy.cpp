@@ -0,0 +1,277 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define VCET_COPY_X86 1
+#endif
+
+#include "VcetCopy.h"
+
+typedef void (*StreamFn)( uint8_t *pDst, const uint8_t *pSrc, size_t size );
+
+// Small enough for the bounce buffer to stay in L1
+static const size_t kReadChunkBytes = 4096;
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void StreamGeneric( uint8_t *pDst, const uint8_t *pSrc, size_t size )
+{
+    memcpy( pDst, pSrc, size );
+}
+
+#ifdef VCET_COPY_X86
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+__attribute__(( target( "sse2" ) ))
+static void StreamSse2( uint8_t *pDst, const uint8_t *pSrc, size_t size )
+{
+    // Regular stores up to the first aligned destination
+    size_t head = std::min( size, (size_t) ( -(uintptr_t) pDst & 15 ) );
+
+    memcpy( pDst, pSrc, head );
+    pDst += head;
+    pSrc += head;
+    size -= head;
+
+    for ( ; size >= 64; size -= 64, pDst += 64, pSrc += 64 ) {
+        __m128i a = _mm_loadu_si128( (const __m128i*) ( pSrc + 0 ) );
+        __m128i b = _mm_loadu_si128( (const __m128i*) ( pSrc + 16 ) );
+        __m128i c = _mm_loadu_si128( (const __m128i*) ( pSrc + 32 ) );
+        __m128i d = _mm_loadu_si128( (const __m128i*) ( pSrc + 48 ) );
+
+        _mm_stream_si128( (__m128i*) ( pDst + 0 ), a );
+        _mm_stream_si128( (__m128i*) ( pDst + 16 ), b );
+        _mm_stream_si128( (__m128i*) ( pDst + 32 ), c );
+        _mm_stream_si128( (__m128i*) ( pDst + 48 ), d );
+    }
+
+    for ( ; size >= 16; size -= 16, pDst += 16, pSrc += 16 ) {
+        _mm_stream_si128( (__m128i*) pDst, _mm_loadu_si128( (const __m128i*) pSrc ) );
+    }
+
+    memcpy( pDst, pSrc, size );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+__attribute__(( target( "avx2" ) ))
+static void StreamAvx2( uint8_t *pDst, const uint8_t *pSrc, size_t size )
+{
+    size_t head = std::min( size, (size_t) ( -(uintptr_t) pDst & 31 ) );
+
+    memcpy( pDst, pSrc, head );
+    pDst += head;
+    pSrc += head;
+    size -= head;
+
+    for ( ; size >= 128; size -= 128, pDst += 128, pSrc += 128 ) {
+        __m256i a = _mm256_loadu_si256( (const __m256i*) ( pSrc + 0 ) );
+        __m256i b = _mm256_loadu_si256( (const __m256i*) ( pSrc + 32 ) );
+        __m256i c = _mm256_loadu_si256( (const __m256i*) ( pSrc + 64 ) );
+        __m256i d = _mm256_loadu_si256( (const __m256i*) ( pSrc + 96 ) );
+
+        _mm256_stream_si256( (__m256i*) ( pDst + 0 ), a );
+        _mm256_stream_si256( (__m256i*) ( pDst + 32 ), b );
+        _mm256_stream_si256( (__m256i*) ( pDst + 64 ), c );
+        _mm256_stream_si256( (__m256i*) ( pDst + 96 ), d );
+    }
+
+    for ( ; size >= 32; size -= 32, pDst += 32, pSrc += 32 ) {
+        _mm256_stream_si256( (__m256i*) pDst, _mm256_loadu_si256( (const __m256i*) pSrc ) );
+    }
+
+    memcpy( pDst, pSrc, size );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+__attribute__(( target( "sse4.1" ) ))
+static void ReadSse41( uint8_t *pDst, const uint8_t *pSrc, size_t size )
+{
+    alignas( 64 ) uint8_t bounce[ kReadChunkBytes ];
+    size_t head = std::min( size, (size_t) ( -(uintptr_t) pSrc & 15 ) );
+
+    memcpy( pDst, pSrc, head );
+    pDst += head;
+    pSrc += head;
+    size -= head;
+
+    while ( size >= 16 ) {
+        size_t chunk = std::min( size, kReadChunkBytes ) & ~(size_t) 15;
+
+        for ( size_t i = 0; i < chunk; i += 16 ) {
+            // Cached mappings benefit from fetching the next chunk early
+            if ( !( i & 63 ) )
+                _mm_prefetch( (const char*) pSrc + i + kReadChunkBytes, _MM_HINT_NTA );
+
+            _mm_store_si128( (__m128i*) ( bounce + i ), _mm_stream_load_si128( (__m128i*) ( pSrc + i ) ) );
+        }
+
+        memcpy( pDst, bounce, chunk );
+        pDst += chunk;
+        pSrc += chunk;
+        size -= chunk;
+    }
+
+    memcpy( pDst, pSrc, size );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+__attribute__(( target( "avx2" ) ))
+static void ReadAvx2( uint8_t *pDst, const uint8_t *pSrc, size_t size )
+{
+    alignas( 64 ) uint8_t bounce[ kReadChunkBytes ];
+    size_t head = std::min( size, (size_t) ( -(uintptr_t) pSrc & 31 ) );
+
+    memcpy( pDst, pSrc, head );
+    pDst += head;
+    pSrc += head;
+    size -= head;
+
+    while ( size >= 32 ) {
+        size_t chunk = std::min( size, kReadChunkBytes ) & ~(size_t) 31;
+
+        for ( size_t i = 0; i < chunk; i += 32 ) {
+            if ( !( i & 63 ) )
+                _mm_prefetch( (const char*) pSrc + i + kReadChunkBytes, _MM_HINT_NTA );
+
+            _mm256_store_si256( (__m256i*) ( bounce + i ), _mm256_stream_load_si256( (const __m256i*) ( pSrc + i ) ) );
+        }
+
+        memcpy( pDst, bounce, chunk );
+        pDst += chunk;
+        pSrc += chunk;
+        size -= chunk;
+    }
+
+    memcpy( pDst, pSrc, size );
+}
+#endif
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static StreamFn PickReadFn()
+{
+#ifdef VCET_COPY_X86
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+        return ReadAvx2;
+
+    if ( __builtin_cpu_supports( "sse4.1" ) )
+        return ReadSse41;
+#endif
+
+    return StreamGeneric;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static StreamFn PickStreamFn()
+{
+#ifdef VCET_COPY_X86
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+        return StreamAvx2;
+
+    if ( __builtin_cpu_supports( "sse2" ) )
+        return StreamSse2;
+#endif
+
+    return StreamGeneric;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void StreamRowRange( StreamFn fn, uint8_t *pDst, uint64_t dstPitch,
+                            const uint8_t *pSrc, uint64_t srcPitch,
+                            uint64_t rowBytes, uint32_t rows )
+{
+    // Tightly packed rows are one copy
+    if ( dstPitch == rowBytes && srcPitch == rowBytes ) {
+        fn( pDst, pSrc, rowBytes * rows );
+    } else {
+        for ( uint32_t i = 0; i < rows; ++i ) {
+            fn( pDst + i * dstPitch, pSrc + i * srcPitch, rowBytes );
+        }
+    }
+
+#ifdef VCET_COPY_X86
+    // Non-temporal stores are weakly ordered, publish them before returning
+    _mm_sfence();
+#endif
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetCopy::StreamRows( uint8_t *pDst, uint64_t dstPitch,
+                           const uint8_t *pSrc, uint64_t srcPitch,
+                           uint64_t rowBytes, uint32_t rows, uint32_t maxThreads )
+{
+    static const StreamFn fn = PickStreamFn();
+    std::vector<std::thread> threads;
+    uint64_t numThreads = std::max( 1u, maxThreads );
+    uint32_t rowsPerThread;
+    uint32_t row = 0;
+
+    if ( !rows || !rowBytes )
+        return;
+
+    numThreads = std::min( numThreads, std::max<uint64_t>( 1, rowBytes * rows / kMinBytesPerThread ) );
+    rowsPerThread = ( rows + numThreads - 1 ) / numThreads;
+
+    // The calling thread takes the last chunk
+    for ( ; row + rowsPerThread < rows; row += rowsPerThread ) {
+        threads.emplace_back( StreamRowRange, fn,
+                              pDst + row * dstPitch, dstPitch,
+                              pSrc + row * srcPitch, srcPitch,
+                              rowBytes, rowsPerThread );
+    }
+
+    StreamRowRange( fn, pDst + row * dstPitch, dstPitch, pSrc + row * srcPitch, srcPitch, rowBytes, rows - row );
+
+    for ( auto &thread : threads ) {
+        thread.join();
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetCopy::StreamRead( uint8_t *pDst, const uint8_t *pSrc, uint64_t size )
+{
+    static const StreamFn fn = PickReadFn();
+
+    fn( pDst, pSrc, size );
+}
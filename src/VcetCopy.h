@@ -0,0 +1,64 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Copies between system memory and bo mappings
+ *
+ * Mappings of write combined memory are slow for anything but writes that
+ * fill whole cache lines, and reads that bypass the cache. The copies here
+ * use the widest non-temporal instructions the CPU supports, picked once at
+ * runtime.
+ */
+class VcetCopy
+{
+    private:
+        static const uint64_t kMinBytesPerThread = 1024 * 1024;
+
+    public:
+        /**
+         * Copy rows of rowBytes each, with non-temporal stores
+         *
+         * Rows start pitch bytes apart in their buffer. The copy is split
+         * across up to maxThreads threads, the calling thread included, if
+         * it is large enough to be worth it.
+         */
+        static void StreamRows( uint8_t *pDst, uint64_t dstPitch,
+                                const uint8_t *pSrc, uint64_t srcPitch,
+                                uint64_t rowBytes, uint32_t rows, uint32_t maxThreads );
+
+        /**
+         * Copy size bytes out of a mapping, with non-temporal loads
+         *
+         * The source is read a chunk at a time into a small cached buffer,
+         * so that the loads aren't interleaved with stores to pDst.
+         */
+        static void StreamRead( uint8_t *pDst, const uint8_t *pSrc, uint64_t size );
+};
@@ -31,6 +31,7 @@
 #include "Drm.h"
 #include "VcetContext.h"
 #include "VcetBo.h"
+#include "VcetSession.h"
 
 #include "VcetIb.h"
 
@@ -44,6 +45,7 @@ VcetIb::VcetIb( VcetContext *pContext )
     , mBo( pContext )
     , mIbData( nullptr )
     , mSeqNo( 0 )
+    , mRing( 0 )
     , mSizeDw( 0 )
 {
 }
@@ -60,7 +62,7 @@ bool VcetIb::Init()
 {
     bool ret;
 
-    ret = mBo.Allocate( kSizeBytes, true, kAlignment );
+    ret = mBo.Allocate( kSizeBytes, VcetBo::Usage::kCommands, kAlignment );
     FailOnTo( !ret, error, "Failed to allocate IB bo\n" );
 
     ret = mBo.Map();
@@ -86,10 +88,12 @@ bool VcetIb::WaitFromCompletion( uint64_t timeout )
 
     fenceStatus.context = mContext->GetDrm()->GetContext();
     fenceStatus.ip_type = mContext->GetIpType();
+    fenceStatus.ring = mRing;
     fenceStatus.fence = mSeqNo;
 
     err = mContext->GetDrm()->CsQueryFenceStatus( &fenceStatus, timeout, 0, &expired);
     FailOnTo( err, error, "Failed to wait for ib completion\n" );
+    FailOnToQ( !expired, error );
 
     return true;
 
@@ -97,6 +101,17 @@ error:
     return false;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetIb::IsIdle()
+{
+    // Never submitted, already reclaimed, or seen signaled through another path
+    if ( !mSeqNo || mContext->IsFenceSignaled( mRing, mSeqNo ) )
+        return true;
+
+    return WaitFromCompletion( 0 );
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetIb::Reset()
@@ -143,15 +158,18 @@ bool VcetIb::WriteNop( uint32_t count )
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetIb::WriteCreateSession( uint32_t width, uint32_t height )
+bool VcetIb::WriteCreateSession( VcetSession *pSession )
 {
+    uint32_t width = pSession->GetAlignedWidth();
+    uint32_t height = pSession->GetAlignedHeight();
+
     FailOnTo( !VcetBo::IsWidthAligned( mContext, width ), error, "unaligned width\n" );
     FailOnTo( !VcetBo::IsHeightAligned( mContext, height ), error, "unaligned height\n" );
 
-    WriteSession();
+    WriteSession( pSession );
     WriteTaskInfo( 0 );
     WriteCreate( width, height );
-    WriteFeedbackBuffer();
+    WriteFeedbackBuffer( pSession );
 
     return true;
 
@@ -161,11 +179,11 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetIb::WriteoDestroySession()
+bool VcetIb::WriteoDestroySession( VcetSession *pSession )
 {
-    WriteSession();
+    WriteSession( pSession );
     WriteTaskInfo( 1 );
-    WriteFeedbackBuffer();
+    WriteFeedbackBuffer( pSession );
     WriteDestroy();
 
     return true;
@@ -173,20 +191,20 @@ bool VcetIb::WriteoDestroySession()
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetIb::WriteCalculateMv( VcetBo *oldFrame, VcetBo *newFrame, VcetBo *mvBo, uint32_t width, uint32_t height )
+bool VcetIb::WriteCalculateMv( VcetSession *pSession, VcetBo *oldFrame, VcetBo *newFrame, VcetBo *mvBo, uint32_t width, uint32_t height )
 {
     RefResource( oldFrame );
     RefResource( newFrame );
     RefResource( mvBo );
 
-    WriteConfigInit();
+    WriteConfigInit( pSession );
 
-    WriteSession();
+    WriteSession( pSession );
     WriteTaskInfo( 3 );
-    WriteBsBuffer();
-    WriteContextBuffer();
+    WriteBsBuffer( pSession );
+    WriteContextBuffer( pSession );
     WriteAuxBuffer( oldFrame->GetSizeBytes() );
-    WriteFeedbackBuffer();
+    WriteFeedbackBuffer( pSession );
 
     WriteMvCmd( oldFrame, mvBo, width, height );
     WriteEncodeCmd( newFrame, width, height );
@@ -203,9 +221,9 @@ void VcetIb::RefResource( VcetBo *bo )
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-void VcetIb::WriteConfigInit()
+void VcetIb::WriteConfigInit( VcetSession *pSession )
 {
-    WriteSession();
+    WriteSession( pSession );
     WriteTaskInfo( 2 );
     WriteVceConfig();
 }
@@ -242,11 +260,11 @@ void VcetIb::WriteDestroy()
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-void VcetIb::WriteSession()
+void VcetIb::WriteSession( VcetSession *pSession )
 {
     Write( 0x0000000c );
     Write( 0x00000001 );
-    Write( mContext->GetSessionId() );
+    Write( pSession->GetId() );
 }
 
 //---------------------------------------------------------------------------//
@@ -385,9 +403,9 @@ void VcetIb::WriteVceConfig()
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-void VcetIb::WriteBsBuffer()
+void VcetIb::WriteBsBuffer( VcetSession *pSession )
 {
-    uint64_t bsAddr = mContext->GetBs()->GetGpuAddr();
+    uint64_t bsAddr = pSession->GetBs()->GetGpuAddr();
 
     Write( 0x00000014 );
     Write( 0x05000004 );
@@ -398,9 +416,9 @@ void VcetIb::WriteBsBuffer()
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-void VcetIb::WriteFeedbackBuffer()
+void VcetIb::WriteFeedbackBuffer( VcetSession *pSession )
 {
-    uint64_t fbAddr = mContext->GetFb()->GetGpuAddr();
+    uint64_t fbAddr = pSession->GetFb()->GetGpuAddr();
 
     Write( 0x00000014 );
     Write( 0x05000005 );
@@ -411,9 +429,9 @@ void VcetIb::WriteFeedbackBuffer()
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-void VcetIb::WriteContextBuffer()
+void VcetIb::WriteContextBuffer( VcetSession *pSession )
 {
-    uint64_t cpbAddr = mContext->GetCpb()->GetGpuAddr();
+    uint64_t cpbAddr = pSession->GetCpb()->GetGpuAddr();
 
     Write( 0x00000010 );
     Write( 0x05000001 );
@@ -35,6 +35,7 @@
 #include "VcetBo.h"
 
 class VcetContext;
+class VcetSession;
 
 class VcetIb
 {
@@ -55,12 +56,17 @@ class VcetIb
 
         bool Reset();
         bool WriteNop( uint32_t count );
-        bool WriteCalculateMv( VcetBo *oldFrame, VcetBo *newFrame, VcetBo *mvBo, uint32_t width, uint32_t height );
-        bool WriteCreateSession( uint32_t width, uint32_t height );
-        bool WriteoDestroySession();
+        bool WriteCalculateMv( VcetSession *pSession, VcetBo *oldFrame, VcetBo *newFrame, VcetBo *mvBo, uint32_t width, uint32_t height );
+        bool WriteCreateSession( VcetSession *pSession );
+        bool WriteoDestroySession( VcetSession *pSession );
 
         bool WaitFromCompletion( uint64_t timeout = AMDGPU_TIMEOUT_INFINITE );
 
+        /**
+         * Returns true if the GPU is no longer using this IB
+         */
+        bool IsIdle();
+
         uint32_t GetSizeDw() { return mSizeDw; }
         uint64_t GetGpuAddress() { return mBo.GetGpuAddr(); }
         uint32_t GetNumResources() { return mReferencedResources.size(); }
@@ -68,6 +74,8 @@ class VcetIb
 
         uint64_t GetSeqNo() { return mSeqNo; }
         void SetSeqNo( uint64_t seq ) { mSeqNo = seq; }
+        uint32_t GetRing() { return mRing; }
+        void SetRing( uint32_t ring ) { mRing = ring; }
 
     private:
         void Write( uint32_t cmd );
@@ -75,13 +83,13 @@ class VcetIb
 
         void WriteCreate( uint32_t width, uint32_t height );
         void WriteDestroy();
-        void WriteSession();
+        void WriteSession( VcetSession *pSession );
         void WriteTaskInfo( uint32_t id );
         void WriteVceConfig();
-        void WriteConfigInit();
-        void WriteBsBuffer();
-        void WriteFeedbackBuffer();
-        void WriteContextBuffer();
+        void WriteConfigInit( VcetSession *pSession );
+        void WriteBsBuffer( VcetSession *pSession );
+        void WriteFeedbackBuffer( VcetSession *pSession );
+        void WriteContextBuffer( VcetSession *pSession );
         void WriteAuxBuffer( uint64_t frameSizeBytes );
         void WriteMvCmd( VcetBo *refFrame, VcetBo *mvBo, uint32_t width, uint32_t height );
         void WriteEncodeCmd( VcetBo *frame, uint32_t width, uint32_t height );
@@ -93,6 +101,7 @@ class VcetIb
 
         uint32_t *mIbData;
         uint64_t mSeqNo;
+        uint32_t mRing;
         uint32_t mSizeDw;
 
         std::vector<amdgpu_bo_handle> mReferencedResources;
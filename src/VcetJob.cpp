@@ -24,17 +24,56 @@
 // SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //
 
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
 #include <util/util.h>
 
 #include "Drm.h"
+#include "VcetBo.h"
 #include "VcetContext.h"
+#include "VcetSubmitter.h"
 
 #include "VcetJob.h"
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint64_t NowNs()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( now ).count();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint64_t Remaining( uint64_t deadlineNs )
+{
+    uint64_t now;
+
+    if ( deadlineNs == AMDGPU_TIMEOUT_INFINITE )
+        return AMDGPU_TIMEOUT_INFINITE;
+
+    now = NowNs();
+
+    return deadlineNs > now ? deadlineNs - now : 0;
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 VcetJob::VcetJob( VcetContext *pContext )
     : mContext( pContext )
+    , mSeqNo( 0 )
+    , mSubmitNs( 0 )
+    , mRing( 0 )
+    , mTracked( false )
+    , mFailed( false )
+    , mPending( 0 )
+    , mReadbackRing( 0 )
+    , mReadbackSeqNo( 0 )
+    , mHasReadbacks( false )
 {
 }
 
@@ -42,6 +81,9 @@ VcetJob::VcetJob( VcetContext *pContext )
 //---------------------------------------------------------------------------//
 VcetJob::~VcetJob()
 {
+    // Don't pull the job from under the submission thread
+    if ( IsPending() )
+        mContext->GetSubmitter()->Flush();
 }
 
 //---------------------------------------------------------------------------//
@@ -54,20 +96,325 @@ bool VcetJob::Init()
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetJob::WaitForCompletion( uint64_t timeout )
+{
+    bool ret;
+    bool completed = false;
+
+    ret = Query( timeout, &completed );
+    FailOnTo( !ret, error, "Failed to wait for job completion: query failed\n" );
+    FailOnToQ( !completed, error );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetJob::SetSeqNo( uint64_t seq )
+{
+    mSeqNo = seq;
+    mSubmitNs = NowNs();
+    mTracked = false;
+    mFailed = false;
+
+    // Readbacks wait for the submission that follows them
+    if ( seq ) {
+        std::lock_guard<std::mutex> lock( mReadbackLock );
+
+        if ( !mQueuedReadbacks.empty() ) {
+            mReadbacks.insert( mReadbacks.end(), mQueuedReadbacks.begin(), mQueuedReadbacks.end() );
+            mQueuedReadbacks.clear();
+            mReadbackRing = mRing;
+            mReadbackSeqNo = seq;
+            mHasReadbacks.store( true, std::memory_order_release );
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetJob::SetSubmitted( bool success )
+{
+    mFailed = !success;
+    mPending.fetch_sub( 1, std::memory_order_release );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJob::Query( uint64_t timeout, bool *pCompleted )
+{
+    bool ret;
+    uint64_t now, deadline;
+    uint64_t sleepNs = 0;
+    uint64_t spinNs = 0;
+
+    // Queued requests are submitted by the submission thread
+    if ( IsPending() ) {
+        if ( !timeout ) {
+            *pCompleted = false;
+            return true;
+        }
+
+        mContext->GetSubmitter()->Flush();
+    }
+
+    FailOnTo( mFailed, error, "Failed to query job: submission failed\n" );
+
+    // Nothing to wait for
+    if ( !mSeqNo || mContext->IsFenceSignaled( mRing, mSeqNo ) ) {
+        RunReadbacks( mRing, mSeqNo );
+        *pCompleted = true;
+        return true;
+    }
+
+    // The reactor publishes our completion, so polling needs no ioctl
+    if ( !timeout && mTracked && mContext->GetReactor()->IsRunning() ) {
+        *pCompleted = false;
+        return true;
+    }
+
+    if ( !timeout )
+        return QueryFence( 0, pCompleted );
+
+    now = NowNs();
+    if ( timeout == AMDGPU_TIMEOUT_INFINITE || timeout > AMDGPU_TIMEOUT_INFINITE - now )
+        deadline = AMDGPU_TIMEOUT_INFINITE;
+    else
+        deadline = now + timeout;
+
+    mContext->GetWaitBudget( now - mSubmitNs, &sleepNs, &spinNs );
+
+    // Sleep through most of the job, then poll across its expected end so
+    // that the wake-up does not go through the scheduler
+    if ( sleepNs ) {
+        ret = QueryFence( std::min( sleepNs, Remaining( deadline ) ), pCompleted );
+        if ( !ret || *pCompleted )
+            return ret;
+    }
+
+    if ( spinNs ) {
+        ret = Spin( NowNs() + std::min( spinNs, Remaining( deadline ) ), pCompleted );
+        if ( !ret || *pCompleted )
+            return ret;
+    }
+
+    return QueryFence( Remaining( deadline ), pCompleted );
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJob::QueryFence( uint64_t timeout, bool *pCompleted )
 {
     int err;
     uint32_t expired;
     struct amdgpu_cs_fence fenceStatus = {0};
 
-    fenceStatus.context = mContext->GetDrm()->GetContext();
-    fenceStatus.ip_type = mContext->GetIpType();
-    fenceStatus.fence = mSeqNo;
+    GetFence( &fenceStatus );
 
     err = mContext->GetDrm()->CsQueryFenceStatus( &fenceStatus, timeout, 0, &expired);
-    FailOnTo( err, error, "Failed to wait for job completion: query failed\n" );
+    FailOnTo( err, error, "Failed to query job status\n" );
+
+    *pCompleted = expired != 0;
+    if ( *pCompleted ) {
+        mContext->OnFenceSignaled( mRing, mSeqNo );
+        RunReadbacks( mRing, mSeqNo );
+
+        if ( mSubmitNs ) {
+            mContext->OnJobDuration( NowNs() - mSubmitNs );
+            mSubmitNs = 0;
+        }
+    }
 
     return true;
 
 error:
     return false;
 }
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJob::Spin( uint64_t endNs, bool *pCompleted )
+{
+    bool ret;
+
+    do {
+        ret = QueryFence( 0, pCompleted );
+        FailOnToQ( !ret, error );
+
+        if ( *pCompleted )
+            return true;
+
+        // Let other threads run on oversubscribed CPUs
+        std::this_thread::yield();
+    } while ( NowNs() < endNs );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJob::WaitMany( VcetContext *pContext, VcetJob **jobs, uint32_t count, bool waitAll, uint64_t timeout, bool *pCompleted, uint32_t *pFirst )
+{
+    int err;
+    uint32_t status = 0;
+    uint32_t first = 0;
+    std::vector<struct amdgpu_cs_fence> fences;
+    std::vector<uint32_t> fenceJobIdx;
+
+    FailOnTo( !count, error, "Failed to wait for jobs: no jobs\n" );
+
+    fences.reserve( count );
+    fenceJobIdx.reserve( count );
+
+    for ( uint32_t i = 0; i < count; ++i ) {
+        FailOnTo( jobs[i]->mContext != pContext, error, "Failed to wait for jobs: context mismatch\n" );
+
+        if ( jobs[i]->IsPending() ) {
+            pContext->GetSubmitter()->Flush();
+            break;
+        }
+    }
+
+    for ( uint32_t i = 0; i < count; ++i ) {
+        struct amdgpu_cs_fence fence = {0};
+
+        FailOnTo( jobs[i]->mFailed, error, "Failed to wait for jobs: submission failed\n" );
+
+        // Unsubmitted jobs are always complete
+        if ( !jobs[i]->mSeqNo ) {
+            if ( !waitAll ) {
+                *pCompleted = true;
+                if ( pFirst )
+                    *pFirst = i;
+                return true;
+            }
+
+            continue;
+        }
+
+        jobs[i]->GetFence( &fence );
+        fences.push_back( fence );
+        fenceJobIdx.push_back( i );
+    }
+
+    if ( fences.empty() ) {
+        *pCompleted = true;
+        if ( pFirst )
+            *pFirst = 0;
+        return true;
+    }
+
+    err = pContext->GetDrm()->CsWaitFences( fences.data(), fences.size(), waitAll, timeout, &status, &first );
+    FailOnTo( err, error, "Failed to wait for jobs: wait fences failed\n" );
+
+    *pCompleted = status != 0;
+
+    if ( *pCompleted && waitAll ) {
+        for ( uint32_t idx : fenceJobIdx ) {
+            pContext->OnFenceSignaled( jobs[idx]->mRing, jobs[idx]->mSeqNo );
+            jobs[idx]->RunReadbacks( jobs[idx]->mRing, jobs[idx]->mSeqNo );
+        }
+    }
+
+    first = fenceJobIdx[ first < fenceJobIdx.size() ? first : 0 ];
+    if ( *pCompleted && !waitAll )
+        jobs[ first ]->RunReadbacks( jobs[ first ]->mRing, jobs[ first ]->mSeqNo );
+
+    if ( pFirst )
+        *pFirst = first;
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJob::ExportSyncFd( int *pFd )
+{
+    int err;
+    uint32_t fd;
+    struct amdgpu_cs_fence fence = {0};
+
+    if ( IsPending() )
+        mContext->GetSubmitter()->Flush();
+
+    FailOnTo( !mSeqNo, error, "Failed to export job: job was never submitted\n" );
+
+    GetFence( &fence );
+
+    err = mContext->GetDrm()->CsFenceToHandle( &fence, AMDGPU_FENCE_TO_HANDLE_GET_SYNC_FILE_FD, &fd );
+    FailOnTo( err, error, "Failed to export job: fence to handle failed\n" );
+
+    *pFd = (int) fd;
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJob::AddReadback( const std::shared_ptr<VcetBo> &bo, uint8_t *pDst, uint64_t offset, uint64_t size )
+{
+    Readback readback = { bo, pDst, offset, size };
+
+    FailOnTo( !pDst, error, "Failed to add readback: no destination\n" );
+    FailOnTo( !bo->IsMappable(), error, "Failed to add readback: bo is not mappable\n" );
+    FailOnTo( offset > bo->GetSizeBytes() || size > bo->GetSizeBytes() - offset,
+              error, "Failed to add readback: out of bounds\n" );
+
+    {
+        std::lock_guard<std::mutex> lock( mReadbackLock );
+        mQueuedReadbacks.push_back( readback );
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetJob::RunReadbacks( uint32_t ring, uint64_t seq )
+{
+    bool ret;
+
+    if ( !mHasReadbacks.load( std::memory_order_acquire ) )
+        return;
+
+    std::lock_guard<std::mutex> lock( mReadbackLock );
+
+    // The job was submitted again since seq
+    if ( ring != mReadbackRing || seq < mReadbackSeqNo )
+        return;
+
+    for ( const Readback &readback : mReadbacks ) {
+        ret = readback.mBo->Readback( readback.mDst, readback.mOffset, readback.mSize );
+        WarnOn( !ret, "Failed to read back bo on job completion\n" );
+    }
+
+    mReadbacks.clear();
+    mHasReadbacks.store( false, std::memory_order_relaxed );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetJob::GetFence( struct amdgpu_cs_fence *pFence )
+{
+    pFence->context = mContext->GetDrm()->GetContext();
+    pFence->ip_type = mContext->GetIpType();
+    pFence->ring = mRing;
+    pFence->fence = mSeqNo;
+}
@@ -27,9 +27,15 @@
 
 #include <libdrm/amdgpu.h>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class VcetBo;
 class VcetContext;
 
-class VcetJob
+class VcetJob : public std::enable_shared_from_this<VcetJob>
 {
     public:
         VcetJob( VcetContext *pContext );
@@ -40,12 +46,114 @@ class VcetJob
          */
         bool Init();
 
+        /**
+         * Wait for the job to complete
+         *
+         * Returns false if the job did not complete within timeout
+         */
         bool WaitForCompletion( uint64_t timeout = AMDGPU_TIMEOUT_INFINITE );
 
+        /**
+         * Wait up to timeout for the job to complete
+         *
+         * Waits follow the context's wait policy. pCompleted reports whether
+         * the job completed. Returns false on error.
+         */
+        bool Query( uint64_t timeout, bool *pCompleted );
+
+        /**
+         * Wait for any or all of the jobs to complete
+         *
+         * All jobs must belong to pContext. On success pCompleted reports
+         * whether the wait condition was met, and pFirst (optional) the index
+         * of a completed job.
+         */
+        static bool WaitMany( VcetContext *pContext, VcetJob **jobs, uint32_t count,
+                              bool waitAll, uint64_t timeout,
+                              bool *pCompleted, uint32_t *pFirst );
+
+        /**
+         * Export the job's fence as a sync_file fd
+         *
+         * The fd becomes readable once the job completes. Caller owns the fd.
+         */
+        bool ExportSyncFd( int *pFd );
+
+        /**
+         * Copy out of bo once the job's next submission completes
+         *
+         * The copy is made by whichever thread first sees the completion,
+         * the completion reactor included, before it reports it. It waits
+         * for the submission handed to the job by the next SetSeqNo().
+         */
+        bool AddReadback( const std::shared_ptr<VcetBo> &bo, uint8_t *pDst, uint64_t offset, uint64_t size );
+
+        /**
+         * Make the copies queued by AddReadback(), once seq has signaled on ring
+         *
+         * Completions of earlier submissions leave them queued. Returns once
+         * they are done, even if another thread makes them.
+         */
+        void RunReadbacks( uint32_t ring, uint64_t seq );
+
+        /**
+         * Describe the fence of the job's latest submission
+         */
+        void GetFence( struct amdgpu_cs_fence *pFence );
+
+        /**
+         * Set the job's latest submission, SetRing() first
+         */
         uint64_t GetSeqNo() { return mSeqNo; }
-        void SetSeqNo( uint64_t seq ) { mSeqNo = seq; }
+        void SetSeqNo( uint64_t seq );
+        uint32_t GetRing() { return mRing; }
+        void SetRing( uint32_t ring ) { mRing = ring; }
+
+        /**
+         * The completion reactor will publish this submission's completion
+         */
+        void SetTracked() { mTracked = true; }
+
+        /**
+         * The job was queued for asynchronous submission
+         *
+         * Until SetSubmitted() is called for every queued request, the job's
+         * other state belongs to the submission thread.
+         */
+        void SetPending() { mPending.fetch_add( 1, std::memory_order_relaxed ); }
+        void SetSubmitted( bool success );
+        bool IsPending() { return mPending.load( std::memory_order_acquire ) != 0; }
 
     private:
+        struct Readback {
+            std::shared_ptr<VcetBo> mBo;
+            uint8_t *mDst;
+            uint64_t mOffset;
+            uint64_t mSize;
+        };
+
+        /**
+         * Query the fence, blocking for up to timeout
+         */
+        bool QueryFence( uint64_t timeout, bool *pCompleted );
+
+        /**
+         * Poll the fence until it signals or the clock reaches endNs
+         */
+        bool Spin( uint64_t endNs, bool *pCompleted );
+
         VcetContext *mContext;
         uint64_t mSeqNo;
+        uint64_t mSubmitNs;     // Cleared once the job's duration is recorded
+        uint32_t mRing;
+        bool mTracked;
+        bool mFailed;               // The latest queued request failed to submit
+        std::atomic<uint32_t> mPending;
+
+        std::mutex mReadbackLock;           // Held while the copies are made
+        std::vector<Readback> mQueuedReadbacks;     // Waiting for the next submission
+        std::vector<Readback> mReadbacks;           // Made once the submission below completes
+        uint32_t mReadbackRing;
+        uint64_t mReadbackSeqNo;
+        std::atomic<bool> mHasReadbacks;
 };
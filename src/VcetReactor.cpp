@@ -0,0 +1,182 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <util/util.h>
+
+#include "Drm.h"
+#include "VcetContext.h"
+#include "VcetJob.h"
+
+#include "VcetReactor.h"
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetReactor::VcetReactor( VcetContext *pContext )
+    : mContext( pContext )
+    , mEventFd( -1 )
+    , mRunning( false )
+{
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetReactor::~VcetReactor()
+{
+    Stop();
+
+    if ( mEventFd >= 0 ) {
+        close( mEventFd );
+        mEventFd = -1;
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetReactor::Start( Callback callback )
+{
+    FailOnTo( mRunning, error, "Reactor already running\n" );
+
+    if ( mEventFd < 0 ) {
+        mEventFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+        FailOnTo( mEventFd < 0, error, "Failed to create reactor eventfd\n" );
+    }
+
+    mCallback = callback;
+    mRunning = true;
+    mThread = std::thread( &VcetReactor::Run, this );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetReactor::Stop()
+{
+    std::deque<Entry> pending;
+
+    {
+        std::lock_guard<std::mutex> lock( mLock );
+        if ( !mRunning )
+            return;
+
+        mRunning = false;
+        pending.swap( mPending );
+    }
+
+    mCond.notify_all();
+    mThread.join();
+
+    // The last references to jobs are dropped without the lock held
+    pending.clear();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetReactor::Track( VcetJob *pJob, void *pCookie )
+{
+    Entry entry = { {}, pJob->shared_from_this(), pCookie };
+
+    pJob->GetFence( &entry.mFence );
+
+    {
+        std::lock_guard<std::mutex> lock( mLock );
+        FailOnTo( !mRunning, error, "Reactor not running\n" );
+
+        mPending.push_back( entry );
+    }
+
+    mCond.notify_one();
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetReactor::WaitForEntry( Entry *pEntry )
+{
+    std::unique_lock<std::mutex> lock( mLock );
+
+    mCond.wait( lock, [this]{ return !mRunning || !mPending.empty(); } );
+    if ( !mRunning )
+        return false;
+
+    *pEntry = mPending.front();
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetReactor::Run()
+{
+    int err;
+    Entry entry;
+    uint32_t expired;
+    uint64_t one = 1;
+
+    while ( WaitForEntry( &entry ) ) {
+        // Wait in slices so that Stop() is not held up by a long job
+        expired = 0;
+        err = mContext->GetDrm()->CsQueryFenceStatus( &entry.mFence, kWaitSliceNs, 0, &expired );
+        WarnOn( err, "Reactor failed to query fence status\n" );
+
+        if ( !err && !expired )
+            continue;
+
+        {
+            std::lock_guard<std::mutex> lock( mLock );
+            if ( !mRunning )
+                break;
+
+            mPending.pop_front();
+        }
+
+        // Lets VcetJobPoll answer for tracked jobs with a memory load
+        if ( !err )
+            mContext->OnFenceSignaled( entry.mFence.ring, entry.mFence.fence );
+
+        // A failed query still retires the entry so that it can't stall the queue
+        if ( !err )
+            entry.mJob->RunReadbacks( entry.mFence.ring, entry.mFence.fence );
+
+        if ( mCallback )
+            mCallback( entry.mCookie );
+
+        if ( write( mEventFd, &one, sizeof(one) ) != sizeof(one) )
+            Warn( "Failed to signal reactor eventfd\n" );
+
+        // Drop our reference before WaitForEntry() takes the lock
+        entry.mJob.reset();
+    }
+}
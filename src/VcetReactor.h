@@ -0,0 +1,107 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+
+#pragma once
+
+#include <libdrm/amdgpu.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class VcetContext;
+class VcetJob;
+
+/**
+ * Completion thread for a VcetContext
+ *
+ * Waits on tracked fences in submission order and, for each one that
+ * completes, makes the job's readbacks, invokes the completion callback and
+ * signals an eventfd.
+ */
+class VcetReactor
+{
+    private:
+        // Upper bound on how long Stop() may take to interrupt a wait
+        static constexpr uint64_t kWaitSliceNs = 10 * 1000 * 1000;
+
+    public:
+        typedef std::function<void( void *pCookie )> Callback;
+
+        VcetReactor( VcetContext *pContext );
+        ~VcetReactor();
+
+        /**
+         * Start the completion thread
+         *
+         * callback may be empty, in which case only the eventfd is signaled
+         */
+        bool Start( Callback callback );
+
+        /**
+         * Stop the completion thread
+         *
+         * Fences that have not completed yet are dropped without notification
+         */
+        void Stop();
+
+        /**
+         * Notify pCookie once the fence of pJob completes
+         */
+        bool Track( VcetJob *pJob, void *pCookie );
+
+        /**
+         * Getters/Setters
+         */
+        bool IsRunning()    { return mRunning; }
+        int GetEventFd()    { return mEventFd; }
+
+    private:
+        struct Entry {
+            struct amdgpu_cs_fence mFence;
+            std::shared_ptr<VcetJob> mJob;      // Outlives the job's handle until reported
+            void *mCookie;
+        };
+
+        void Run();
+        bool WaitForEntry( Entry *pEntry );
+
+        VcetContext *mContext;
+
+        Callback mCallback;
+        int mEventFd;
+
+        std::thread mThread;
+        std::mutex mLock;
+        std::condition_variable mCond;
+        std::deque<Entry> mPending;
+        std::atomic<bool> mRunning;
+};
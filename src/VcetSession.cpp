@@ -0,0 +1,208 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include <util/util.h>
+
+#include "Drm.h"
+#include "VcetBo.h"
+
+#include "VcetSession.h"
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static uint32_t GenSessionId()
+{
+    static std::atomic<uint32_t> sNextSessionId( 1 );
+    return  ( 0xA3D << 16 ) | sNextSessionId++;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSession::VcetSession( VcetContext *pContext, uint32_t alignedWidth, uint32_t alignedHeight )
+    : mContext( pContext )
+    , mId( GenSessionId() )
+    , mAlignedWidth( alignedWidth )
+    , mAlignedHeight( alignedHeight )
+    , mBoFb( nullptr )
+    , mBoBs( nullptr )
+    , mBoCpb( nullptr )
+    , mLastSeqNo()
+    , mUsers( 0 )
+    , mLastUse( 0 )
+    , mCreated( false )
+{
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSession::~VcetSession()
+{
+    delete mBoFb;
+    mBoFb = nullptr;
+
+    delete mBoBs;
+    mBoBs = nullptr;
+
+    delete mBoCpb;
+    mBoCpb = nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSession::Init()
+{
+    bool ret;
+
+    // Only the firmware touches the bitstream and reference pictures
+    ret = AllocateResource( mBoFb, GetFbSize(), true );
+    FailOnTo( !ret, error, "Failed to allocate fb bo\n" );
+
+    ret = AllocateResource( mBoBs, GetBsSize(), false );
+    FailOnTo( !ret, error, "Failed to allocate bs bo\n" );
+
+    ret = AllocateResource( mBoCpb, GetCpbSize(), false );
+    FailOnTo( !ret, error, "Failed to allocate cpb bo\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSession::AllocateResource( VcetBo*& bo, uint64_t size, bool mappable )
+{
+    bool ret;
+
+    bo = new VcetBo( mContext );
+    FailOnTo( !bo, error, "Failed to create bo\n" );
+
+    ret = bo->Allocate( size, mappable );
+    FailOnTo( !ret, error, "Failed to allocate bo\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSession::OnSubmit( uint32_t ring, uint64_t seqNo )
+{
+    util::AtomicMax( &mLastSeqNo[ ring ], seqNo );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSession::WaitIdle()
+{
+    int err;
+    uint32_t expired;
+
+    for ( uint32_t ring = 0; ring < VcetContext::kMaxRings; ++ring ) {
+        struct amdgpu_cs_fence fence = {0};
+        uint64_t seqNo = mLastSeqNo[ ring ].load( std::memory_order_acquire );
+
+        if ( !seqNo || mContext->IsFenceSignaled( ring, seqNo ) )
+            continue;
+
+        fence.context = mContext->GetDrm()->GetContext();
+        fence.ip_type = mContext->GetIpType();
+        fence.ring = ring;
+        fence.fence = seqNo;
+
+        err = mContext->GetDrm()->CsQueryFenceStatus( &fence, AMDGPU_TIMEOUT_INFINITE, 0, &expired );
+        FailOnTo( err || !expired, error, "Failed to wait for session jobs\n" );
+
+        mContext->OnFenceSignaled( ring, seqNo );
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSession::IsIdle()
+{
+    int err;
+    uint32_t expired;
+
+    for ( uint32_t ring = 0; ring < VcetContext::kMaxRings; ++ring ) {
+        struct amdgpu_cs_fence fence = {0};
+        uint64_t seqNo = mLastSeqNo[ ring ].load( std::memory_order_acquire );
+
+        if ( !seqNo || mContext->IsFenceSignaled( ring, seqNo ) )
+            continue;
+
+        fence.context = mContext->GetDrm()->GetContext();
+        fence.ip_type = mContext->GetIpType();
+        fence.ring = ring;
+        fence.fence = seqNo;
+
+        err = mContext->GetDrm()->CsQueryFenceStatus( &fence, 0, 0, &expired );
+        if ( err || !expired )
+            return false;
+
+        mContext->OnFenceSignaled( ring, seqNo );
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetSession::GetFrameSizeBytes()
+{
+    return mAlignedWidth * mAlignedHeight * VcetBo::kNv21Bpp;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetSession::GetFbSize()
+{
+    // TODO: might need per-family values
+    return 4096;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetSession::GetBsSize()
+{
+    // TODO: need per-family values
+    return 0x154000;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint64_t VcetSession::GetCpbSize()
+{
+    return GetFrameSizeBytes() * kNumCpbBuffers;
+}
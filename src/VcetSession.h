@@ -0,0 +1,123 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "VcetContext.h"
+
+class VcetBo;
+
+/**
+ * A VCE encode session for one aligned frame size
+ *
+ * Owns the buffers the firmware uses for the session. The owning VcetContext
+ * creates and destroys the session on the engine.
+ */
+class VcetSession
+{
+    private:
+        static constexpr int kNumCpbBuffers = 10;
+
+    public:
+        VcetSession( VcetContext *pContext, uint32_t alignedWidth, uint32_t alignedHeight );
+        ~VcetSession();
+
+        /**
+         * Allocate the session's buffers
+         */
+        bool Init();
+
+        /**
+         * Record a submission that used the session
+         */
+        void OnSubmit( uint32_t ring, uint64_t seqNo );
+
+        /**
+         * Wait for every submission that used the session to complete
+         */
+        bool WaitIdle();
+
+        /**
+         * Check whether every submission that used the session completed,
+         * without blocking
+         */
+        bool IsIdle();
+
+        /**
+         * Getters/Setters
+         */
+        uint32_t GetId() { return mId; }
+        uint32_t GetAlignedWidth() { return mAlignedWidth; }
+        uint32_t GetAlignedHeight() { return mAlignedHeight; }
+
+        VcetBo *GetFb() { return mBoFb; }
+        VcetBo *GetBs() { return mBoBs; }
+        VcetBo *GetCpb() { return mBoCpb; }
+
+        bool IsCreated() { return mCreated; }
+        void SetCreated( bool created ) { mCreated = created; }
+
+        /**
+         * Pin the session while a submission is built on it
+         *
+         * tick orders the sessions by their latest use. Only called with the
+         * owning context's session lock held, so that an idle session found
+         * under the lock stays idle. Release() and OnSubmit() need no lock.
+         */
+        void Acquire( uint64_t tick ) { mUsers++; mLastUse = tick; }
+        void Release() { mUsers.fetch_sub( 1, std::memory_order_release ); }
+        bool IsInUse() { return mUsers.load( std::memory_order_acquire ) != 0; }
+        uint64_t GetLastUse() { return mLastUse; }
+
+    private:
+        bool AllocateResource( VcetBo*& bo, uint64_t size, bool mappable );
+
+        /**
+         * Size of an NV21 frame of the session's dimensions
+         */
+        uint64_t GetFrameSizeBytes();
+
+        uint64_t GetFbSize();
+        uint64_t GetBsSize();
+        uint64_t GetCpbSize();
+
+        VcetContext *mContext;
+
+        uint32_t mId;
+        uint32_t mAlignedWidth;
+        uint32_t mAlignedHeight;
+
+        VcetBo *mBoFb;
+        VcetBo *mBoBs;
+        VcetBo *mBoCpb;
+
+        // Latest submission that used the session, per ring
+        std::atomic<uint64_t> mLastSeqNo[ VcetContext::kMaxRings ];
+
+        std::atomic<uint32_t> mUsers;
+        uint64_t mLastUse;
+        bool mCreated;
+};
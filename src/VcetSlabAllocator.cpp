@@ -0,0 +1,312 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include <algorithm>
+
+#include <util/util.h>
+
+#include "Drm.h"
+#include "VcetBo.h"
+#include "VcetSubmitter.h"
+
+#include "VcetSlabAllocator.h"
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSlabAllocator::VcetSlabAllocator( VcetContext *pContext )
+    : mContext( pContext )
+    , mNumBlocks( 0 )
+{
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSlabAllocator::~VcetSlabAllocator()
+{
+    std::vector<Slab*> slabs;
+
+    WarnOn( mNumBlocks, "Destroying %u slab blocks that are still in use\n", mNumBlocks );
+
+    for ( auto &heap : mHeaps ) {
+        for ( auto &sizeClass : heap.mSlabs ) {
+            slabs.insert( slabs.end(), sizeClass.begin(), sizeClass.end() );
+            sizeClass.clear();
+        }
+    }
+
+    DestroySlabs( slabs );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSlabAllocator::Allocate( uint64_t sizeBytes, uint32_t domain, uint64_t flags, Block *pBlock )
+{
+    Slab *slab;
+    uint32_t index;
+    uint32_t heap;
+    uint32_t sizeClass = GetSizeClass( sizeBytes );
+    std::vector<Slab*> dead;
+    std::unique_lock<std::mutex> lock( mLock );
+
+    FailOnTo( !sizeBytes || sizeBytes > kMaxBlockSizeBytes, error, "Invalid slab block size\n" );
+
+    heap = GetHeap( domain, flags );
+
+    Reclaim( false, &dead );
+
+    slab = FindFreeSlab( heap, sizeClass );
+    if ( !slab ) {
+        // Check on the GPU before growing
+        Reclaim( true, &dead );
+        slab = FindFreeSlab( heap, sizeClass );
+    }
+
+    if ( !slab ) {
+        // Keep the kernel round trips out of the lock
+        lock.unlock();
+
+        slab = CreateSlab( domain, flags, sizeClass );
+        FailOnTo( !slab, error, "Failed to create slab\n" );
+
+        lock.lock();
+        slab->mHeap = heap;
+        mHeaps[ heap ].mSlabs[ sizeClass ].push_back( slab );
+    }
+
+    index = slab->mFree.back();
+    slab->mFree.pop_back();
+    slab->mNumUsed++;
+    mNumBlocks++;
+
+    pBlock->mSlab = slab;
+    pBlock->mIndex = index;
+    pBlock->mBoHandle = slab->mBo->GetBoHandle();
+    pBlock->mGpuAddr = slab->mBo->GetGpuAddr() + index * GetBlockSize( sizeClass );
+    pBlock->mCpuAddr = slab->mBo->GetCpuAddr() ? slab->mBo->GetCpuAddr() + index * GetBlockSize( sizeClass ) : nullptr;
+
+    lock.unlock();
+    DestroySlabs( dead );
+
+    return true;
+
+error:
+    if ( lock.owns_lock() )
+        lock.unlock();
+
+    DestroySlabs( dead );
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSlabAllocator::Free( const Block &block )
+{
+    RetiredBlock retired = {};
+    std::vector<Slab*> dead;
+
+    // Queued requests may still reference the block
+    mContext->GetSubmitter()->Flush();
+
+    std::unique_lock<std::mutex> lock( mLock );
+
+    retired.mSlab = block.mSlab;
+    retired.mIndex = block.mIndex;
+    mContext->GetSubmittedSeqNos( retired.mSeqNos );
+
+    mRetired.push_back( retired );
+    mNumBlocks--;
+
+    // Blocks the GPU never saw go straight back on the free list
+    Reclaim( false, &dead );
+
+    lock.unlock();
+    DestroySlabs( dead );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetSlabAllocator::GetNumSlabs()
+{
+    uint32_t count = 0;
+    std::lock_guard<std::mutex> lock( mLock );
+
+    for ( auto &heap : mHeaps ) {
+        for ( auto &sizeClass : heap.mSlabs ) {
+            count += sizeClass.size();
+        }
+    }
+
+    return count;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetSlabAllocator::GetSizeClass( uint64_t sizeBytes )
+{
+    uint32_t sizeClass = 0;
+
+    while ( sizeClass < kNumClasses - 1 && GetBlockSize( sizeClass ) < sizeBytes )
+        sizeClass++;
+
+    return sizeClass;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetSlabAllocator::GetHeap( uint32_t domain, uint64_t flags )
+{
+    uint32_t heap;
+
+    for ( heap = 0; heap < mHeaps.size(); ++heap ) {
+        if ( mHeaps[ heap ].mDomain == domain && mHeaps[ heap ].mFlags == flags )
+            return heap;
+    }
+
+    mHeaps.emplace_back();
+    mHeaps.back().mDomain = domain;
+    mHeaps.back().mFlags = flags;
+
+    return heap;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSlabAllocator::Slab *VcetSlabAllocator::CreateSlab( uint32_t domain, uint64_t flags, uint32_t sizeClass )
+{
+    bool ret;
+    uint32_t numBlocks = kSlabSizeBytes / GetBlockSize( sizeClass );
+    Slab *slab = new Slab();
+
+    slab->mBo = new VcetBo( mContext );
+    slab->mHeap = 0;
+    slab->mClass = sizeClass;
+    slab->mNumUsed = 0;
+
+    ret = slab->mBo->AllocateInDomain( kSlabSizeBytes, domain, flags, kSlabSizeBytes );
+    FailOnTo( !ret, error, "Failed to allocate slab bo\n" );
+
+    // Mappable slabs stay mapped, blocks are mapped for free
+    if ( slab->mBo->IsMappable() ) {
+        ret = slab->mBo->Map();
+        FailOnTo( !ret, error, "Failed to map slab bo\n" );
+    }
+
+    // Hand out the lowest blocks first
+    slab->mFree.reserve( numBlocks );
+    for ( uint32_t i = numBlocks; i > 0; --i ) {
+        slab->mFree.push_back( i - 1 );
+    }
+
+    return slab;
+
+error:
+    delete slab->mBo;
+    delete slab;
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSlabAllocator::Slab *VcetSlabAllocator::FindFreeSlab( uint32_t heap, uint32_t sizeClass )
+{
+    Slab *best = nullptr;
+
+    // Prefer the fullest slab, so that the others can drain
+    for ( Slab *slab : mHeaps[ heap ].mSlabs[ sizeClass ] ) {
+        if ( !slab->mFree.empty() && ( !best || slab->mNumUsed > best->mNumUsed ) )
+            best = slab;
+    }
+
+    return best;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSlabAllocator::Reclaim( bool query, std::vector<Slab*> *pDead )
+{
+    while ( !mRetired.empty() && IsRetired( mRetired.front(), query ) ) {
+        Slab *slab = mRetired.front().mSlab;
+
+        slab->mFree.push_back( mRetired.front().mIndex );
+        slab->mNumUsed--;
+        mRetired.pop_front();
+
+        // Retired blocks still count as used
+        if ( slab->mNumUsed )
+            continue;
+
+        std::vector<Slab*> &slabs = mHeaps[ slab->mHeap ].mSlabs[ slab->mClass ];
+        uint32_t numEmpty = std::count_if( slabs.begin(), slabs.end(),
+                                           []( Slab *s ) { return s->mNumUsed == 0; } );
+
+        if ( numEmpty > kMaxEmptySlabs ) {
+            slabs.erase( std::find( slabs.begin(), slabs.end(), slab ) );
+            pDead->push_back( slab );
+        }
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSlabAllocator::IsRetired( const RetiredBlock &retired, bool query )
+{
+    int err;
+    uint32_t expired;
+
+    for ( uint32_t ring = 0; ring < VcetContext::kMaxRings; ++ring ) {
+        uint64_t seqNo = retired.mSeqNos[ ring ];
+        struct amdgpu_cs_fence fence = {0};
+
+        if ( !seqNo || mContext->IsFenceSignaled( ring, seqNo ) )
+            continue;
+
+        if ( !query )
+            return false;
+
+        fence.context = mContext->GetDrm()->GetContext();
+        fence.ip_type = mContext->GetIpType();
+        fence.ring = ring;
+        fence.fence = seqNo;
+
+        err = mContext->GetDrm()->CsQueryFenceStatus( &fence, 0, 0, &expired );
+        if ( err || !expired )
+            return false;
+
+        mContext->OnFenceSignaled( ring, seqNo );
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSlabAllocator::DestroySlabs( const std::vector<Slab*> &slabs )
+{
+    for ( Slab *slab : slabs ) {
+        delete slab->mBo;
+        delete slab;
+    }
+}
@@ -0,0 +1,141 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <libdrm/amdgpu.h>
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "VcetContext.h"
+
+class VcetBo;
+
+/**
+ * Carves small bos out of a few large ones
+ *
+ * Blocks come in power of two size classes, each slab holding blocks of a
+ * single class of a single heap. Allocating and freeing a block only touches
+ * the free lists, the kernel is involved when a size class runs out of slabs.
+ *
+ * The GPU may still be using a freed block, so it only goes back on its
+ * free list once every submission made before the free has retired.
+ */
+class VcetSlabAllocator
+{
+    private:
+        static constexpr uint64_t kSlabSizeBytes = 2 * 1024 * 1024;
+        static constexpr uint64_t kMinBlockSizeBytes = 4096;
+        static constexpr uint32_t kNumClasses = 7;
+        static constexpr uint32_t kMaxEmptySlabs = 1;   // Kept around per size class
+
+        struct Slab;
+
+        // Slabs of one domain and set of creation flags
+        struct Heap {
+            uint32_t mDomain;
+            uint64_t mFlags;
+            std::vector<Slab*> mSlabs[ kNumClasses ];
+        };
+
+        struct Slab {
+            VcetBo *mBo;
+            uint32_t mHeap;                 // Index in mHeaps
+            uint32_t mClass;
+            uint32_t mNumUsed;
+            std::vector<uint32_t> mFree;    // Block indices
+        };
+
+    public:
+        // Larger allocations get a bo of their own
+        static constexpr uint64_t kMaxBlockSizeBytes = kMinBlockSizeBytes << ( kNumClasses - 1 );
+        static constexpr uint64_t kBlockAlignment = kMinBlockSizeBytes;
+
+        struct Block {
+            Slab *mSlab;
+            uint32_t mIndex;
+            amdgpu_bo_handle mBoHandle;     // The slab's
+            uint64_t mGpuAddr;
+            uint8_t *mCpuAddr;              // nullptr if the slab isn't mappable
+        };
+
+    public:
+        VcetSlabAllocator( VcetContext *pContext );
+        ~VcetSlabAllocator();
+
+        /**
+         * Allocate a block of at least sizeBytes
+         *
+         * The block lives in a bo allocated with domain and flags, see
+         * VcetBo::AllocateInDomain().
+         */
+        bool Allocate( uint64_t sizeBytes, uint32_t domain, uint64_t flags, Block *pBlock );
+
+        /**
+         * Return a block once the GPU is done with it
+         */
+        void Free( const Block &block );
+
+        /**
+         * Getters/Setters
+         */
+        uint32_t GetNumSlabs();
+        uint32_t GetNumBlocks()     { std::lock_guard<std::mutex> lock( mLock ); return mNumBlocks; }
+
+    private:
+        struct RetiredBlock {
+            Slab *mSlab;
+            uint32_t mIndex;
+            uint64_t mSeqNos[ VcetContext::kMaxRings ];  // Submissions that may use the block
+        };
+
+        static uint32_t GetSizeClass( uint64_t sizeBytes );
+        static uint64_t GetBlockSize( uint32_t sizeClass ) { return kMinBlockSizeBytes << sizeClass; }
+
+        uint32_t GetHeap( uint32_t domain, uint64_t flags );
+        Slab *CreateSlab( uint32_t domain, uint64_t flags, uint32_t sizeClass );
+        Slab *FindFreeSlab( uint32_t heap, uint32_t sizeClass );
+
+        /**
+         * Put retired blocks back on their free lists
+         *
+         * Fences that aren't known to have signaled are queried if query is
+         * set. Empty slabs in excess are moved to pDead, they must be
+         * destroyed once the lock is dropped.
+         */
+        void Reclaim( bool query, std::vector<Slab*> *pDead );
+        bool IsRetired( const RetiredBlock &retired, bool query );
+        void DestroySlabs( const std::vector<Slab*> &slabs );
+
+        VcetContext *mContext;
+
+        std::mutex mLock;
+        std::vector<Heap> mHeaps;               // Only ever grows, a handful of entries
+        std::deque<RetiredBlock> mRetired;      // In order of retirement
+        uint32_t mNumBlocks;
+};
@@ -0,0 +1,271 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include <util/util.h>
+
+#include "VcetJob.h"
+
+#include "VcetSubmitter.h"
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSubmitter::VcetSubmitter( VcetContext *pContext )
+    : mContext( pContext )
+    , mTail( 0 )
+    , mHead( 0 )
+    , mProcessed( 0 )
+    , mSleeping( false )
+    , mFlushWaiters( 0 )
+    , mRunning( false )
+    , mThreadId( std::thread::id() )
+{
+    for ( uint32_t i = 0; i < kQueueSize; ++i )
+        mCells[i].mSeq = i;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetSubmitter::~VcetSubmitter()
+{
+    Stop();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSubmitter::Start()
+{
+    FailOnTo( mRunning, error, "Submitter already running\n" );
+
+    {
+        // The thread waits for mRunning under mLock, and requests can be
+        // queued as soon as it is set, so publish the thread's id first
+        std::lock_guard<std::mutex> lock( mLock );
+        mThread = std::thread( &VcetSubmitter::Run, this );
+        mThreadId = mThread.get_id();
+        mRunning = true;
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSubmitter::Stop()
+{
+    if ( !mRunning )
+        return;
+
+    Flush();
+
+    {
+        std::lock_guard<std::mutex> lock( mLock );
+        mRunning = false;
+    }
+
+    mCond.notify_all();
+    mThread.join();
+    mThreadId = std::thread::id();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSubmitter::Enqueue( const VcetContext::MvRequest &request, void *pCookie )
+{
+    bool ret;
+    Cell *cell;
+    uint64_t pos = mTail.load( std::memory_order_relaxed );
+
+    FailOnTo( !mRunning, error, "Submitter not running\n" );
+
+    // Rejected here, a bad request would fail the batch it is drained with
+    ret = mContext->ValidateMvRequest( &request );
+    FailOnTo( !ret, error, "Bad request\n" );
+
+    // Claim a slot
+    for ( ;; ) {
+        cell = &mCells[ pos & kQueueMask ];
+        int64_t diff = (int64_t) cell->mSeq.load( std::memory_order_acquire ) - (int64_t) pos;
+
+        if ( diff == 0 ) {
+            if ( mTail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                break;
+        } else if ( diff < 0 ) {
+            // Full, wait for the submission thread to catch up
+            std::this_thread::yield();
+            pos = mTail.load( std::memory_order_relaxed );
+        } else {
+            pos = mTail.load( std::memory_order_relaxed );
+        }
+    }
+
+    if ( request.mJob )
+        request.mJob->SetPending();
+
+    cell->mRequest.mRequest = request;
+    cell->mRequest.mCookie = pCookie;
+    cell->mSeq.store( pos + 1, std::memory_order_release );
+
+    // Pairs with the fence in WaitForRequest(), either we see the submission
+    // thread asleep or it sees our request
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    if ( mSleeping.load( std::memory_order_relaxed ) ) {
+        std::lock_guard<std::mutex> lock( mLock );
+        mCond.notify_one();
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSubmitter::Flush()
+{
+    uint64_t target = mTail.load();
+
+    if ( !mRunning || mProcessed.load() >= target )
+        return;
+
+    // Evicting a session frees bos from the submission thread. No queued
+    // request references those, and the thread can't wait for itself.
+    if ( std::this_thread::get_id() == mThreadId.load() )
+        return;
+
+    mFlushWaiters++;
+    {
+        std::unique_lock<std::mutex> lock( mLock );
+        mFlushCond.wait( lock, [this, target]{ return mProcessed.load() >= target; } );
+    }
+    mFlushWaiters--;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSubmitter::HasRequest()
+{
+    return mCells[ mHead & kQueueMask ].mSeq.load( std::memory_order_acquire ) == mHead + 1;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetSubmitter::WaitForRequest()
+{
+    std::unique_lock<std::mutex> lock( mLock );
+
+    mSleeping.store( true, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    mCond.wait( lock, [this]{ return !mRunning || HasRequest(); } );
+    mSleeping.store( false, std::memory_order_relaxed );
+
+    return mRunning;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetSubmitter::Dequeue( VcetContext::MvRequest *pRequests, void **pCookies, uint32_t max )
+{
+    uint32_t count = 0;
+
+    while ( count < max && HasRequest() ) {
+        Cell *cell = &mCells[ mHead & kQueueMask ];
+
+        pRequests[ count ] = cell->mRequest.mRequest;
+        pCookies[ count ] = cell->mRequest.mCookie;
+        count++;
+        cell->mSeq.store( mHead + kQueueSize, std::memory_order_release );
+        mHead++;
+    }
+
+    return count;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSubmitter::Process( VcetContext::MvRequest *pRequests, void **pCookies, uint32_t count )
+{
+    bool ret;
+    uint32_t numSubmitted = 0;
+
+    ret = mContext->CalculateMvBatch( pRequests, count, &numSubmitted );
+
+    // The batch mixes producers, so one failing request must not fail the
+    // others. Give each of the remaining requests a submission of its own.
+    if ( !ret ) {
+        for ( uint32_t i = numSubmitted; i < count; ++i ) {
+            ret = mContext->CalculateMvBatch( &pRequests[i], 1 );
+            WarnOn( !ret, "Failed to submit queued request\n" );
+        }
+    }
+
+    for ( uint32_t i = 0; i < count; ++i ) {
+        VcetJob *pJob = pRequests[i].mJob;
+
+        if ( !pJob )
+            continue;
+
+        // Jobs that made it into a submission before a failure have a seq_no
+        if ( pJob->GetSeqNo() ) {
+            ret = mContext->TrackCompletion( pJob, pCookies[i] );
+            WarnOn( !ret, "Failed to track completion of a queued request\n" );
+        }
+
+        pJob->SetSubmitted( pJob->GetSeqNo() != 0 );
+    }
+
+    // Pairs with mFlushWaiters++ in Flush()
+    mProcessed.store( mHead );
+    if ( mFlushWaiters.load() ) {
+        std::lock_guard<std::mutex> lock( mLock );
+        mFlushCond.notify_all();
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetSubmitter::Run()
+{
+    VcetContext::MvRequest requests[ kMaxBatch ];
+    void *cookies[ kMaxBatch ];
+    uint32_t count;
+
+    for ( ;; ) {
+        count = Dequeue( requests, cookies, kMaxBatch );
+        if ( count ) {
+            Process( requests, cookies, count );
+            continue;
+        }
+
+        // Stop() flushes first, so the queue is empty once we are told to quit
+        if ( !WaitForRequest() )
+            break;
+    }
+}
@@ -0,0 +1,121 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "VcetContext.h"
+
+/**
+ * Submission thread for a VcetContext
+ *
+ * Producers push motion vector requests into a bounded lock-free queue. A
+ * single thread drains it, builds the IBs and packs whatever accumulated
+ * into as few submissions as possible.
+ */
+class VcetSubmitter
+{
+    private:
+        static constexpr uint32_t kQueueSize = 256;
+        static constexpr uint32_t kQueueMask = kQueueSize - 1;
+        static constexpr uint32_t kMaxBatch = 32;
+
+    public:
+        VcetSubmitter( VcetContext *pContext );
+        ~VcetSubmitter();
+
+        /**
+         * Start the submission thread
+         */
+        bool Start();
+
+        /**
+         * Submit everything queued so far and stop the submission thread
+         *
+         * No request may be enqueued concurrently
+         */
+        void Stop();
+
+        /**
+         * Queue a request for submission, safe to call from any thread
+         *
+         * Invalid requests are rejected. The request's job is pending until
+         * the submission thread picks it up. pCookie is handed to the
+         * completion reactor. Blocks while the queue is full.
+         */
+        bool Enqueue( const VcetContext::MvRequest &request, void *pCookie );
+
+        /**
+         * Wait until every request queued so far has been submitted
+         *
+         * Returns immediately when the submission thread is not running
+         */
+        void Flush();
+
+        bool IsRunning() { return mRunning; }
+
+    private:
+        struct Request {
+            VcetContext::MvRequest mRequest;
+            void *mCookie;
+        };
+
+        // A queue slot is free for enqueue position p when mSeq == p, and
+        // holds the request for position p when mSeq == p + 1
+        struct Cell {
+            std::atomic<uint64_t> mSeq;
+            Request mRequest;
+        };
+
+        void Run();
+        bool HasRequest();
+        bool WaitForRequest();
+        uint32_t Dequeue( VcetContext::MvRequest *pRequests, void **pCookies, uint32_t max );
+        void Process( VcetContext::MvRequest *pRequests, void **pCookies, uint32_t count );
+
+        VcetContext *mContext;
+
+        Cell mCells[ kQueueSize ];
+        std::atomic<uint64_t> mTail;        // Next enqueue position
+        uint64_t mHead;                     // Next dequeue position, submission thread only
+        std::atomic<uint64_t> mProcessed;   // Requests submitted so far
+
+        std::thread mThread;
+        std::mutex mLock;
+        std::condition_variable mCond;          // Wakes the submission thread
+        std::condition_variable mFlushCond;     // Wakes Flush()
+        std::atomic<bool> mSleeping;
+        std::atomic<uint32_t> mFlushWaiters;
+        std::atomic<bool> mRunning;
+
+        // Read by Flush() from any thread, mThread is only touched by
+        // Start() and Stop()
+        std::atomic<std::thread::id> mThreadId;
+};
@@ -0,0 +1,186 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+
+#include <util/util.h>
+
+#include "Drm.h"
+#include "VcetContext.h"
+
+#include "VcetVaArena.h"
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetVaArena::VcetVaArena( VcetContext *pContext )
+    : mContext( pContext )
+    , mUsedBytes( 0 )
+{
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+VcetVaArena::~VcetVaArena()
+{
+    int err;
+
+    WarnOn( mUsedBytes, "Destroying a VA arena with 0x%lx bytes in use\n", mUsedBytes );
+
+    for ( Region &region : mRegions ) {
+        err = mContext->GetDrm()->VaRangeFree( region.mVaHandle );
+        WarnOn( err, "Failed to free VA arena region\n" );
+    }
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetVaArena::Init()
+{
+    std::lock_guard<std::mutex> lock( mLock );
+
+    return AddRegion();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetVaArena::AddRegion()
+{
+    int err;
+    Region region;
+
+    FailOnToQ( mRegions.size() >= kMaxRegions, error );
+
+    // Aligned to its size, so that every block is naturally aligned
+    err = mContext->GetDrm()->VaRangeAlloc( amdgpu_gpu_va_range_general,
+                                            kRegionSizeBytes, kRegionSizeBytes, 0,
+                                            &region.mBase, &region.mVaHandle, 0 );
+    FailOnTo( err, error, "Failed to reserve VA arena region\n" );
+
+    region.mFree[ kNumOrders - 1 ].insert( 0 );
+    mRegions.push_back( std::move( region ) );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetVaArena::Allocate( uint64_t sizeBytes, uint64_t *pGpuAddr )
+{
+    uint32_t order = GetOrder( sizeBytes );
+    uint32_t found = kNumOrders;
+    uint64_t offset;
+    Region *region = nullptr;
+    std::lock_guard<std::mutex> lock( mLock );
+
+    if ( mRegions.empty() || !sizeBytes || sizeBytes > kRegionSizeBytes )
+        return false;
+
+    // The lowest region with room keeps placement deterministic
+    for ( Region &candidate : mRegions ) {
+        found = order;
+        while ( found < kNumOrders && candidate.mFree[ found ].empty() )
+            found++;
+
+        if ( found < kNumOrders ) {
+            region = &candidate;
+            break;
+        }
+    }
+
+    if ( !region ) {
+        if ( !AddRegion() )
+            return false;
+
+        region = &mRegions.back();
+        found = kNumOrders - 1;
+    }
+
+    // The lowest free block keeps placement deterministic
+    offset = *region->mFree[ found ].begin();
+    region->mFree[ found ].erase( region->mFree[ found ].begin() );
+
+    // Split it down to size, keeping the lower halves
+    while ( found > order ) {
+        found--;
+        region->mFree[ found ].insert( offset + GetBlockSize( found ) );
+    }
+
+    mUsedBytes += GetBlockSize( order );
+    *pGpuAddr = region->mBase + offset;
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetVaArena::Free( uint64_t gpuAddr, uint64_t sizeBytes )
+{
+    uint32_t order = GetOrder( sizeBytes );
+    uint64_t offset;
+    Region *region = nullptr;
+    std::lock_guard<std::mutex> lock( mLock );
+
+    for ( Region &candidate : mRegions ) {
+        if ( gpuAddr - candidate.mBase < kRegionSizeBytes ) {
+            region = &candidate;
+            break;
+        }
+    }
+
+    if ( !region ) {
+        Warn( "Freeing 0x%lx, which is not in the VA arena\n", gpuAddr );
+        return;
+    }
+
+    offset = gpuAddr - region->mBase;
+    mUsedBytes -= GetBlockSize( order );
+
+    // Merge with the free buddies
+    while ( order < kNumOrders - 1 ) {
+        auto buddy = region->mFree[ order ].find( offset ^ GetBlockSize( order ) );
+        if ( buddy == region->mFree[ order ].end() )
+            break;
+
+        region->mFree[ order ].erase( buddy );
+        offset &= ~GetBlockSize( order );
+        order++;
+    }
+
+    region->mFree[ order ].insert( offset );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+uint32_t VcetVaArena::GetOrder( uint64_t sizeBytes )
+{
+    uint32_t order = 0;
+
+    while ( order < kNumOrders - 1 && GetBlockSize( order ) < sizeBytes )
+        order++;
+
+    return order;
+}
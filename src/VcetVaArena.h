@@ -0,0 +1,103 @@
+/* * Copyright (C) 2018 Valve Software
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated
+ * documentation files (the "Software"), to deal in the
+ * Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall
+ * be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+ * KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+ * WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+ * PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+ * OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <libdrm/amdgpu.h>
+
+#include <mutex>
+#include <set>
+#include <vector>
+
+class VcetContext;
+
+/**
+ * GPU VA ranges reserved as needed, handed out by a buddy allocator
+ *
+ * Blocks are power of two sized and naturally aligned. Placement only
+ * depends on the sequence of allocations made by the context, so bos land at
+ * the same addresses from one run to the next.
+ */
+class VcetVaArena
+{
+    private:
+        static constexpr uint64_t kMinBlockSizeBytes = 4096;
+        static constexpr uint32_t kNumOrders = 15;      // 4 KB to 64 MB
+        static constexpr uint64_t kRegionSizeBytes = kMinBlockSizeBytes << ( kNumOrders - 1 );
+
+        // A context's frames, sessions and slabs fit in the first region up
+        // to 1080p. Cap the reservations at 4 GB of VA per context.
+        static constexpr uint32_t kMaxRegions = 64;
+
+    public:
+        VcetVaArena( VcetContext *pContext );
+        ~VcetVaArena();
+
+        /**
+         * Reserve the first region
+         */
+        bool Init();
+
+        /**
+         * Hand out a range of at least sizeBytes
+         *
+         * Returns false if the arena can't fit it, the caller should fall
+         * back to a VA range of its own.
+         */
+        bool Allocate( uint64_t sizeBytes, uint64_t *pGpuAddr );
+
+        /**
+         * Give back a range returned by Allocate( sizeBytes )
+         */
+        void Free( uint64_t gpuAddr, uint64_t sizeBytes );
+
+        /**
+         * Getters/Setters
+         */
+        uint64_t GetUsedBytes()     { std::lock_guard<std::mutex> lock( mLock ); return mUsedBytes; }
+        uint64_t GetReservedBytes() { std::lock_guard<std::mutex> lock( mLock ); return mRegions.size() * kRegionSizeBytes; }
+
+    private:
+        struct Region {
+            amdgpu_va_handle mVaHandle;
+            uint64_t mBase;
+            std::set<uint64_t> mFree[ kNumOrders ];     // Offsets of free blocks
+        };
+
+        /**
+         * Reserve one more region, requires mLock
+         */
+        bool AddRegion();
+
+        static uint32_t GetOrder( uint64_t sizeBytes );
+        static uint64_t GetBlockSize( uint32_t order ) { return kMinBlockSizeBytes << order; }
+
+        VcetContext *mContext;
+
+        std::mutex mLock;
+        std::vector<Region> mRegions;
+        uint64_t mUsedBytes;
+};
@@ -25,14 +25,21 @@
 //
 
 #include <stdio.h>
+#include <string.h>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include <util/util.h>
 #include <vcetoy/vcetoy.h>
 
+#include "Drm.h"
 #include "VcetContext.h"
 #include "VcetBo.h"
 #include "VcetJob.h"
+#include "VcetSlabAllocator.h"
+#include "VcetSubmitter.h"
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
@@ -136,6 +143,168 @@ error:
     VcetJob *name = VcetJobFromHandle( hnd );            \
     if (!name) return false;
 
+static_assert( VcetContext::kMaxRings == VCET_MAX_RINGS, "VcetContextStats ring counters out of sync" );
+
+/**
+ * The device list is built once per process
+ */
+static std::mutex sDeviceListLock;
+static std::vector<VcetDeviceInfo> sDeviceList;
+static bool sDeviceListValid = false;
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool ProbeDevice( const DrmDeviceDesc &desc, VcetDeviceInfo *pInfo )
+{
+    bool ret;
+    VcetContext probe;
+
+    memset( pInfo, 0, sizeof(*pInfo) );
+    snprintf( pInfo->renderNode, sizeof(pInfo->renderNode), "%s", desc.mRenderNode.c_str() );
+    snprintf( pInfo->busId, sizeof(pInfo->busId), "%s", desc.mBusId.c_str() );
+    pInfo->pciVendorId = desc.mVendorId;
+    pInfo->pciDeviceId = desc.mDeviceId;
+
+    ret = probe.MinimalInit( desc.mBusId.c_str() );
+    FailOnTo( !ret, error, "Failed to probe device %s\n", desc.mBusId.c_str() );
+
+    pInfo->familyId = probe.GetFamilyId();
+    pInfo->mvSupported = probe.IsMvDumpSupported();
+    WarnOn( !probe.QueryVceFwVersion( &pInfo->vceFwVersion ), "Failed to query VCE firmware of %s\n", desc.mBusId.c_str() );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool GetDeviceList( std::vector<VcetDeviceInfo> *pDevices )
+{
+    int err;
+    Drm drm;
+    std::vector<DrmDeviceDesc> descs;
+    std::lock_guard<std::mutex> lock( sDeviceListLock );
+
+    if ( !sDeviceListValid ) {
+        err = drm.GetDevices( &descs );
+        FailOnTo( err, error, "Failed to enumerate devices\n" );
+
+        // Keep devices that fail to probe so indices match the drm order
+        for ( const DrmDeviceDesc &desc : descs ) {
+            VcetDeviceInfo info;
+            ProbeDevice( desc, &info );
+            sDeviceList.push_back( info );
+        }
+
+        sDeviceListValid = true;
+    }
+
+    *pDevices = sDeviceList;
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool SelectLeastLoadedDevice( const std::vector<VcetDeviceInfo> &devices, uint32_t *pIndex )
+{
+    uint32_t bestLoad = UINT32_MAX;
+
+    for ( uint32_t i = 0; i < devices.size(); ++i ) {
+        uint32_t load;
+
+        if ( !devices[i].mvSupported )
+            continue;
+
+        load = VcetContext::GetDeviceLoad( devices[i].busId );
+        if ( load < bestLoad ) {
+            bestLoad = load;
+            *pIndex = i;
+        }
+    }
+
+    return bestLoad != UINT32_MAX;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool GetDrmPriority( VcetPriority priority, int32_t *pDrmPriority )
+{
+    switch ( priority ) {
+        case VCET_PRIORITY_LOW:
+            *pDrmPriority = AMDGPU_CTX_PRIORITY_LOW;
+            return true;
+        case VCET_PRIORITY_NORMAL:
+            *pDrmPriority = AMDGPU_CTX_PRIORITY_NORMAL;
+            return true;
+        case VCET_PRIORITY_HIGH:
+            *pDrmPriority = AMDGPU_CTX_PRIORITY_HIGH;
+            return true;
+        case VCET_PRIORITY_VERY_HIGH:
+            *pDrmPriority = AMDGPU_CTX_PRIORITY_VERY_HIGH;
+            return true;
+    }
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool GetDeviceBusId( uint32_t deviceIndex, std::string *pBusId )
+{
+    bool ret;
+    std::vector<VcetDeviceInfo> devices;
+
+    ret = GetDeviceList( &devices );
+    FailOnTo( !ret, error, "Failed to select device: device query failed\n" );
+
+    if ( deviceIndex == VCET_DEVICE_LEAST_LOADED ) {
+        ret = SelectLeastLoadedDevice( devices, &deviceIndex );
+        FailOnTo( !ret, error, "Failed to select device: no supported device\n" );
+    }
+
+    FailOnTo( deviceIndex >= devices.size(), error, "Failed to select device: bad device index\n" );
+
+    *pBusId = devices[deviceIndex].busId;
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool CreateContext( VcetCtxHandle *pCtx, const char *busId, uint32_t maxWidth, uint32_t maxHeight,
+                           int32_t priority = AMDGPU_CTX_PRIORITY_NORMAL )
+{
+    bool ret;
+    std::shared_ptr<VcetContext> ctx = nullptr;
+
+    FailOnTo( !pCtx, error, "Failed to create context: bad parameter\n" );
+
+    ctx = std::make_shared<VcetContext>();
+    FailOnTo( !ctx, error, "Failed to create context: out of memory\n" );
+
+    ret = ctx->Init( maxWidth, maxHeight, busId, priority );
+    FailOnTo( !ret, error, "Failed to create context: init failed\n" );
+
+    FailOnTo( !ctx->IsMvDumpSupported(), error, "MV dump not supported\n" );
+
+    *pCtx = new VcetCtxProxy(std::move(ctx));
+    FailOnTo( !*pCtx, error, "Failed to create context: failed to allocate handle\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetIsSystemSupported()
@@ -161,22 +330,53 @@ error:
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetContextCreate( VcetCtxHandle *pCtx, uint32_t maxWidth, uint32_t maxHeight )
+{
+    return CreateContext( pCtx, nullptr, maxWidth, maxHeight );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextCreate2( VcetCtxHandle *pCtx, const VcetContextCreateInfo *pCreateInfo )
 {
     bool ret;
-    std::shared_ptr<VcetContext> ctx = nullptr;
+    int32_t priority;
+    std::string busId;
 
-    FailOnTo( !pCtx, error, "Failed to create context: bad parameter\n" );
+    FailOnTo( !pCreateInfo, error, "Failed to create context: bad parameter\n" );
 
-    ctx = std::make_shared<VcetContext>();
-    FailOnTo( !ctx, error, "Failed to create context: out of memory\n" );
+    ret = GetDrmPriority( pCreateInfo->priority, &priority );
+    FailOnTo( !ret, error, "Failed to create context: bad priority\n" );
 
-    ret = ctx->Init( maxWidth, maxHeight );
-    FailOnTo( !ret, error, "Failed to create context: init failed\n" );
+    if ( !pCreateInfo->selectDevice )
+        return CreateContext( pCtx, nullptr, pCreateInfo->width, pCreateInfo->height, priority );
 
-    FailOnTo( !ctx->IsMvDumpSupported(), error, "MV dump not supported\n" );
+    ret = GetDeviceBusId( pCreateInfo->deviceIndex, &busId );
+    FailOnTo( !ret, error, "Failed to create context: bad device\n" );
 
-    *pCtx = new VcetCtxProxy(std::move(ctx));
-    FailOnTo( !*pCtx, error, "Failed to create context: failed to allocate handle\n" );
+    return CreateContext( pCtx, busId.c_str(), pCreateInfo->width, pCreateInfo->height, priority );
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetEnumerateDevices( VcetDeviceInfo *pDevices, uint32_t *pCount )
+{
+    bool ret;
+    std::vector<VcetDeviceInfo> devices;
+
+    FailOnTo( !pCount, error, "Failed to enumerate devices: bad parameter\n" );
+
+    ret = GetDeviceList( &devices );
+    FailOnTo( !ret, error, "Failed to enumerate devices: query failed\n" );
+
+    if ( pDevices ) {
+        *pCount = std::min<uint32_t>( *pCount, devices.size() );
+        memcpy( pDevices, devices.data(), *pCount * sizeof(VcetDeviceInfo) );
+    } else {
+        *pCount = devices.size();
+    }
 
     return true;
 
@@ -184,6 +384,48 @@ error:
     return false;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextCreateOnDevice( VcetCtxHandle *pCtx, uint32_t deviceIndex, uint32_t maxWidth, uint32_t maxHeight )
+{
+    bool ret;
+    std::string busId;
+
+    ret = GetDeviceBusId( deviceIndex, &busId );
+    FailOnTo( !ret, error, "Failed to create context: bad device\n" );
+
+    return CreateContext( pCtx, busId.c_str(), maxWidth, maxHeight );
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextGetDevice( VcetCtxHandle _ctx, uint32_t *pDeviceIndex )
+{
+    bool ret;
+    std::vector<VcetDeviceInfo> devices;
+    VCET_CTX_B( ctx, _ctx );
+
+    FailOnTo( !pDeviceIndex, error, "Failed to get device: bad parameter\n" );
+
+    ret = GetDeviceList( &devices );
+    FailOnTo( !ret, error, "Failed to get device: device query failed\n" );
+
+    for ( uint32_t i = 0; i < devices.size(); ++i ) {
+        if ( ctx->GetDrm()->GetBusId() == devices[i].busId ) {
+            *pDeviceIndex = i;
+            return true;
+        }
+    }
+
+    FailOnTo( true, error, "Failed to get device: device not enumerated\n" );
+
+error:
+    return false;
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 void VcetContextDestroy( VcetCtxHandle *pCtx )
@@ -195,6 +437,193 @@ void VcetContextDestroy( VcetCtxHandle *pCtx )
     *pCtx = nullptr;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextGetStats( VcetCtxHandle _ctx, VcetContextStats *pStats )
+{
+    VCET_CTX_B( ctx, _ctx );
+
+    FailOnTo( !pStats, error, "Failed to get stats: bad parameter\n" );
+
+    // Account for the requests that are still queued
+    ctx->GetSubmitter()->Flush();
+
+    memset( pStats, 0, sizeof(*pStats) );
+    pStats->boListCacheHits = ctx->GetBoListCacheHits();
+    pStats->boListCacheMisses = ctx->GetBoListCacheMisses();
+    pStats->ibRingWaits = ctx->GetIbRingWaits();
+    pStats->ibRingSize = ctx->GetIbRingSize();
+    pStats->numSessions = ctx->GetNumSessions();
+    pStats->sessionEvictions = ctx->GetSessionEvictions();
+    pStats->numSlabs = ctx->GetSlabAllocator()->GetNumSlabs();
+    pStats->numSlabBlocks = ctx->GetSlabAllocator()->GetNumBlocks();
+    pStats->vaArenaBytes = ctx->GetVaArena()->GetUsedBytes();
+    pStats->vaArenaReservedBytes = ctx->GetVaArena()->GetReservedBytes();
+    pStats->importCacheHits = ctx->GetImportCacheHits();
+    pStats->numCachedImports = ctx->GetNumCachedImports();
+    pStats->numRings = ctx->GetNumRings();
+
+    for ( uint32_t i = 0; i < pStats->numRings; ++i ) {
+        pStats->ringSubmissions[i] = ctx->GetRingSubmissions( ctx->GetRing( i ) );
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextSetIbRingPolicy( VcetCtxHandle _ctx, VcetIbRingPolicy policy, uint32_t maxIbs )
+{
+    bool ret;
+    VcetContext::IbRingPolicy ringPolicy;
+    VCET_CTX_B( ctx, _ctx );
+
+    switch ( policy ) {
+    case VCET_IB_RING_POLICY_WAIT:
+        ringPolicy = VcetContext::IbRingPolicy::Wait;
+        break;
+    case VCET_IB_RING_POLICY_GROW:
+        ringPolicy = VcetContext::IbRingPolicy::Grow;
+        break;
+    case VCET_IB_RING_POLICY_FAIL:
+        ringPolicy = VcetContext::IbRingPolicy::Fail;
+        break;
+    default:
+        FailOnTo( true, error, "Failed to set ib ring policy: bad policy %d\n", policy );
+    }
+
+    ret = ctx->SetIbRingPolicy( ringPolicy, maxIbs );
+    FailOnTo( !ret, error, "Failed to set ib ring policy: bad parameter\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextSetRingBalancePolicy( VcetCtxHandle _ctx, VcetRingBalancePolicy policy )
+{
+    VCET_CTX_B( ctx, _ctx );
+
+    switch ( policy ) {
+    case VCET_RING_BALANCE_LEAST_OUTSTANDING:
+        ctx->SetRingBalancePolicy( VcetContext::RingBalancePolicy::LeastOutstanding );
+        break;
+    case VCET_RING_BALANCE_ROUND_ROBIN:
+        ctx->SetRingBalancePolicy( VcetContext::RingBalancePolicy::RoundRobin );
+        break;
+    default:
+        FailOnTo( true, error, "Failed to set ring balance policy: bad policy %d\n", policy );
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextFlushImports( VcetCtxHandle _ctx )
+{
+    VCET_CTX_B( ctx, _ctx );
+
+    ctx->FlushImportCache();
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextSetWaitPolicy( VcetCtxHandle _ctx, VcetWaitPolicy policy, uint32_t spin_us )
+{
+    uint64_t spinNs = spin_us * 1000ull;
+    VCET_CTX_B( ctx, _ctx );
+
+    switch ( policy ) {
+    case VCET_WAIT_BLOCK:
+        ctx->SetWaitPolicy( VcetContext::WaitPolicy::Block, spinNs );
+        break;
+    case VCET_WAIT_SPIN:
+        ctx->SetWaitPolicy( VcetContext::WaitPolicy::Spin, spinNs );
+        break;
+    case VCET_WAIT_ADAPTIVE:
+        ctx->SetWaitPolicy( VcetContext::WaitPolicy::Adaptive, spinNs );
+        break;
+    default:
+        FailOnTo( true, error, "Failed to set wait policy: bad policy %d\n", policy );
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextSetAsyncSubmit( VcetCtxHandle _ctx, bool enable )
+{
+    bool ret;
+    VCET_CTX_B( ctx, _ctx );
+
+    if ( !enable ) {
+        ctx->GetSubmitter()->Stop();
+        return true;
+    }
+
+    if ( ctx->GetSubmitter()->IsRunning() )
+        return true;
+
+    ret = ctx->GetSubmitter()->Start();
+    FailOnTo( !ret, error, "Failed to enable async submission: failed to start thread\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetContextStartReactor( VcetCtxHandle _ctx, VcetJobCompletionCallback callback, void *pUserData, int *pEventFd )
+{
+    bool ret;
+    VcetReactor::Callback reactorCallback;
+    VCET_CTX_B( ctx, _ctx );
+
+    if ( callback ) {
+        reactorCallback = [callback, pUserData]( void *pCookie ) {
+            callback( reinterpret_cast<VcetJobHandle>( pCookie ), pUserData );
+        };
+    }
+
+    ret = ctx->GetReactor()->Start( reactorCallback );
+    FailOnTo( !ret, error, "Failed to start reactor: start failed\n" );
+
+    if ( pEventFd )
+        *pEventFd = ctx->GetReactor()->GetEventFd();
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+void VcetContextStopReactor( VcetCtxHandle _ctx )
+{
+    VCET_CTX_V( ctx, _ctx );
+
+    ctx->GetReactor()->Stop();
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetBoAlignDimensions( VcetCtxHandle _ctx, uint32_t width, uint32_t height, uint32_t *pAlignedWidth, uint32_t *pAlignedHeight )
@@ -268,19 +697,55 @@ error:
 
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
-bool VcetBoImport( VcetCtxHandle _ctx, int fd, bool mappable, VcetBoHandle *pBo )
+bool VcetBoCreate2( VcetCtxHandle _ctx, const VcetBoCreateInfo *pCreateInfo, VcetBoHandle *pBo )
 {
     bool ret;
+    VcetBo::Usage usage;
     std::shared_ptr<VcetBo> bo = nullptr;
     VCET_CTX_B( ctx, _ctx );
 
-    FailOnTo( !pBo , error, "Failed to import bo: bad parameter\n" );
+    FailOnTo( !pCreateInfo || !pBo, error, "Failed to create bo: bad parameter\n" );
+    FailOnTo( !pCreateInfo->sizeBytes == !( pCreateInfo->width && pCreateInfo->height ),
+              error, "Failed to create bo: expected either a size or image dimensions\n" );
+
+    switch ( pCreateInfo->usage ) {
+    case VCET_BO_USAGE_DEVICE:          usage = VcetBo::Usage::kDevice; break;
+    case VCET_BO_USAGE_DEVICE_UPLOAD:   usage = VcetBo::Usage::kDeviceUpload; break;
+    case VCET_BO_USAGE_UPLOAD:          usage = VcetBo::Usage::kUpload; break;
+    case VCET_BO_USAGE_READBACK:        usage = VcetBo::Usage::kReadback; break;
+    default:
+        FailOnTo( true, error, "Failed to create bo: bad usage %d\n", pCreateInfo->usage );
+    }
 
     bo = std::make_shared<VcetBo>( ctx );
-    FailOnTo( !bo, error, "Failed to import bo: out of memory\n" );
+    FailOnTo( !bo, error, "Failed to create bo: out of memory\n" );
+
+    if ( pCreateInfo->sizeBytes )
+        ret = bo->Allocate( pCreateInfo->sizeBytes, usage );
+    else
+        ret = bo->Allocate( pCreateInfo->width, pCreateInfo->height, usage );
+    FailOnTo( !ret, error, "Failed to create bo: failed to allocate\n" );
+
+    *pBo = new VcetBoProxy(std::move(bo));
+    FailOnTo( !*pBo, error, "Failed to create bo: failed to allocate handle\n" );
+
+    return true;
 
-    ret = bo->Import( fd, mappable );
-    FailOnTo( !ret, error, "Failed to import bo: failed to import\n" );
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBoImport( VcetCtxHandle _ctx, int fd, bool mappable, VcetBoHandle *pBo )
+{
+    std::shared_ptr<VcetBo> bo = nullptr;
+    VCET_CTX_B( ctx, _ctx );
+
+    FailOnTo( !pBo , error, "Failed to import bo: bad parameter\n" );
+
+    bo = ctx->ImportBo( fd, mappable );
+    FailOnTo( !bo, error, "Failed to import bo: failed to import\n" );
 
     *pBo = new VcetBoProxy(std::move(bo));
     FailOnTo( !*pBo , error, "Failed to import bo: failed to allocate handle\n" );
@@ -291,6 +756,31 @@ error:
     return false;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBoCreateFromHostPtr( VcetCtxHandle _ctx, void *ptr, uint64_t sizeBytes, VcetBoHandle *pBo )
+{
+    bool ret;
+    std::shared_ptr<VcetBo> bo = nullptr;
+    VCET_CTX_B( ctx, _ctx );
+
+    FailOnTo( !pBo, error, "Failed to create bo from host memory: bad parameter\n" );
+
+    bo = std::make_shared<VcetBo>( ctx );
+    FailOnTo( !bo, error, "Failed to create bo from host memory: out of memory\n" );
+
+    ret = bo->CreateFromHostPtr( ptr, sizeBytes );
+    FailOnTo( !ret, error, "Failed to create bo from host memory: failed to wrap\n" );
+
+    *pBo = new VcetBoProxy(std::move(bo));
+    FailOnTo( !*pBo, error, "Failed to create bo from host memory: failed to allocate handle\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 void VcetBoDestroy( VcetBoHandle *pBo )
@@ -339,6 +829,38 @@ error:
     return false;
 }
 
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBoUpload( VcetBoHandle _bo, const void *pSrc, uint32_t srcPitch, uint32_t rows, uint32_t maxThreads )
+{
+    bool ret;
+    VCET_BO_B( bo, _bo );
+
+    ret = bo->Upload( (const uint8_t*) pSrc, srcPitch, rows, maxThreads );
+    FailOnTo( !ret, error, "Failed to upload to bo: upload failed\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetBoReadback( VcetBoHandle _bo, void *pDst, uint64_t offset, uint64_t size )
+{
+    bool ret;
+    VCET_BO_B( bo, _bo );
+
+    ret = bo->Readback( (uint8_t*) pDst, offset, size );
+    FailOnTo( !ret, error, "Failed to read back bo: readback failed\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
 //---------------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 bool VcetCalculateMv( VcetCtxHandle _ctx, VcetBoHandle _oldFrame, VcetBoHandle _newFrame, VcetBoHandle _mvBo, uint32_t width, uint32_t height, VcetJobHandle _job )
@@ -353,9 +875,81 @@ bool VcetCalculateMv( VcetCtxHandle _ctx, VcetBoHandle _oldFrame, VcetBoHandle _
 
     FailOnTo( !ctx , error, "Failed to calculate mv: bad parameter\n" );
 
+    if ( ctx->GetSubmitter()->IsRunning() ) {
+        VcetContext::MvRequest request = { oldFrame, newFrame, mvBo, width, height, job };
+
+        ret = ctx->GetSubmitter()->Enqueue( request, _job );
+        FailOnTo( !ret, error, "Failed to calculate mv: failed to queue request\n" );
+
+        return true;
+    }
+
     ret = ctx->CalculateMv( oldFrame, newFrame, mvBo, width, height, job );
     FailOnTo( !ret, error, "Failed to calculate mv: processing failure\n" );
 
+    ret = ctx->TrackCompletion( job, _job );
+    FailOnTo( !ret, error, "Failed to calculate mv: failed to track completion\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetCalculateMvBatch( VcetCtxHandle _ctx, const VcetMvBatchEntry *pEntries, uint32_t count )
+{
+    bool ret;
+    bool tracked;
+    std::vector<VcetContext::MvRequest> requests;
+    VCET_CTX_B( ctx, _ctx );
+
+    FailOnTo( !pEntries || !count, error, "Failed to calculate mv batch: bad parameter\n" );
+
+    requests.resize( count );
+    for ( uint32_t i = 0; i < count; ++i ) {
+        VCET_BO_B( oldFrame, pEntries[i].oldFrame );
+        VCET_BO_B( newFrame, pEntries[i].newFrame );
+        VCET_BO_B( mvBo, pEntries[i].mvBo );
+        VCET_JOB_B( job, pEntries[i].job );
+
+        requests[i].mOldFrame = oldFrame;
+        requests[i].mNewFrame = newFrame;
+        requests[i].mMvBo = mvBo;
+        requests[i].mWidth = pEntries[i].width;
+        requests[i].mHeight = pEntries[i].height;
+        requests[i].mJob = job;
+    }
+
+    if ( ctx->GetSubmitter()->IsRunning() ) {
+        // Like a synchronous batch, queue nothing unless the whole batch is valid
+        for ( uint32_t i = 0; i < count; ++i ) {
+            ret = ctx->ValidateMvRequest( &requests[i] );
+            FailOnTo( !ret, error, "Failed to calculate mv batch: bad request %u\n", i );
+        }
+
+        for ( uint32_t i = 0; i < count; ++i ) {
+            ret = ctx->GetSubmitter()->Enqueue( requests[i], pEntries[i].job );
+            FailOnTo( !ret, error, "Failed to calculate mv batch: failed to queue request\n" );
+        }
+
+        return true;
+    }
+
+    ret = ctx->CalculateMvBatch( requests.data(), count );
+
+    // Requests submitted ahead of a failure still complete as usual
+    for ( uint32_t i = 0; i < count; ++i ) {
+        if ( !requests[i].mJob->GetSeqNo() )
+            continue;
+
+        tracked = ctx->TrackCompletion( requests[i].mJob, pEntries[i].job );
+        FailOnTo( !tracked, error, "Failed to calculate mv batch: failed to track completion\n" );
+    }
+
+    FailOnTo( !ret, error, "Failed to calculate mv batch: processing failure\n" );
+
     return true;
 
 error:
@@ -403,12 +997,99 @@ void VcetJobDestroy( VcetJobHandle *pJob )
 bool VcetJobWait( VcetCtxHandle _ctx, VcetJobHandle _job, uint64_t timeout_ns )
 {
     bool ret;
+    bool completed = false;
     VCET_CTX_B( ctx, _ctx );
     VCET_JOB_B( job, _job );
 
-    ret = job->WaitForCompletion( timeout_ns );
+    ret = job->Query( timeout_ns, &completed );
     FailOnTo( !ret, error, "Failed to wait for job completion: wait failed.\n" );
 
+    // A timeout is not an error, report it quietly
+    FailOnToQ( !completed, error );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJobPoll( VcetCtxHandle _ctx, VcetJobHandle _job, bool *pCompleted )
+{
+    bool ret;
+    VCET_CTX_B( ctx, _ctx );
+    VCET_JOB_B( job, _job );
+
+    FailOnTo( !pCompleted, error, "Failed to poll job: bad parameter\n" );
+
+    ret = job->Query( 0, pCompleted );
+    FailOnTo( !ret, error, "Failed to poll job: query failed\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJobWaitMany( VcetCtxHandle _ctx, const VcetJobHandle *pJobs, uint32_t count, bool waitAll, uint64_t timeout_ns, bool *pCompleted, uint32_t *pFirst )
+{
+    bool ret;
+    std::vector<VcetJob*> jobs;
+    VCET_CTX_B( ctx, _ctx );
+
+    FailOnTo( !pJobs || !count || !pCompleted, error, "Failed to wait for jobs: bad parameter\n" );
+
+    jobs.resize( count );
+    for ( uint32_t i = 0; i < count; ++i ) {
+        VCET_JOB_B( job, pJobs[i] );
+        jobs[i] = job;
+    }
+
+    ret = VcetJob::WaitMany( ctx, jobs.data(), count, waitAll, timeout_ns, pCompleted, pFirst );
+    FailOnTo( !ret, error, "Failed to wait for jobs: wait failed\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJobExportSyncFd( VcetCtxHandle _ctx, VcetJobHandle _job, int *pFd )
+{
+    bool ret;
+    VCET_CTX_B( ctx, _ctx );
+    VCET_JOB_B( job, _job );
+
+    FailOnTo( !pFd, error, "Failed to export job: bad parameter\n" );
+
+    ret = job->ExportSyncFd( pFd );
+    FailOnTo( !ret, error, "Failed to export job: export failed\n" );
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+bool VcetJobAddReadback( VcetJobHandle _job, VcetBoHandle _bo, void *pDst, uint64_t offset, uint64_t size )
+{
+    bool ret;
+    VcetBoProxy *bo = reinterpret_cast<VcetBoProxy*>( _bo );
+    VCET_JOB_B( job, _job );
+
+    FailOnTo( !bo || !bo->mPtr, error, "Failed to add readback: invalid bo handle\n" );
+
+    // The job keeps the bo alive until the copy is made
+    ret = job->AddReadback( bo->mPtr, (uint8_t*) pDst, offset, size );
+    FailOnTo( !ret, error, "Failed to add readback: add failed\n" );
+
     return true;
 
 error:
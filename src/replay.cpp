@@ -0,0 +1,541 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include <util/util.h>
+
+#include "Drm.h"
+#include "DrmCapture.h"
+
+/**
+ * Replays a command stream recorded with VCETOY_CAPTURE
+ *
+ * Combined with VCETOY_LIBDRM/VCETOY_LIBDRM_AMDGPU pointing at the libdrm
+ * stand-in, this measures the CPU cost of the submission path without a GPU.
+ */
+
+typedef std::chrono::steady_clock ReplayClock;
+
+struct ReplayBo {
+    amdgpu_bo_handle mHandle;
+    amdgpu_va_handle mVaHandle;
+    uint64_t mVa;
+    uint64_t mSize;
+    uint8_t *mCpu;
+};
+
+struct ReplayStats {
+    uint64_t mSubmits;
+    uint64_t mRequests;
+    uint64_t mIbs;
+    ReplayClock::duration mBoListTime;
+    ReplayClock::duration mSubmitTime;
+};
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+class CaptureReader
+{
+    public:
+        CaptureReader( const uint8_t *pData, size_t size )
+            : mData( pData )
+            , mSize( size )
+            , mOffset( 0 )
+        {
+        }
+
+        const void *Read( size_t size )
+        {
+            const void *pRet;
+
+            if ( size > mSize - mOffset )
+                return nullptr;
+
+            pRet = mData + mOffset;
+            mOffset += size;
+            return pRet;
+        }
+
+        template <typename T>
+        const T *Read()
+        {
+            return (const T*) Read( sizeof(T) );
+        }
+
+        bool AtEnd() { return mOffset == mSize; }
+
+    private:
+        const uint8_t *mData;
+        size_t mSize;
+        size_t mOffset;
+};
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool LoadCapture( const char *path, std::vector<uint8_t> *pData )
+{
+    FILE *file;
+    long size;
+    const CaptureHeader *pHeader;
+
+    file = fopen( path, "rb" );
+    FailOnTo( !file, error, "Failed to load capture: could not open %s\n", path );
+
+    fseek( file, 0, SEEK_END );
+    size = ftell( file );
+    fseek( file, 0, SEEK_SET );
+
+    pData->resize( size );
+    FailOnTo( size && fread( pData->data(), size, 1, file ) != 1, error_close, "Failed to load capture: read failed\n" );
+    fclose( file );
+
+    pHeader = (const CaptureHeader*) pData->data();
+    FailOnTo( pData->size() < sizeof(*pHeader), error, "Failed to load capture: truncated header\n" );
+    FailOnTo( pHeader->mMagic != kCaptureMagic, error, "Failed to load capture: bad magic\n" );
+    FailOnTo( pHeader->mVersion != kCaptureVersion, error, "Failed to load capture: unsupported version %u\n", pHeader->mVersion );
+
+    return true;
+
+error_close:
+    fclose( file );
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool DumpSubmit( CaptureReader *pReader )
+{
+    const CaptureSubmit *pSubmit = pReader->Read<CaptureSubmit>();
+    FailOnTo( !pSubmit, error, "Failed to dump submit: truncated\n" );
+
+    printf( "submit requests=%u\n", pSubmit->mNumRequests );
+
+    for ( uint32_t i = 0; i < pSubmit->mNumRequests; ++i ) {
+        const CaptureRequest *pRequest = pReader->Read<CaptureRequest>();
+        const uint32_t *pBos;
+        FailOnTo( !pRequest, error, "Failed to dump submit: truncated request\n" );
+
+        pBos = (const uint32_t*) pReader->Read( pRequest->mNumBos * sizeof(uint32_t) );
+        FailOnTo( !pBos, error, "Failed to dump submit: truncated bo list\n" );
+
+        printf( "  request ip=%u instance=%u ring=%u bos=[", pRequest->mIpType, pRequest->mIpInstance, pRequest->mRing );
+        for ( uint32_t j = 0; j < pRequest->mNumBos; ++j )
+            printf( "%s%u", j ? "," : "", pBos[j] );
+        printf( "]\n" );
+
+        for ( uint32_t j = 0; j < pRequest->mNumIbs; ++j ) {
+            const CaptureIb *pIb = pReader->Read<CaptureIb>();
+            const uint32_t *pDwords;
+            FailOnTo( !pIb, error, "Failed to dump submit: truncated ib\n" );
+
+            pDwords = (const uint32_t*) pReader->Read( pIb->mSizeDw * sizeof(uint32_t) );
+            FailOnTo( !pDwords, error, "Failed to dump submit: truncated ib data\n" );
+
+            printf( "    ib va=0x%lx size_dw=%u flags=0x%x\n", pIb->mVa, pIb->mSizeDw, pIb->mFlags );
+            for ( uint32_t k = 0; k < pIb->mSizeDw; ++k )
+                printf( "%s%08x%s", k % 8 ? " " : "      ", pDwords[k], ( k % 8 == 7 || k + 1 == pIb->mSizeDw ) ? "\n" : "" );
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool Dump( const std::vector<uint8_t> &capture )
+{
+    CaptureReader reader( capture.data(), capture.size() );
+    reader.Read<CaptureHeader>();
+
+    while ( !reader.AtEnd() ) {
+        const CaptureRecordHeader *pHeader = reader.Read<CaptureRecordHeader>();
+        FailOnTo( !pHeader, error, "Failed to dump: truncated record\n" );
+
+        const void *pPayload = reader.Read( pHeader->mSizeBytes );
+        FailOnTo( !pPayload, error, "Failed to dump: truncated payload\n" );
+
+        CaptureReader payload( (const uint8_t*) pPayload, pHeader->mSizeBytes );
+
+        switch ( pHeader->mType ) {
+            case kCaptureRecordBoAlloc: {
+                const CaptureBoAlloc *pAlloc = payload.Read<CaptureBoAlloc>();
+                FailOnTo( !pAlloc, error, "Failed to dump: bad bo alloc\n" );
+                printf( "bo_alloc id=%u size=%lu align=%lu heap=0x%x flags=0x%lx%s\n",
+                        pAlloc->mBoId, pAlloc->mSize, pAlloc->mAlignment,
+                        pAlloc->mHeap, pAlloc->mFlags, pAlloc->mImported ? " imported" : "" );
+                break;
+            }
+            case kCaptureRecordBoFree: {
+                const CaptureBoFree *pFree = payload.Read<CaptureBoFree>();
+                FailOnTo( !pFree, error, "Failed to dump: bad bo free\n" );
+                printf( "bo_free id=%u\n", pFree->mBoId );
+                break;
+            }
+            case kCaptureRecordVaOp: {
+                const CaptureVaOp *pOp = payload.Read<CaptureVaOp>();
+                FailOnTo( !pOp, error, "Failed to dump: bad va op\n" );
+                printf( "va_%s id=%u offset=%lu size=%lu addr=0x%lx flags=0x%lx\n",
+                        pOp->mOp == AMDGPU_VA_OP_MAP ? "map" : "unmap",
+                        pOp->mBoId, pOp->mOffset, pOp->mSize, pOp->mAddr, pOp->mFlags );
+                break;
+            }
+            case kCaptureRecordSubmit:
+                FailOnTo( !DumpSubmit( &payload ), error, "Failed to dump: bad submit\n" );
+                break;
+            default:
+                printf( "unknown type=%u size=%u\n", pHeader->mType, pHeader->mSizeBytes );
+                break;
+        }
+    }
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static ReplayBo *FindBoByVa( std::map<uint32_t, ReplayBo> *pBos, uint64_t va )
+{
+    for ( auto &it : *pBos ) {
+        ReplayBo &bo = it.second;
+        if ( bo.mVa && va >= bo.mVa && va < bo.mVa + bo.mSize )
+            return &bo;
+    }
+
+    return nullptr;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void FreeBo( Drm *pDrm, ReplayBo *pBo )
+{
+    if ( pBo->mCpu )
+        pDrm->BoCpuUnmap( pBo->mHandle );
+
+    if ( pBo->mVaHandle ) {
+        pDrm->BoVaOp( pBo->mHandle, 0, pBo->mSize, pBo->mVa, 0, AMDGPU_VA_OP_UNMAP );
+        pDrm->VaRangeFree( pBo->mVaHandle );
+    }
+
+    pDrm->BoFree( pBo->mHandle );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool ReplaySubmit( Drm *pDrm, CaptureReader *pReader, std::map<uint32_t, ReplayBo> *pBos,
+                          std::vector<struct amdgpu_cs_fence> *pFences, ReplayStats *pStats )
+{
+    int err;
+    uint32_t expired;
+    const CaptureSubmit *pSubmit;
+    std::vector<struct amdgpu_cs_request> requests;
+    std::vector<std::vector<struct amdgpu_cs_ib_info>> ibs;
+    ReplayClock::time_point start;
+
+    pSubmit = pReader->Read<CaptureSubmit>();
+    FailOnTo( !pSubmit, error, "Failed to replay submit: truncated\n" );
+
+    requests.resize( pSubmit->mNumRequests );
+    ibs.resize( pSubmit->mNumRequests );
+
+    // The IBs are about to be overwritten, so drain the previous submission
+    for ( auto &fence : *pFences ) {
+        err = pDrm->CsQueryFenceStatus( &fence, AMDGPU_TIMEOUT_INFINITE, 0, &expired );
+        FailOnTo( err, error, "Failed to replay submit: fence wait failed\n" );
+    }
+    pFences->clear();
+
+    for ( uint32_t i = 0; i < pSubmit->mNumRequests; ++i ) {
+        const CaptureRequest *pRequest = pReader->Read<CaptureRequest>();
+        const uint32_t *pBoIds;
+        std::vector<amdgpu_bo_handle> handles;
+        FailOnTo( !pRequest, error, "Failed to replay submit: truncated request\n" );
+
+        pBoIds = (const uint32_t*) pReader->Read( pRequest->mNumBos * sizeof(uint32_t) );
+        FailOnTo( !pBoIds, error, "Failed to replay submit: truncated bo list\n" );
+
+        for ( uint32_t j = 0; j < pRequest->mNumBos; ++j ) {
+            auto it = pBos->find( pBoIds[j] );
+            FailOnTo( it == pBos->end(), error, "Failed to replay submit: unknown bo %u\n", pBoIds[j] );
+            handles.push_back( it->second.mHandle );
+        }
+
+        for ( uint32_t j = 0; j < pRequest->mNumIbs; ++j ) {
+            const CaptureIb *pIb = pReader->Read<CaptureIb>();
+            const void *pDwords;
+            struct amdgpu_cs_ib_info ib = {};
+            ReplayBo *pIbBo;
+            FailOnTo( !pIb, error, "Failed to replay submit: truncated ib\n" );
+
+            pDwords = pReader->Read( pIb->mSizeDw * sizeof(uint32_t) );
+            FailOnTo( !pDwords, error, "Failed to replay submit: truncated ib data\n" );
+
+            pIbBo = FindBoByVa( pBos, pIb->mVa );
+            FailOnTo( !pIbBo, error, "Failed to replay submit: no bo backs ib va 0x%lx\n", pIb->mVa );
+
+            if ( !pIbBo->mCpu ) {
+                err = pDrm->BoCpuMap( pIbBo->mHandle, &pIbBo->mCpu );
+                FailOnTo( err, error, "Failed to replay submit: ib map failed\n" );
+            }
+
+            memcpy( pIbBo->mCpu + ( pIb->mVa - pIbBo->mVa ), pDwords, pIb->mSizeDw * sizeof(uint32_t) );
+
+            ib.ib_mc_address = pIb->mVa;
+            ib.size = pIb->mSizeDw;
+            ib.flags = pIb->mFlags;
+            ibs[i].push_back( ib );
+        }
+
+        requests[i].ip_type = pRequest->mIpType;
+        requests[i].ip_instance = pRequest->mIpInstance;
+        requests[i].ring = pRequest->mRing;
+        requests[i].number_of_ibs = ibs[i].size();
+        requests[i].ibs = ibs[i].data();
+
+        start = ReplayClock::now();
+        err = pDrm->BoListCreate( handles.size(), handles.data(), nullptr, &requests[i].resources );
+        pStats->mBoListTime += ReplayClock::now() - start;
+        FailOnTo( err, error, "Failed to replay submit: bo list create failed\n" );
+
+        pStats->mIbs += ibs[i].size();
+    }
+
+    start = ReplayClock::now();
+    err = pDrm->CsSubmit( 0, requests.data(), requests.size() );
+    pStats->mSubmitTime += ReplayClock::now() - start;
+
+    for ( auto &request : requests )
+        pDrm->BoListDestroy( request.resources );
+
+    FailOnTo( err, error, "Failed to replay submit: submission failed\n" );
+
+    for ( auto &request : requests ) {
+        struct amdgpu_cs_fence fence = {};
+        fence.context = pDrm->GetContext();
+        fence.ip_type = request.ip_type;
+        fence.ip_instance = request.ip_instance;
+        fence.ring = request.ring;
+        fence.fence = request.seq_no;
+        pFences->push_back( fence );
+    }
+
+    pStats->mSubmits++;
+    pStats->mRequests += requests.size();
+
+    return true;
+
+error:
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool Replay( Drm *pDrm, const std::vector<uint8_t> &capture, ReplayStats *pStats )
+{
+    int err;
+    uint32_t expired;
+    std::map<uint32_t, ReplayBo> bos;
+    std::vector<struct amdgpu_cs_fence> fences;
+    CaptureReader reader( capture.data(), capture.size() );
+    reader.Read<CaptureHeader>();
+
+    while ( !reader.AtEnd() ) {
+        const CaptureRecordHeader *pHeader = reader.Read<CaptureRecordHeader>();
+        FailOnTo( !pHeader, error, "Failed to replay: truncated record\n" );
+
+        const void *pPayload = reader.Read( pHeader->mSizeBytes );
+        FailOnTo( !pPayload, error, "Failed to replay: truncated payload\n" );
+
+        CaptureReader payload( (const uint8_t*) pPayload, pHeader->mSizeBytes );
+
+        switch ( pHeader->mType ) {
+            case kCaptureRecordBoAlloc: {
+                const CaptureBoAlloc *pAlloc = payload.Read<CaptureBoAlloc>();
+                struct amdgpu_bo_alloc_request req = {};
+                ReplayBo bo = {};
+                FailOnTo( !pAlloc, error, "Failed to replay: bad bo alloc\n" );
+
+                req.alloc_size = pAlloc->mSize;
+                req.phys_alignment = pAlloc->mAlignment;
+                req.preferred_heap = pAlloc->mHeap;
+                req.flags = pAlloc->mFlags;
+
+                err = pDrm->BoAlloc( &req, &bo.mHandle );
+                FailOnTo( err, error, "Failed to replay: bo alloc failed\n" );
+
+                bo.mSize = pAlloc->mSize;
+                bos[pAlloc->mBoId] = bo;
+                break;
+            }
+            case kCaptureRecordBoFree: {
+                const CaptureBoFree *pFree = payload.Read<CaptureBoFree>();
+                FailOnTo( !pFree, error, "Failed to replay: bad bo free\n" );
+
+                auto it = bos.find( pFree->mBoId );
+                FailOnTo( it == bos.end(), error, "Failed to replay: unknown bo %u\n", pFree->mBoId );
+
+                FreeBo( pDrm, &it->second );
+                bos.erase( it );
+                break;
+            }
+            case kCaptureRecordVaOp: {
+                const CaptureVaOp *pOp = payload.Read<CaptureVaOp>();
+                FailOnTo( !pOp, error, "Failed to replay: bad va op\n" );
+
+                auto it = bos.find( pOp->mBoId );
+                FailOnTo( it == bos.end(), error, "Failed to replay: unknown bo %u\n", pOp->mBoId );
+                ReplayBo &bo = it->second;
+
+                if ( pOp->mOp == AMDGPU_VA_OP_MAP ) {
+                    uint64_t va = 0;
+
+                    err = pDrm->VaRangeAlloc( amdgpu_gpu_va_range_general, pOp->mSize, 0, pOp->mAddr,
+                                              &va, &bo.mVaHandle, 0 );
+                    FailOnTo( err || va != pOp->mAddr, error, "Failed to replay: va 0x%lx unavailable\n", pOp->mAddr );
+
+                    err = pDrm->BoVaOp( bo.mHandle, pOp->mOffset, pOp->mSize, pOp->mAddr, pOp->mFlags, AMDGPU_VA_OP_MAP );
+                    FailOnTo( err, error, "Failed to replay: va map failed\n" );
+
+                    bo.mVa = pOp->mAddr - pOp->mOffset;
+                    bo.mSize = pOp->mOffset + pOp->mSize;
+                } else {
+                    err = pDrm->BoVaOp( bo.mHandle, pOp->mOffset, pOp->mSize, pOp->mAddr, pOp->mFlags, pOp->mOp );
+                    FailOnTo( err, error, "Failed to replay: va unmap failed\n" );
+
+                    if ( bo.mVaHandle )
+                        pDrm->VaRangeFree( bo.mVaHandle );
+
+                    bo.mVaHandle = 0;
+                    bo.mVa = 0;
+                }
+                break;
+            }
+            case kCaptureRecordSubmit:
+                FailOnTo( !ReplaySubmit( pDrm, &payload, &bos, &fences, pStats ), error, "Failed to replay: bad submit\n" );
+                break;
+            default:
+                Warn( "Skipping unknown capture record type %u\n", pHeader->mType );
+                break;
+        }
+    }
+
+    for ( auto &fence : fences )
+        pDrm->CsQueryFenceStatus( &fence, AMDGPU_TIMEOUT_INFINITE, 0, &expired );
+
+    for ( auto &it : bos )
+        FreeBo( pDrm, &it.second );
+
+    return true;
+
+error:
+    for ( auto &it : bos )
+        FreeBo( pDrm, &it.second );
+
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static double ToUs( ReplayClock::duration duration, uint64_t count )
+{
+    double us = std::chrono::duration<double, std::micro>( duration ).count();
+    return count ? us / count : 0;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void Usage( const char *argv0 )
+{
+    printf( "usage: %s [--dump] [--iterations N] capture\n", argv0 );
+    printf( "  --dump          print the capture as text instead of replaying it\n" );
+    printf( "  --iterations N  replay the capture N times (default 1)\n" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int main( int argc, char **argv )
+{
+    int err;
+    bool dump = false;
+    uint32_t iterations = 1;
+    const char *path = nullptr;
+    std::vector<uint8_t> capture;
+    ReplayStats stats = {};
+    ReplayClock::time_point start;
+    ReplayClock::duration total;
+    Drm drm;
+
+    for ( int i = 1; i < argc; ++i ) {
+        if ( !strcmp( argv[i], "--dump" ) ) {
+            dump = true;
+        } else if ( !strcmp( argv[i], "--iterations" ) && i + 1 < argc ) {
+            iterations = strtoul( argv[++i], nullptr, 0 );
+        } else if ( argv[i][0] != '-' && !path ) {
+            path = argv[i];
+        } else {
+            Usage( argv[0] );
+            return 1;
+        }
+    }
+
+    if ( !path ) {
+        Usage( argv[0] );
+        return 1;
+    }
+
+    FailOnTo( !LoadCapture( path, &capture ), error, "Failed to load %s\n", path );
+
+    if ( dump )
+        return Dump( capture ) ? 0 : 1;
+
+    err = drm.Init();
+    FailOnTo( err, error, "Failed to initialize drm\n" );
+
+    start = ReplayClock::now();
+    for ( uint32_t i = 0; i < iterations; ++i ) {
+        FailOnTo( !Replay( &drm, capture, &stats ), error, "Failed to replay %s\n", path );
+    }
+    total = ReplayClock::now() - start;
+
+    printf( "Replayed %lu submits (%lu requests, %lu ibs) over %u iterations in %.3f ms\n",
+            stats.mSubmits, stats.mRequests, stats.mIbs, iterations,
+            std::chrono::duration<double, std::milli>( total ).count() );
+    printf( "  bo list create: %8.3f us/submit\n", ToUs( stats.mBoListTime, stats.mSubmits ) );
+    printf( "  cs submit:      %8.3f us/submit\n", ToUs( stats.mSubmitTime, stats.mSubmits ) );
+
+    return 0;
+
+error:
+    return 1;
+}
@@ -0,0 +1,1179 @@
+//
+// Copyright (C) 2018 Valve Software
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated
+// documentation files (the "Software"), to deal in the
+// Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute,
+// sublicense, and/or sell copies of the Software, and to
+// permit persons to whom the Software is furnished to do so,
+// subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall
+// be included in all copies or substantial portions of the
+// Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY
+// KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+// WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR
+// PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS
+// OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+// OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+// SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vcetoy/vcetoy.h>
+
+/**
+ * Motion vector throughput benchmark
+ *
+ * Keeps a configurable number of jobs in flight and reports the sustained job
+ * rate and the CPU time spent in VcetCalculateMv. Run it against the libdrm
+ * stand-in, optionally with VCETOY_FAKEDRM_LATENCY_US, to benchmark without a
+ * GPU.
+ *
+ * With --contexts N it instead measures VcetContextCreate latency while N
+ * contexts are alive at once, as when one process handles many streams. Each
+ * context holds a VCE session, of which a device has 16.
+ *
+ * With --priority it measures the latency of single jobs while another
+ * context keeps the engine saturated, once with both at normal priority and
+ * once from a high priority context against a low priority load.
+ *
+ * With --wait it measures the wake-up delay of VcetJobWait under each wait
+ * policy, as the time from submission to wake-up beyond the fastest job seen.
+ * Run it with VCETOY_FAKEDRM_LATENCY_US to model a job of fixed duration.
+ *
+ * With --async it compares synchronous and asynchronous submission: the cost
+ * of a VcetCalculateMv call with D jobs in flight, and the latency from the
+ * call to the wake-up of a single job.
+ *
+ * With --threads N it submits from 1, 2, 4, ... N threads sharing one
+ * context, each keeping D jobs in flight, and reports the aggregate job rate
+ * and the cost of each VcetCalculateMv call.
+ *
+ * With --sizes N it cycles a stream through N frame sizes, switching every
+ * kJobsPerSize jobs, once recreating the context on each switch and once
+ * letting the context's session pool handle all of them.
+ *
+ * With --churn N it replaces one of N live motion vector bos before each job,
+ * as a pipeline recycling its outputs would, and reports the cost of
+ * VcetBoCreate and VcetBoDestroy. Once with bos small enough to be carved out
+ * of the context's slabs, and once with bos just too large for them.
+ *
+ * With --imports N it imports the motion vector bo of each job from one of N
+ * dma-bufs in turn, as with a producer cycling through N buffers, and reports
+ * the cost of VcetBoImport. Once going through the context's import cache and
+ * once flushing it after every import. The libdrm stand-in takes memfds as
+ * dma-bufs.
+ *
+ * With --maps N it maps and unmaps a frame N times per frame, as code that
+ * maps around each CPU access would, and reports the cost of a cycle. Once
+ * with a new frame bo every frame, and once reusing the same bo.
+ */
+
+typedef std::chrono::steady_clock BenchClock;
+
+static const uint32_t kJobsPerSize = 8;
+
+// Just above the largest block the slabs hand out
+static const uint64_t kUnslabbedBoSize = 256 * 1024 + 4096;
+
+struct BenchOptions {
+    uint32_t mWidth;
+    uint32_t mHeight;
+    uint32_t mJobs;
+    uint32_t mDepth;
+    uint32_t mContexts;
+    uint32_t mPriority;
+    uint32_t mWait;
+    uint32_t mAsync;
+    uint32_t mThreads;
+    uint32_t mSizes;
+    uint32_t mChurn;
+    uint32_t mImports;
+    uint32_t mMaps;
+    uint32_t mUploads;
+    uint32_t mReadbacks;
+};
+
+/**
+ * A context with a pair of frames to compute motion vectors between
+ */
+struct BenchStream {
+    VcetCtxHandle mCtx;
+    VcetBoHandle mFrames[2];
+    VcetBoHandle mMvBo;
+    std::vector<VcetJobHandle> mJobs;
+};
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static double ToMs( BenchClock::duration duration )
+{
+    return std::chrono::duration<double, std::milli>( duration ).count();
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static double ThreadCpuUs()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &ts );
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static int CountOpenFds()
+{
+    int count = 0;
+    DIR *dir = opendir( "/proc/self/fd" );
+
+    if ( !dir )
+        return -1;
+
+    while ( readdir( dir ) )
+        count++;
+
+    closedir( dir );
+
+    // Skip ".", ".." and the fd of dir itself
+    return count - 3;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool CreateFrame( VcetCtxHandle ctx, const BenchOptions &options, int shift, VcetBoHandle *pBo )
+{
+    uint8_t *pData = nullptr;
+    uint32_t alignedWidth, alignedHeight;
+
+    if ( !VcetBoCreateImage( ctx, options.mWidth, options.mHeight, true, pBo, &alignedWidth, &alignedHeight ) )
+        return false;
+
+    if ( !VcetBoMap( *pBo, &pData ) )
+        return false;
+
+    // A repeatable noise pattern, shifted to create motion between frames
+    for ( uint32_t y = 0; y < alignedHeight; ++y ) {
+        for ( uint32_t x = 0; x < alignedWidth; ++x ) {
+            uint32_t v = ( x + shift ) * 2654435761u ^ y * 40503u;
+            pData[ y * alignedWidth + x ] = v >> 24;
+        }
+    }
+    memset( pData + alignedWidth * alignedHeight, 128, alignedWidth * alignedHeight / 2 );
+
+    return VcetBoUnmap( *pBo );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void DestroyStream( BenchStream *pStream )
+{
+    for ( auto &job : pStream->mJobs )
+        VcetJobDestroy( &job );
+    VcetBoDestroy( &pStream->mMvBo );
+    VcetBoDestroy( &pStream->mFrames[0] );
+    VcetBoDestroy( &pStream->mFrames[1] );
+    VcetContextDestroy( &pStream->mCtx );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool CreateStream( const BenchOptions &options, VcetPriority priority, uint32_t depth, BenchStream *pStream )
+{
+    VcetContextCreateInfo createInfo = {};
+
+    *pStream = BenchStream();
+    pStream->mJobs.resize( depth, nullptr );
+
+    createInfo.width = options.mWidth;
+    createInfo.height = options.mHeight;
+    createInfo.priority = priority;
+
+    if ( !VcetContextCreate2( &pStream->mCtx, &createInfo ) ) {
+        printf( "Failed to create a %ux%u context\n", options.mWidth, options.mHeight );
+        return false;
+    }
+
+    if ( !CreateFrame( pStream->mCtx, options, 0, &pStream->mFrames[0] ) ||
+         !CreateFrame( pStream->mCtx, options, 4, &pStream->mFrames[1] ) )
+        goto error;
+
+    if ( !VcetBoCreate( pStream->mCtx, options.mWidth * options.mHeight, true, &pStream->mMvBo ) )
+        goto error;
+
+    for ( auto &job : pStream->mJobs ) {
+        if ( !VcetJobCreate( pStream->mCtx, &job ) )
+            goto error;
+    }
+
+    return true;
+
+error:
+    DestroyStream( pStream );
+    return false;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool Submit( const BenchOptions &options, BenchStream *pStream, VcetJobHandle job )
+{
+    return VcetCalculateMv( pStream->mCtx, pStream->mFrames[0], pStream->mFrames[1], pStream->mMvBo,
+                            options.mWidth, options.mHeight, job );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool Run( const BenchOptions &options )
+{
+    BenchStream stream;
+    BenchClock::duration submitTime = BenchClock::duration::zero();
+    BenchClock::time_point start, submitStart;
+    double totalMs;
+    bool ret = false;
+
+    if ( !CreateStream( options, VCET_PRIORITY_NORMAL, options.mDepth, &stream ) )
+        return false;
+
+    start = BenchClock::now();
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        VcetJobHandle job = stream.mJobs[ i % options.mDepth ];
+
+        // Recycle the oldest job once the pipeline is full
+        if ( i >= options.mDepth && !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        submitStart = BenchClock::now();
+        if ( !Submit( options, &stream, job ) )
+            goto out;
+        submitTime += BenchClock::now() - submitStart;
+    }
+
+    for ( auto &job : stream.mJobs ) {
+        if ( !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+    }
+    totalMs = ToMs( BenchClock::now() - start );
+
+    printf( "%ux%u, %u jobs, %u in flight\n", options.mWidth, options.mHeight, options.mJobs, options.mDepth );
+    printf( "  total:  %10.3f ms\n", totalMs );
+    printf( "  rate:   %10.1f jobs/s\n", options.mJobs * 1000.0 / totalMs );
+    printf( "  submit: %10.3f us/job\n", ToMs( submitTime ) * 1000.0 / options.mJobs );
+
+    ret = true;
+
+out:
+    DestroyStream( &stream );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void SaturateThread( const BenchOptions &options, BenchStream *pStream, std::atomic<bool> *pStop )
+{
+    uint32_t i = 0;
+
+    while ( !pStop->load() ) {
+        VcetJobHandle job = pStream->mJobs[ i++ % pStream->mJobs.size() ];
+
+        if ( !VcetJobWait( pStream->mCtx, job, VCETOY_TIMEOUT_INFINITE ) || !Submit( options, pStream, job ) )
+            break;
+    }
+
+    for ( auto &job : pStream->mJobs )
+        VcetJobWait( pStream->mCtx, job, VCETOY_TIMEOUT_INFINITE );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunPriorityLatency( const BenchOptions &options, VcetPriority loadPriority, VcetPriority priority, const char *name )
+{
+    BenchStream background, foreground;
+    std::vector<double> latencies;
+    std::atomic<bool> stop( false );
+    std::thread saturate;
+    bool ret = false;
+
+    if ( !CreateStream( options, loadPriority, options.mDepth, &background ) )
+        return false;
+
+    if ( !CreateStream( options, priority, 1, &foreground ) ) {
+        DestroyStream( &background );
+        return false;
+    }
+
+    saturate = std::thread( SaturateThread, std::cref( options ), &background, &stop );
+
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        BenchClock::time_point start = BenchClock::now();
+
+        if ( !Submit( options, &foreground, foreground.mJobs[0] ) ||
+             !VcetJobWait( foreground.mCtx, foreground.mJobs[0], VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        latencies.push_back( ToMs( BenchClock::now() - start ) );
+    }
+
+    std::sort( latencies.begin(), latencies.end() );
+    printf( "  %-7s p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n", name,
+            latencies[ latencies.size() / 2 ],
+            latencies[ latencies.size() * 99 / 100 ],
+            latencies.back() );
+
+    ret = true;
+
+out:
+    stop = true;
+    saturate.join();
+    DestroyStream( &foreground );
+    DestroyStream( &background );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunPriority( const BenchOptions &options )
+{
+    printf( "%ux%u, %u jobs against a load %u deep\n",
+            options.mWidth, options.mHeight, options.mJobs, options.mDepth );
+
+    return RunPriorityLatency( options, VCET_PRIORITY_NORMAL, VCET_PRIORITY_NORMAL, "equal" ) &&
+           RunPriorityLatency( options, VCET_PRIORITY_LOW, VCET_PRIORITY_HIGH, "high" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunWaitLatency( const BenchOptions &options, VcetWaitPolicy policy,
+                            std::vector<double> *pLatencies, double *pCpuUs )
+{
+    static const uint32_t kWarmupJobs = 16;
+    BenchStream stream;
+    VcetJobHandle job;
+    double cpuStart;
+    bool ret = false;
+
+    if ( !CreateStream( options, VCET_PRIORITY_NORMAL, 1, &stream ) )
+        return false;
+
+    job = stream.mJobs[0];
+    if ( !VcetContextSetWaitPolicy( stream.mCtx, policy, 0 ) )
+        goto out;
+
+    // Give the adaptive policy a job history
+    for ( uint32_t i = 0; i < kWarmupJobs; ++i ) {
+        if ( !Submit( options, &stream, job ) || !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+    }
+
+    cpuStart = ThreadCpuUs();
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        BenchClock::time_point start = BenchClock::now();
+
+        if ( !Submit( options, &stream, job ) || !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        pLatencies->push_back( ToMs( BenchClock::now() - start ) * 1000.0 );
+    }
+    *pCpuUs = ( ThreadCpuUs() - cpuStart ) / options.mJobs;
+
+    ret = true;
+
+out:
+    DestroyStream( &stream );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunWait( const BenchOptions &options )
+{
+    static const VcetWaitPolicy kPolicies[] = { VCET_WAIT_BLOCK, VCET_WAIT_SPIN, VCET_WAIT_ADAPTIVE };
+    static const char *kNames[] = { "block", "spin", "adaptive" };
+    static const uint32_t kNumPolicies = sizeof( kPolicies ) / sizeof( kPolicies[0] );
+    std::vector<double> latencies[ kNumPolicies ];
+    double cpuUs[ kNumPolicies ];
+    double fastest = 1e12;
+
+    for ( uint32_t i = 0; i < kNumPolicies; ++i ) {
+        if ( !RunWaitLatency( options, kPolicies[i], &latencies[i], &cpuUs[i] ) )
+            return false;
+
+        std::sort( latencies[i].begin(), latencies[i].end() );
+        fastest = std::min( fastest, latencies[i].front() );
+    }
+
+    printf( "%ux%u, %u jobs, fastest job %.1f us\n", options.mWidth, options.mHeight, options.mJobs, fastest );
+    for ( uint32_t i = 0; i < kNumPolicies; ++i ) {
+        const std::vector<double> &sorted = latencies[i];
+
+        printf( "  %-8s wake-up p50 %8.1f us  p99 %8.1f us  cpu %8.1f us/job\n", kNames[i],
+                sorted[ sorted.size() / 2 ] - fastest,
+                sorted[ sorted.size() * 99 / 100 ] - fastest,
+                cpuUs[i] );
+    }
+
+    return true;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunSubmitCost( const BenchOptions &options, bool async )
+{
+    BenchStream stream;
+    std::vector<double> callUs, latencyUs;
+    bool ret = false;
+
+    if ( !CreateStream( options, VCET_PRIORITY_NORMAL, options.mDepth, &stream ) )
+        return false;
+
+    if ( !VcetContextSetAsyncSubmit( stream.mCtx, async ) )
+        goto out;
+
+    // Cost of the call while the pipeline is kept full
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        VcetJobHandle job = stream.mJobs[ i % options.mDepth ];
+        BenchClock::time_point start;
+
+        if ( i >= options.mDepth && !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        start = BenchClock::now();
+        if ( !Submit( options, &stream, job ) )
+            goto out;
+        callUs.push_back( ToMs( BenchClock::now() - start ) * 1000.0 );
+    }
+
+    for ( auto &job : stream.mJobs ) {
+        if ( !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+    }
+
+    // Latency of a lone job, including the hand-off to the submission thread
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        BenchClock::time_point start = BenchClock::now();
+
+        if ( !Submit( options, &stream, stream.mJobs[0] ) ||
+             !VcetJobWait( stream.mCtx, stream.mJobs[0], VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        latencyUs.push_back( ToMs( BenchClock::now() - start ) * 1000.0 );
+    }
+
+    std::sort( callUs.begin(), callUs.end() );
+    std::sort( latencyUs.begin(), latencyUs.end() );
+    printf( "  %-6s call p50 %8.3f us  p99 %8.3f us  latency p50 %8.1f us  p99 %8.1f us\n",
+            async ? "async" : "sync",
+            callUs[ callUs.size() / 2 ], callUs[ callUs.size() * 99 / 100 ],
+            latencyUs[ latencyUs.size() / 2 ], latencyUs[ latencyUs.size() * 99 / 100 ] );
+
+    ret = true;
+
+out:
+    DestroyStream( &stream );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunAsync( const BenchOptions &options )
+{
+    printf( "%ux%u, %u jobs, %u in flight\n", options.mWidth, options.mHeight, options.mJobs, options.mDepth );
+
+    return RunSubmitCost( options, false ) && RunSubmitCost( options, true );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static void SubmitThread( const BenchOptions &options, BenchStream *pStream, uint32_t jobs,
+                          double *pSubmitUs, std::atomic<bool> *pFailed )
+{
+    std::vector<VcetJobHandle> pipeline( options.mDepth, nullptr );
+    BenchClock::duration submitTime = BenchClock::duration::zero();
+    VcetBoHandle mvBo = nullptr;
+
+    if ( !VcetBoCreate( pStream->mCtx, options.mWidth * options.mHeight, true, &mvBo ) )
+        goto fail;
+
+    for ( auto &job : pipeline ) {
+        if ( !VcetJobCreate( pStream->mCtx, &job ) )
+            goto fail;
+    }
+
+    for ( uint32_t i = 0; i < jobs; ++i ) {
+        VcetJobHandle job = pipeline[ i % options.mDepth ];
+        BenchClock::time_point start;
+
+        if ( i >= options.mDepth && !VcetJobWait( pStream->mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto fail;
+
+        start = BenchClock::now();
+        if ( !VcetCalculateMv( pStream->mCtx, pStream->mFrames[0], pStream->mFrames[1], mvBo,
+                               options.mWidth, options.mHeight, job ) )
+            goto fail;
+        submitTime += BenchClock::now() - start;
+    }
+
+    for ( auto &job : pipeline ) {
+        if ( !VcetJobWait( pStream->mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto fail;
+    }
+
+    *pSubmitUs = ToMs( submitTime ) * 1000.0 / jobs;
+
+out:
+    for ( auto &job : pipeline )
+        VcetJobDestroy( &job );
+    VcetBoDestroy( &mvBo );
+    return;
+
+fail:
+    *pFailed = true;
+    goto out;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunThreads( const BenchOptions &options )
+{
+    BenchStream stream;
+    bool ret = false;
+
+    if ( !CreateStream( options, VCET_PRIORITY_NORMAL, 1, &stream ) )
+        return false;
+
+    printf( "%ux%u, %u jobs, %u in flight per thread\n", options.mWidth, options.mHeight, options.mJobs, options.mDepth );
+
+    for ( uint32_t count = 1; count <= options.mThreads; count *= 2 ) {
+        std::vector<std::thread> threads;
+        std::vector<double> submitUs( count, 0.0 );
+        std::atomic<bool> failed( false );
+        uint32_t jobs = std::max( options.mJobs / count, options.mDepth );
+        BenchClock::time_point start = BenchClock::now();
+        double totalMs, meanUs = 0;
+
+        for ( uint32_t i = 0; i < count; ++i )
+            threads.emplace_back( SubmitThread, std::cref( options ), &stream, jobs, &submitUs[i], &failed );
+
+        for ( auto &thread : threads )
+            thread.join();
+        totalMs = ToMs( BenchClock::now() - start );
+
+        if ( failed ) {
+            printf( "Failed to submit from %u threads\n", count );
+            goto out;
+        }
+
+        for ( double us : submitUs )
+            meanUs += us / count;
+
+        printf( "  %2u threads  rate %10.1f jobs/s  submit %8.3f us/job\n",
+                count, jobs * count * 1000.0 / totalMs, meanUs );
+    }
+
+    ret = true;
+
+out:
+    DestroyStream( &stream );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunSizesLoop( const BenchOptions &options, bool recreate, const char *name )
+{
+    BenchStream stream;
+    BenchOptions sizeOptions = options;
+    BenchClock::time_point start;
+    uint32_t size = 0;
+    double totalMs;
+    bool ret = false;
+
+    if ( !CreateStream( options, VCET_PRIORITY_NORMAL, options.mDepth, &stream ) )
+        return false;
+
+    start = BenchClock::now();
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        VcetJobHandle job;
+
+        // Shrink the frame by a macroblock column for each new size. Both
+        // modes drain the stream and get new frames, as an app would.
+        if ( i && i % kJobsPerSize == 0 ) {
+            size = ( size + 1 ) % options.mSizes;
+            sizeOptions.mWidth = options.mWidth - size * 16;
+
+            for ( auto &pending : stream.mJobs ) {
+                if ( !VcetJobWait( stream.mCtx, pending, VCETOY_TIMEOUT_INFINITE ) )
+                    goto out;
+            }
+
+            // Without the session pool, each size needs its own context
+            if ( recreate ) {
+                DestroyStream( &stream );
+                if ( !CreateStream( sizeOptions, VCET_PRIORITY_NORMAL, options.mDepth, &stream ) )
+                    return false;
+            } else {
+                VcetBoDestroy( &stream.mFrames[0] );
+                VcetBoDestroy( &stream.mFrames[1] );
+
+                if ( !CreateFrame( stream.mCtx, sizeOptions, 0, &stream.mFrames[0] ) ||
+                     !CreateFrame( stream.mCtx, sizeOptions, 4, &stream.mFrames[1] ) )
+                    goto out;
+            }
+        }
+
+        job = stream.mJobs[ i % options.mDepth ];
+        if ( i % kJobsPerSize >= options.mDepth && !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        if ( !Submit( sizeOptions, &stream, job ) )
+            goto out;
+    }
+
+    for ( auto &job : stream.mJobs ) {
+        if ( !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+    }
+    totalMs = ToMs( BenchClock::now() - start );
+
+    printf( "  %-10s %10.1f jobs/s\n", name, options.mJobs * 1000.0 / totalMs );
+
+    ret = true;
+
+out:
+    DestroyStream( &stream );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunSizes( const BenchOptions &options )
+{
+    printf( "up to %ux%u, %u sizes, %u jobs per size, %u jobs, %u in flight\n",
+            options.mWidth, options.mHeight, options.mSizes, kJobsPerSize, options.mJobs, options.mDepth );
+
+    return RunSizesLoop( options, true, "recreate:" ) &&
+           RunSizesLoop( options, false, "pool:" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunChurnLoop( const BenchOptions &options, uint64_t sizeBytes, const char *name )
+{
+    BenchStream stream;
+    std::vector<VcetBoHandle> bos( options.mChurn, nullptr );
+    BenchClock::duration createTime = BenchClock::duration::zero();
+    BenchClock::duration destroyTime = BenchClock::duration::zero();
+    BenchClock::time_point start;
+    bool ret = false;
+
+    if ( !CreateStream( options, VCET_PRIORITY_NORMAL, options.mDepth, &stream ) )
+        return false;
+
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        VcetBoHandle *pBo = &bos[ i % options.mChurn ];
+        VcetJobHandle job = stream.mJobs[ i % options.mDepth ];
+        bool created;
+
+        if ( i >= options.mDepth && !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        // The GPU may still be writing to the bo being replaced
+        start = BenchClock::now();
+        VcetBoDestroy( pBo );
+        destroyTime += BenchClock::now() - start;
+
+        start = BenchClock::now();
+        created = VcetBoCreate( stream.mCtx, sizeBytes, true, pBo );
+        createTime += BenchClock::now() - start;
+
+        if ( !created )
+            goto out;
+
+        if ( !VcetCalculateMv( stream.mCtx, stream.mFrames[0], stream.mFrames[1], *pBo,
+                               options.mWidth, options.mHeight, job ) )
+            goto out;
+    }
+
+    for ( auto &job : stream.mJobs ) {
+        if ( !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+    }
+
+    printf( "  %-10s %7llu KB %10.3f us/create %10.3f us/destroy\n", name,
+            (unsigned long long) sizeBytes / 1024,
+            ToMs( createTime ) * 1000.0 / options.mJobs,
+            ToMs( destroyTime ) * 1000.0 / options.mJobs );
+
+    ret = true;
+
+out:
+    for ( auto &bo : bos )
+        VcetBoDestroy( &bo );
+    DestroyStream( &stream );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunChurn( const BenchOptions &options )
+{
+    // One 16 byte motion vector per macroblock
+    uint64_t mvSize = options.mWidth * options.mHeight / 16;
+
+    printf( "%ux%u, %u jobs, %u in flight, %u live bos\n",
+            options.mWidth, options.mHeight, options.mJobs, options.mDepth, options.mChurn );
+
+    return RunChurnLoop( options, mvSize, "slab:" ) &&
+           RunChurnLoop( options, std::max( mvSize, kUnslabbedBoSize ), "direct:" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunImportsLoop( const BenchOptions &options, bool flush, const char *name )
+{
+    BenchStream stream;
+    std::vector<int> fds( options.mImports, -1 );
+    std::vector<VcetBoHandle> bos( options.mDepth, nullptr );
+    BenchClock::duration importTime = BenchClock::duration::zero();
+    BenchClock::time_point start;
+    uint64_t mvSize = options.mWidth * options.mHeight / 16;
+    bool ret = false;
+
+    if ( !CreateStream( options, VCET_PRIORITY_NORMAL, options.mDepth, &stream ) )
+        return false;
+
+    for ( auto &fd : fds ) {
+        fd = memfd_create( "vcetoy-bench", 0 );
+        if ( fd < 0 || ftruncate( fd, mvSize ) )
+            goto out;
+    }
+
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        VcetBoHandle *pBo = &bos[ i % options.mDepth ];
+        VcetJobHandle job = stream.mJobs[ i % options.mDepth ];
+        bool imported;
+
+        if ( i >= options.mDepth && !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+
+        VcetBoDestroy( pBo );
+
+        start = BenchClock::now();
+        imported = VcetBoImport( stream.mCtx, fds[ i % options.mImports ], true, pBo );
+        importTime += BenchClock::now() - start;
+
+        if ( !imported )
+            goto out;
+
+        if ( flush && !VcetContextFlushImports( stream.mCtx ) )
+            goto out;
+
+        if ( !VcetCalculateMv( stream.mCtx, stream.mFrames[0], stream.mFrames[1], *pBo,
+                               options.mWidth, options.mHeight, job ) )
+            goto out;
+    }
+
+    for ( auto &job : stream.mJobs ) {
+        if ( !VcetJobWait( stream.mCtx, job, VCETOY_TIMEOUT_INFINITE ) )
+            goto out;
+    }
+
+    printf( "  %-10s %10.3f us/import\n", name, ToMs( importTime ) * 1000.0 / options.mJobs );
+
+    ret = true;
+
+out:
+    for ( auto &bo : bos )
+        VcetBoDestroy( &bo );
+    DestroyStream( &stream );
+
+    for ( auto &fd : fds ) {
+        if ( fd >= 0 )
+            close( fd );
+    }
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunImports( const BenchOptions &options )
+{
+    printf( "%ux%u, %u jobs, %u in flight, %u buffers\n",
+            options.mWidth, options.mHeight, options.mJobs, options.mDepth, options.mImports );
+
+    return RunImportsLoop( options, true, "uncached:" ) &&
+           RunImportsLoop( options, false, "cached:" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunMapsLoop( const BenchOptions &options, bool fresh, const char *name )
+{
+    VcetCtxHandle ctx = nullptr;
+    VcetBoHandle bo = nullptr;
+    BenchClock::duration mapTime = BenchClock::duration::zero();
+    BenchClock::time_point start;
+    uint32_t alignedWidth, alignedHeight;
+    volatile uint8_t sink = 0;
+    bool ret = false;
+
+    if ( !VcetContextCreate( &ctx, options.mWidth, options.mHeight ) ) {
+        printf( "Failed to create a %ux%u context\n", options.mWidth, options.mHeight );
+        return false;
+    }
+
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        if ( fresh || !bo ) {
+            VcetBoDestroy( &bo );
+            if ( !VcetBoCreateImage( ctx, options.mWidth, options.mHeight, true, &bo, &alignedWidth, &alignedHeight ) )
+                goto out;
+        }
+
+        for ( uint32_t j = 0; j < options.mMaps; ++j ) {
+            uint8_t *pData = nullptr;
+            bool mapped;
+
+            start = BenchClock::now();
+            mapped = VcetBoMap( bo, &pData );
+            if ( mapped ) {
+                sink = pData[ j ];
+                mapped = VcetBoUnmap( bo );
+            }
+            mapTime += BenchClock::now() - start;
+
+            if ( !mapped )
+                goto out;
+        }
+    }
+
+    printf( "  %-10s %10.3f us/cycle\n", name, ToMs( mapTime ) * 1000.0 / ( options.mJobs * options.mMaps ) );
+
+    ret = true;
+
+out:
+    (void) sink;
+    VcetBoDestroy( &bo );
+    VcetContextDestroy( &ctx );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunMaps( const BenchOptions &options )
+{
+    printf( "%ux%u, %u frames, %u map/unmap cycles per frame\n",
+            options.mWidth, options.mHeight, options.mJobs, options.mMaps );
+
+    return RunMapsLoop( options, true, "new bo:" ) &&
+           RunMapsLoop( options, false, "same bo:" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunUploadsLoop( const BenchOptions &options, VcetBoUsage usage, const char *name )
+{
+    VcetCtxHandle ctx = nullptr;
+    VcetBoHandle bo = nullptr;
+    VcetBoCreateInfo createInfo = {};
+    BenchClock::duration times[3] = {};
+    BenchClock::time_point start;
+    uint32_t alignedWidth, alignedHeight;
+    uint32_t rows = options.mHeight + options.mHeight / 2;
+    std::vector<uint8_t> src( (size_t) options.mWidth * rows );
+    double frameGb = src.size() / 1e9;
+    uint8_t *pData = nullptr;
+    bool ret = false;
+
+    for ( size_t i = 0; i < src.size(); ++i ) {
+        src[i] = i * 7;
+    }
+
+    if ( !VcetContextCreate( &ctx, options.mWidth, options.mHeight ) ) {
+        printf( "Failed to create a %ux%u context\n", options.mWidth, options.mHeight );
+        return false;
+    }
+
+    createInfo.width = options.mWidth;
+    createInfo.height = options.mHeight;
+    createInfo.usage = usage;
+    if ( !VcetBoCreate2( ctx, &createInfo, &bo ) ||
+         !VcetBoAlignDimensions( ctx, options.mWidth, options.mHeight, &alignedWidth, &alignedHeight ) ||
+         !VcetBoMap( bo, &pData ) )
+        goto out;
+
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        start = BenchClock::now();
+        for ( uint32_t row = 0; row < rows; ++row ) {
+            uint32_t dstRow = row < options.mHeight ? row : alignedHeight + row - options.mHeight;
+
+            memcpy( pData + (size_t) dstRow * alignedWidth, &src[ (size_t) row * options.mWidth ], options.mWidth );
+        }
+        times[0] += BenchClock::now() - start;
+
+        start = BenchClock::now();
+        if ( !VcetBoUpload( bo, src.data(), options.mWidth, rows, 1 ) )
+            goto out;
+        times[1] += BenchClock::now() - start;
+
+        start = BenchClock::now();
+        if ( !VcetBoUpload( bo, src.data(), options.mWidth, rows, options.mUploads ) )
+            goto out;
+        times[2] += BenchClock::now() - start;
+    }
+
+    printf( "  %-14s memcpy %7.2f GB/s, upload %7.2f GB/s, %u threads %7.2f GB/s\n", name,
+            frameGb * options.mJobs * 1000.0 / ToMs( times[0] ),
+            frameGb * options.mJobs * 1000.0 / ToMs( times[1] ),
+            options.mUploads,
+            frameGb * options.mJobs * 1000.0 / ToMs( times[2] ) );
+
+    ret = VcetBoUnmap( bo );
+
+out:
+    VcetBoDestroy( &bo );
+    VcetContextDestroy( &ctx );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunUploads( const BenchOptions &options )
+{
+    printf( "%ux%u, %u frames\n", options.mWidth, options.mHeight, options.mJobs );
+
+    return RunUploadsLoop( options, VCET_BO_USAGE_UPLOAD, "upload:" ) &&
+           RunUploadsLoop( options, VCET_BO_USAGE_DEVICE_UPLOAD, "device upload:" ) &&
+           RunUploadsLoop( options, VCET_BO_USAGE_READBACK, "readback:" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunReadbacksLoop( const BenchOptions &options, VcetBoUsage usage, const char *name )
+{
+    VcetCtxHandle ctx = nullptr;
+    VcetBoHandle bo = nullptr;
+    VcetBoCreateInfo createInfo = {};
+    BenchClock::duration times[3] = {};
+    BenchClock::time_point start;
+    std::vector<uint8_t> dst( (size_t) options.mWidth * options.mHeight * 3 / 2 );
+    double frameGb = dst.size() / 1e9;
+    uint8_t *pData = nullptr;
+    volatile uint64_t sink = 0;
+    bool ret = false;
+
+    if ( !VcetContextCreate( &ctx, options.mWidth, options.mHeight ) ) {
+        printf( "Failed to create a %ux%u context\n", options.mWidth, options.mHeight );
+        return false;
+    }
+
+    createInfo.sizeBytes = dst.size();
+    createInfo.usage = usage;
+    if ( !VcetBoCreate2( ctx, &createInfo, &bo ) || !VcetBoMap( bo, &pData ) )
+        goto out;
+
+    memset( pData, 1, dst.size() );
+
+    for ( uint32_t i = 0; i < options.mJobs; ++i ) {
+        uint64_t sum = 0;
+
+        start = BenchClock::now();
+        for ( size_t j = 0; j < dst.size(); ++j ) {
+            sum += ( (volatile uint8_t*) pData )[j];
+        }
+        times[0] += BenchClock::now() - start;
+        sink = sum;
+
+        start = BenchClock::now();
+        memcpy( dst.data(), pData, dst.size() );
+        times[1] += BenchClock::now() - start;
+
+        start = BenchClock::now();
+        if ( !VcetBoReadback( bo, dst.data(), 0, dst.size() ) )
+            goto out;
+        times[2] += BenchClock::now() - start;
+    }
+
+    printf( "  %-14s bytes %7.2f GB/s, memcpy %7.2f GB/s, readback %7.2f GB/s\n", name,
+            frameGb * options.mJobs * 1000.0 / ToMs( times[0] ),
+            frameGb * options.mJobs * 1000.0 / ToMs( times[1] ),
+            frameGb * options.mJobs * 1000.0 / ToMs( times[2] ) );
+
+    ret = VcetBoUnmap( bo );
+
+out:
+    (void) sink;
+    VcetBoDestroy( &bo );
+    VcetContextDestroy( &ctx );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunReadbacks( const BenchOptions &options )
+{
+    printf( "%ux%u, %u frames\n", options.mWidth, options.mHeight, options.mJobs );
+
+    return RunReadbacksLoop( options, VCET_BO_USAGE_READBACK, "readback:" ) &&
+           RunReadbacksLoop( options, VCET_BO_USAGE_UPLOAD, "upload:" ) &&
+           RunReadbacksLoop( options, VCET_BO_USAGE_DEVICE_UPLOAD, "device upload:" );
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+static bool RunContextCreate( const BenchOptions &options )
+{
+    std::vector<VcetCtxHandle> contexts( options.mContexts, nullptr );
+    BenchClock::duration createTime = BenchClock::duration::zero();
+    BenchClock::duration firstTime = BenchClock::duration::zero();
+    BenchClock::time_point start;
+    int baseFds = CountOpenFds();
+    bool ret = false;
+
+    for ( uint32_t i = 0; i < options.mContexts; ++i ) {
+        start = BenchClock::now();
+        if ( !VcetContextCreate( &contexts[i], options.mWidth, options.mHeight ) ) {
+            printf( "Failed to create context %u\n", i );
+            goto out;
+        }
+
+        if ( i == 0 )
+            firstTime = BenchClock::now() - start;
+        else
+            createTime += BenchClock::now() - start;
+    }
+
+    printf( "%ux%u, %u live contexts\n", options.mWidth, options.mHeight, options.mContexts );
+    printf( "  first:  %10.3f us\n", ToMs( firstTime ) * 1000.0 );
+    if ( options.mContexts > 1 )
+        printf( "  create: %10.3f us/ctx\n", ToMs( createTime ) * 1000.0 / ( options.mContexts - 1 ) );
+    printf( "  fds:    %10d\n", CountOpenFds() - baseFds );
+
+    ret = true;
+
+out:
+    for ( auto &ctx : contexts )
+        VcetContextDestroy( &ctx );
+
+    return ret;
+}
+
+//---------------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+int main( int argc, char **argv )
+{
+    BenchOptions options = { 352, 288, 200, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+    for ( int i = 1; i + 1 < argc; i += 2 ) {
+        uint32_t value = strtoul( argv[i + 1], nullptr, 0 );
+
+        if ( !strcmp( argv[i], "--width" ) ) {
+            options.mWidth = value;
+        } else if ( !strcmp( argv[i], "--height" ) ) {
+            options.mHeight = value;
+        } else if ( !strcmp( argv[i], "--jobs" ) ) {
+            options.mJobs = value;
+        } else if ( !strcmp( argv[i], "--depth" ) ) {
+            options.mDepth = value;
+        } else if ( !strcmp( argv[i], "--contexts" ) ) {
+            options.mContexts = value;
+        } else if ( !strcmp( argv[i], "--priority" ) ) {
+            options.mPriority = value;
+        } else if ( !strcmp( argv[i], "--wait" ) ) {
+            options.mWait = value;
+        } else if ( !strcmp( argv[i], "--async" ) ) {
+            options.mAsync = value;
+        } else if ( !strcmp( argv[i], "--threads" ) ) {
+            options.mThreads = value;
+        } else if ( !strcmp( argv[i], "--sizes" ) ) {
+            options.mSizes = value;
+        } else if ( !strcmp( argv[i], "--churn" ) ) {
+            options.mChurn = value;
+        } else if ( !strcmp( argv[i], "--imports" ) ) {
+            options.mImports = value;
+        } else if ( !strcmp( argv[i], "--maps" ) ) {
+            options.mMaps = value;
+        } else if ( !strcmp( argv[i], "--uploads" ) ) {
+            options.mUploads = value;
+        } else if ( !strcmp( argv[i], "--readbacks" ) ) {
+            options.mReadbacks = value;
+        } else {
+            printf( "usage: %s [--width W] [--height H] [--jobs N] [--depth D] [--contexts C] [--priority 1] [--wait 1] [--async 1] [--threads N] [--sizes N] [--churn N] [--imports N] [--maps N] [--uploads N] [--readbacks 1]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    if ( !options.mDepth || !options.mJobs ) {
+        printf( "--jobs and --depth must be non zero\n" );
+        return 1;
+    }
+
+    if ( options.mContexts )
+        return RunContextCreate( options ) ? 0 : 1;
+
+    if ( options.mPriority )
+        return RunPriority( options ) ? 0 : 1;
+
+    if ( options.mWait )
+        return RunWait( options ) ? 0 : 1;
+
+    if ( options.mAsync )
+        return RunAsync( options ) ? 0 : 1;
+
+    if ( options.mThreads )
+        return RunThreads( options ) ? 0 : 1;
+
+    if ( options.mSizes ) {
+        if ( options.mSizes * 16 >= options.mWidth ) {
+            printf( "--sizes must leave a non zero frame width\n" );
+            return 1;
+        }
+
+        return RunSizes( options ) ? 0 : 1;
+    }
+
+    if ( options.mChurn )
+        return RunChurn( options ) ? 0 : 1;
+
+    if ( options.mImports )
+        return RunImports( options ) ? 0 : 1;
+
+    if ( options.mMaps )
+        return RunMaps( options ) ? 0 : 1;
+
+    if ( options.mUploads )
+        return RunUploads( options ) ? 0 : 1;
+
+    if ( options.mReadbacks )
+        return RunReadbacks( options ) ? 0 : 1;
+
+    return Run( options ) ? 0 : 1;
+}
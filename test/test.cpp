@@ -24,6 +24,18 @@
 // SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 //
 
+#include <fcntl.h>
+#include <linux/udmabuf.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
 #include <gtest/gtest.h>
 
 #include <util/util.h>
@@ -47,6 +59,41 @@ static void DumpDataToFile( uint8_t *pData, uint64_t size, const char *prefix, u
     fwrite( pData, size, sizeof(uint8_t), file );
 }
 
+/**
+ * A dma-buf backed by a memfd, through udmabuf where available
+ *
+ * Returns the memfd, the libdrm stand-in accepts it as a dma-buf as is.
+ */
+static int CreateDmaBuf( uint64_t size, int *pDmaBuf )
+{
+    int memfd = memfd_create( "vcetoy-test", MFD_ALLOW_SEALING );
+    int dev;
+    struct udmabuf_create create = {};
+
+    if ( memfd < 0 )
+        return -1;
+
+    if ( ftruncate( memfd, size ) || fcntl( memfd, F_ADD_SEALS, F_SEAL_SHRINK ) ) {
+        close( memfd );
+        return -1;
+    }
+
+    *pDmaBuf = -1;
+
+    dev = open( "/dev/udmabuf", O_RDWR );
+    if ( dev >= 0 ) {
+        create.memfd = memfd;
+        create.size = size;
+        *pDmaBuf = ioctl( dev, UDMABUF_CREATE, &create );
+        close( dev );
+    }
+
+    if ( *pDmaBuf < 0 )
+        *pDmaBuf = dup( memfd );
+
+    return memfd;
+}
+
 class VcetTest : public ::testing::Test
 {
     protected:
@@ -148,6 +195,129 @@ TEST_F( VcetTest, BoUnmapBadParam )
     ASSERT_FALSE( VcetBoUnmap( mUnmappableBo ) );
 }
 
+TEST_F( VcetTest, BoMapRefcount )
+{
+    const uint32_t kThreads = 4;
+    const uint32_t kCycles = 1000;
+    uint8_t *pData = nullptr;
+    uint8_t *pAgain = nullptr;
+    std::vector<std::thread> threads;
+    std::atomic<uint32_t> failures( 0 );
+
+    // Nested maps share the mapping
+    ASSERT_TRUE( VcetBoMap( mMappableBo, &pData ) );
+    ASSERT_TRUE( VcetBoMap( mMappableBo, &pAgain ) );
+    ASSERT_EQ( pData, pAgain );
+    pData[0] = 0xa5;
+
+    ASSERT_TRUE( VcetBoUnmap( mMappableBo ) );
+    ASSERT_TRUE( VcetBoUnmap( mMappableBo ) );
+    ASSERT_FALSE( VcetBoUnmap( mMappableBo ) );
+
+    // The mapping outlives its last reference
+    ASSERT_TRUE( VcetBoMap( mMappableBo, &pAgain ) );
+    ASSERT_EQ( pData, pAgain );
+    ASSERT_EQ( 0xa5, pAgain[0] );
+    ASSERT_TRUE( VcetBoUnmap( mMappableBo ) );
+
+    for ( uint32_t i = 0; i < kThreads; ++i ) {
+        threads.emplace_back( [&]() {
+            for ( uint32_t j = 0; j < kCycles; ++j ) {
+                uint8_t *pThreadData = nullptr;
+
+                if ( !VcetBoMap( mMappableBo, &pThreadData ) || pThreadData != pData )
+                    failures++;
+
+                if ( !VcetBoUnmap( mMappableBo ) )
+                    failures++;
+            }
+        } );
+    }
+
+    for ( auto &thread : threads ) {
+        thread.join();
+    }
+
+    ASSERT_EQ( 0u, failures.load() );
+    ASSERT_FALSE( VcetBoUnmap( mMappableBo ) );
+}
+
+TEST_F( VcetTest, BoUpload )
+{
+    const uint32_t kBigWidth = 3840;
+    const uint32_t kBigHeight = 2160;
+    const uint32_t kThreads = 4;
+    uint32_t width = mWidthAlignment * 3 + 2;
+    uint32_t height = mHeightAlignment + 2;
+    uint32_t srcPitch = width + 7;
+    uint32_t rows = height + height / 2;
+    uint32_t alignedWidth = 0;
+    uint32_t alignedHeight = 0;
+    std::vector<uint8_t> src( srcPitch * rows );
+    VcetBoCreateInfo createInfo = {};
+    VcetBoHandle bo = nullptr;
+    uint8_t *pData = nullptr;
+
+    for ( uint32_t i = 0; i < src.size(); ++i ) {
+        src[i] = i * 7 + i / srcPitch;
+    }
+
+    ASSERT_TRUE( VcetBoCreateImage( mCtx, width, height, true, &bo, &alignedWidth, &alignedHeight ) );
+    ASSERT_FALSE( VcetBoUpload( bo, src.data(), width - 1, rows, 1 ) );
+    ASSERT_FALSE( VcetBoUpload( bo, src.data(), srcPitch, rows + 1, 1 ) );
+    ASSERT_TRUE( VcetBoUpload( bo, src.data(), srcPitch, rows, 1 ) );
+    ASSERT_TRUE( VcetBoMap( bo, &pData ) );
+
+    // Rows land at the aligned pitch, chroma at the aligned height
+    for ( uint32_t row = 0; row < rows; ++row ) {
+        uint32_t dstRow = row < height ? row : alignedHeight + row - height;
+
+        ASSERT_EQ( 0, memcmp( pData + dstRow * alignedWidth, &src[ row * srcPitch ], width ) );
+        for ( uint32_t col = width; col < alignedWidth; ++col ) {
+            ASSERT_EQ( 0, pData[ dstRow * alignedWidth + col ] );
+        }
+    }
+
+    ASSERT_TRUE( VcetBoUnmap( bo ) );
+    VcetBoDestroy( &bo );
+
+    // Plain bos take the rows back to back
+    ASSERT_TRUE( VcetBoCreate( mCtx, srcPitch * rows, true, &bo ) );
+    ASSERT_TRUE( VcetBoUpload( bo, src.data(), srcPitch, rows, 1 ) );
+    ASSERT_TRUE( VcetBoMap( bo, &pData ) );
+    ASSERT_EQ( 0, memcmp( pData, src.data(), src.size() ) );
+    ASSERT_TRUE( VcetBoUnmap( bo ) );
+    VcetBoDestroy( &bo );
+
+    ASSERT_TRUE( VcetBoCreate( mCtx, srcPitch * rows, false, &bo ) );
+    ASSERT_FALSE( VcetBoUpload( bo, src.data(), srcPitch, rows, 1 ) );
+    VcetBoDestroy( &bo );
+
+    // Large frames are split across threads
+    rows = kBigHeight + kBigHeight / 2;
+    src.resize( kBigWidth * rows );
+    for ( uint32_t i = 0; i < src.size(); ++i ) {
+        src[i] = i * 13 + i / kBigWidth;
+    }
+
+    createInfo.width = kBigWidth;
+    createInfo.height = kBigHeight;
+    createInfo.usage = VCET_BO_USAGE_UPLOAD;
+    ASSERT_TRUE( VcetBoCreate2( mCtx, &createInfo, &bo ) );
+    ASSERT_TRUE( VcetBoAlignDimensions( mCtx, kBigWidth, kBigHeight, &alignedWidth, &alignedHeight ) );
+    ASSERT_TRUE( VcetBoUpload( bo, src.data(), kBigWidth, rows, kThreads ) );
+    ASSERT_TRUE( VcetBoMap( bo, &pData ) );
+
+    for ( uint32_t row = 0; row < rows; ++row ) {
+        uint32_t dstRow = row < kBigHeight ? row : alignedHeight + row - kBigHeight;
+
+        ASSERT_EQ( 0, memcmp( pData + (uint64_t) dstRow * alignedWidth, &src[ row * kBigWidth ], kBigWidth ) );
+    }
+
+    ASSERT_TRUE( VcetBoUnmap( bo ) );
+    VcetBoDestroy( &bo );
+}
+
 class VcetTestFrames : public VcetTest
 {
     protected:
@@ -316,6 +486,1231 @@ TEST_F(VcetTestFrames, MultipleSubmissions )
     }
 }
 
+TEST_F(VcetTestFrames, BoListCacheHits )
+{
+    VcetContextStats stats;
+
+    for ( int i = 0; i < 20; i++ ) {
+        ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                      mMappableBo,
+                                      mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                      mJob ));
+        ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    }
+
+    // Every submission after the first pass through the IB ring reuses a list
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_GT( stats.boListCacheHits, 0u );
+    ASSERT_GT( stats.boListCacheMisses, 0u );
+
+    ASSERT_FALSE( VcetContextGetStats( mCtx, nullptr ) );
+    ASSERT_FALSE( VcetContextGetStats( nullptr, &stats ) );
+}
+
+TEST_F(VcetTestFrames, CalculateMvBatch )
+{
+    static const int kBatchSize = 3;
+    VcetBoHandle mvBo[ kBatchSize ];
+    VcetJobHandle job[ kBatchSize ];
+    VcetMvBatchEntry entries[ kBatchSize ];
+    uint8_t *mvData[ kBatchSize ];
+
+    for ( int i = 0; i < kBatchSize; ++i ) {
+        ASSERT_TRUE( VcetBoCreate( mCtx, mBoSize, true, &mvBo[i] ) );
+        ASSERT_TRUE( VcetBoMap( mvBo[i], &mvData[i] ) );
+        memset( mvData[i], 0, mBoSize );
+        ASSERT_TRUE( VcetJobCreate( mCtx, &job[i] ) );
+
+        entries[i].oldFrame = mFrame[0]->mBo;
+        entries[i].newFrame = mFrame[i]->mBo;
+        entries[i].mvBo = mvBo[i];
+        entries[i].width = mFrame[0]->mWidth;
+        entries[i].height = mFrame[0]->mHeight;
+        entries[i].job = job[i];
+    }
+
+    ASSERT_TRUE( VcetCalculateMvBatch( mCtx, entries, kBatchSize ) );
+
+    for ( int i = 0; i < kBatchSize; ++i ) {
+        ASSERT_TRUE( VcetJobWait( mCtx, job[i], VCETOY_TIMEOUT_INFINITE ) );
+
+        uint64_t sum = 0;
+        for ( uint32_t j = 0; j < mBoSize; ++j ) {
+            sum += mvData[i][j];
+        }
+
+        // Entry 0 compares a frame against itself
+        if ( i == 0 )
+            ASSERT_EQ( 0u, sum );
+        else
+            ASSERT_NE( 0u, sum );
+
+        VcetJobDestroy( &job[i] );
+        VcetBoDestroy( &mvBo[i] );
+    }
+
+    ASSERT_FALSE( VcetCalculateMvBatch( mCtx, nullptr, kBatchSize ) );
+    ASSERT_FALSE( VcetCalculateMvBatch( mCtx, entries, 0 ) );
+
+    // A bad entry past the first submission's worth fails the whole batch
+    // before anything reaches the GPU
+    static const int kLongBatchSize = 12;
+    VcetMvBatchEntry longEntries[ kLongBatchSize ];
+    VcetJobHandle longJob[ kLongBatchSize ];
+    VcetContextStats before = {};
+    VcetContextStats stats = {};
+    VcetBoHandle smallBo = nullptr;
+
+    ASSERT_TRUE( VcetBoCreate( mCtx, 4096, true, &smallBo ) );
+
+    for ( int i = 0; i < kLongBatchSize; ++i ) {
+        ASSERT_TRUE( VcetJobCreate( mCtx, &longJob[i] ) );
+
+        longEntries[i].oldFrame = mFrame[0]->mBo;
+        longEntries[i].newFrame = i == kLongBatchSize - 1 ? smallBo : mFrame[1]->mBo;
+        longEntries[i].mvBo = mMappableBo;
+        longEntries[i].width = mFrame[0]->mWidth;
+        longEntries[i].height = mFrame[0]->mHeight;
+        longEntries[i].job = longJob[i];
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &before ) );
+    ASSERT_FALSE( VcetCalculateMvBatch( mCtx, longEntries, kLongBatchSize ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+
+    for ( uint32_t ring = 0; ring < stats.numRings; ++ring ) {
+        ASSERT_EQ( before.ringSubmissions[ring], stats.ringSubmissions[ring] );
+    }
+
+    for ( int i = 0; i < kLongBatchSize; ++i ) {
+        ASSERT_TRUE( VcetJobWait( mCtx, longJob[i], VCETOY_TIMEOUT_INFINITE ) );
+        VcetJobDestroy( &longJob[i] );
+    }
+
+    VcetBoDestroy( &smallBo );
+}
+
+TEST_F(VcetTestFrames, CalculateMvBounds )
+{
+    // The engine reads frames at the aligned size
+    uint32_t width = mWidthAlignment * 8 + 1;
+    uint32_t height = mHeightAlignment * 32;
+    uint32_t alignedWidth, alignedHeight;
+    VcetBoHandle frame = nullptr;
+    VcetBoHandle alignedFrame = nullptr;
+    VcetBoHandle smallMvBo = nullptr;
+
+    ASSERT_TRUE( VcetBoAlignDimensions( mCtx, width, height, &alignedWidth, &alignedHeight ) );
+    ASSERT_TRUE( VcetBoCreate( mCtx, width * height * 3 / 2, false, &frame ) );
+    ASSERT_TRUE( VcetBoCreate( mCtx, alignedWidth * alignedHeight * 3 / 2, false, &alignedFrame ) );
+    ASSERT_TRUE( VcetBoCreate( mCtx, 4096, true, &smallMvBo ) );
+
+    ASSERT_FALSE( VcetCalculateMv( mCtx, frame, frame, mMappableBo, width, height, mJob ) );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, alignedFrame, alignedFrame, mMappableBo, width, height, mJob ) );
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+
+    // 16 bytes per macroblock
+    ASSERT_FALSE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo, smallMvBo,
+                                   mFrame[0]->mWidth, mFrame[0]->mHeight, mJob ) );
+
+    VcetBoDestroy( &smallMvBo );
+    VcetBoDestroy( &alignedFrame );
+    VcetBoDestroy( &frame );
+}
+
+TEST_F(VcetTestFrames, IbRingGrow )
+{
+    static const int kJobCount = 32;
+    VcetJobHandle job[ kJobCount ];
+    VcetContextStats stats;
+
+    ASSERT_FALSE( VcetContextSetIbRingPolicy( mCtx, VCET_IB_RING_POLICY_GROW, 1 ) );
+    ASSERT_TRUE( VcetContextSetIbRingPolicy( mCtx, VCET_IB_RING_POLICY_GROW, kJobCount ) );
+
+    // Keep every job in flight at the same time
+    for ( int i = 0; i < kJobCount; i++ ) {
+        ASSERT_TRUE( VcetJobCreate( mCtx, &job[i] ) );
+        ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                      mMappableBo,
+                                      mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                      job[i] ));
+    }
+
+    for ( int i = 0; i < kJobCount; i++ ) {
+        ASSERT_TRUE( VcetJobWait( mCtx, job[i], VCETOY_TIMEOUT_INFINITE ) );
+        VcetJobDestroy( &job[i] );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_LE( stats.ibRingSize, (uint32_t)kJobCount );
+}
+
+TEST_F(VcetTestFrames, RingBalance )
+{
+    static const int kJobCount = 12;
+    VcetJobHandle job[ kJobCount ];
+    VcetContextStats before, after;
+    uint64_t total = 0;
+
+    ASSERT_FALSE( VcetContextSetRingBalancePolicy( mCtx, (VcetRingBalancePolicy) 42 ) );
+    ASSERT_TRUE( VcetContextSetRingBalancePolicy( mCtx, VCET_RING_BALANCE_ROUND_ROBIN ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &before ) );
+    ASSERT_GE( before.numRings, 1u );
+    ASSERT_LE( before.numRings, (uint32_t)VCET_MAX_RINGS );
+
+    for ( int i = 0; i < kJobCount; i++ ) {
+        ASSERT_TRUE( VcetJobCreate( mCtx, &job[i] ) );
+        ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                      mMappableBo,
+                                      mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                      job[i] ));
+    }
+
+    // Each job waits on the ring it was placed on
+    for ( int i = 0; i < kJobCount; i++ ) {
+        ASSERT_TRUE( VcetJobWait( mCtx, job[i], VCETOY_TIMEOUT_INFINITE ) );
+        VcetJobDestroy( &job[i] );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &after ) );
+    for ( uint32_t i = 0; i < after.numRings; i++ ) {
+        uint64_t submissions = after.ringSubmissions[i] - before.ringSubmissions[i];
+
+        ASSERT_EQ( (uint64_t)kJobCount / after.numRings, submissions );
+        total += submissions;
+    }
+    ASSERT_EQ( (uint64_t)kJobCount, total );
+
+    ASSERT_TRUE( VcetContextSetRingBalancePolicy( mCtx, VCET_RING_BALANCE_LEAST_OUTSTANDING ) );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo, mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight, mJob ) );
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+}
+
+TEST_F(VcetTestFrames, WaitPolicy )
+{
+    static const VcetWaitPolicy kPolicies[] = { VCET_WAIT_SPIN, VCET_WAIT_ADAPTIVE, VCET_WAIT_BLOCK };
+    bool completed = false;
+
+    ASSERT_FALSE( VcetContextSetWaitPolicy( mCtx, (VcetWaitPolicy) 42, 0 ) );
+
+    for ( VcetWaitPolicy policy : kPolicies ) {
+        ASSERT_TRUE( VcetContextSetWaitPolicy( mCtx, policy, 50 ) );
+
+        // Several rounds so that the adaptive policy has a job history
+        for ( int i = 0; i < 4; i++ ) {
+            ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                          mMappableBo,
+                                          mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                          mJob ));
+            ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+            ASSERT_TRUE( VcetJobPoll( mCtx, mJob, &completed ) );
+            ASSERT_TRUE( completed );
+        }
+    }
+}
+
+TEST_F(VcetTestFrames, JobExportSyncFd )
+{
+    int fd = -1;
+    struct pollfd pfd = {};
+
+    ASSERT_FALSE( VcetJobExportSyncFd( mCtx, mJob, &fd ) );
+
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+
+    ASSERT_FALSE( VcetJobExportSyncFd( mCtx, mJob, nullptr ) );
+    ASSERT_TRUE( VcetJobExportSyncFd( mCtx, mJob, &fd ) );
+    ASSERT_GE( fd, 0 );
+
+    // The fd must become readable once the job retires
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    ASSERT_EQ( 1, poll( &pfd, 1, 5000 ) );
+    ASSERT_TRUE( pfd.revents & POLLIN );
+
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, 0 ) );
+
+    close( fd );
+}
+
+TEST_F(VcetTestFrames, JobPollAndWaitMany )
+{
+    static const int kJobCount = 4;
+    VcetJobHandle job[ kJobCount ];
+    bool completed = false;
+    uint32_t first = kJobCount;
+
+    for ( int i = 0; i < kJobCount; i++ ) {
+        ASSERT_TRUE( VcetJobCreate( mCtx, &job[i] ) );
+        ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                      mMappableBo,
+                                      mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                      job[i] ));
+    }
+
+    ASSERT_TRUE( VcetJobPoll( mCtx, job[0], &completed ) );
+    ASSERT_FALSE( VcetJobPoll( mCtx, job[0], nullptr ) );
+
+    ASSERT_TRUE( VcetJobWaitMany( mCtx, job, kJobCount, false, VCETOY_TIMEOUT_INFINITE, &completed, &first ) );
+    ASSERT_TRUE( completed );
+    ASSERT_LT( first, (uint32_t)kJobCount );
+
+    ASSERT_TRUE( VcetJobWaitMany( mCtx, job, kJobCount, true, VCETOY_TIMEOUT_INFINITE, &completed, nullptr ) );
+    ASSERT_TRUE( completed );
+
+    for ( int i = 0; i < kJobCount; i++ ) {
+        ASSERT_TRUE( VcetJobPoll( mCtx, job[i], &completed ) );
+        ASSERT_TRUE( completed );
+        VcetJobDestroy( &job[i] );
+    }
+
+    ASSERT_FALSE( VcetJobWaitMany( mCtx, nullptr, kJobCount, true, 0, &completed, nullptr ) );
+    ASSERT_FALSE( VcetJobWaitMany( mCtx, &mJob, 0, true, 0, &completed, nullptr ) );
+}
+
+struct ReactorTestState {
+    std::atomic<int> mCompleted;
+    VcetJobHandle mLastJob;
+};
+
+static void ReactorTestCallback( VcetJobHandle job, void *pUserData )
+{
+    ReactorTestState *state = (ReactorTestState*) pUserData;
+    state->mLastJob = job;
+    state->mCompleted++;
+}
+
+TEST_F(VcetTestFrames, ReactorCompletion )
+{
+    static const int kJobCount = 5;
+    ReactorTestState state;
+    int eventFd = -1;
+    uint64_t notified = 0;
+
+    state.mCompleted = 0;
+    state.mLastJob = nullptr;
+
+    ASSERT_TRUE( VcetContextStartReactor( mCtx, ReactorTestCallback, &state, &eventFd ) );
+    ASSERT_GE( eventFd, 0 );
+    ASSERT_FALSE( VcetContextStartReactor( mCtx, ReactorTestCallback, &state, nullptr ) );
+
+    for ( int i = 0; i < kJobCount; i++ ) {
+        ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                      mMappableBo,
+                                      mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                      mJob ));
+    }
+
+    // The eventfd counts completions
+    while ( notified < kJobCount ) {
+        struct pollfd pfd = { eventFd, POLLIN, 0 };
+        uint64_t value = 0;
+
+        ASSERT_EQ( 1, poll( &pfd, 1, 5000 ) );
+        ASSERT_EQ( (ssize_t)sizeof(value), read( eventFd, &value, sizeof(value) ) );
+        notified += value;
+    }
+
+    ASSERT_EQ( (uint64_t)kJobCount, notified );
+    ASSERT_EQ( kJobCount, state.mCompleted );
+    ASSERT_EQ( mJob, state.mLastJob );
+
+    VcetContextStopReactor( mCtx );
+    VcetContextStopReactor( mCtx );
+}
+
+TEST_F(VcetTestFrames, BoReadback )
+{
+    struct ReadbackState {
+        const uint8_t *mBoData;
+        const uint8_t *mDst;
+        uint64_t mSize;
+        std::atomic<int> mMatches;
+    };
+
+    const uint64_t kOffset = 3;
+    const uint64_t kSize = 1001;
+    std::vector<uint8_t> dst( mBoSize, 0 );
+    ReadbackState state;
+    VcetBoCreateInfo createInfo = {};
+    VcetBoHandle wcBo = nullptr;
+    uint8_t *pData = nullptr;
+    uint8_t *pWcData = nullptr;
+    bool completed = false;
+    int eventFd = -1;
+    uint64_t value = 0;
+    struct pollfd pfd = {};
+
+    ASSERT_TRUE( VcetBoMap( mMappableBo, &pData ) );
+
+    // Ranges must be in bounds, and the bo mappable
+    ASSERT_FALSE( VcetBoReadback( mMappableBo, dst.data(), 2 * mBoSize, 1 ) );
+    ASSERT_FALSE( VcetBoReadback( mMappableBo, dst.data(), 1, 2 * mBoSize ) );
+    ASSERT_FALSE( VcetBoReadback( mUnmappableBo, dst.data(), 0, 1 ) );
+    ASSERT_FALSE( VcetJobAddReadback( mJob, mMappableBo, dst.data(), 1, 2 * mBoSize ) );
+    ASSERT_FALSE( VcetJobAddReadback( mJob, mUnmappableBo, dst.data(), 0, 1 ) );
+
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+
+    ASSERT_TRUE( VcetBoReadback( mMappableBo, dst.data(), 0, mBoSize ) );
+    ASSERT_EQ( 0, memcmp( pData, dst.data(), mBoSize ) );
+
+    std::fill( dst.begin(), dst.end(), 0 );
+    ASSERT_TRUE( VcetBoReadback( mMappableBo, dst.data(), kOffset, kSize ) );
+    ASSERT_EQ( 0, memcmp( pData + kOffset, dst.data(), kSize ) );
+    ASSERT_EQ( 0, dst[ kSize ] );
+
+    // Write combined bos take the streaming path
+    createInfo.sizeBytes = mBoSize;
+    createInfo.usage = VCET_BO_USAGE_UPLOAD;
+    ASSERT_TRUE( VcetBoCreate2( mCtx, &createInfo, &wcBo ) );
+    ASSERT_TRUE( VcetBoMap( wcBo, &pWcData ) );
+    memcpy( pWcData, pData, mBoSize );
+
+    std::fill( dst.begin(), dst.end(), 0 );
+    ASSERT_TRUE( VcetBoReadback( wcBo, dst.data(), kOffset, mBoSize - kOffset ) );
+    ASSERT_EQ( 0, memcmp( pData + kOffset, dst.data(), mBoSize - kOffset ) );
+
+    ASSERT_TRUE( VcetBoUnmap( wcBo ) );
+    VcetBoDestroy( &wcBo );
+
+    // Made by the waiting thread
+    memset( pData, 0, mBoSize );
+    std::fill( dst.begin(), dst.end(), 0 );
+    ASSERT_TRUE( VcetJobAddReadback( mJob, mMappableBo, dst.data(), 0, mBoSize ) );
+
+    // The job's previous submission has completed, but the copy waits for the next
+    pData[0] = 1;
+    ASSERT_TRUE( VcetJobPoll( mCtx, mJob, &completed ) );
+    ASSERT_TRUE( completed );
+    ASSERT_EQ( 0, dst[0] );
+    pData[0] = 0;
+
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_EQ( 0, memcmp( pData, dst.data(), mBoSize ) );
+
+    // Made by the reactor, before it reports the completion
+    state.mBoData = pData;
+    state.mDst = dst.data();
+    state.mSize = mBoSize;
+    state.mMatches = -1;
+
+    ASSERT_TRUE( VcetContextStartReactor( mCtx,
+                                          []( VcetJobHandle job, void *pUserData ) {
+                                              ReadbackState *pState = (ReadbackState*) pUserData;
+                                              pState->mMatches = !memcmp( pState->mBoData, pState->mDst, pState->mSize );
+                                          },
+                                          &state, &eventFd ) );
+
+    memset( pData, 0, mBoSize );
+    std::fill( dst.begin(), dst.end(), 0 );
+    ASSERT_TRUE( VcetJobAddReadback( mJob, mMappableBo, dst.data(), 0, mBoSize ) );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+
+    pfd.fd = eventFd;
+    pfd.events = POLLIN;
+    ASSERT_EQ( 1, poll( &pfd, 1, 5000 ) );
+    ASSERT_EQ( (ssize_t)sizeof(value), read( eventFd, &value, sizeof(value) ) );
+    ASSERT_EQ( 1, state.mMatches );
+
+    VcetContextStopReactor( mCtx );
+    ASSERT_TRUE( VcetBoUnmap( mMappableBo ) );
+}
+
+TEST_F(VcetTestFrames, HostPtrBo )
+{
+    uint64_t pageSize = sysconf( _SC_PAGESIZE );
+    uint64_t frameSize = ( mFrame[0]->mSize + pageSize - 1 ) & ~( pageSize - 1 );
+    uint64_t mvSize = ( mBoSize + pageSize - 1 ) & ~( pageSize - 1 );
+    uint8_t *frames[2] = {};
+    uint8_t *mv = nullptr;
+    VcetBoHandle frameBos[2] = {};
+    VcetBoHandle mvBo = nullptr;
+    uint8_t *pData = nullptr;
+    uint8_t *refData = nullptr;
+
+    for ( uint32_t i = 0; i < 2; ++i ) {
+        frames[i] = (uint8_t*) aligned_alloc( pageSize, frameSize );
+        ASSERT_NE( nullptr, frames[i] );
+        memcpy( frames[i], mFrame[i]->mBoData, mFrame[i]->mSize );
+    }
+
+    mv = (uint8_t*) aligned_alloc( pageSize, mvSize );
+    ASSERT_NE( nullptr, mv );
+    memset( mv, 0, mvSize );
+
+    // The kernel pins whole pages
+    ASSERT_FALSE( VcetBoCreateFromHostPtr( mCtx, mv + 1, pageSize, &mvBo ) );
+    ASSERT_FALSE( VcetBoCreateFromHostPtr( mCtx, mv, pageSize + 1, &mvBo ) );
+    ASSERT_FALSE( VcetBoCreateFromHostPtr( mCtx, nullptr, pageSize, &mvBo ) );
+
+    for ( uint32_t i = 0; i < 2; ++i ) {
+        ASSERT_TRUE( VcetBoCreateFromHostPtr( mCtx, frames[i], frameSize, &frameBos[i] ) );
+    }
+    ASSERT_TRUE( VcetBoCreateFromHostPtr( mCtx, mv, mvSize, &mvBo ) );
+
+    ASSERT_TRUE( VcetBoMap( mvBo, &pData ) );
+    ASSERT_EQ( mv, pData );
+    ASSERT_TRUE( VcetBoUnmap( mvBo ) );
+
+    // The GPU reads and writes host memory directly
+    ASSERT_TRUE( VcetCalculateMv( mCtx, frameBos[0], frameBos[1],
+                                  mvBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+
+    ASSERT_TRUE( VcetBoMap( mMappableBo, &refData ) );
+    memset( refData, 0, mBoSize );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_EQ( 0, memcmp( mv, refData, mBoSize ) );
+    ASSERT_TRUE( VcetBoUnmap( mMappableBo ) );
+
+    VcetBoDestroy( &mvBo );
+    free( mv );
+
+    for ( uint32_t i = 0; i < 2; ++i ) {
+        VcetBoDestroy( &frameBos[i] );
+        free( frames[i] );
+    }
+}
+
+TEST_F(VcetTestFrames, ConcurrentSubmit )
+{
+    static const int kThreads = 4;
+    static const int kJobsPerThread = 24;
+    VcetContextStats before, after, reclaimed;
+    std::vector<std::thread> threads;
+    std::vector<std::thread> idleThreads;
+    std::atomic<bool> releaseIdle( false );
+    std::atomic<int> failures( 0 );
+    uint64_t total = 0;
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &before ) );
+
+    // Each thread has its own job and output, and builds its IBs in its own pool
+    for ( int t = 0; t < kThreads; t++ ) {
+        threads.emplace_back( [&] {
+            VcetJobHandle job = nullptr;
+            VcetBoHandle mvBo = nullptr;
+            VcetContextStats stats;
+            bool completed;
+
+            if ( !VcetJobCreate( mCtx, &job ) || !VcetBoCreate( mCtx, mBoSize, true, &mvBo ) ) {
+                failures++;
+                return;
+            }
+
+            for ( int i = 0; i < kJobsPerThread; i++ ) {
+                if ( !VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo, mvBo,
+                                       mFrame[0]->mWidth, mFrame[0]->mHeight, job ) ||
+                     !VcetJobPoll( mCtx, job, &completed ) ||
+                     !VcetJobWait( mCtx, job, VCETOY_TIMEOUT_INFINITE ) ||
+                     !VcetContextGetStats( mCtx, &stats ) )
+                    failures++;
+            }
+
+            VcetBoDestroy( &mvBo );
+            VcetJobDestroy( &job );
+        } );
+    }
+
+    for ( auto &thread : threads )
+        thread.join();
+    ASSERT_EQ( 0, failures.load() );
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &after ) );
+    for ( uint32_t i = 0; i < after.numRings; i++ )
+        total += after.ringSubmissions[i] - before.ringSubmissions[i];
+    ASSERT_EQ( (uint64_t)( kThreads * kJobsPerThread ), total );
+    ASSERT_GT( after.ibRingSize, before.ibRingSize );
+
+    // The context remains usable from the creating thread
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+
+    // Threads that exit leave their pools for the next ones. Idle threads
+    // take over the ids of the exited ones, so that pools aren't just found
+    // again by a recycled id. Run more threads than there are pools.
+    for ( int t = 0; t < kThreads * 2; t++ ) {
+        std::thread thread( [&] {
+            if ( !VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                   mMappableBo,
+                                   mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                   mJob ) ||
+                 !VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) )
+                failures++;
+        } );
+        thread.join();
+
+        idleThreads.emplace_back( [&] {
+            while ( !releaseIdle )
+                usleep( 1000 );
+        } );
+    }
+
+    releaseIdle = true;
+    for ( auto &thread : idleThreads )
+        thread.join();
+    ASSERT_EQ( 0, failures.load() );
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &reclaimed ) );
+    ASSERT_EQ( after.ibRingSize, reclaimed.ibRingSize );
+}
+
+TEST_F(VcetTestFrames, AsyncSubmit )
+{
+    static const int kThreads = 2;
+    static const int kJobsPerThread = 8;
+    ReactorTestState state;
+    VcetJobHandle job[ kThreads ][ kJobsPerThread ];
+    VcetMvBatchEntry entries[2];
+    VcetContextStats before, after;
+    std::vector<std::thread> threads;
+    std::atomic<int> failures( 0 );
+
+    state.mCompleted = 0;
+    state.mLastJob = nullptr;
+
+    ASSERT_TRUE( VcetContextStartReactor( mCtx, ReactorTestCallback, &state, nullptr ) );
+    ASSERT_TRUE( VcetContextSetAsyncSubmit( mCtx, true ) );
+    ASSERT_TRUE( VcetContextSetAsyncSubmit( mCtx, true ) );
+
+    for ( int t = 0; t < kThreads; t++ ) {
+        for ( int i = 0; i < kJobsPerThread; i++ )
+            ASSERT_TRUE( VcetJobCreate( mCtx, &job[t][i] ) );
+    }
+
+    // Several producers share the queue
+    for ( int t = 0; t < kThreads; t++ ) {
+        threads.emplace_back( [&, t] {
+            for ( int i = 0; i < kJobsPerThread; i++ ) {
+                if ( !VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                       mMappableBo,
+                                       mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                       job[t][i] ) )
+                    failures++;
+            }
+        } );
+    }
+
+    for ( auto &thread : threads )
+        thread.join();
+    ASSERT_EQ( 0, failures.load() );
+
+    for ( int t = 0; t < kThreads; t++ ) {
+        for ( int i = 0; i < kJobsPerThread; i++ ) {
+            ASSERT_TRUE( VcetJobWait( mCtx, job[t][i], VCETOY_TIMEOUT_INFINITE ) );
+            VcetJobDestroy( &job[t][i] );
+        }
+    }
+
+    // Every queued job is handed to the reactor once submitted
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds( 5 );
+    while ( state.mCompleted < kThreads * kJobsPerThread && std::chrono::steady_clock::now() < deadline )
+        usleep( 1000 );
+    VcetContextStopReactor( mCtx );
+    ASSERT_EQ( kThreads * kJobsPerThread, state.mCompleted.load() );
+
+    // Bad requests are rejected before they can share a batch with others
+    ASSERT_FALSE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                   mMappableBo,
+                                   mFrame[0]->mWidth * 2, mFrame[0]->mHeight,
+                                   mJob ));
+
+    // Nor is anything queued from a batch with a bad entry
+    for ( VcetMvBatchEntry &entry : entries ) {
+        entry.oldFrame = mFrame[0]->mBo;
+        entry.newFrame = mFrame[1]->mBo;
+        entry.mvBo = mMappableBo;
+        entry.width = mFrame[0]->mWidth;
+        entry.height = mFrame[0]->mHeight;
+        entry.job = mJob;
+    }
+    entries[1].width *= 2;
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &before ) );
+    ASSERT_FALSE( VcetCalculateMvBatch( mCtx, entries, 2 ) );
+    ASSERT_TRUE( VcetContextSetAsyncSubmit( mCtx, false ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &after ) );
+    for ( uint32_t i = 0; i < after.numRings; i++ )
+        ASSERT_EQ( before.ringSubmissions[i], after.ringSubmissions[i] );
+
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+}
+
+TEST_F(VcetTestFrames, ReactorPolling )
+{
+    bool completed = false;
+    int eventFd = -1;
+
+    ASSERT_TRUE( VcetContextStartReactor( mCtx, nullptr, nullptr, &eventFd ) );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+
+    // Tracked jobs are only ever reported done by the reactor thread
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds( 5 );
+    while ( !completed && std::chrono::steady_clock::now() < deadline )
+        ASSERT_TRUE( VcetJobPoll( mCtx, mJob, &completed ) );
+    ASSERT_TRUE( completed );
+
+    // Once stopped, polling falls back to querying the kernel
+    VcetContextStopReactor( mCtx );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_TRUE( VcetJobPoll( mCtx, mJob, &completed ) );
+    ASSERT_TRUE( completed );
+}
+
+TEST_F(VcetTestFrames, SessionPool )
+{
+    // The kernel's VCE handle limit, shared with every user of the device
+    const uint32_t kMaxSessions = 16;
+    const uint32_t kSizes = 20;
+    VcetContextStats stats = {};
+    VcetCtxHandle other = nullptr;
+    uint64_t evictions;
+    uint32_t device;
+
+    // Another context on the device holds one of the handles
+    ASSERT_TRUE( VcetContextGetDevice( mCtx, &device ) );
+    ASSERT_TRUE( VcetContextCreateOnDevice( &other, device, GetWidth(), GetHeight() ) );
+
+    // Each aligned size gets its own session, until the device runs out
+    for ( uint32_t i = 0; i < kSizes; ++i ) {
+        ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                      mMappableBo,
+                                      64 + i * mWidthAlignment, 64,
+                                      mJob ));
+        ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_LT( stats.numSessions, kMaxSessions );
+    ASSERT_GE( stats.sessionEvictions, kSizes + 2 - kMaxSessions );
+    evictions = stats.sessionEvictions;
+
+    // Sizes that differ only by alignment padding share a session
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  64 + ( kSizes - 1 ) * mWidthAlignment - 1, 64,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( evictions, stats.sessionEvictions );
+
+    // The session the context was created with is the least recently used
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( evictions + 1, stats.sessionEvictions );
+
+    // Handles given back by other contexts can be used
+    VcetContextDestroy( &other );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  64, 128,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_LE( stats.numSessions, kMaxSessions );
+    ASSERT_EQ( evictions + 1, stats.sessionEvictions );
+
+    // Frame bos must hold frames of the given size
+    ASSERT_FALSE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                   mMappableBo,
+                                   mFrame[0]->mWidth * 2, mFrame[0]->mHeight,
+                                   mJob ));
+}
+
+TEST_F(VcetTestFrames, SlabAllocation )
+{
+    const uint32_t kNumBos = 32;
+    const uint32_t kBoSize = 4096;
+    const uint32_t kMvBoSize = 64 * 1024;
+    const uint32_t kLargeBoSize = 256 * 1024;
+    VcetContextStats before = {};
+    VcetContextStats stats = {};
+    VcetBoHandle bos[ kNumBos ] = {};
+    uint8_t *data[ kNumBos ] = {};
+    VcetBoHandle mvBo = nullptr;
+    uint8_t *mvData = nullptr;
+    uint8_t *refData = nullptr;
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &before ) );
+
+    // Small bos are carved out of a shared slab
+    for ( uint32_t i = 0; i < kNumBos; ++i ) {
+        ASSERT_TRUE( VcetBoCreate( mCtx, kBoSize, true, &bos[i] ) );
+        ASSERT_TRUE( VcetBoMap( bos[i], &data[i] ) );
+        memset( data[i], i, kBoSize );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( before.numSlabBlocks + kNumBos, stats.numSlabBlocks );
+    ASSERT_LE( stats.numSlabs, before.numSlabs + 1 );
+
+    // Blocks don't overlap
+    for ( uint32_t i = 0; i < kNumBos; ++i ) {
+        for ( uint32_t j = 0; j < kBoSize; ++j ) {
+            ASSERT_EQ( (uint8_t) i, data[i][j] );
+        }
+    }
+
+    // The GPU writes to a block at its offset within the slab
+    ASSERT_TRUE( VcetBoCreate( mCtx, kMvBoSize, true, &mvBo ) );
+    ASSERT_TRUE( VcetBoMap( mvBo, &mvData ) );
+    ASSERT_TRUE( VcetBoMap( mMappableBo, &refData ) );
+    memset( mvData, 0, kMvBoSize );
+    memset( refData, 0, kMvBoSize );
+
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mvBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_EQ( 0, memcmp( mvData, refData, kMvBoSize ) );
+
+    for ( uint32_t i = 0; i < kNumBos; ++i ) {
+        ASSERT_EQ( (uint8_t) i, data[i][0] );
+        ASSERT_EQ( (uint8_t) i, data[i][kBoSize - 1] );
+    }
+
+    for ( uint32_t i = 0; i < kNumBos; ++i ) {
+        ASSERT_TRUE( VcetBoUnmap( bos[i] ) );
+        VcetBoDestroy( &bos[i] );
+    }
+
+    // Freed blocks are reused rather than growing the slabs
+    for ( uint32_t round = 0; round < 4; ++round ) {
+        for ( uint32_t i = 0; i < kNumBos; ++i ) {
+            ASSERT_TRUE( VcetBoCreate( mCtx, kLargeBoSize, false, &bos[i] ) );
+        }
+
+        ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+        if ( round ) {
+            ASSERT_EQ( before.numSlabs, stats.numSlabs );
+        }
+        before = stats;
+
+        for ( uint32_t i = 0; i < kNumBos; ++i ) {
+            VcetBoDestroy( &bos[i] );
+        }
+    }
+
+    ASSERT_TRUE( VcetBoUnmap( mMappableBo ) );
+    ASSERT_TRUE( VcetBoUnmap( mvBo ) );
+    VcetBoDestroy( &mvBo );
+}
+
+TEST_F(VcetTestFrames, VaArena )
+{
+    // Too large for the slabs, so each bo gets its own VA
+    const uint64_t kSizes[] = { 300 * 1024, 1024 * 1024, 5 * 1024 * 1024, 512 * 1024 };
+    const uint32_t kNumBos = sizeof( kSizes ) / sizeof( kSizes[0] );
+    VcetContextStats before = {};
+    VcetContextStats stats = {};
+    VcetBoHandle bos[ kNumBos ] = {};
+    uint64_t expected = 0;
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &before ) );
+    ASSERT_NE( 0u, before.vaArenaBytes );
+
+    // Ranges are handed out in power of two blocks
+    for ( uint32_t i = 0; i < kNumBos; ++i ) {
+        uint64_t block = 4096;
+        while ( block < kSizes[i] )
+            block *= 2;
+        expected += block;
+
+        ASSERT_TRUE( VcetBoCreate( mCtx, kSizes[i], i % 2, &bos[i] ) );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( before.vaArenaBytes + expected, stats.vaArenaBytes );
+
+    // Freed out of order, the blocks still merge back
+    for ( uint32_t i = 0; i < kNumBos; i += 2 ) {
+        VcetBoDestroy( &bos[i] );
+    }
+    for ( uint32_t i = 1; i < kNumBos; i += 2 ) {
+        VcetBoDestroy( &bos[i] );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( before.vaArenaBytes, stats.vaArenaBytes );
+
+    // The arena reserves more VA once the working set outgrows it
+    ASSERT_GE( before.vaArenaReservedBytes, before.vaArenaBytes );
+
+    expected = 0;
+    for ( uint32_t i = 0; expected <= before.vaArenaReservedBytes; ++i ) {
+        ASSERT_LT( i, kNumBos );
+        ASSERT_TRUE( VcetBoCreate( mCtx, before.vaArenaReservedBytes / 2, false, &bos[i] ) );
+        expected += before.vaArenaReservedBytes / 2;
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( before.vaArenaBytes + expected, stats.vaArenaBytes );
+    ASSERT_GT( stats.vaArenaReservedBytes, before.vaArenaReservedBytes );
+
+    for ( uint32_t i = 0; i < kNumBos; ++i ) {
+        VcetBoDestroy( &bos[i] );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( before.vaArenaBytes, stats.vaArenaBytes );
+}
+
+TEST_F(VcetTestFrames, BoUsage )
+{
+    const uint64_t kSmallBoSize = 16 * 1024;
+    const VcetBoUsage kUsages[] = { VCET_BO_USAGE_DEVICE, VCET_BO_USAGE_DEVICE_UPLOAD,
+                                    VCET_BO_USAGE_UPLOAD, VCET_BO_USAGE_READBACK };
+    const uint32_t kNumUsages = sizeof( kUsages ) / sizeof( kUsages[0] );
+    VcetBoCreateInfo createInfo = {};
+    VcetContextStats before = {};
+    VcetContextStats stats = {};
+    VcetBoHandle bos[ kNumUsages ] = {};
+    VcetBoHandle frames[2] = {};
+    VcetBoHandle mvBo = nullptr;
+    uint8_t *data = nullptr;
+    uint8_t *mvData = nullptr;
+    uint8_t *refData = nullptr;
+
+    // Either a size or image dimensions
+    ASSERT_FALSE( VcetBoCreate2( mCtx, nullptr, &bos[0] ) );
+    ASSERT_FALSE( VcetBoCreate2( mCtx, &createInfo, &bos[0] ) );
+    createInfo.sizeBytes = kSmallBoSize;
+    createInfo.width = mFrame[0]->mWidth;
+    createInfo.height = mFrame[0]->mHeight;
+    ASSERT_FALSE( VcetBoCreate2( mCtx, &createInfo, &bos[0] ) );
+    createInfo.width = 0;
+    createInfo.height = 0;
+    createInfo.usage = (VcetBoUsage) 42;
+    ASSERT_FALSE( VcetBoCreate2( mCtx, &createInfo, &bos[0] ) );
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &before ) );
+
+    // Only device bos can't be mapped
+    for ( uint32_t i = 0; i < kNumUsages; ++i ) {
+        createInfo.usage = kUsages[i];
+        ASSERT_TRUE( VcetBoCreate2( mCtx, &createInfo, &bos[i] ) );
+
+        if ( kUsages[i] == VCET_BO_USAGE_DEVICE ) {
+            ASSERT_FALSE( VcetBoMap( bos[i], &data ) );
+            continue;
+        }
+
+        ASSERT_TRUE( VcetBoMap( bos[i], &data ) );
+        memset( data, i, kSmallBoSize );
+        ASSERT_EQ( (uint8_t) i, data[ kSmallBoSize - 1 ] );
+        ASSERT_TRUE( VcetBoUnmap( bos[i] ) );
+    }
+
+    // Blocks of different usages don't share a slab
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( before.numSlabs + kNumUsages, stats.numSlabs );
+
+    // Frames uploaded to write combined memory, vectors read back from cached
+    createInfo.sizeBytes = 0;
+    createInfo.usage = VCET_BO_USAGE_UPLOAD;
+    for ( uint32_t i = 0; i < 2; ++i ) {
+        createInfo.width = mFrame[i]->mWidth;
+        createInfo.height = mFrame[i]->mHeight;
+        ASSERT_TRUE( VcetBoCreate2( mCtx, &createInfo, &frames[i] ) );
+        ASSERT_TRUE( VcetBoMap( frames[i], &data ) );
+        memcpy( data, mFrame[i]->mBoData, mFrame[i]->mSize );
+        ASSERT_TRUE( VcetBoUnmap( frames[i] ) );
+    }
+
+    createInfo.sizeBytes = mBoSize;
+    createInfo.width = 0;
+    createInfo.height = 0;
+    createInfo.usage = VCET_BO_USAGE_READBACK;
+    ASSERT_TRUE( VcetBoCreate2( mCtx, &createInfo, &mvBo ) );
+    ASSERT_TRUE( VcetBoMap( mvBo, &mvData ) );
+    ASSERT_TRUE( VcetBoMap( mMappableBo, &refData ) );
+    memset( mvData, 0, mBoSize );
+    memset( refData, 0, mBoSize );
+
+    ASSERT_TRUE( VcetCalculateMv( mCtx, frames[0], frames[1],
+                                  mvBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_TRUE( VcetCalculateMv( mCtx, mFrame[0]->mBo, mFrame[1]->mBo,
+                                  mMappableBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  mJob ));
+    ASSERT_TRUE( VcetJobWait( mCtx, mJob, VCETOY_TIMEOUT_INFINITE ) );
+    ASSERT_EQ( 0, memcmp( mvData, refData, mBoSize ) );
+
+    ASSERT_TRUE( VcetBoUnmap( mMappableBo ) );
+    ASSERT_TRUE( VcetBoUnmap( mvBo ) );
+    VcetBoDestroy( &mvBo );
+
+    for ( uint32_t i = 0; i < 2; ++i ) {
+        VcetBoDestroy( &frames[i] );
+    }
+
+    for ( uint32_t i = 0; i < kNumUsages; ++i ) {
+        VcetBoDestroy( &bos[i] );
+    }
+}
+
+TEST_F(VcetTestFrames, CommandStreamCapture )
+{
+    char path[] = "/tmp/vcetoy-capture-XXXXXX";
+    VcetCtxHandle ctx = nullptr;
+    VcetBoHandle mvBo = nullptr;
+    VcetJobHandle job = nullptr;
+    char magic[4] = {};
+    long size;
+    int fd;
+
+    fd = mkstemp( path );
+    ASSERT_GE( fd, 0 );
+    close( fd );
+
+    // Only contexts created while the variable is set are captured
+    ASSERT_EQ( 0, setenv( "VCETOY_CAPTURE", path, 1 ) );
+    ASSERT_TRUE( VcetContextCreate( &ctx, GetWidth(), GetHeight() ) );
+    ASSERT_EQ( 0, unsetenv( "VCETOY_CAPTURE" ) );
+
+    ASSERT_TRUE( VcetBoCreate( ctx, mBoSize, true, &mvBo ) );
+    ASSERT_TRUE( VcetJobCreate( ctx, &job ) );
+    ASSERT_TRUE( VcetCalculateMv( ctx, mvBo, mvBo, mvBo,
+                                  mFrame[0]->mWidth, mFrame[0]->mHeight,
+                                  job ) );
+    ASSERT_TRUE( VcetJobWait( ctx, job, VCETOY_TIMEOUT_INFINITE ) );
+    VcetJobDestroy( &job );
+    VcetBoDestroy( &mvBo );
+    VcetContextDestroy( &ctx );
+
+    FILE *file = fopen( path, "rb" );
+    ASSERT_NE( nullptr, file );
+    ASSERT_EQ( (size_t)1, fread( magic, sizeof(magic), 1, file ) );
+    fseek( file, 0, SEEK_END );
+    size = ftell( file );
+    fclose( file );
+    unlink( path );
+
+    ASSERT_EQ( 0, memcmp( magic, "VCTC", sizeof(magic) ) );
+    ASSERT_GT( size, 8 );
+}
+
+TEST_F( VcetTest, EnumerateDevices )
+{
+    uint32_t count = 0;
+    uint32_t index;
+    VcetCtxHandle ctx = nullptr;
+
+    ASSERT_TRUE( VcetEnumerateDevices( nullptr, &count ) );
+    ASSERT_GE( count, 1u );
+
+    std::vector<VcetDeviceInfo> devices( count );
+    ASSERT_TRUE( VcetEnumerateDevices( devices.data(), &count ) );
+    ASSERT_EQ( devices.size(), count );
+    ASSERT_NE( '\0', devices[0].renderNode[0] );
+    ASSERT_NE( '\0', devices[0].busId[0] );
+    ASSERT_EQ( 0x1002, devices[0].pciVendorId );
+
+    // The fixture context runs on the default device
+    ASSERT_TRUE( VcetContextGetDevice( mCtx, &index ) );
+    ASSERT_LT( index, count );
+
+    ASSERT_FALSE( VcetContextCreateOnDevice( &ctx, count, GetWidth(), GetHeight() ) );
+
+    ASSERT_TRUE( VcetContextCreateOnDevice( &ctx, 0, GetWidth(), GetHeight() ) );
+    ASSERT_TRUE( VcetContextGetDevice( ctx, &index ) );
+    ASSERT_EQ( 0u, index );
+    VcetContextDestroy( &ctx );
+
+    ASSERT_TRUE( VcetContextCreateOnDevice( &ctx, VCET_DEVICE_LEAST_LOADED, GetWidth(), GetHeight() ) );
+    ASSERT_TRUE( VcetContextGetDevice( ctx, &index ) );
+    ASSERT_TRUE( devices[index].mvSupported );
+
+    // With a second device free, placement should spread the load
+    if ( count > 1 ) {
+        uint32_t otherIndex;
+        VcetCtxHandle other = nullptr;
+
+        ASSERT_TRUE( VcetContextCreateOnDevice( &other, VCET_DEVICE_LEAST_LOADED, GetWidth(), GetHeight() ) );
+        ASSERT_TRUE( VcetContextGetDevice( other, &otherIndex ) );
+        ASSERT_NE( index, otherIndex );
+        VcetContextDestroy( &other );
+    }
+
+    VcetContextDestroy( &ctx );
+}
+
+TEST_F( VcetTest, ContextPriority )
+{
+    uint32_t count = 0;
+    uint32_t index = 0;
+    uint32_t alignedWidth, alignedHeight;
+    VcetContextCreateInfo createInfo = {};
+    VcetCtxHandle ctx = nullptr;
+    VcetBoHandle bo = nullptr;
+    VcetJobHandle job = nullptr;
+
+    createInfo.width = GetWidth();
+    createInfo.height = GetHeight();
+
+    ASSERT_FALSE( VcetContextCreate2( &ctx, nullptr ) );
+
+    createInfo.priority = (VcetPriority) 42;
+    ASSERT_FALSE( VcetContextCreate2( &ctx, &createInfo ) );
+
+    // Elevated priorities need CAP_SYS_NICE on real hardware
+    for ( VcetPriority priority : { VCET_PRIORITY_LOW, VCET_PRIORITY_NORMAL, VCET_PRIORITY_HIGH } ) {
+        createInfo.priority = priority;
+        if ( !VcetContextCreate2( &ctx, &createInfo ) ) {
+            ASSERT_GT( priority, VCET_PRIORITY_NORMAL );
+            continue;
+        }
+
+        ASSERT_TRUE( VcetBoAlignDimensions( ctx, GetWidth(), GetHeight(), &alignedWidth, &alignedHeight ) );
+        ASSERT_TRUE( VcetBoCreate( ctx, alignedWidth * alignedHeight * 3 / 2, true, &bo ) );
+        ASSERT_TRUE( VcetJobCreate( ctx, &job ) );
+        ASSERT_TRUE( VcetCalculateMv( ctx, bo, bo, bo, GetWidth(), GetHeight(), job ) );
+        ASSERT_TRUE( VcetJobWait( ctx, job, VCETOY_TIMEOUT_INFINITE ) );
+        VcetJobDestroy( &job );
+        VcetBoDestroy( &bo );
+        VcetContextDestroy( &ctx );
+    }
+
+    // Priority contexts can be placed on any device
+    ASSERT_TRUE( VcetEnumerateDevices( nullptr, &count ) );
+
+    createInfo.priority = VCET_PRIORITY_LOW;
+    createInfo.selectDevice = true;
+    createInfo.deviceIndex = count;
+    ASSERT_FALSE( VcetContextCreate2( &ctx, &createInfo ) );
+
+    createInfo.deviceIndex = count - 1;
+    ASSERT_TRUE( VcetContextCreate2( &ctx, &createInfo ) );
+    ASSERT_TRUE( VcetContextGetDevice( ctx, &index ) );
+    ASSERT_EQ( count - 1, index );
+    VcetContextDestroy( &ctx );
+
+    createInfo.deviceIndex = VCET_DEVICE_LEAST_LOADED;
+    ASSERT_TRUE( VcetContextCreate2( &ctx, &createInfo ) );
+    VcetContextDestroy( &ctx );
+}
+
+TEST_F( VcetTest, ImportCache )
+{
+    // Kept in sync with the cache size of the context
+    const uint32_t kImportCacheSize = 16;
+    const uint64_t kSize = 64 * 1024;
+    VcetContextStats stats = {};
+    VcetBoHandle bo = nullptr;
+    VcetBoHandle again = nullptr;
+    VcetBoHandle other = nullptr;
+    uint8_t *pData = nullptr;
+    uint8_t value = 0;
+    int dmaBuf, dmaBuf2, otherDmaBuf;
+    int memfd, otherMemfd;
+
+    memfd = CreateDmaBuf( kSize, &dmaBuf );
+    ASSERT_GE( memfd, 0 );
+    otherMemfd = CreateDmaBuf( kSize, &otherDmaBuf );
+    ASSERT_GE( otherMemfd, 0 );
+
+    ASSERT_TRUE( VcetBoImport( mCtx, dmaBuf, true, &bo ) );
+    ASSERT_TRUE( VcetBoMap( bo, &pData ) );
+    pData[0] = 0x5a;
+    ASSERT_TRUE( VcetBoUnmap( bo ) );
+
+    // The same buffer through another fd hits the cache
+    dmaBuf2 = dup( dmaBuf );
+    ASSERT_TRUE( VcetBoImport( mCtx, dmaBuf2, true, &again ) );
+    ASSERT_TRUE( VcetBoImport( mCtx, otherDmaBuf, true, &other ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( 1u, stats.importCacheHits );
+    ASSERT_EQ( 2u, stats.numCachedImports );
+
+    ASSERT_TRUE( VcetBoMap( again, &pData ) );
+    ASSERT_EQ( 0x5a, pData[0] );
+    ASSERT_TRUE( VcetBoUnmap( again ) );
+    ASSERT_EQ( 1, pread( memfd, &value, 1, 0 ) );
+    ASSERT_EQ( 0x5a, value );
+
+    // Flushed imports stay valid for their handles
+    ASSERT_TRUE( VcetContextFlushImports( mCtx ) );
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( 0u, stats.numCachedImports );
+    ASSERT_TRUE( VcetBoMap( bo, &pData ) );
+    ASSERT_EQ( 0x5a, pData[0] );
+    ASSERT_TRUE( VcetBoUnmap( bo ) );
+
+    VcetBoDestroy( &bo );
+    VcetBoDestroy( &again );
+    VcetBoDestroy( &other );
+
+    // The cache holds the most recent imports only
+    for ( uint32_t i = 0; i < kImportCacheSize + 4; ++i ) {
+        int fd;
+        int mfd = CreateDmaBuf( kSize, &fd );
+
+        ASSERT_GE( mfd, 0 );
+        ASSERT_TRUE( VcetBoImport( mCtx, fd, true, &bo ) );
+        VcetBoDestroy( &bo );
+        close( mfd );
+        close( fd );
+    }
+
+    ASSERT_TRUE( VcetContextGetStats( mCtx, &stats ) );
+    ASSERT_EQ( kImportCacheSize, stats.numCachedImports );
+
+    close( memfd );
+    close( otherMemfd );
+    close( dmaBuf );
+    close( dmaBuf2 );
+    close( otherDmaBuf );
+}
+
 class VcetTestParams : public VcetTest,
     public ::testing::WithParamInterface<std::tuple<
                       bool, uint64_t, bool, bool, bool